@@ -0,0 +1,105 @@
+/* Compares crate config load times: YAML/JSON text versus the binary encoding
+ * produced by mvlcc_crateconfig_to_binary().
+ *
+ * Usage: bench_crateconfig_load <crateconfig.yaml> [<iterations>] [<binary_out>]
+ *
+ * If binary_out is given the binary encoded config is written to that file. It
+ * can be passed to mvlcc_crateconfig_from_file() like any other config file.
+ */
+
+#include <mvlcc_wrap.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage: %s <crateconfig.yaml> [<iterations>] [<binary_out>]\n", argv[0]);
+        return 1;
+    }
+
+    const char *config_filename = argv[1];
+    int iterations = argc > 2 ? atoi(argv[2]) : 100;
+    const char *binary_out = argc > 3 ? argv[3] : NULL;
+
+    if (iterations <= 0)
+    {
+        fprintf(stderr, "Invalid iteration count: %s\n", argv[2]);
+        return 1;
+    }
+
+    mvlcc_crateconfig_t crateconfig = {};
+
+    if (mvlcc_crateconfig_from_file(&crateconfig, config_filename))
+    {
+        fprintf(stderr, "Error reading crate config: %s\n", mvlcc_crateconfig_strerror(crateconfig));
+        mvlcc_crateconfig_destroy(&crateconfig);
+        return 1;
+    }
+
+    char *yaml = mvlcc_crateconfig_to_yaml(crateconfig);
+    size_t binary_size = 0;
+    uint8_t *binary = mvlcc_crateconfig_to_binary(crateconfig, &binary_size);
+    mvlcc_crateconfig_destroy(&crateconfig);
+
+    if (binary_out)
+    {
+        FILE *f = fopen(binary_out, "wb");
+        if (!f || fwrite(binary, 1, binary_size, f) != binary_size)
+        {
+            fprintf(stderr, "Error writing binary config to %s\n", binary_out);
+            return 1;
+        }
+        fclose(f);
+    }
+
+    int res = 0;
+    double t0 = now_us();
+
+    for (int i = 0; i < iterations && !res; ++i)
+    {
+        mvlcc_crateconfig_t cc = {};
+        res = mvlcc_crateconfig_from_yaml(&cc, yaml);
+        mvlcc_crateconfig_destroy(&cc);
+    }
+
+    double t1 = now_us();
+
+    for (int i = 0; i < iterations && !res; ++i)
+    {
+        mvlcc_crateconfig_t cc = {};
+        res = mvlcc_crateconfig_from_binary(&cc, binary, binary_size);
+        mvlcc_crateconfig_destroy(&cc);
+    }
+
+    double t2 = now_us();
+
+    if (res)
+    {
+        fprintf(stderr, "Error loading crate config during benchmark\n");
+    }
+    else
+    {
+        double yaml_us = (t1 - t0) / iterations;
+        double binary_us = (t2 - t1) / iterations;
+
+        printf("config: %s, iterations: %d\n", config_filename, iterations);
+        printf("  yaml:   %8zu bytes, %10.2lf us/load\n", strlen(yaml), yaml_us);
+        printf("  binary: %8zu bytes, %10.2lf us/load (%.1lfx faster)\n",
+            binary_size, binary_us, binary_us > 0.0 ? yaml_us / binary_us : 0.0);
+    }
+
+    free(yaml);
+    free(binary);
+
+    return res == 0 ? 0 : 1;
+}
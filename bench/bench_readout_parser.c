@@ -0,0 +1,285 @@
+/* Readout parser throughput benchmark using synthetic readout buffers.
+ *
+ * Usage: bench_readout_parser [options]
+ *   -c <crateconfig>  use the readout stacks and connection type of this config
+ *   -m <modules>      modules in the generated readout stack (default 4)
+ *   -s <reads>        single reads per module (default 2)
+ *   -w <words>        block read words per module, 0 for none (default 100)
+ *   -e                generate ETH packets instead of the USB format
+ *   -b <bytes>        readout buffer size (default 1 MiB)
+ *   -n <buffers>      number of distinct buffers (default 64)
+ *   -i <iterations>   passes over all buffers (default 20)
+ *
+ * The buffers are generated with the simulator, see mvlcc_make_mvlc_sim().
+ * Each pass is timed with:
+ *   parse only     no callbacks, mvlcc_readout_parser_parse_buffer() alone
+ *   translate      empty event callback: adds the translation of the parser
+ *                  module data to mvlcc_module_data_t and the callback call
+ *   consume        callback summing all data words
+ * and the plain cost of calling a C callback through a function pointer is
+ * measured separately.
+ */
+
+#include <mvlcc_wrap.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+static double now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+typedef struct
+{
+    uint32_t *data;
+    size_t words;
+} buffer_t;
+
+typedef struct
+{
+    size_t events;
+    uint64_t sum;
+} bench_context_t;
+
+static MVLCC_DEFINE_EVENT_CALLBACK(count_event)
+{
+    (void) crateIndex; (void) eventIndex; (void) moduleDataList; (void) moduleCount;
+    ((bench_context_t *) userContext)->events++;
+}
+
+static MVLCC_DEFINE_EVENT_CALLBACK(consume_event)
+{
+    (void) crateIndex; (void) eventIndex;
+    bench_context_t *ctx = (bench_context_t *) userContext;
+    ctx->events++;
+
+    for (unsigned mi = 0; mi < moduleCount; ++mi)
+    {
+        for (size_t i = 0; i < moduleDataList[mi].data_span.size; ++i)
+            ctx->sum += moduleDataList[mi].data_span.data[i];
+    }
+}
+
+static MVLCC_DEFINE_EVENT_CALLBACK(empty_event)
+{
+    (void) userContext; (void) crateIndex; (void) eventIndex; (void) moduleDataList; (void) moduleCount;
+}
+
+static int make_crateconfig(mvlcc_crateconfig_t *crateconfig, int modules, int single_reads,
+    int block_words, int eth)
+{
+    *crateconfig = mvlcc_createconfig_create();
+    mvlcc_command_list_t stack = mvlcc_command_list_create();
+    char cmd[128];
+    int res = 0;
+
+    for (int mi = 0; mi < modules && !res; ++mi)
+    {
+        snprintf(cmd, sizeof(cmd), "module%d", mi);
+        mvlcc_command_list_begin_module_group(stack, cmd);
+
+        for (int si = 0; si < single_reads && !res; ++si)
+        {
+            snprintf(cmd, sizeof(cmd), "vme_read 0x09 d32 0x%08x", (mi << 24) | 0x6000 | (si * 4));
+            res = mvlcc_command_list_add_command(stack, cmd);
+        }
+
+        if (block_words > 0 && !res)
+        {
+            snprintf(cmd, sizeof(cmd), "vme_read 0x0b 0x%08x %d", mi << 24, block_words);
+            res = mvlcc_command_list_add_command(stack, cmd);
+        }
+    }
+
+    if (!res)
+        res = mvlcc_crateconfig_set_readout_stack(*crateconfig, 0, stack);
+
+    mvlcc_command_list_destroy(&stack);
+
+    if (res)
+        return res;
+
+    return mvlcc_crateconfig_set_connection_type(*crateconfig,
+        eth ? MVLCC_CONNECTION_ETH : MVLCC_CONNECTION_USB);
+}
+
+static int generate_buffers(mvlcc_crateconfig_t crateconfig, uint32_t block_words,
+    buffer_t *buffers, size_t buffer_count, size_t buffer_bytes)
+{
+    mvlcc_sim_params_t params = { 0.0, block_words, 1 };
+    mvlcc_t mvlc = mvlcc_make_mvlc_sim(crateconfig, &params);
+    mvlcc_readout_context_t ctx = {};
+    int res = 0;
+
+    if ((res = mvlcc_connect(mvlc)) || (res = mvlcc_init_readout2(mvlc, crateconfig))
+        || (res = mvlcc_set_daq_mode(mvlc, 1)))
+        goto done;
+
+    ctx = mvlcc_readout_context_create2(mvlc);
+
+    for (size_t bi = 0; bi < buffer_count && !res; ++bi)
+    {
+        size_t bytes = 0;
+        buffers[bi].data = mvlcc_buffer_alloc(buffer_bytes);
+        if (!buffers[bi].data)
+        {
+            res = -1;
+            break;
+        }
+        res = mvlcc_readout(ctx, (uint8_t *) buffers[bi].data, buffer_bytes, &bytes, 100);
+        buffers[bi].words = bytes / sizeof(uint32_t);
+        if (!res && !bytes)
+            res = -1;
+    }
+
+    mvlcc_readout_context_destroy(&ctx);
+
+done:
+    mvlcc_free_mvlc(mvlc);
+    return res;
+}
+
+/* Parses all buffers iterations times, returns the elapsed time in us. */
+static double run_parser(mvlcc_crateconfig_t crateconfig, event_data_callback_t *callback,
+    bench_context_t *ctx, buffer_t *buffers, size_t buffer_count, int iterations, int *parse_errors)
+{
+    mvlcc_readout_parser_t parser = {};
+
+    if (mvlcc_readout_parser_create(&parser, crateconfig, ctx, callback, NULL))
+    {
+        fprintf(stderr, "Error creating readout parser\n");
+        mvlcc_readout_parser_destroy(&parser);
+        return -1.0;
+    }
+
+    size_t buffer_number = 1;
+    double t0 = now_us();
+
+    for (int it = 0; it < iterations; ++it)
+    {
+        for (size_t bi = 0; bi < buffer_count; ++bi)
+        {
+            if (mvlcc_readout_parser_parse_buffer(parser, buffer_number++, buffers[bi].data, buffers[bi].words))
+                ++*parse_errors;
+        }
+    }
+
+    double elapsed = now_us() - t0;
+    mvlcc_readout_parser_destroy(&parser);
+    return elapsed;
+}
+
+static void report(const char *name, double elapsed_us, size_t bytes, size_t events)
+{
+    double s = elapsed_us / 1e6;
+    printf("  %-14s %10.2lf MB/s %12.0lf events/s %10.1lf ns/event\n",
+        name, bytes / 1e6 / s, events / s, elapsed_us * 1e3 / events);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *config_filename = NULL;
+    int modules = 4, single_reads = 2, block_words = 100, eth = 0, iterations = 20;
+    mvlcc_buffer_alloc_options_t alloc_options = { 0, MVLCC_NUMA_NODE_ANY };
+    size_t buffer_bytes = 1u << 20, buffer_count = 64;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "c:m:s:w:eb:n:i:HN:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'c': config_filename = optarg; break;
+            case 'm': modules = atoi(optarg); break;
+            case 's': single_reads = atoi(optarg); break;
+            case 'w': block_words = atoi(optarg); break;
+            case 'e': eth = 1; break;
+            case 'b': buffer_bytes = strtoul(optarg, NULL, 0); break;
+            case 'n': buffer_count = strtoul(optarg, NULL, 0); break;
+            case 'i': iterations = atoi(optarg); break;
+            case 'H': alloc_options.hugepages = 1; break;
+            case 'N': alloc_options.numa_node = atoi(optarg); break;
+            default:
+                fprintf(stderr, "Usage: %s [-c crateconfig] [-m modules] [-s single_reads] [-w block_words]"
+                    " [-e] [-b buffer_bytes] [-n buffers] [-i iterations] [-H] [-N numa_node]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (modules <= 0 || single_reads < 0 || block_words < 0 || iterations <= 0 || !buffer_count
+        || buffer_bytes < 1024)
+    {
+        fprintf(stderr, "Invalid arguments\n");
+        return 1;
+    }
+
+    mvlcc_set_buffer_alloc_options(&alloc_options);
+
+    mvlcc_crateconfig_t crateconfig = {};
+    int res = config_filename
+        ? mvlcc_crateconfig_from_file(&crateconfig, config_filename)
+        : make_crateconfig(&crateconfig, modules, single_reads, block_words, eth);
+
+    if (res)
+    {
+        fprintf(stderr, "Error creating crate config: %s\n", mvlcc_crateconfig_strerror(crateconfig));
+        mvlcc_crateconfig_destroy(&crateconfig);
+        return 1;
+    }
+
+    buffer_t *buffers = calloc(buffer_count, sizeof(buffer_t));
+
+    if (generate_buffers(crateconfig, block_words, buffers, buffer_count, buffer_bytes))
+    {
+        fprintf(stderr, "Error generating readout buffers\n");
+        res = 1;
+        goto done;
+    }
+
+    size_t total_bytes = 0;
+    for (size_t bi = 0; bi < buffer_count; ++bi)
+        total_bytes += buffers[bi].words * sizeof(uint32_t);
+    total_bytes *= iterations;
+
+    int parse_errors = 0;
+    bench_context_t ctx = {};
+
+    double t_parse = run_parser(crateconfig, NULL, &ctx, buffers, buffer_count, iterations, &parse_errors);
+    double t_count = run_parser(crateconfig, count_event, &ctx, buffers, buffer_count, iterations, &parse_errors);
+    const size_t events = ctx.events;
+    ctx.events = 0;
+    double t_consume = run_parser(crateconfig, consume_event, &ctx, buffers, buffer_count, iterations, &parse_errors);
+
+    if (t_parse < 0.0 || t_count < 0.0 || t_consume < 0.0 || !events)
+    {
+        fprintf(stderr, "Error running the parser (events=%zu)\n", events);
+        res = 1;
+        goto done;
+    }
+
+    /* Plain function pointer call cost, for comparison with the translation. */
+    event_data_callback_t *volatile callback = empty_event;
+    double t0 = now_us();
+    for (size_t i = 0; i < events; ++i)
+        callback(NULL, 0, 0, NULL, 0);
+    double t_dispatch = now_us() - t0;
+
+    printf("data: %s, buffers: %zu x %zu bytes, iterations: %d, events: %zu, parse errors: %d\n",
+        config_filename ? config_filename : (eth ? "eth" : "usb"), buffer_count, buffer_bytes,
+        iterations, events, parse_errors);
+    report("parse only", t_parse, total_bytes, events);
+    report("translate", t_count, total_bytes, events);
+    report("consume", t_consume, total_bytes, events);
+    printf("  translation + callback: %.1lf ns/event, C callback dispatch: %.1lf ns/event, checksum: %llx\n",
+        (t_count - t_parse) * 1e3 / events, t_dispatch * 1e3 / events, (unsigned long long) ctx.sum);
+
+done:
+    for (size_t bi = 0; bi < buffer_count; ++bi)
+        mvlcc_buffer_free(buffers[bi].data);
+    free(buffers);
+    mvlcc_crateconfig_destroy(&crateconfig);
+
+    return res == 0 ? 0 : 1;
+}
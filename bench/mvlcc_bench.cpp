@@ -0,0 +1,270 @@
+/* Single cycle latency benchmark for register and VME accesses.
+ *
+ * Usage: mvlcc_bench [options] <url>
+ *   <url>             passed to mvlcc_make_mvlc(): usb://, eth://<host> (also
+ *                     the loopback emulator, see tools/) or sim://
+ *   -p <pattern>      reg:      register write + read (like example/test3.c)
+ *                     vme-read: single VME read
+ *                     vme-rwr:  VME read-write-read (like example/test2.c)
+ *                     vme-reg:  register write + read through VME at
+ *                               0xffff0000 (like example/test4.c)
+ *                     (default reg)
+ *   -n <cycles>       number of pattern cycles (default 100000)
+ *   -a <address>      VME base address (default 0x21000000)
+ *   -r <register>     internal register for the reg patterns (default 0x1304)
+ *
+ * The latency of every call is recorded into a log-linear histogram and
+ * p50/p99/p99.9/max are reported. Command pipe retries and lost command
+ * packets (ETH) are sampled around each call; calls during which they
+ * increased are reported separately to show how much of the tail they cause.
+ */
+
+#include <mvlcc_wrap.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+
+// Log-linear histogram of nanosecond values: 2^SubBucketBits buckets per
+// power of two, so the relative error of the reported values is below
+// 1 / 2^SubBucketBits.
+class LatencyHistogram
+{
+    public:
+        static const unsigned SubBucketBits = 5;
+        static const unsigned SubBuckets = 1u << SubBucketBits;
+
+        LatencyHistogram()
+            : buckets_((64 - SubBucketBits + 1) * SubBuckets)
+        {}
+
+        void record(uint64_t ns)
+        {
+            ++buckets_[index(ns)];
+            ++count_;
+            max_ = std::max(max_, ns);
+        }
+
+        uint64_t count() const { return count_; }
+        uint64_t max() const { return max_; }
+
+        // Upper bound of the bucket containing the q-quantile.
+        uint64_t percentile(double q) const
+        {
+            if (!count_)
+                return 0;
+
+            const uint64_t rank = std::max<uint64_t>(1, static_cast<uint64_t>(q * count_ + 0.5));
+            uint64_t seen = 0;
+
+            for (size_t i = 0; i < buckets_.size(); ++i)
+            {
+                seen += buckets_[i];
+                if (seen >= rank)
+                    return std::min(upperBound(i), max_);
+            }
+
+            return max_;
+        }
+
+    private:
+        static size_t index(uint64_t v)
+        {
+            if (v < SubBuckets)
+                return v;
+
+            const unsigned msb = 63 - __builtin_clzll(v);
+            const unsigned shift = msb - SubBucketBits;
+            return (shift + 1) * SubBuckets + ((v >> shift) & (SubBuckets - 1));
+        }
+
+        static uint64_t upperBound(size_t i)
+        {
+            if (i < SubBuckets)
+                return i;
+
+            const unsigned shift = i / SubBuckets - 1;
+            const uint64_t base = (SubBuckets + i % SubBuckets) << shift;
+            return base + (1ull << shift) - 1;
+        }
+
+        std::vector<uint64_t> buckets_;
+        uint64_t count_ = 0;
+        uint64_t max_ = 0;
+};
+
+struct ErrorCounters
+{
+    size_t retries = 0;
+    size_t lostPackets = 0;
+
+    bool operator!=(const ErrorCounters &o) const
+    {
+        return retries != o.retries || lostPackets != o.lostPackets;
+    }
+};
+
+ErrorCounters read_error_counters(mvlcc_t mvlc)
+{
+    ErrorCounters result;
+    mvlcc_cmd_counters_t counters;
+
+    if (mvlcc_get_cmd_counters(mvlc, &counters))
+        return result;
+
+    result.retries = counters.super_transaction_retries + counters.stack_transaction_retries
+        + counters.stack_exec_requests_lost + counters.stack_exec_responses_lost;
+    result.lostPackets = counters.eth_pipes[MVLCC_PIPE_COMMAND].lost_packets;
+
+    return result;
+}
+
+struct Sample
+{
+    uint64_t ns;
+    bool affected;
+};
+
+void print_histogram(const char *name, const LatencyHistogram &h)
+{
+    printf("  %-10s n=%-9lu p50=%8.1lf us  p99=%8.1lf us  p99.9=%8.1lf us  max=%8.1lf us\n",
+        name, static_cast<unsigned long>(h.count()),
+        h.percentile(0.5) / 1e3, h.percentile(0.99) / 1e3, h.percentile(0.999) / 1e3, h.max() / 1e3);
+}
+
+}
+
+int main(int argc, char *argv[])
+{
+    std::string pattern = "reg";
+    unsigned long cycles = 100000;
+    uint32_t vmeBase = 0x21000000u;
+    uint16_t regAddr = 0x1304u;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "p:n:a:r:")) != -1)
+    {
+        switch (opt)
+        {
+            case 'p': pattern = optarg; break;
+            case 'n': cycles = strtoul(optarg, nullptr, 0); break;
+            case 'a': vmeBase = strtoul(optarg, nullptr, 0); break;
+            case 'r': regAddr = strtoul(optarg, nullptr, 0); break;
+            default:
+                fprintf(stderr, "Usage: %s [-p reg|vme-read|vme-rwr|vme-reg] [-n cycles] [-a vme_base] [-r register] <url>\n", argv[0]);
+                return 1;
+        }
+    }
+
+    if (optind >= argc || (pattern != "reg" && pattern != "vme-read" && pattern != "vme-rwr" && pattern != "vme-reg"))
+    {
+        fprintf(stderr, "Usage: %s [-p reg|vme-read|vme-rwr|vme-reg] [-n cycles] [-a vme_base] [-r register] <url>\n", argv[0]);
+        return 1;
+    }
+
+    mvlcc_t mvlc = mvlcc_make_mvlc(argv[optind]);
+
+    if (int ec = mvlcc_connect(mvlc))
+    {
+        fprintf(stderr, "Could not connect: %s\n", mvlcc_strerror(ec));
+        mvlcc_free_mvlc(mvlc);
+        return 1;
+    }
+
+    // One entry per call, used to correlate the tail with retries afterwards.
+    std::vector<Sample> samples;
+    samples.reserve(cycles * 3);
+    LatencyHistogram all, clean, affected;
+    const auto start = read_error_counters(mvlc);
+    int ret = 0;
+
+    auto timed = [&] (auto &&call) -> int
+    {
+        const auto before = read_error_counters(mvlc);
+        const auto t0 = std::chrono::steady_clock::now();
+        int ec = call();
+        const auto t1 = std::chrono::steady_clock::now();
+        const bool hit = read_error_counters(mvlc) != before;
+        const uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(t1 - t0).count();
+
+        all.record(ns);
+        (hit ? affected : clean).record(ns);
+        samples.push_back({ ns, hit });
+        return ec;
+    };
+
+    uint32_t value = 0;
+    const auto runStart = std::chrono::steady_clock::now();
+
+    for (unsigned long i = 0; i < cycles && !ret; ++i)
+    {
+        int ec = 0;
+
+        if (pattern == "reg")
+        {
+            if (!(ec = timed([&] { return mvlcc_register_write(mvlc, regAddr, 0b11); })))
+                ec = timed([&] { return mvlcc_register_read(mvlc, regAddr, &value); });
+        }
+        else if (pattern == "vme-reg")
+        {
+            if (!(ec = timed([&] { return mvlcc_single_vme_write(mvlc, 0xffff0000u + regAddr, 0b11, 32, 16); })))
+                ec = timed([&] { return mvlcc_single_vme_read(mvlc, 0xffff0000u + regAddr, &value, 32, 16); });
+        }
+        else if (pattern == "vme-read")
+        {
+            ec = timed([&] { return mvlcc_single_vme_read(mvlc, vmeBase + 0x6008u, &value, 32, 16); });
+        }
+        else
+        {
+            if (!(ec = timed([&] { return mvlcc_single_vme_read(mvlc, vmeBase + 0x6008u, &value, 32, 16); }))
+                && !(ec = timed([&] { return mvlcc_single_vme_write(mvlc, vmeBase + 0x6004u, 9, 32, 16); })))
+                ec = timed([&] { return mvlcc_single_vme_read(mvlc, vmeBase + 0x6004u, &value, 32, 16); });
+        }
+
+        if (ec)
+        {
+            fprintf(stderr, "Error in cycle %lu: %s\n", i, mvlcc_strerror(ec));
+            ret = 1;
+        }
+    }
+
+    const double runSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - runStart).count();
+    const auto end = read_error_counters(mvlc);
+
+    printf("target: %s, pattern: %s, calls: %lu, %.0lf calls/s\n", argv[optind], pattern.c_str(),
+        static_cast<unsigned long>(all.count()), all.count() / runSeconds);
+    print_histogram("all", all);
+    print_histogram("clean", clean);
+    print_histogram("affected", affected);
+    printf("  retries: %zu, lost command packets: %zu\n",
+        end.retries - start.retries, end.lostPackets - start.lostPackets);
+
+    for (double q: { 0.99, 0.999 })
+    {
+        const uint64_t threshold = all.percentile(q);
+        size_t tail = 0, tailAffected = 0;
+
+        for (const auto &s: samples)
+        {
+            if (s.ns >= threshold)
+            {
+                ++tail;
+                tailAffected += s.affected;
+            }
+        }
+
+        printf("  calls >= p%g: %zu, with retries or lost packets: %zu (%.1lf%%)\n",
+            q * 100, tail, tailAffected, tail ? 100.0 * tailAffected / tail : 0.0);
+    }
+
+    mvlcc_disconnect(mvlc);
+    mvlcc_free_mvlc(mvlc);
+
+    return ret;
+}
@@ -71,21 +71,35 @@ int main(int argc, char *argv[])
 
     setup_signal_handlers();
 
-    if (argc < 2)
+    /* -H: readout buffer with hugepages on the NUMA node of the readout
+     * thread. */
+    bool local_hugepages = false;
+    bool bad_args = false;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "H")) != -1)
     {
-        fprintf(stdout, "Usage: %s <crateconfig> [<max_duration_s>]\n", argv[0]);
+        if (opt == 'H')
+            local_hugepages = true;
+        else
+            bad_args = true;
+    }
+
+    if (bad_args || argc - optind < 1)
+    {
+        fprintf(stdout, "Usage: %s [-H] <crateconfig> [<max_duration_s>]\n", argv[0]);
         return 1;
     }
 
-    const char *config_filename = argv[1];
+    const char *config_filename = argv[optind];
     int max_duration_s = 0;
 
-    if (argc > 2)
+    if (argc - optind > 1)
     {
-        max_duration_s = atoi(argv[2]);
+        max_duration_s = atoi(argv[optind + 1]);
         if (max_duration_s < 0)
         {
-            fprintf(stdout, "Invalid duration: %s\n", argv[2]);
+            fprintf(stdout, "Invalid duration: %s\n", argv[optind + 1]);
             return 1;
         }
     }
@@ -129,9 +143,23 @@ int main(int argc, char *argv[])
     readout_context = mvlcc_readout_context_create2(mvlc);
 
     const size_t readout_buffer_size = 1024 * 1024;
-    readout_buffer.data = malloc(readout_buffer_size);
+
+    if (local_hugepages)
+    {
+        mvlcc_buffer_alloc_options_t alloc_options = { 1, MVLCC_NUMA_NODE_LOCAL };
+        mvlcc_set_buffer_alloc_options(&alloc_options);
+    }
+
+    readout_buffer.data = mvlcc_buffer_alloc(readout_buffer_size);
     readout_buffer.capacity = readout_buffer_size;
 
+    if (!readout_buffer.data)
+    {
+        fprintf(stdout, "Error allocating the readout buffer\n");
+        res = 1;
+        goto free_things;
+    }
+
     int readout_timeout_ms = 500;
 
     /* Enables trigger processing of the MVLC. It is assumed that modules are
@@ -150,7 +178,11 @@ int main(int argc, char *argv[])
         goto free_things;
     }
 
-    size_t linear_buffer_number = 1;
+    /* Pinning and priority are configured with mvlcc_thread_set_config(). This
+     * also makes the thread show up in the thread statistics. */
+    mvlcc_thread_apply_config(MVLCC_THREAD_READOUT);
+
+    mvlcc_readout_info_t readout_info;
     struct timeval start_time;
     gettimeofday(&start_time, NULL);
     struct timeval last_report_time = start_time;
@@ -161,24 +193,30 @@ int main(int argc, char *argv[])
     {
         readout_buffer.used = 0;
 
-        res = mvlcc_readout(readout_context,
+        res = mvlcc_readout2(readout_context,
             readout_buffer.data, readout_buffer.capacity,
-            &readout_buffer.used, readout_timeout_ms);
+            &readout_info, readout_timeout_ms);
+        readout_buffer.used = readout_info.bytes_used;
 
         if (res)
         {
-            fprintf(stdout, "Error reading out data: %s\n", mvlcc_strerror(res));
+            fprintf(stdout, "Error reading out data: %s\n",
+                res == -1 ? mvlcc_readout_context_strerror(readout_context) : mvlcc_strerror(res));
             break;
         }
 
         if (readout_buffer.used == 0)
             continue;
 
-        fprintf(stdout, "readout received %zu bytes / %zu words\n", readout_buffer.used, readout_buffer.used / 4);
+        fprintf(stdout, "readout buffer #%zu: %zu bytes / %zu words\n",
+            readout_info.buffer_number, readout_buffer.used, readout_buffer.used / 4);
 
-        mvlcc_parse_result_t parse_result = mvlcc_readout_parser_parse_buffer(
-            parser, linear_buffer_number++,
-            (const uint32_t *)readout_buffer.data, readout_buffer.used / 4);
+        if (readout_info.flags & MVLCC_READOUT_FLAG_PACKET_LOSS)
+            fprintf(stdout, "Lost %llu packets before buffer #%zu\n",
+                (unsigned long long) readout_info.lost_packets, readout_info.buffer_number);
+
+        mvlcc_parse_result_t parse_result = mvlcc_readout_parser_parse_buffer2(
+            parser, &readout_info, (const uint32_t *)readout_buffer.data);
 
         if (parse_result != 0)
         {
@@ -224,6 +262,23 @@ int main(int argc, char *argv[])
     else
         fprintf(stdout, "Stopping readout\n");
 
+    mvlcc_readout_stats_t readout_stats;
+    if (mvlcc_readout_context_get_stats(readout_context, &readout_stats) == 0)
+    {
+        fprintf(stdout, "Readout: %llu buffers, %llu empty reads, %llu timeouts, %.2lf MiB,"
+            " in readout: %.2lf s, in processing: %.2lf s\n",
+            (unsigned long long) readout_stats.buffers, (unsigned long long) readout_stats.empty_reads,
+            (unsigned long long) readout_stats.timeouts, readout_stats.bytes / (1024.0 * 1024.0),
+            readout_stats.readout_ns / 1e9, readout_stats.consumer_ns / 1e9);
+    }
+
+    mvlcc_thread_stats_t thread_stats;
+    if (mvlcc_thread_get_stats(&thread_stats, 1) > 0)
+    {
+        fprintf(stdout, "Readout thread: cpu time %.2lf s, %llu preemptions\n",
+            thread_stats.cpu_ns / 1e9, (unsigned long long) thread_stats.involuntary_switches);
+    }
+
     /* Ideally the readout would still be running in another thread. */
 
     if ((res = run_commands(mvlc, mcst_stop_commands)))
@@ -242,7 +297,7 @@ int main(int argc, char *argv[])
 
 free_things:
     fprintf(stdout, "Free all the things!\n");
-    free(readout_buffer.data);
+    mvlcc_buffer_free(readout_buffer.data);
     mvlcc_readout_context_destroy(&readout_context);
     mvlcc_command_list_destroy(&mcst_start_commands);
     mvlcc_command_list_destroy(&mcst_stop_commands);
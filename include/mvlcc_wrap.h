@@ -12,6 +12,17 @@ extern "C" {
 /* TODO: port this to the d-type struct pattern */
 typedef void *mvlcc_t;
 
+/* Concurrency: one mvlcc_t may be shared by a readout thread and any number
+ * of slow-control threads.
+ * - Command pipe calls (register and VME access, block reads,
+ *   mvlcc_run_command(), DAQ mode, init and connect/disconnect) are
+ *   serialized per mvlcc_t and served in FIFO order.
+ * - mvlcc_readout() uses the data pipe only and runs in parallel with them.
+ *   A mvlcc_readout_context_t must be used by one thread at a time.
+ * - Parsers, command lists and crate configs are not synchronized, each
+ *   instance must be used by one thread at a time.
+ * mvlcc_free_mvlc() must not overlap any other call on the same mvlcc_t. */
+
 typedef enum {
   mvlcc_A16 = 0x29,
   mvlcc_A24 = 0x39,
@@ -38,10 +49,27 @@ int mvlcc_single_vme_read(mvlcc_t a_mvlc, uint32_t address, uint32_t * value, ui
 int mvlcc_single_vme_write(mvlcc_t a_mvlc, uint32_t address, uint32_t value, uint8_t amod, uint8_t dataWidth);
 int mvlcc_register_read(mvlcc_t a_mvlc, uint16_t address, uint32_t *value);
 int mvlcc_register_write(mvlcc_t a_mvlc, uint16_t address, uint32_t value);
+/* Error codes returned by the mvlc functions are MVLC error codes or, for
+ * values outside their range, system errno values (negative values are taken
+ * as -errno). -1, the generic failure code of the functions with their own
+ * strerror(), yields "generic failure". Thread-safe, the returned strings are
+ * static. */
 const char *mvlcc_strerror(int errnum);
+
+typedef enum
+{
+  MVLCC_ERROR_MVLC,
+  MVLCC_ERROR_SYSTEM
+} mvlcc_error_category_t;
+
+/* Like mvlcc_strerror() with an explicit category, for codes that are known to
+ * be errno values even if they fall into the MVLC range. */
+const char *mvlcc_strerror_category(mvlcc_error_category_t category, int errnum);
 int mvlcc_is_mvlc_valid(mvlcc_t a_mvlc);
 int mvlcc_is_ethernet(mvlcc_t a_mvlc);
 int mvlcc_is_usb(mvlcc_t a_mvlc);
+/* Returns 1 for simulated controllers, see mvlcc_make_mvlc_sim(). */
+int mvlcc_is_sim(mvlcc_t a_mvlc);
 int mvlcc_set_daq_mode(mvlcc_t, bool enable);
 
 /* Uses the internal mesytec::mvlc::CrateConfig set when
@@ -79,6 +107,71 @@ void mvlcc_set_global_log_level(const char *levelName);
  * cmd execution. */
 void mvlcc_print_mvlc_cmd_counters(FILE *out, mvlcc_t a_mvlc);
 
+typedef struct
+{
+  uint64_t receive_attempts;
+  uint64_t received_packets;
+  uint64_t received_bytes;
+  uint64_t short_packets;
+  uint64_t packets_with_residue;
+  uint64_t no_header;
+  uint64_t header_out_of_range;
+  uint64_t lost_packets;         /* gaps in the packet numbers */
+  /* Kernel socket state. socket_drops counts packets dropped because the
+   * receive buffer was full, lost_packets - socket_drops were lost before
+   * reaching the host. A drop shows up as a gap only once the next packet is
+   * read. rcvbuf_bytes and rx_queue_bytes are current values, not counters.
+   * The data pipe counts include packets read with batched receive (see
+   * mvlcc_readout_context_set_eth_batch()), short_packets includes the
+   * truncated ones. */
+  uint64_t socket_drops;
+  uint64_t rcvbuf_bytes;
+  uint64_t rx_queue_bytes;
+} mvlcc_eth_pipe_stats_t;
+
+#define MVLCC_PIPE_COMMAND 0
+#define MVLCC_PIPE_DATA 1
+#define MVLCC_PIPE_COUNT 2
+
+/* Snapshot of the command pipe counters and, for ETH connections, the packet
+ * stats of both pipes. All counters are monotonic while connected. */
+typedef struct
+{
+  /* transactions */
+  uint64_t super_transactions;
+  uint64_t super_transaction_retries;
+  uint64_t stack_transactions;
+  uint64_t stack_transaction_retries;
+  uint64_t stack_exec_requests_lost;
+  uint64_t stack_exec_responses_lost;
+  /* command pipe reader */
+  uint64_t cmd_reads;
+  uint64_t cmd_bytes_read;
+  uint64_t cmd_timeouts;
+  uint64_t cmd_invalid_headers;
+  uint64_t cmd_words_skipped;
+  uint64_t cmd_error_buffers;
+  uint64_t cmd_super_buffers;
+  uint64_t cmd_stack_buffers;
+  uint64_t cmd_dso_buffers;
+  uint64_t cmd_short_super_frames;
+  uint64_t cmd_super_format_errors;
+  uint64_t cmd_super_ref_mismatches;
+  uint64_t cmd_stack_ref_mismatches;
+  /* ETH only, indexed by MVLCC_PIPE_COMMAND/DATA */
+  int is_ethernet;
+  mvlcc_eth_pipe_stats_t eth_pipes[MVLCC_PIPE_COUNT];
+} mvlcc_cmd_counters_t;
+
+/* Fills counters. Simulated controllers report all zeroes. Returns 0 on
+ * success, -1 if the mvlc is not valid. */
+int mvlcc_get_cmd_counters(mvlcc_t a_mvlc, mvlcc_cmd_counters_t *counters);
+
+/* delta = now - prev for every counter, e.g. for rate computations. Current
+ * values like rcvbuf_bytes are copied from now. delta may alias now or prev. */
+void mvlcc_cmd_counters_delta(const mvlcc_cmd_counters_t *now, const mvlcc_cmd_counters_t *prev,
+  mvlcc_cmd_counters_t *delta);
+
 /* (flueke): Returns a pointer to the internal MVLC object. Use from C++ only. */
 void *mvlcc_get_mvlc_object(mvlcc_t a_mvlc);
 
@@ -100,6 +193,11 @@ void mvlcc_command_set_vme_address(mvlcc_command_t cmd, uint32_t address);
 void mvlcc_command_add_to_vme_address(mvlcc_command_t cmd, uint32_t offset);
 int mvlcc_run_command(mvlcc_t a_mvlc, mvlcc_command_t cmd, uint32_t *buffer, size_t size_in, size_t *size_out);
 
+/* Writes the last 64 commands run with mvlcc_run_command() and
+ * mvlcc_vme_block_read(), oldest first, with their duration, result and first
+ * response word. Failed commands also log these records at debug level. */
+void mvlcc_dump_command_log(FILE *out, mvlcc_t a_mvlc);
+
 /* Wraps mesytec::mvlc::StackCommandBuilder */
 typedef struct
 {
@@ -130,9 +228,95 @@ int mvlcc_command_list_from_yaml(mvlcc_command_list_t *cmd_listp, const char *st
 int mvlcc_command_list_from_json(mvlcc_command_list_t *cmd_listp, const char *str);
 int mvlcc_command_list_from_text(mvlcc_command_list_t *cmd_listp, const char *str);
 
+/* Compact, versioned binary encoding. Much faster to load than YAML or JSON.
+ * The returned buffer must be free()'d by the caller, its size in bytes is
+ * stored in sizep. from_binary() follows the same conventions as the other
+ * from_* functions above. */
+uint8_t *mvlcc_command_list_to_binary(mvlcc_command_list_t cmd_list, size_t *sizep);
+int mvlcc_command_list_from_binary(mvlcc_command_list_t *cmd_listp, const uint8_t *data, size_t size);
+
 /* boolean return value. */
 int mvlcc_command_list_eq(mvlcc_command_list_t a, mvlcc_command_list_t b);
 
+/* VME bus timing model used by the stack optimizer and the readout estimator.
+ * All times in ns. Use mvlcc_timing_model_init() to get the default values,
+ * then adjust them to measurements of the actual modules. */
+
+enum { MVLCC_TIMING_A16, MVLCC_TIMING_A24, MVLCC_TIMING_A32, MVLCC_TIMING_ADDR_COUNT };
+enum { MVLCC_TIMING_D16, MVLCC_TIMING_D32, MVLCC_TIMING_DATA_COUNT };
+
+typedef struct
+{
+  /* single read/write cycle times indexed by address and data width */
+  double single_cycle_ns[MVLCC_TIMING_ADDR_COUNT][MVLCC_TIMING_DATA_COUNT];
+  double block_setup_ns;      /* address phase of block transfers */
+  double blt_word_ns;         /* per 32-bit BLT beat */
+  double mblt_word_ns;        /* per 64-bit MBLT beat */
+  double esst_word_ns;        /* per 64-bit 2eSST beat */
+  double wait_clock_ns;       /* per clock of the 'wait' command */
+  double command_overhead_ns; /* markers, accu and other non-VME commands */
+  double stack_overhead_ns;   /* per stack execution: trigger and frame handling */
+  double link_bytes_per_s;    /* readout link bandwidth, 0 for unlimited */
+  /* Data words assumed for each block read. 0 uses the maximum transfer
+   * count of the command (worst case). */
+  uint32_t assumed_block_words;
+} mvlcc_timing_model_t;
+
+void mvlcc_timing_model_init(mvlcc_timing_model_t *model);
+
+/* Readout stack optimization flags. */
+#define MVLCC_OPTIMIZE_MERGE_READS    0x1u
+#define MVLCC_OPTIMIZE_DROP_REDUNDANT 0x2u
+#define MVLCC_OPTIMIZE_ALL            0x3u
+
+typedef struct
+{
+  /* MVLCC_OPTIMIZE_MERGE_READS: replace the longest run of single D32 reads
+   * to consecutive A24/A32 addresses in each module group by one address
+   * incrementing BLT read. Only done for groups without a block read. The
+   * module needs to support BLT access to these registers. The read data then
+   * shows up in the dynamic part of mvlcc_module_data_t instead of the prefix!
+   *
+   * MVLCC_OPTIMIZE_DROP_REDUNDANT: merge adjacent waits, drop zero waits and
+   * set_accu commands overwritten by the next command, and software delays
+   * in readout stacks (see readout_stack). Markers produce output data and
+   * are always kept. */
+  unsigned flags;
+  /* Minimum run length of single reads to merge. 0 selects the default of 4. */
+  unsigned min_merge_run;
+  /* Stack memory available to this stack in 32-bit words. 0 selects the
+   * size of the MVLC stack memory minus the immediate stack reserve. */
+  size_t stack_memory_words;
+  /* Used for the bus time estimates in the report. NULL for the defaults. */
+  const mvlcc_timing_model_t *timing_model;
+  /* Nonzero if the list is a readout stack. The MVLC does not execute
+   * software delays, so they are dropped from readout stacks only. Init and
+   * other lists run by the library keep them. */
+  int readout_stack;
+} mvlcc_stack_optimize_options_t;
+
+typedef struct
+{
+  size_t commands_before;
+  size_t commands_after;
+  size_t stack_words_before;
+  size_t stack_words_after;
+  size_t merged_reads;      /* single reads folded into block reads */
+  size_t removed_commands;
+  double bus_time_before_ns; /* estimated VME bus time per stack execution */
+  double bus_time_after_ns;
+  int fits_stack_memory;
+} mvlcc_stack_optimize_report_t;
+
+/* Optimizes the command list in place. options may be NULL to apply all
+ * optimizations with default settings (not as a readout stack), report may be
+ * NULL. Returns 0 on success, -1 if the optimized stack does not fit into the
+ * stack memory, the command list is left unchanged then. Use
+ * mvlcc_command_list_strerror() to get the error message. */
+int mvlcc_command_list_optimize(mvlcc_command_list_t cmd_list,
+  const mvlcc_stack_optimize_options_t *options,
+  mvlcc_stack_optimize_report_t *report);
+
 typedef struct
 {
   intptr_t d;
@@ -148,12 +332,41 @@ char *mvlcc_crateconfig_to_json(mvlcc_crateconfig_t crateconfig);
 int mvlcc_crateconfig_from_yaml(mvlcc_crateconfig_t *crateconfigp, const char *str);
 int mvlcc_crateconfig_from_json(mvlcc_crateconfig_t *crateconfigp, const char *str);
 
+/* Binary counterparts of the above. See mvlcc_command_list_to_binary(). */
+uint8_t *mvlcc_crateconfig_to_binary(mvlcc_crateconfig_t crateconfig, size_t *sizep);
+int mvlcc_crateconfig_from_binary(mvlcc_crateconfig_t *crateconfigp, const uint8_t *data, size_t size);
+
+/* Loads YAML, JSON (.json extension) or binary encoded (detected by content)
+ * crate configs. */
 int mvlcc_crateconfig_from_file(mvlcc_crateconfig_t *crateconfigp, const char *filename);
 
 const char *mvlcc_crateconfig_strerror(mvlcc_crateconfig_t crateconfig);
 
 mvlcc_t mvlcc_make_mvlc_from_crateconfig_t(mvlcc_crateconfig_t crateconfig);
 
+typedef struct
+{
+  double trigger_rate_hz;    /* 0: generate events as fast as they are read out */
+  uint32_t block_read_words; /* words per block read, capped at the commands max transfers. 0: 100 */
+  uint32_t seed;             /* seed for the generated block read data */
+} mvlcc_sim_params_t;
+
+/* Creates a simulated controller for testing without hardware. Register and
+ * VME accesses operate on an in-memory address space, command lists run
+ * against it. After mvlcc_init_readout2() and mvlcc_set_daq_mode(1)
+ * mvlcc_readout() returns generated events for the configs readout stacks,
+ * triggered round-robin: USB framing or ETH data packets depending on the
+ * connection type of crateconfig, so the output can be passed to
+ * mvlcc_readout_parser_parse_buffer() unchanged. Single reads yield one word,
+ * block reads a block frame with block_read_words random words.
+ * params may be NULL.
+ * mvlcc_make_mvlc() creates simulators from URLs of the form
+ * "sim://[config file][?rate=<hz>&block_words=<n>&seed=<n>]", e.g.
+ * "sim://crate.yaml?rate=1000". Without a file the config is empty, omitted
+ * params take their defaults. For unknown params, invalid values or
+ * unreadable config files mvlcc_is_mvlc_valid() returns 0 on the result. */
+mvlcc_t mvlcc_make_mvlc_sim(mvlcc_crateconfig_t crateconfig, const mvlcc_sim_params_t *params);
+
 /* Returns a copy of the crateconfigs readout stack. */
 mvlcc_command_list_t mvlcc_crateconfig_get_readout_stack(
   mvlcc_crateconfig_t crateconfig, unsigned stackId);
@@ -165,11 +378,74 @@ mvlcc_command_list_t mvlcc_crateconfig_get_readout_stack(
 int mvlcc_crateconfig_set_readout_stack(
   mvlcc_crateconfig_t crateconfig, unsigned stackId, mvlcc_command_list_t cmd_list);
 
+/* Sets the connection type (MVLCC_CONNECTION_USB or _ETH) of the crateconfig,
+ * e.g. for simulated controllers. Returns 0 on success, -1 for unknown types. */
+int mvlcc_crateconfig_set_connection_type(mvlcc_crateconfig_t crateconfig, int connection_type);
+
 mvlcc_command_list_t mvlcc_crateconfig_get_mcst_daq_start(mvlcc_crateconfig_t crateconfig);
 mvlcc_command_list_t mvlcc_crateconfig_get_mcst_daq_stop(mvlcc_crateconfig_t crateconfig);
 
+#define MVLCC_MAX_READOUT_STACKS 8
+
+typedef struct
+{
+  unsigned stack_index;       /* index into the crateconfigs readout stacks */
+  uint32_t trigger;           /* trigger register value, 0 if not set */
+  double bus_time_ns;         /* VME bus time per execution, excluding overhead */
+  size_t bytes_per_event;
+  size_t stack_memory_words;
+  double max_trigger_rate_hz;
+  int link_limited;           /* rate limited by link bandwidth, not bus time */
+  size_t bottleneck_command_index;
+  double bottleneck_command_ns;
+  char bottleneck_command[128];
+} mvlcc_stack_estimate_t;
+
+typedef struct
+{
+  size_t stack_count;
+  mvlcc_stack_estimate_t stacks[MVLCC_MAX_READOUT_STACKS];
+  size_t total_stack_memory_words;
+  int fits_stack_memory;
+  /* Max rate if all stacks are executed for every trigger. */
+  double combined_max_trigger_rate_hz;
+} mvlcc_readout_estimate_t;
+
+/* Statically estimates the readout performance of all non-empty readout
+ * stacks of the crateconfig. model may be NULL to use the defaults.
+ * Returns 0 on success, -1 otherwise. Use mvlcc_crateconfig_strerror() to
+ * get the error message. */
+int mvlcc_crateconfig_estimate_readout(mvlcc_crateconfig_t crateconfig,
+  const mvlcc_timing_model_t *model, mvlcc_readout_estimate_t *estimate);
+
 int mvlcc_init_readout2(mvlcc_t a_mvlc, mvlcc_crateconfig_t crateconfig);
 
+typedef struct
+{
+  int full_init;          /* no usable previous state, full init was done */
+  int init_registers_run;
+  int trigger_io_run;
+  size_t init_groups_run; /* module init groups that changed and were run */
+  int stacks_uploaded;
+  int triggers_applied;   /* always set on success */
+} mvlcc_init_diff_t;
+
+/* Differential variant of mvlcc_init_readout2(): compares crateconfig to the
+ * config last applied to this mvlc and only runs what changed: MVLC register
+ * and trigger I/O init lists, the init commands of changed module groups and
+ * readout stacks. DAQ mode and triggers are disabled while doing so, then the
+ * triggers are set up again and DAQ mode is re-enabled if it was enabled
+ * before, so the call also re-arms the readout after mvlcc_stop(). Falls back
+ * to the full init if there is no previous config, the connection settings
+ * changed or module groups were added, removed or renamed, with the same
+ * handling of triggers and DAQ mode. The applied state
+ * is forgotten on connect and disconnect and after errors.
+ * Note: unchanged modules are not re-initialized. Use mvlcc_init_readout2() or
+ * mvlcc_forget_applied_config() after power cycling the crate.
+ * diff may be NULL. Returns 0 on success, the error code otherwise. */
+int mvlcc_init_readout_diff(mvlcc_t a_mvlc, mvlcc_crateconfig_t crateconfig, mvlcc_init_diff_t *diff);
+void mvlcc_forget_applied_config(mvlcc_t a_mvlc);
+
 typedef struct
 {
   intptr_t d;
@@ -183,6 +459,233 @@ void mvlcc_readout_context_set_mvlc(mvlcc_readout_context_t ctx, mvlcc_t a_mvlc)
 int mvlcc_readout(mvlcc_readout_context_t ctx,
   uint8_t *dest, size_t bytes_free, size_t *bytes_used, int timeout_ms);
 
+/* Format of readout buffers. FRAMES is the plain frame stream of USB readouts
+ * and aligned mode, ETH_PACKETS contains the ETH packets including their
+ * headers. */
+#define MVLCC_DATA_FORMAT_FRAMES 0
+#define MVLCC_DATA_FORMAT_ETH_PACKETS 1
+
+/* The buffer was returned in aligned mode. */
+#define MVLCC_READOUT_FLAG_ALIGNED            (1u << 0)
+/* The buffer starts with frames of an event begun in the previous buffer. */
+#define MVLCC_READOUT_FLAG_CONTINUES_PREVIOUS (1u << 1)
+/* The last event is continued in the next buffer. */
+#define MVLCC_READOUT_FLAG_CONTINUED          (1u << 2)
+/* ETH data packets were lost since the previous buffer. */
+#define MVLCC_READOUT_FLAG_PACKET_LOSS        (1u << 3)
+/* Aligned mode dropped incomplete events or stray data since the previous
+ * buffer. */
+#define MVLCC_READOUT_FLAG_DATA_DROPPED       (1u << 4)
+
+#define MVLCC_CONNECTION_USB 0
+#define MVLCC_CONNECTION_ETH 1
+
+/* Descriptor of a readout buffer. Loss and packet counts cover the reads since
+ * the previous buffer, including reads that returned no data. */
+typedef struct
+{
+  size_t bytes_used;
+  /* Starts at 1, counts the buffers containing data returned by this context. */
+  size_t buffer_number;
+  int data_format;      /* MVLCC_DATA_FORMAT_* */
+  uint32_t flags;       /* MVLCC_READOUT_FLAG_* */
+  int crate_index;      /* crate id of the crate config the mvlc was created from */
+  int connection_type;  /* MVLCC_CONNECTION_* */
+  /* Time the read returned, CLOCK_MONOTONIC and CLOCK_TAI. tai_ns is 0 if
+   * CLOCK_TAI is not available. */
+  uint64_t monotonic_ns;
+  uint64_t tai_ns;
+  /* ETH only: data packets received and lost. Taken from the data pipe
+   * statistics of the connection, for simulated ETH crates in aligned mode
+   * from the packet numbers. */
+  uint64_t packets;
+  uint64_t lost_packets;
+  uint64_t dropped_bytes; /* aligned mode, see MVLCC_READOUT_FLAG_DATA_DROPPED */
+} mvlcc_readout_info_t;
+
+/* Like mvlcc_readout() but fills in a descriptor of the returned buffer.
+ * Returns -1 if bytes_free is below the minimum of aligned mode or batched
+ * receive, use mvlcc_readout_context_strerror() to get the error message. */
+int mvlcc_readout2(mvlcc_readout_context_t ctx, uint8_t *dest, size_t bytes_free,
+  mvlcc_readout_info_t *info, int timeout_ms);
+
+const char *mvlcc_readout_context_strerror(mvlcc_readout_context_t ctx);
+
+/* Max size of a single frame, the minimum buffer size in aligned mode. */
+#define MVLCC_READOUT_ALIGNED_MIN_BYTES ((1u << 13) * 4u)
+
+/* Aligned mode: every buffer returned by mvlcc_readout() and mvlcc_readout2()
+ * starts and ends with a complete event, so buffers can be parsed
+ * independently, e.g. by different threads with their own parser. The data is
+ * always returned as MVLCC_DATA_FORMAT_FRAMES: for ETH connections the packets
+ * are unpacked, events broken by packet loss are dropped. Only events larger
+ * than the buffer are split, this is reported with the continuation flags.
+ * dest has to be 4 byte aligned and hold at least
+ * MVLCC_READOUT_ALIGNED_MIN_BYTES. Enable before the first readout, returns -1
+ * if there is already partial data from a non-aligned readout. */
+int mvlcc_readout_context_set_aligned(mvlcc_readout_context_t ctx, int enable);
+
+/* Batched receive for ETH connections: mvlcc_readout() receives many data
+ * packets per recvmmsg() call directly into dest instead of one per syscall.
+ * The data format and the packet loss reporting are unchanged. dest has to
+ * hold at least one jumbo frame (9000 bytes). */
+typedef struct
+{
+  unsigned batch_packets;   /* packets per recvmmsg() call, 0: 64 */
+  int rcvbuf_bytes;         /* SO_RCVBUF of the data socket, 0: unchanged */
+  int busy_poll_us;         /* SO_BUSY_POLL of the data socket, 0: unchanged */
+} mvlcc_eth_batch_options_t;
+
+/* NULL switches back to the standard receive path. Returns 0 on success, -1
+ * for connections other than ETH (including simulated ones) or if a socket
+ * option could not be set, e.g. SO_BUSY_POLL without CAP_NET_ADMIN. Enable
+ * before the first readout or after a timeout. */
+int mvlcc_readout_context_set_eth_batch(mvlcc_readout_context_t ctx, const mvlcc_eth_batch_options_t *options);
+
+typedef struct
+{
+  uint64_t syscalls;            /* recvmmsg() calls */
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t lost_packets;        /* gaps in the packet numbers */
+  uint64_t truncated_packets;   /* larger than a jumbo frame, dropped */
+  uint64_t short_packets;       /* no complete header, dropped */
+  /* Dropped by the kernel because the socket receive buffer was full, from
+   * SO_RXQ_OVFL. lost_packets - socket_drops were lost before reaching the
+   * host: on the wire, in switches or the NIC. */
+  uint64_t socket_drops;
+} mvlcc_eth_batch_stats_t;
+
+/* Totals of batched receive on the connection of ctx, also after switching it
+ * off and on again. Returns -1 if batched receive is not enabled. */
+int mvlcc_readout_context_get_eth_batch_stats(mvlcc_readout_context_t ctx, mvlcc_eth_batch_stats_t *stats);
+
+#define MVLCC_READOUT_FILL_BUCKETS 10
+
+/* Statistics of the mvlcc_readout() calls made with a readout context. */
+typedef struct
+{
+  uint64_t reads;           /* mvlcc_readout() calls */
+  uint64_t buffers;         /* calls that returned data */
+  uint64_t bytes;
+  uint64_t empty_reads;     /* calls that returned no data */
+  uint64_t timeouts;        /* calls that ended with a timeout */
+  uint64_t errors;          /* calls that ended with another error */
+  uint64_t readout_ns;      /* time spent inside mvlcc_readout() */
+  uint64_t consumer_ns;     /* time between returning from and calling mvlcc_readout() again */
+  uint64_t carries;         /* calls starting with a partial frame left over by the previous call */
+  uint64_t carried_bytes;
+  /* bytes_used / bytes_free in steps of 1/MVLCC_READOUT_FILL_BUCKETS, full
+   * buffers are counted in the last bucket. */
+  uint64_t fill_histogram[MVLCC_READOUT_FILL_BUCKETS];
+} mvlcc_readout_stats_t;
+
+/* May be called from any thread while another thread is in mvlcc_readout().
+ * A readout_ns much larger than consumer_ns means the readout is waiting for
+ * data (link or trigger limited), the opposite means the consumer is the
+ * bottleneck. Returns 0 on success. */
+int mvlcc_readout_context_get_stats(mvlcc_readout_context_t ctx, mvlcc_readout_stats_t *stats);
+
+/* Memory of large readout and parser buffers: the aligned mode input buffer,
+ * parser pool buffers and mvlcc_buffer_alloc(). Settings apply to buffers
+ * allocated afterwards. */
+
+typedef struct
+{
+  /* Returns NULL on failure. */
+  void *(*alloc)(void *user, size_t bytes);
+  void (*free)(void *user, void *ptr, size_t bytes);
+  void *user;
+} mvlcc_allocator_t;
+
+/* Takes precedence over the built-in allocator. NULL restores the built-in
+ * allocator. */
+void mvlcc_set_allocator(const mvlcc_allocator_t *allocator);
+
+#define MVLCC_NUMA_NODE_ANY   -1
+/* The node of the CPU the allocating thread runs on. */
+#define MVLCC_NUMA_NODE_LOCAL -2
+
+/* Built-in allocator. By default buffers come from malloc(). With hugepages
+ * or a NUMA node set they are mapped, rounded up to 2 MiB for hugepages,
+ * placed on the node and faulted in at allocation time. Explicit hugepages
+ * (vm.nr_hugepages) are used if available, transparent hugepages otherwise. */
+typedef struct
+{
+  int hugepages;
+  int numa_node;  /* node number or MVLCC_NUMA_NODE_* */
+} mvlcc_buffer_alloc_options_t;
+
+void mvlcc_set_buffer_alloc_options(const mvlcc_buffer_alloc_options_t *options);
+
+/* NUMA node of the network interface, e.g. the one receiving MVLC ETH data,
+ * or -1 if unknown. */
+int mvlcc_numa_node_of_interface(const char *ifname);
+
+/* Allocates a buffer for use with mvlcc_readout() from the configured
+ * allocator. Returns NULL on failure. */
+void *mvlcc_buffer_alloc(size_t bytes);
+void mvlcc_buffer_free(void *ptr);
+
+/* Scheduling of the threads doing readout work. Library threads apply the
+ * configuration of their role when they start; the readout runs on threads of
+ * the caller, which opt in with mvlcc_thread_apply_config(). Pin readout
+ * threads to CPUs kept free of other work and give them a SCHED_FIFO priority
+ * to avoid packet loss from preemption. */
+
+typedef enum
+{
+  MVLCC_THREAD_READOUT,   /* caller threads calling mvlcc_readout() */
+  MVLCC_THREAD_PARSER,    /* mvlcc_parser_pool_t workers */
+  MVLCC_THREAD_WRITER,    /* threads sending or writing readout data */
+  MVLCC_THREAD_ROLE_COUNT
+} mvlcc_thread_role_t;
+
+typedef struct
+{
+  const char *cpus;       /* CPU list like "2-3,6". NULL or "": affinity unchanged */
+  int fifo_priority;      /* SCHED_FIFO priority 1-99, 0: scheduling policy unchanged */
+  const char *name;       /* at most 15 characters, NULL: "mvlcc-<role>". Library
+                             threads of the same role get an index appended. */
+} mvlcc_thread_config_t;
+
+/* Applies to threads starting or calling mvlcc_thread_apply_config()
+ * afterwards. NULL restores the defaults. Returns 0 on success, -1 for an
+ * invalid CPU list, priority or name. */
+int mvlcc_thread_set_config(mvlcc_thread_role_t role, const mvlcc_thread_config_t *config);
+
+/* Applies the configuration of role to the calling thread and includes it in
+ * mvlcc_thread_get_stats() until it exits. Returns 0 on success, -1 with errno
+ * set to the error of the first failed step otherwise, e.g. EPERM for
+ * SCHED_FIFO without CAP_SYS_NICE. The other steps are still applied. */
+int mvlcc_thread_apply_config(mvlcc_thread_role_t role);
+
+typedef struct
+{
+  mvlcc_thread_role_t role;
+  int tid;
+  char name[16];
+  int cpu;                        /* CPU the thread last ran on */
+  uint64_t cpu_ns;                /* user and system time */
+  uint64_t voluntary_switches;    /* blocking, e.g. waiting for data */
+  uint64_t involuntary_switches;  /* preemptions */
+} mvlcc_thread_stats_t;
+
+/* Fills in up to max_count entries and returns the number of registered
+ * threads. */
+size_t mvlcc_thread_get_stats(mvlcc_thread_stats_t *stats, size_t max_count);
+
+/* Per thread in-memory trace of the entry and exit of mvlcc_readout(),
+ * mvlcc_readout_parser_parse_buffer(), the event callbacks, mvlcc_run_command()
+ * and mvlcc_vme_block_read(). Each thread keeps the last records_per_thread
+ * events, 0 disables tracing and keeps the recorded events for dumping.
+ * Enabling again discards them.
+ * The same events are available as USDT probes when built with USDT=1, see
+ * src/mvlcc_trace.h. */
+void mvlcc_trace_enable(size_t records_per_thread);
+/* Writes the recorded events of all threads, oldest first. */
+void mvlcc_trace_dump(FILE *out);
+
 typedef struct
 {
   const uint32_t *data;
@@ -219,6 +722,8 @@ typedef struct
   intptr_t d;
 } mvlcc_readout_parser_t;
 
+/* The callbacks may be NULL. Data is then still parsed but not translated to
+ * mvlcc_module_data_t or delivered. */
 int mvlcc_readout_parser_create(
   mvlcc_readout_parser_t *parserp,
   mvlcc_crateconfig_t crateconfig,
@@ -238,6 +743,330 @@ mvlcc_parse_result_t mvlcc_readout_parser_parse_buffer(
   const uint32_t *buffer,
   size_t size);
 
+/* Parses a buffer returned by mvlcc_readout2() using the data format and
+ * buffer number from info. */
+mvlcc_parse_result_t mvlcc_readout_parser_parse_buffer2(
+  mvlcc_readout_parser_t parser,
+  const mvlcc_readout_info_t *info,
+  const uint32_t *buffer);
+
+/* Backpressure policy of library managed buffer queues (mvlcc_parser_pool_t,
+ * mvlcc_stream_server_t clients): what happens to a buffer when its consumer
+ * is slower than the readout. Only BLOCK ever makes the readout wait, use the
+ * other modes for monitoring consumers. */
+typedef enum
+{
+  MVLCC_BACKPRESSURE_BLOCK,       /* wait for the consumer */
+  MVLCC_BACKPRESSURE_DROP_NEWEST, /* discard the buffer that does not fit */
+  MVLCC_BACKPRESSURE_DROP_OLDEST, /* discard the oldest queued buffer instead */
+  MVLCC_BACKPRESSURE_SAMPLE       /* pass every sample_every-th buffer, drop the newest if full */
+} mvlcc_backpressure_mode_t;
+
+typedef struct
+{
+  mvlcc_backpressure_mode_t mode;
+  unsigned sample_every;  /* SAMPLE only, 0 and 1 pass every buffer */
+} mvlcc_backpressure_t;
+
+/* offered == accepted + dropped_newest + sampled_out. dropped_oldest buffers
+ * were accepted before. */
+typedef struct
+{
+  uint64_t offered;         /* buffers containing data */
+  uint64_t accepted;        /* queued for the consumer */
+  uint64_t dropped_newest;
+  uint64_t dropped_oldest;
+  uint64_t sampled_out;
+  uint64_t blocked;         /* BLOCK: number of waits */
+  uint64_t blocked_ns;      /* BLOCK: total time waited */
+} mvlcc_backpressure_stats_t;
+
+/* Parses buffers from an aligned readout context (see
+ * mvlcc_readout_context_set_aligned()) on several threads. Each thread works
+ * with a copy of the template parser's state and its callbacks and user
+ * context. With ordered != 0 the events are delivered one buffer at a time in
+ * submission order. Otherwise the callbacks are called from the parser threads
+ * concurrently and must be thread-safe.
+ *
+ * Usage: get a buffer with mvlcc_parser_pool_acquire_buffer(), fill it with
+ * mvlcc_readout2() and hand it back with mvlcc_parser_pool_submit(). The buffer
+ * must not be touched after submitting it. Acquire and submit from one thread. */
+
+typedef struct
+{
+  intptr_t d;
+} mvlcc_parser_pool_t;
+
+typedef struct
+{
+  uint64_t buffers;         /* parsed buffers */
+  uint64_t events;          /* readout events, delivered events in ordered mode */
+  uint64_t system_events;
+  uint64_t parse_errors;    /* buffers with a parse result other than Ok */
+} mvlcc_parser_pool_stats_t;
+
+/* threads == 0 uses 2 threads, buffer_count == 0 uses 4 buffers per thread,
+ * buffer_bytes == 0 uses 1 MiB buffers. Returns 0 on success, -1 otherwise. Use
+ * mvlcc_parser_pool_strerror() to get the error message. The pool has to be
+ * destroyed in both cases. */
+int mvlcc_parser_pool_create(
+  mvlcc_parser_pool_t *poolp,
+  mvlcc_readout_parser_t template_parser,
+  unsigned threads,
+  int ordered,
+  size_t buffer_count,
+  size_t buffer_bytes);
+
+/* Waits for outstanding buffers, stops the threads and frees the pool. */
+void mvlcc_parser_pool_destroy(mvlcc_parser_pool_t *pool);
+const char *mvlcc_parser_pool_strerror(mvlcc_parser_pool_t pool);
+
+size_t mvlcc_parser_pool_buffer_bytes(mvlcc_parser_pool_t pool);
+/* Returns a free buffer or NULL if none became free within timeout_ms, see
+ * mvlcc_parser_pool_set_backpressure() for the non-blocking modes. */
+uint8_t *mvlcc_parser_pool_acquire_buffer(mvlcc_parser_pool_t pool, int timeout_ms);
+/* Queues a buffer obtained from mvlcc_parser_pool_acquire_buffer() for
+ * parsing. Buffers with info->bytes_used == 0 are just returned to the pool.
+ * Returns 0 on success, -1 if the buffer does not belong to the pool or was
+ * not filled by an aligned readout (MVLCC_READOUT_FLAG_ALIGNED missing) or
+ * contains a split event (MVLCC_READOUT_FLAG_CONTINUES_PREVIOUS or
+ * _CONTINUED). Such buffers are returned to the pool unparsed. */
+int mvlcc_parser_pool_submit(mvlcc_parser_pool_t pool, uint8_t *buffer,
+  const mvlcc_readout_info_t *info);
+/* Blocks until all submitted buffers have been parsed and delivered. */
+void mvlcc_parser_pool_flush(mvlcc_parser_pool_t pool);
+mvlcc_parser_pool_stats_t mvlcc_parser_pool_get_stats(mvlcc_parser_pool_t pool);
+/* Default MVLCC_BACKPRESSURE_BLOCK: mvlcc_parser_pool_acquire_buffer() waits
+ * for a free buffer. In the other modes it never waits. If no buffer is free,
+ * DROP_OLDEST takes back the oldest buffer not being parsed yet, otherwise a
+ * scratch buffer is returned whose data is discarded on submit. SAMPLE parses
+ * only every sample_every-th submitted buffer. May be called from any thread.
+ * Returns 0 on success, -1 for invalid policies. */
+int mvlcc_parser_pool_set_backpressure(mvlcc_parser_pool_t pool,
+  const mvlcc_backpressure_t *policy);
+mvlcc_backpressure_stats_t mvlcc_parser_pool_get_backpressure_stats(mvlcc_parser_pool_t pool);
+
+/* Publishes readout buffers to other processes on the same host through a
+ * POSIX shared memory ring (shm_open() name, e.g. "/mvlcc-crate0"). One
+ * publisher, typically the readout process, copies each buffer with its
+ * mvlcc_readout_info_t into the next slot. Any number of readers attach
+ * read-only and copy the buffers out again. Readers never hold back the
+ * publisher: a reader falling more than slot_count buffers behind loses the
+ * overwritten ones and counts them in mvlcc_shm_reader_stats_t.lost_buffers. */
+
+typedef struct
+{
+  intptr_t d;
+} mvlcc_shm_publisher_t;
+
+/* Creates the ring, replacing an existing one of the same name. slot_bytes is
+ * the maximum buffer size. Returns 0 on success, -1 otherwise. Use
+ * mvlcc_shm_publisher_strerror() to get the error message. The publisher has
+ * to be destroyed in both cases. */
+int mvlcc_shm_publisher_create(mvlcc_shm_publisher_t *pubp, const char *name,
+  size_t slot_count, size_t slot_bytes);
+/* Closes the ring, waking up waiting readers, and removes the name. */
+void mvlcc_shm_publisher_destroy(mvlcc_shm_publisher_t *pub);
+const char *mvlcc_shm_publisher_strerror(mvlcc_shm_publisher_t pub);
+/* Publishes info->bytes_used bytes of data. Returns 0 on success, -1 if the
+ * buffer is larger than slot_bytes. */
+int mvlcc_shm_publisher_publish(mvlcc_shm_publisher_t pub, const uint8_t *data,
+  const mvlcc_readout_info_t *info);
+
+typedef struct
+{
+  intptr_t d;
+} mvlcc_shm_reader_t;
+
+/* Every buffer in order, waiting for the next one. */
+#define MVLCC_SHM_READ_NEXT   0
+/* Only the newest buffer, skipping older unread ones (event displays, monitors).
+ * Skipped buffers count as lost. */
+#define MVLCC_SHM_READ_LATEST 1
+
+typedef struct
+{
+  uint64_t buffers;       /* buffers read */
+  uint64_t lost_buffers;  /* overwritten before they were read, or skipped */
+  size_t slot_bytes;      /* minimum bytes_free for mvlcc_shm_reader_read() */
+} mvlcc_shm_reader_stats_t;
+
+/* Attaches to the ring of a running publisher. Reading starts with the next
+ * buffer published. Returns 0 on success, -1 otherwise. Use
+ * mvlcc_shm_reader_strerror() to get the error message. The reader has to be
+ * destroyed in both cases. */
+int mvlcc_shm_reader_create(mvlcc_shm_reader_t *readerp, const char *name, int mode);
+void mvlcc_shm_reader_destroy(mvlcc_shm_reader_t *reader);
+const char *mvlcc_shm_reader_strerror(mvlcc_shm_reader_t reader);
+/* Copies the next buffer to dest, waiting up to timeout_ms for it. A timeout
+ * is not an error, info->bytes_used is 0 then. Returns -1 once the publisher
+ * is gone or if bytes_free is smaller than the slot size. */
+int mvlcc_shm_reader_read(mvlcc_shm_reader_t reader, uint8_t *dest, size_t bytes_free,
+  mvlcc_readout_info_t *info, int timeout_ms);
+mvlcc_shm_reader_stats_t mvlcc_shm_reader_get_stats(mvlcc_shm_reader_t reader);
+
+/* Streams readout buffers to subscribers over TCP or a Unix stream socket,
+ * e.g. to distribute raw data to analysis nodes. Buffers are used like
+ * mvlcc_parser_pool_t buffers: get one with mvlcc_stream_server_acquire_buffer(),
+ * fill it with mvlcc_readout2() and hand it over with
+ * mvlcc_stream_server_submit(). It is sent to all connected clients from
+ * there without further copies and returns to the pool afterwards.
+ *
+ * Each buffer is sent as a MVLCC_STREAM_HEADER_BYTES frame header, see
+ * mvlcc_stream_decode_header(), followed by info.bytes_used bytes of data.
+ * Clients only receive buffers submitted after they connected. */
+
+typedef struct
+{
+  intptr_t d;
+} mvlcc_stream_server_t;
+
+/* Policies for clients whose queue is full. */
+#define MVLCC_STREAM_DROP       0  /* apply the backpressure policy, see below */
+#define MVLCC_STREAM_DISCONNECT 1  /* close the connection */
+
+typedef struct
+{
+  size_t buffer_count;    /* 0: 16 */
+  size_t buffer_bytes;    /* 0: 1 MiB */
+  /* Buffers queued per client, 0: 8. A slow client holds up to this many
+   * pool buffers, keep buffer_count above clients * client_queue. */
+  size_t client_queue;
+  int slow_client_policy; /* MVLCC_STREAM_DROP or MVLCC_STREAM_DISCONNECT */
+} mvlcc_stream_server_options_t;
+
+typedef struct
+{
+  uint64_t clients;           /* currently connected */
+  uint64_t accepted;
+  uint64_t disconnected;      /* including slow_disconnects */
+  uint64_t slow_disconnects;
+  uint64_t buffers;           /* submitted buffers containing data */
+  uint64_t sent_buffers;      /* summed over all clients */
+  uint64_t sent_bytes;        /* including frame headers */
+  uint64_t dropped_buffers;   /* summed over all clients */
+} mvlcc_stream_server_stats_t;
+
+/* address is "tcp://host:port" or "unix:/path/to/socket". An empty host
+ * listens on all addresses, port 0 on a free port, see
+ * mvlcc_stream_server_port(). options may be NULL. Returns 0 on success, -1
+ * otherwise. Use mvlcc_stream_server_strerror() to get the error message. The
+ * server has to be destroyed in both cases. */
+int mvlcc_stream_server_create(mvlcc_stream_server_t *serverp, const char *address,
+  const mvlcc_stream_server_options_t *options);
+/* Closes all connections, buffers not sent yet are discarded. */
+void mvlcc_stream_server_destroy(mvlcc_stream_server_t *server);
+const char *mvlcc_stream_server_strerror(mvlcc_stream_server_t server);
+/* Bound TCP port, 0 for Unix sockets. */
+int mvlcc_stream_server_port(mvlcc_stream_server_t server);
+
+size_t mvlcc_stream_server_buffer_bytes(mvlcc_stream_server_t server);
+/* Returns a free buffer or NULL if none became free within timeout_ms, see
+ * mvlcc_stream_server_set_backpressure() for the non-blocking modes. */
+uint8_t *mvlcc_stream_server_acquire_buffer(mvlcc_stream_server_t server, int timeout_ms);
+/* Sends a buffer obtained from mvlcc_stream_server_acquire_buffer() to the
+ * connected clients. Only waits for clients in MVLCC_BACKPRESSURE_BLOCK mode.
+ * Buffers with info->bytes_used == 0 are just returned to the pool. Returns 0
+ * on success, -1 if the buffer does not belong to the server. */
+int mvlcc_stream_server_submit(mvlcc_stream_server_t server, uint8_t *buffer,
+  const mvlcc_readout_info_t *info);
+mvlcc_stream_server_stats_t mvlcc_stream_server_get_stats(mvlcc_stream_server_t server);
+/* Policy for full client queues with MVLCC_STREAM_DROP, default
+ * MVLCC_BACKPRESSURE_DROP_NEWEST. BLOCK makes mvlcc_stream_server_submit()
+ * wait for the slowest client, for at most one second per call. The buffer is
+ * dropped for clients whose queue is still full then, and no new clients are
+ * accepted while it waits. SAMPLE sends every sample_every-th buffer to
+ * all clients. In all modes but BLOCK, mvlcc_stream_server_acquire_buffer()
+ * returns a scratch buffer, discarded on submit, instead of waiting when
+ * stalled clients hold the whole pool. Counters are per client queue. May be
+ * called from any thread. Returns 0 on success, -1 for invalid policies. */
+int mvlcc_stream_server_set_backpressure(mvlcc_stream_server_t server,
+  const mvlcc_backpressure_t *policy);
+mvlcc_backpressure_stats_t mvlcc_stream_server_get_backpressure_stats(mvlcc_stream_server_t server);
+
+#define MVLCC_STREAM_HEADER_BYTES 88
+
+/* Decodes a frame header received from a stream server. dropped_buffers is
+ * the number of buffers skipped for this client so far and may be NULL.
+ * Returns 0 on success, -1 if header is not a frame header of this version. */
+int mvlcc_stream_decode_header(const uint8_t *header, mvlcc_readout_info_t *info,
+  uint64_t *dropped_buffers);
+
+/* Process-wide cache of parsed crate configs and readout parser templates,
+ * keyed by a hash of the config content. mvlcc_crateconfig_from_yaml/json()
+ * (and thus from_file()) skip parsing text they have seen before and all
+ * readout parsers created from equal configs share one immutable, reference
+ * counted config and parser template. Enabled by default, thread-safe. */
+
+typedef struct
+{
+  size_t config_entries;
+  size_t parser_entries;
+  size_t config_hits;
+  size_t config_misses;
+  size_t parser_hits;
+  size_t parser_misses;
+  size_t evictions;
+} mvlcc_config_cache_stats_t;
+
+void mvlcc_config_cache_set_enabled(int enabled);
+/* Maximum number of cached configs and, separately, of parser templates
+ * (default 32). The least recently used entries are dropped beyond it,
+ * shrinking evicts immediately. */
+void mvlcc_config_cache_set_capacity(size_t capacity);
+size_t mvlcc_config_cache_get_capacity(void);
+/* Drops all cache entries. Existing parsers keep their shared data alive. */
+void mvlcc_config_cache_clear(void);
+mvlcc_config_cache_stats_t mvlcc_config_cache_get_stats(void);
+
+/* Content hash of the crateconfig. Equal configs yield equal hashes. */
+uint64_t mvlcc_crateconfig_hash(mvlcc_crateconfig_t crateconfig);
+
+/* MVLC_ETH protocol emulator listening on local UDP ports. It answers command
+ * pipe requests and streams simulated readout data (see mvlcc_make_mvlc_sim())
+ * for the stacks uploaded by the client. Use mvlcc_make_mvlc_eth() with the
+ * bind address to talk to it. Loss, reordering, malformed packets and rate
+ * limits apply to the packets sent by the emulator. */
+
+typedef struct
+{
+  intptr_t d;
+} mvlcc_eth_emulator_t;
+
+typedef struct
+{
+  const char *bind_address;     /* NULL: 127.0.0.1 */
+  uint16_t command_port;        /* 0: 0x8000. The data pipe uses command_port + 1. */
+  double data_loss;             /* probability of dropping a data pipe packet */
+  double command_loss;          /* probability of dropping a command pipe packet */
+  double reorder;               /* probability of swapping a packet with its successor */
+  double data_rate_bytes_per_s; /* 0: unlimited */
+  int jumbo_frames;
+  mvlcc_sim_params_t sim;
+  double malformed;             /* probability of following a data pipe packet with one
+                                   without a complete header or exceeding a jumbo frame */
+} mvlcc_eth_emulator_params_t;
+
+typedef struct
+{
+  size_t command_requests;
+  size_t stack_execs;
+  size_t packets_sent;
+  size_t packets_dropped;
+  size_t packets_reordered;
+  size_t data_bytes_sent;
+  size_t packets_malformed;
+} mvlcc_eth_emulator_stats_t;
+
+/* Starts the emulator threads. Returns 0 on success, -1 otherwise. Use
+ * mvlcc_eth_emulator_strerror() to get the error message. The emulator has to
+ * be destroyed in both cases. */
+int mvlcc_eth_emulator_create(mvlcc_eth_emulator_t *emup, const mvlcc_eth_emulator_params_t *params);
+/* Stops the emulator and frees it. */
+void mvlcc_eth_emulator_destroy(mvlcc_eth_emulator_t *emu);
+const char *mvlcc_eth_emulator_strerror(mvlcc_eth_emulator_t emu);
+mvlcc_eth_emulator_stats_t mvlcc_eth_emulator_get_stats(mvlcc_eth_emulator_t emu);
+
 #ifdef __cplusplus
 }
 #endif
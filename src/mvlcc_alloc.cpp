@@ -0,0 +1,229 @@
+#include "mvlcc_alloc.h"
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <new>
+#include <string>
+#include <utility>
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+
+constexpr size_t HugePageSize = 2u << 20;
+// From <numaif.h>, which is part of libnuma and not always installed.
+constexpr int MPOL_PREFERRED_ = 1;
+
+struct AllocSettings
+{
+	std::mutex mutex;
+	bool haveHook = false;
+	mvlcc_allocator_t hook = {};
+	mvlcc_buffer_alloc_options_t options = { 0, MVLCC_NUMA_NODE_ANY };
+};
+
+AllocSettings &settings()
+{
+	static AllocSettings instance;
+	return instance;
+}
+
+// Prefers the node for the pages of the mapping. Must be done before the
+// pages are touched.
+void bind_to_node(void *addr, size_t bytes, int node)
+{
+	if (node < 0 || node >= static_cast<int>(sizeof(unsigned long) * 8))
+		return;
+
+	unsigned long nodeMask = 1ul << node;
+	// Failure (no NUMA support) leaves the default first-touch placement.
+	syscall(SYS_mbind, addr, bytes, MPOL_PREFERRED_, &nodeMask, sizeof(nodeMask) * 8, 0);
+}
+
+}
+
+int current_numa_node()
+{
+	unsigned cpu = 0, node = 0;
+
+	if (syscall(SYS_getcpu, &cpu, &node, nullptr))
+		return -1;
+
+	return static_cast<int>(node);
+}
+
+int interface_numa_node(const char *ifname)
+{
+	std::ifstream in(std::string("/sys/class/net/") + ifname + "/device/numa_node");
+	int node = -1;
+
+	if (!(in >> node))
+		return -1;
+
+	return node;
+}
+
+void set_buffer_allocator(const mvlcc_allocator_t *allocator)
+{
+	auto &s = settings();
+	std::lock_guard<std::mutex> guard(s.mutex);
+	s.haveHook = allocator && allocator->alloc && allocator->free;
+	s.hook = s.haveHook ? *allocator : mvlcc_allocator_t{};
+}
+
+void set_buffer_alloc_options(const mvlcc_buffer_alloc_options_t &options)
+{
+	auto &s = settings();
+	std::lock_guard<std::mutex> guard(s.mutex);
+	s.options = options;
+}
+
+BufferMemory::BufferMemory(size_t bytes)
+{
+	reserve(bytes);
+}
+
+BufferMemory::~BufferMemory()
+{
+	release();
+}
+
+BufferMemory::BufferMemory(BufferMemory &&other) noexcept
+{
+	*this = std::move(other);
+}
+
+BufferMemory &BufferMemory::operator=(BufferMemory &&other) noexcept
+{
+	if (this != &other)
+	{
+		release();
+		data_ = std::exchange(other.data_, nullptr);
+		bytes_ = std::exchange(other.bytes_, 0);
+		mappedBytes_ = std::exchange(other.mappedBytes_, 0);
+		source_ = std::exchange(other.source_, Source::None);
+		hook_ = other.hook_;
+	}
+
+	return *this;
+}
+
+void BufferMemory::reserve(size_t bytes)
+{
+	if (bytes <= bytes_ && data_)
+		return;
+
+	release();
+
+	mvlcc_allocator_t hook = {};
+	mvlcc_buffer_alloc_options_t options = {};
+	bool haveHook = false;
+
+	{
+		auto &s = settings();
+		std::lock_guard<std::mutex> guard(s.mutex);
+		haveHook = s.haveHook;
+		hook = s.hook;
+		options = s.options;
+	}
+
+	if (haveHook)
+	{
+		if (!(data_ = hook.alloc(hook.user, bytes)))
+			throw std::bad_alloc();
+
+		hook_ = hook;
+		source_ = Source::Hook;
+		bytes_ = bytes;
+		return;
+	}
+
+	const int node = options.numa_node == MVLCC_NUMA_NODE_LOCAL ? current_numa_node() : options.numa_node;
+
+	if (!options.hugepages && node < 0)
+	{
+		if (!(data_ = std::malloc(bytes)))
+			throw std::bad_alloc();
+
+		source_ = Source::Malloc;
+		bytes_ = bytes;
+		return;
+	}
+
+	const size_t mapped = options.hugepages
+		? (bytes + HugePageSize - 1) / HugePageSize * HugePageSize
+		: bytes;
+
+	void *addr = MAP_FAILED;
+
+	// Explicit hugepages need a reserved pool (vm.nr_hugepages), fall back to
+	// transparent hugepages.
+	if (options.hugepages)
+		addr = mmap(nullptr, mapped, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+
+	if (addr == MAP_FAILED)
+	{
+		// Transparent hugepages only back 2 MiB aligned ranges: map one
+		// hugepage more and unmap the unaligned head and the rest of the tail.
+		const size_t slack = options.hugepages ? HugePageSize : 0;
+		void *base = mmap(nullptr, mapped + slack, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (base == MAP_FAILED)
+			throw std::bad_alloc();
+
+		addr = base;
+
+		if (options.hugepages)
+		{
+			const auto start = reinterpret_cast<uintptr_t>(base);
+			const auto aligned = (start + HugePageSize - 1) & ~static_cast<uintptr_t>(HugePageSize - 1);
+
+			if (aligned > start)
+				munmap(base, aligned - start);
+
+			if (start + slack > aligned)
+				munmap(reinterpret_cast<void *>(aligned + mapped), start + slack - aligned);
+
+			addr = reinterpret_cast<void *>(aligned);
+			madvise(addr, mapped, MADV_HUGEPAGE);
+		}
+	}
+
+	bind_to_node(addr, mapped, node);
+	// Fault the pages in now instead of during the readout.
+	std::memset(addr, 0, mapped);
+
+	data_ = addr;
+	bytes_ = bytes;
+	mappedBytes_ = mapped;
+	source_ = Source::Mmap;
+}
+
+void BufferMemory::release()
+{
+	switch (source_)
+	{
+		case Source::None:
+			break;
+		case Source::Hook:
+			hook_.free(hook_.user, data_, bytes_);
+			break;
+		case Source::Malloc:
+			std::free(data_);
+			break;
+		case Source::Mmap:
+			munmap(data_, mappedBytes_);
+			break;
+	}
+
+	data_ = nullptr;
+	bytes_ = 0;
+	mappedBytes_ = 0;
+	source_ = Source::None;
+}
@@ -0,0 +1,56 @@
+#pragma once
+
+// Allocation of large, long lived readout and parser buffers. The memory comes
+// from the allocator hook set with mvlcc_set_allocator() or from the built-in
+// allocator configured with mvlcc_set_buffer_alloc_options(): malloc by
+// default, optionally 2 MiB hugepages and placement on a NUMA node.
+//
+// Small and growing containers (parser state, aligner backlog) keep using the
+// standard allocator.
+
+#include <mvlcc_wrap.h>
+
+#include <cstddef>
+
+class BufferMemory
+{
+	public:
+		BufferMemory() = default;
+		// Throws std::bad_alloc if the allocator fails.
+		explicit BufferMemory(size_t bytes);
+		~BufferMemory();
+
+		BufferMemory(BufferMemory &&other) noexcept;
+		BufferMemory &operator=(BufferMemory &&other) noexcept;
+
+		BufferMemory(const BufferMemory &) = delete;
+		BufferMemory &operator=(const BufferMemory &) = delete;
+
+		uint8_t *data() const { return static_cast<uint8_t *>(data_); }
+		size_t size() const { return bytes_; }
+
+		// Allocates again if bytes is larger than the current size. The
+		// contents are not preserved.
+		void reserve(size_t bytes);
+
+	private:
+		enum class Source { None, Hook, Malloc, Mmap };
+
+		void release();
+
+		void *data_ = nullptr;
+		size_t bytes_ = 0;
+		size_t mappedBytes_ = 0;
+		Source source_ = Source::None;
+		mvlcc_allocator_t hook_ = {};
+};
+
+// NUMA node of the CPU the calling thread runs on, -1 if unknown.
+int current_numa_node();
+
+// Settings for buffers allocated afterwards. Thread-safe.
+void set_buffer_allocator(const mvlcc_allocator_t *allocator);
+void set_buffer_alloc_options(const mvlcc_buffer_alloc_options_t &options);
+
+// NUMA node of the PCI device behind a network interface, -1 if unknown.
+int interface_numa_node(const char *ifname);
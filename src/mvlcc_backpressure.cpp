@@ -0,0 +1,49 @@
+#include "mvlcc_backpressure.h"
+
+#include <stdexcept>
+
+void Backpressure::setPolicy(const mvlcc_backpressure_t &policy)
+{
+	switch (policy.mode)
+	{
+		case MVLCC_BACKPRESSURE_BLOCK:
+		case MVLCC_BACKPRESSURE_DROP_NEWEST:
+		case MVLCC_BACKPRESSURE_DROP_OLDEST:
+		case MVLCC_BACKPRESSURE_SAMPLE:
+			break;
+
+		default:
+			throw std::invalid_argument("invalid backpressure mode");
+	}
+
+	sampleEvery_.store(policy.sample_every ? policy.sample_every : 1, std::memory_order_relaxed);
+	mode_.store(policy.mode, std::memory_order_relaxed);
+}
+
+bool Backpressure::sampleNext()
+{
+	if (mode() != MVLCC_BACKPRESSURE_SAMPLE)
+		return true;
+
+	return sampleCounter_++ % sampleEvery_.load(std::memory_order_relaxed) == 0;
+}
+
+void Backpressure::addBlocked(std::chrono::steady_clock::time_point start)
+{
+	const auto elapsed = std::chrono::steady_clock::now() - start;
+	add_counter(counters_.blocked, 1);
+	add_counter(counters_.blockedNs, std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+}
+
+mvlcc_backpressure_stats_t Backpressure::stats() const
+{
+	mvlcc_backpressure_stats_t result = {};
+	result.offered = counters_.offered.load(std::memory_order_relaxed);
+	result.accepted = counters_.accepted.load(std::memory_order_relaxed);
+	result.dropped_newest = counters_.droppedNewest.load(std::memory_order_relaxed);
+	result.dropped_oldest = counters_.droppedOldest.load(std::memory_order_relaxed);
+	result.sampled_out = counters_.sampledOut.load(std::memory_order_relaxed);
+	result.blocked = counters_.blocked.load(std::memory_order_relaxed);
+	result.blocked_ns = counters_.blockedNs.load(std::memory_order_relaxed);
+	return result;
+}
@@ -0,0 +1,125 @@
+#pragma once
+
+// Backpressure policy of the library managed buffer queues (parser pool,
+// stream server clients): what a producer does when the consumer side is
+// full. BLOCK waits, the other modes never do and account for every buffer
+// not passed on.
+//
+// The policy may be changed from any thread. The counters have a single
+// writer, the producing thread, and may be read from other threads (see
+// add_counter()).
+
+#include <mvlcc_wrap.h>
+
+#include <atomic>
+#include <chrono>
+#include <optional>
+
+#include "mvlcc_counters.h"
+#include "mvlcc_queue.h"
+
+struct BackpressureCounters
+{
+	std::atomic<uint64_t> offered = 0;
+	std::atomic<uint64_t> accepted = 0;
+	std::atomic<uint64_t> droppedNewest = 0;
+	std::atomic<uint64_t> droppedOldest = 0;
+	std::atomic<uint64_t> sampledOut = 0;
+	std::atomic<uint64_t> blocked = 0;
+	std::atomic<uint64_t> blockedNs = 0;
+};
+
+class Backpressure
+{
+	public:
+		explicit Backpressure(mvlcc_backpressure_mode_t mode)
+			: mode_(mode)
+		{}
+
+		// Throws std::invalid_argument for unknown modes.
+		void setPolicy(const mvlcc_backpressure_t &policy);
+
+		mvlcc_backpressure_mode_t mode() const { return mode_.load(std::memory_order_relaxed); }
+
+		// Sampling decision for the next buffer, call once per buffer. Always
+		// true unless in SAMPLE mode, then true for every Nth buffer starting
+		// with the first.
+		bool sampleNext();
+
+		// Queues value according to the mode. Returns the item the caller has
+		// to dispose of: value itself if it was dropped, the evicted oldest
+		// item in DROP_OLDEST mode or nothing. Sampling is up to the caller.
+		// BLOCK mode waits at most blockTimeout if given, value is dropped if
+		// the queue is still full then.
+		template<typename T>
+		std::optional<T> offer(BoundedQueue<T> &queue, T value,
+			std::optional<std::chrono::milliseconds> blockTimeout = {});
+
+		// Accounts a wait of the producer since start.
+		void addBlocked(std::chrono::steady_clock::time_point start);
+
+		BackpressureCounters &counters() { return counters_; }
+		mvlcc_backpressure_stats_t stats() const;
+
+	private:
+		std::atomic<mvlcc_backpressure_mode_t> mode_;
+		std::atomic<unsigned> sampleEvery_ = 1;
+		uint64_t sampleCounter_ = 0;
+		BackpressureCounters counters_;
+};
+
+template<typename T>
+std::optional<T> Backpressure::offer(BoundedQueue<T> &queue, T value,
+	std::optional<std::chrono::milliseconds> blockTimeout)
+{
+	add_counter(counters_.offered, 1);
+
+	switch (mode())
+	{
+		case MVLCC_BACKPRESSURE_BLOCK:
+			if (!queue.tryPush(value))
+			{
+				const auto start = std::chrono::steady_clock::now();
+				const bool pushed = blockTimeout ? queue.push(value, *blockTimeout) : queue.push(value);
+				addBlocked(start);
+
+				if (!pushed)
+				{
+					add_counter(counters_.droppedNewest, 1);
+					return value;
+				}
+			}
+			break;
+
+		case MVLCC_BACKPRESSURE_DROP_OLDEST:
+			{
+				std::optional<T> evicted;
+
+				if (!queue.pushEvictOldest(value, evicted))
+				{
+					add_counter(counters_.droppedNewest, 1);
+					return value;
+				}
+
+				if (evicted)
+				{
+					add_counter(counters_.accepted, 1);
+					add_counter(counters_.droppedOldest, 1);
+					return evicted;
+				}
+			}
+			break;
+
+		case MVLCC_BACKPRESSURE_DROP_NEWEST:
+		case MVLCC_BACKPRESSURE_SAMPLE:
+			if (!queue.tryPush(value))
+			{
+				add_counter(counters_.droppedNewest, 1);
+				return value;
+			}
+			break;
+	}
+
+	add_counter(counters_.accepted, 1);
+	return {};
+}
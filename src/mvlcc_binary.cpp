@@ -0,0 +1,304 @@
+#include "mvlcc_binary.h"
+
+#include <map>
+#include <stdexcept>
+
+using namespace mesytec::mvlc;
+
+namespace
+{
+
+static const uint8_t BinaryMagic[4] = { 'M', 'V', 'C', 'B' };
+
+struct BinaryWriter
+{
+	std::vector<uint8_t> out;
+
+	void u8_(uint8_t v) { out.push_back(v); }
+
+	void u16_(uint16_t v)
+	{
+		out.push_back(v & 0xff);
+		out.push_back((v >> 8) & 0xff);
+	}
+
+	void u32_(uint32_t v)
+	{
+		for (int i = 0; i < 4; ++i)
+			out.push_back((v >> (i * 8)) & 0xff);
+	}
+
+	void str_(const std::string &s)
+	{
+		u32_(s.size());
+		out.insert(std::end(out), std::begin(s), std::end(s));
+	}
+};
+
+struct BinaryReader
+{
+	const uint8_t *data;
+	size_t size;
+	size_t pos = 0;
+
+	BinaryReader(const uint8_t *data_, size_t size_)
+		: data(data_)
+		, size(size_)
+	{}
+
+	void need(size_t bytes)
+	{
+		if (size - pos < bytes)
+			throw std::runtime_error("binary config: unexpected end of input");
+	}
+
+	uint8_t u8_()
+	{
+		need(1);
+		return data[pos++];
+	}
+
+	uint16_t u16_()
+	{
+		need(2);
+		uint16_t v = data[pos] | (data[pos + 1] << 8);
+		pos += 2;
+		return v;
+	}
+
+	uint32_t u32_()
+	{
+		need(4);
+		uint32_t v = 0;
+		for (int i = 0; i < 4; ++i)
+			v |= static_cast<uint32_t>(data[pos + i]) << (i * 8);
+		pos += 4;
+		return v;
+	}
+
+	std::string str_()
+	{
+		auto len = u32_();
+		need(len);
+		std::string s(reinterpret_cast<const char *>(data + pos), len);
+		pos += len;
+		return s;
+	}
+
+	// Element counts are checked against the remaining input to reject
+	// corrupted data before attempting huge allocations.
+	uint32_t count_(size_t minElementSize)
+	{
+		auto count = u32_();
+		if (count > (size - pos) / minElementSize)
+			throw std::runtime_error("binary config: element count out of range");
+		return count;
+	}
+};
+
+void write_header(BinaryWriter &w, BinaryKind kind)
+{
+	for (auto c: BinaryMagic)
+		w.u8_(c);
+	w.u16_(MVLCC_BINARY_FORMAT_VERSION);
+	w.u8_(static_cast<uint8_t>(kind));
+	w.u8_(0); // reserved
+}
+
+void read_header(BinaryReader &r, BinaryKind expectedKind)
+{
+	if (!is_binary_encoded(r.data, r.size))
+		throw std::runtime_error("binary config: bad magic");
+
+	r.pos += sizeof(BinaryMagic);
+
+	if (auto version = r.u16_(); version != MVLCC_BINARY_FORMAT_VERSION)
+		throw std::runtime_error(fmt::format("binary config: unsupported format version {}", version));
+
+	if (r.u8_() != static_cast<uint8_t>(expectedKind))
+		throw std::runtime_error("binary config: unexpected payload kind");
+
+	r.u8_(); // reserved
+}
+
+// Encoded size of a command without custom values, see write_command().
+constexpr size_t MinCommandBytes = 4 * sizeof(uint8_t) + sizeof(uint16_t) + 3 * sizeof(uint32_t);
+
+void write_command(BinaryWriter &w, const StackCommand &cmd)
+{
+	w.u8_(static_cast<uint8_t>(cmd.type));
+	w.u8_(cmd.amod);
+	w.u8_(static_cast<uint8_t>(cmd.dataWidth));
+	w.u8_(static_cast<uint8_t>(cmd.rate));
+	w.u16_(cmd.transfers);
+	w.u32_(cmd.address);
+	w.u32_(cmd.value);
+	w.u32_(cmd.customValues.size());
+	for (auto v: cmd.customValues)
+		w.u32_(v);
+}
+
+StackCommand read_command(BinaryReader &r)
+{
+	StackCommand cmd;
+	cmd.type = static_cast<StackCommand::CommandType>(r.u8_());
+	cmd.amod = r.u8_();
+	cmd.dataWidth = static_cast<VMEDataWidth>(r.u8_());
+	cmd.rate = static_cast<Blk2eSSTRate>(r.u8_());
+	cmd.transfers = r.u16_();
+	cmd.address = r.u32_();
+	cmd.value = r.u32_();
+	auto customCount = r.count_(4);
+	cmd.customValues.reserve(customCount);
+	for (size_t i = 0; i < customCount; ++i)
+		cmd.customValues.push_back(r.u32_());
+	return cmd;
+}
+
+void write_builder(BinaryWriter &w, const StackCommandBuilder &builder)
+{
+	w.str_(builder.getName());
+	const auto &groups = builder.getGroups();
+	w.u32_(groups.size());
+
+	for (const auto &group: groups)
+	{
+		w.str_(group.name);
+
+		// Sorted so that equal configs always encode to the same bytes.
+		std::map<std::string, std::string> meta(std::begin(group.meta), std::end(group.meta));
+		w.u32_(meta.size());
+		for (const auto &kv: meta)
+		{
+			w.str_(kv.first);
+			w.str_(kv.second);
+		}
+
+		w.u32_(group.commands.size());
+		for (const auto &cmd: group.commands)
+			write_command(w, cmd);
+	}
+}
+
+StackCommandBuilder read_builder(BinaryReader &r)
+{
+	StackCommandBuilder builder;
+	builder.setName(r.str_());
+	auto groupCount = r.count_(12);
+
+	for (size_t gi = 0; gi < groupCount; ++gi)
+	{
+		StackCommandBuilder::Group group;
+		group.name = r.str_();
+
+		auto metaCount = r.count_(8);
+		for (size_t mi = 0; mi < metaCount; ++mi)
+		{
+			auto key = r.str_();
+			group.meta[key] = r.str_();
+		}
+
+		auto cmdCount = r.count_(MinCommandBytes);
+		group.commands.reserve(cmdCount);
+		for (size_t ci = 0; ci < cmdCount; ++ci)
+			group.commands.emplace_back(read_command(r));
+
+		builder.addGroup(group);
+	}
+
+	return builder;
+}
+
+}
+
+bool is_binary_encoded(const uint8_t *data, size_t size)
+{
+	return data && size >= sizeof(BinaryMagic)
+		&& std::equal(std::begin(BinaryMagic), std::end(BinaryMagic), data);
+}
+
+std::vector<uint8_t> command_list_to_binary(const StackCommandBuilder &cmdList)
+{
+	BinaryWriter w;
+	write_header(w, BinaryKind::CommandList);
+	write_builder(w, cmdList);
+	return w.out;
+}
+
+StackCommandBuilder command_list_from_binary(const uint8_t *data, size_t size)
+{
+	BinaryReader r(data, size);
+	read_header(r, BinaryKind::CommandList);
+	auto result = read_builder(r);
+
+	if (r.pos != r.size)
+		throw std::runtime_error("binary config: trailing data after command list");
+
+	return result;
+}
+
+std::vector<uint8_t> crate_config_to_binary(const CrateConfig &config)
+{
+	BinaryWriter w;
+	write_header(w, BinaryKind::CrateConfig);
+
+	w.u8_(static_cast<uint8_t>(config.connectionType));
+	w.str_(config.usbDevSerial);
+	w.u32_(static_cast<uint32_t>(config.usbIndex));
+	w.str_(config.ethHost);
+	w.u8_(config.ethJumboEnable);
+	w.u32_(config.crateId);
+
+	w.u32_(config.stacks.size());
+	for (const auto &stack: config.stacks)
+		write_builder(w, stack);
+
+	w.u32_(config.triggers.size());
+	for (auto trigger: config.triggers)
+		w.u32_(trigger);
+
+	write_builder(w, config.initRegisters);
+	write_builder(w, config.initTriggerIO);
+	write_builder(w, config.initCommands);
+	write_builder(w, config.stopCommands);
+	write_builder(w, config.mcstDaqStart);
+	write_builder(w, config.mcstDaqStop);
+
+	return w.out;
+}
+
+CrateConfig crate_config_from_binary(const uint8_t *data, size_t size)
+{
+	BinaryReader r(data, size);
+	read_header(r, BinaryKind::CrateConfig);
+
+	CrateConfig config;
+	config.connectionType = static_cast<ConnectionType>(r.u8_());
+	config.usbDevSerial = r.str_();
+	config.usbIndex = static_cast<int>(r.u32_());
+	config.ethHost = r.str_();
+	config.ethJumboEnable = r.u8_();
+	config.crateId = r.u32_();
+
+	auto stackCount = r.count_(8);
+	config.stacks.reserve(stackCount);
+	for (size_t i = 0; i < stackCount; ++i)
+		config.stacks.emplace_back(read_builder(r));
+
+	auto triggerCount = r.count_(4);
+	config.triggers.reserve(triggerCount);
+	for (size_t i = 0; i < triggerCount; ++i)
+		config.triggers.push_back(r.u32_());
+
+	config.initRegisters = read_builder(r);
+	config.initTriggerIO = read_builder(r);
+	config.initCommands = read_builder(r);
+	config.stopCommands = read_builder(r);
+	config.mcstDaqStart = read_builder(r);
+	config.mcstDaqStop = read_builder(r);
+
+	if (r.pos != r.size)
+		throw std::runtime_error("binary config: trailing data after crate config");
+
+	return config;
+}
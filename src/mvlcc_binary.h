@@ -0,0 +1,30 @@
+#pragma once
+
+// Compact, versioned binary encoding of StackCommandBuilder and CrateConfig
+// objects. Meant as a fast alternative to the YAML/JSON formats when the same
+// configuration has to be loaded many times, e.g. by worker processes.
+//
+// Layout: 4 byte magic "MVCB", u16 format version, u8 payload kind, u8 reserved,
+// followed by the payload. All integers are stored little-endian, strings and
+// vectors are prefixed by their u32 element count.
+//
+// The decode functions throw std::runtime_error on malformed input.
+
+#include <mesytec-mvlc/mesytec-mvlc.h>
+
+static const uint16_t MVLCC_BINARY_FORMAT_VERSION = 1;
+
+enum class BinaryKind: uint8_t
+{
+	CommandList = 1,
+	CrateConfig = 2,
+};
+
+std::vector<uint8_t> command_list_to_binary(const mesytec::mvlc::StackCommandBuilder &cmdList);
+mesytec::mvlc::StackCommandBuilder command_list_from_binary(const uint8_t *data, size_t size);
+
+std::vector<uint8_t> crate_config_to_binary(const mesytec::mvlc::CrateConfig &config);
+mesytec::mvlc::CrateConfig crate_config_from_binary(const uint8_t *data, size_t size);
+
+// True if data starts with the binary format magic bytes.
+bool is_binary_encoded(const uint8_t *data, size_t size);
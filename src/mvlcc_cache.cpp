@@ -0,0 +1,218 @@
+#include "mvlcc_cache.h"
+
+#include <algorithm>
+#include <unordered_map>
+
+#include "mvlcc_binary.h"
+
+using namespace mesytec::mvlc;
+
+namespace
+{
+
+// The key content is kept alongside each entry and compared on lookup, so a
+// hash collision results in a cache miss, never in a wrong config.
+struct ConfigEntry
+{
+	std::string text;
+	std::shared_ptr<const CrateConfig> config;
+	uint64_t lastUse;
+};
+
+struct ParserEntry
+{
+	std::vector<uint8_t> encoded;
+	std::shared_ptr<const ParserTemplate> parserTemplate;
+	uint64_t lastUse;
+};
+
+struct ConfigCache
+{
+	std::mutex mutex;
+	bool enabled = true;
+	size_t capacity = ConfigCacheDefaultCapacity;
+	// Incremented on every hit and insert, orders the entries by last use.
+	uint64_t useCounter = 0;
+	std::unordered_map<uint64_t, ConfigEntry> configs;
+	std::unordered_map<uint64_t, ParserEntry> parsers;
+	ConfigCacheStats stats = {};
+};
+
+// Drops least recently used entries until the map holds at most capacity
+// entries. Linear scans, the maps are small.
+template<typename Map>
+void evict_lru(Map &entries, size_t capacity, size_t &evictions)
+{
+	while (entries.size() > capacity)
+	{
+		auto oldest = std::min_element(std::begin(entries), std::end(entries),
+			[] (const auto &a, const auto &b) { return a.second.lastUse < b.second.lastUse; });
+		entries.erase(oldest);
+		++evictions;
+	}
+}
+
+ConfigCache &get_cache()
+{
+	static ConfigCache cache;
+	return cache;
+}
+
+std::shared_ptr<const ParserTemplate> make_parser_template(const CrateConfig &config)
+{
+	auto result = std::make_shared<ParserTemplate>();
+	result->config = std::make_shared<CrateConfig>(config);
+	result->state = readout_parser::make_readout_parser(result->config->stacks);
+	return result;
+}
+
+}
+
+uint64_t content_hash(const void *data, size_t size)
+{
+	auto bytes = reinterpret_cast<const uint8_t *>(data);
+	uint64_t hash = 0xcbf29ce484222325ull;
+
+	for (size_t i = 0; i < size; ++i)
+	{
+		hash ^= bytes[i];
+		hash *= 0x100000001b3ull;
+	}
+
+	return hash;
+}
+
+uint64_t crate_config_hash(const CrateConfig &config)
+{
+	auto encoded = crate_config_to_binary(config);
+	return content_hash(encoded.data(), encoded.size());
+}
+
+std::shared_ptr<const CrateConfig> cached_crate_config_from_text(
+	const std::string &text, bool isJson)
+{
+	auto parse = [&] ()
+	{
+		return std::make_shared<const CrateConfig>(isJson
+			? crate_config_from_json(text)
+			: crate_config_from_yaml(text));
+	};
+
+	auto &cache = get_cache();
+	// JSON and YAML texts never collide in practice but keep them apart anyway.
+	const auto key = content_hash(text.data(), text.size()) ^ isJson;
+
+	{
+		std::unique_lock<std::mutex> guard(cache.mutex);
+
+		if (!cache.enabled)
+		{
+			guard.unlock();
+			return parse();
+		}
+
+		if (auto it = cache.configs.find(key);
+			it != std::end(cache.configs) && it->second.text == text)
+		{
+			++cache.stats.configHits;
+			it->second.lastUse = ++cache.useCounter;
+			return it->second.config;
+		}
+
+		++cache.stats.configMisses;
+	}
+
+	// Parse without holding the lock. Concurrent misses on the same text both
+	// parse, the last one to finish wins the cache slot.
+	auto config = parse();
+
+	std::lock_guard<std::mutex> guard(cache.mutex);
+	cache.configs[key] = { text, config, ++cache.useCounter };
+	evict_lru(cache.configs, cache.capacity, cache.stats.evictions);
+	return config;
+}
+
+std::shared_ptr<const ParserTemplate> cached_parser_template(const CrateConfig &config)
+{
+	auto &cache = get_cache();
+
+	{
+		std::lock_guard<std::mutex> guard(cache.mutex);
+		if (!cache.enabled)
+			return make_parser_template(config);
+	}
+
+	auto encoded = crate_config_to_binary(config);
+	const auto key = content_hash(encoded.data(), encoded.size());
+
+	{
+		std::lock_guard<std::mutex> guard(cache.mutex);
+
+		if (auto it = cache.parsers.find(key);
+			it != std::end(cache.parsers) && it->second.encoded == encoded)
+		{
+			++cache.stats.parserHits;
+			it->second.lastUse = ++cache.useCounter;
+			return it->second.parserTemplate;
+		}
+
+		++cache.stats.parserMisses;
+	}
+
+	auto parserTemplate = make_parser_template(config);
+
+	std::lock_guard<std::mutex> guard(cache.mutex);
+	cache.parsers[key] = { std::move(encoded), parserTemplate, ++cache.useCounter };
+	evict_lru(cache.parsers, cache.capacity, cache.stats.evictions);
+	return parserTemplate;
+}
+
+void config_cache_set_enabled(bool enabled)
+{
+	auto &cache = get_cache();
+	std::lock_guard<std::mutex> guard(cache.mutex);
+	cache.enabled = enabled;
+}
+
+bool config_cache_is_enabled()
+{
+	auto &cache = get_cache();
+	std::lock_guard<std::mutex> guard(cache.mutex);
+	return cache.enabled;
+}
+
+void config_cache_set_capacity(size_t capacity)
+{
+	auto &cache = get_cache();
+	std::lock_guard<std::mutex> guard(cache.mutex);
+	cache.capacity = capacity;
+	evict_lru(cache.configs, cache.capacity, cache.stats.evictions);
+	evict_lru(cache.parsers, cache.capacity, cache.stats.evictions);
+}
+
+size_t config_cache_get_capacity()
+{
+	auto &cache = get_cache();
+	std::lock_guard<std::mutex> guard(cache.mutex);
+	return cache.capacity;
+}
+
+void config_cache_clear()
+{
+	auto &cache = get_cache();
+	std::lock_guard<std::mutex> guard(cache.mutex);
+	// Objects still referenced by parsers stay alive until those are destroyed.
+	cache.configs.clear();
+	cache.parsers.clear();
+	cache.stats = {};
+}
+
+ConfigCacheStats config_cache_get_stats()
+{
+	auto &cache = get_cache();
+	std::lock_guard<std::mutex> guard(cache.mutex);
+	auto result = cache.stats;
+	result.configEntries = cache.configs.size();
+	result.parserEntries = cache.parsers.size();
+	return result;
+}
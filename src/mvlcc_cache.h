@@ -0,0 +1,55 @@
+#pragma once
+
+// Process-wide cache of parsed crate configs and readout parser templates.
+// Entries are keyed by a hash of the config content and handed out as shared,
+// immutable objects, so that many parser instances created from the same
+// config share one parsed form. Each of the two kinds of entries is limited to
+// a capacity, the least recently used entries are dropped beyond it. All
+// functions are thread-safe.
+
+#include <mesytec-mvlc/mesytec-mvlc.h>
+
+// 64-bit FNV-1a hash.
+uint64_t content_hash(const void *data, size_t size);
+
+// Content hash of a crate config, computed over its binary encoding.
+uint64_t crate_config_hash(const mesytec::mvlc::CrateConfig &config);
+
+// Pristine parser state created by make_readout_parser() for a config. Copy
+// the state and set its userContext before use.
+struct ParserTemplate
+{
+	std::shared_ptr<const mesytec::mvlc::CrateConfig> config;
+	mesytec::mvlc::readout_parser::ReadoutParserState state;
+};
+
+// Parses YAML or JSON crate config text or returns the cached result of an
+// earlier parse of the same text. Throws on parse errors.
+std::shared_ptr<const mesytec::mvlc::CrateConfig> cached_crate_config_from_text(
+	const std::string &text, bool isJson);
+
+// Returns the shared parser template for the given config, creating it if
+// needed. Throws if make_readout_parser() fails.
+std::shared_ptr<const ParserTemplate> cached_parser_template(
+	const mesytec::mvlc::CrateConfig &config);
+
+static const size_t ConfigCacheDefaultCapacity = 32;
+
+struct ConfigCacheStats
+{
+	size_t configEntries;
+	size_t parserEntries;
+	size_t configHits;
+	size_t configMisses;
+	size_t parserHits;
+	size_t parserMisses;
+	size_t evictions;
+};
+
+void config_cache_set_enabled(bool enabled);
+bool config_cache_is_enabled();
+// Entries per kind. Shrinking evicts immediately, 0 keeps nothing cached.
+void config_cache_set_capacity(size_t capacity);
+size_t config_cache_get_capacity();
+void config_cache_clear();
+ConfigCacheStats config_cache_get_stats();
@@ -0,0 +1,99 @@
+#include "mvlcc_command_log.h"
+
+#include <cstring>
+
+using namespace mesytec::mvlc;
+
+void CommandLog::record(const StackCommand &cmd, std::chrono::steady_clock::time_point start,
+	const std::error_code &ec, const uint32_t *response, size_t responseWords)
+{
+	const auto now = std::chrono::steady_clock::now();
+
+	Record rec = {};
+	rec.timestampNs = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+	rec.durationNs = std::chrono::duration_cast<std::chrono::nanoseconds>(now - start).count();
+	rec.type = cmd.type;
+	rec.amod = cmd.amod;
+	rec.dataWidth = cmd.dataWidth;
+	rec.transfers = cmd.transfers;
+	rec.address = cmd.address;
+	rec.value = cmd.value;
+	rec.ec = ec.value();
+	rec.responseWords = responseWords;
+	rec.firstResponseWord = responseWords ? response[0] : 0;
+
+	uint64_t words[RecordWords] = {};
+	std::memcpy(words, &rec, sizeof(rec));
+
+	const uint64_t index = head_.fetch_add(1, std::memory_order_relaxed);
+	auto &slot = slots_[index % Capacity];
+
+	slot.sequence.store(0, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	for (size_t i = 0; i < RecordWords; ++i)
+		slot.words[i].store(words[i], std::memory_order_relaxed);
+
+	slot.sequence.store(index + 1, std::memory_order_release);
+}
+
+std::vector<CommandLog::Record> CommandLog::records() const
+{
+	const uint64_t head = head_.load(std::memory_order_acquire);
+	std::vector<Record> result;
+	result.reserve(Capacity);
+
+	for (uint64_t index = head > Capacity ? head - Capacity : 0; index < head; ++index)
+	{
+		const auto &slot = slots_[index % Capacity];
+
+		if (slot.sequence.load(std::memory_order_acquire) != index + 1)
+			continue;
+
+		uint64_t words[RecordWords];
+
+		for (size_t i = 0; i < RecordWords; ++i)
+			words[i] = slot.words[i].load(std::memory_order_relaxed);
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+
+		if (slot.sequence.load(std::memory_order_relaxed) != index + 1)
+			continue;
+
+		Record rec;
+		std::memcpy(&rec, words, sizeof(rec));
+		result.push_back(rec);
+	}
+
+	return result;
+}
+
+std::string CommandLog::format(const Record &record)
+{
+	StackCommand cmd;
+	cmd.type = record.type;
+	cmd.amod = record.amod;
+	cmd.dataWidth = record.dataWidth;
+	cmd.transfers = record.transfers;
+	cmd.address = record.address;
+	cmd.value = record.value;
+
+	return fmt::format("t={} duration={}us cmd='{}' ec={} response[{}]={:#010x}",
+		record.timestampNs, record.durationNs / 1000.0, to_string(cmd), record.ec,
+		record.responseWords, record.firstResponseWord);
+}
+
+void CommandLog::dump(FILE *out) const
+{
+	for (const auto &rec: records())
+		fprintf(out, "%s\n", format(rec).c_str());
+}
+
+void CommandLog::log(spdlog::level::level_enum level) const
+{
+	if (!spdlog::should_log(level))
+		return;
+
+	for (const auto &rec: records())
+		spdlog::log(level, "recent command: {}", format(rec));
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+// Ring of the most recent commands run through the C API.
+//
+// Records are plain fields, formatting happens only when the ring is dumped,
+// so recording costs a few relaxed stores. Writers claim slots with a
+// fetch_add and may run concurrently; each slot carries a sequence number
+// which lets the dump skip slots that are being overwritten.
+
+#include <mesytec-mvlc/mesytec-mvlc.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+
+class CommandLog
+{
+	public:
+		static const size_t Capacity = 64;
+
+		struct Record
+		{
+			uint64_t timestampNs;
+			uint64_t durationNs;
+			mesytec::mvlc::StackCommand::CommandType type;
+			uint8_t amod;
+			mesytec::mvlc::VMEDataWidth dataWidth;
+			uint16_t transfers;
+			uint32_t address;
+			uint32_t value;
+			int ec;
+			uint32_t responseWords;
+			uint32_t firstResponseWord;
+		};
+
+		void record(const mesytec::mvlc::StackCommand &cmd, std::chrono::steady_clock::time_point start,
+			const std::error_code &ec, const uint32_t *response, size_t responseWords);
+
+		// Oldest first. Slots written concurrently with the copy are skipped.
+		std::vector<Record> records() const;
+
+		void dump(FILE *out) const;
+		void log(spdlog::level::level_enum level) const;
+
+		static std::string format(const Record &record);
+
+	private:
+		// The record fields are stored as words so that they can be accessed
+		// atomically.
+		static const size_t RecordWords = (sizeof(Record) + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+
+		struct Slot
+		{
+			std::atomic<uint64_t> sequence = 0; // index + 1 of the record, 0 while being written
+			std::array<std::atomic<uint64_t>, RecordWords> words = {};
+		};
+
+		std::atomic<uint64_t> head_ = 0;
+		std::array<Slot, Capacity> slots_;
+};
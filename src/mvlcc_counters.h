@@ -0,0 +1,21 @@
+#pragma once
+
+// Statistics counters, read from other threads with relaxed loads at any time
+// without locking. Each counter is consistent on its own, a snapshot of
+// several counters is not.
+
+#include <atomic>
+#include <cstdint>
+
+// For counters with a single writer thread: a relaxed load/store pair instead
+// of a read-modify-write operation.
+inline void add_counter(std::atomic<uint64_t> &counter, uint64_t value)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + value, std::memory_order_relaxed);
+}
+
+// For counters updated from several threads.
+inline void add_shared_counter(std::atomic<uint64_t> &counter, uint64_t value)
+{
+	counter.fetch_add(value, std::memory_order_relaxed);
+}
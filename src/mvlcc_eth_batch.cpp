@@ -0,0 +1,185 @@
+#include "mvlcc_eth_batch.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <system_error>
+
+#include <poll.h>
+
+#include "mvlcc_socket_stats.h"
+
+using namespace mesytec::mvlc;
+
+namespace
+{
+
+constexpr size_t ControlBytes = CMSG_SPACE(sizeof(uint32_t));
+
+std::error_code last_error()
+{
+	return std::error_code(errno, std::system_category());
+}
+
+// What readout() returns if no packet arrives in time.
+std::error_code read_timeout()
+{
+	return make_error_code(MVLCErrorCode::SocketReadTimeout);
+}
+
+void set_socket_option(int fd, int option, int value, const char *name)
+{
+	if (setsockopt(fd, SOL_SOCKET, option, &value, sizeof(value)))
+		throw std::system_error(last_error(), name);
+}
+
+}
+
+EthBatchReceiver::EthBatchReceiver(int fd, const mvlcc_eth_batch_options_t &options,
+	std::shared_ptr<EthBatchCounters> counters)
+	: fd_(fd)
+	, msgs_(options.batch_packets ? options.batch_packets : 64)
+	, iovecs_(msgs_.size())
+	, controls_(msgs_.size() * ControlBytes)
+	, counters_(counters ? std::move(counters) : std::make_shared<EthBatchCounters>())
+{
+	// Reports the kernel's drop counter of the socket with each packet.
+	set_socket_option(fd_, SO_RXQ_OVFL, 1, "SO_RXQ_OVFL");
+
+	if (options.rcvbuf_bytes > 0)
+	{
+		// SO_RCVBUFFORCE ignores net.core.rmem_max but needs CAP_NET_ADMIN.
+		if (setsockopt(fd_, SOL_SOCKET, SO_RCVBUFFORCE, &options.rcvbuf_bytes, sizeof(options.rcvbuf_bytes)))
+			set_socket_option(fd_, SO_RCVBUF, options.rcvbuf_bytes, "SO_RCVBUF");
+	}
+
+	if (options.busy_poll_us > 0)
+		set_socket_option(fd_, SO_BUSY_POLL, options.busy_poll_us, "SO_BUSY_POLL");
+}
+
+std::pair<std::error_code, size_t> EthBatchReceiver::receive(uint8_t *dest, size_t bytesFree,
+	std::chrono::milliseconds timeout)
+{
+	size_t used = 0;
+	const auto deadline = std::chrono::steady_clock::now() + timeout;
+
+	while (bytesFree - used >= SlotBytes)
+	{
+		const size_t slots = std::min(msgs_.size(), (bytesFree - used) / SlotBytes);
+
+		for (size_t i = 0; i < slots; ++i)
+		{
+			iovecs_[i] = { dest + used + i * SlotBytes, SlotBytes };
+			msgs_[i] = {};
+			msgs_[i].msg_hdr.msg_iov = &iovecs_[i];
+			msgs_[i].msg_hdr.msg_iovlen = 1;
+			msgs_[i].msg_hdr.msg_control = controls_.data() + i * ControlBytes;
+			msgs_[i].msg_hdr.msg_controllen = ControlBytes;
+		}
+
+		const int received = recvmmsg(fd_, msgs_.data(), slots, MSG_DONTWAIT, nullptr);
+		add_counter(counters_->syscalls, 1);
+
+		if (received < 0)
+		{
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				return { last_error(), used };
+
+			if (used)
+				break;
+
+			const auto remaining = std::chrono::ceil<std::chrono::milliseconds>(
+				deadline - std::chrono::steady_clock::now());
+
+			if (remaining.count() <= 0)
+				return { read_timeout(), 0 };
+
+			// Nothing queued: wait for the first packet until the deadline,
+			// also after interruptions. With net.core.busy_poll set, poll()
+			// busy waits on the device queue.
+			pollfd pfd = { fd_, POLLIN, 0 };
+			const int ready = poll(&pfd, 1, static_cast<int>(remaining.count()));
+
+			if (ready < 0 && errno != EINTR)
+				return { last_error(), 0 };
+
+			if (ready == 0)
+				return { read_timeout(), 0 };
+
+			continue;
+		}
+
+		// Move the packets together, dropping truncated and short ones.
+		uint8_t *out = dest + used;
+
+		for (int i = 0; i < received; ++i)
+		{
+			const auto *packet = static_cast<const uint8_t *>(iovecs_[i].iov_base);
+			const size_t len = msgs_[i].msg_len;
+
+			// The counter is only sent once it is non-zero.
+			const int64_t drops = rxq_ovfl_drops(msgs_[i].msg_hdr);
+			if (drops > static_cast<int64_t>(counters_->socketDrops.load(std::memory_order_relaxed)))
+				counters_->socketDrops.store(drops, std::memory_order_relaxed);
+
+			if (msgs_[i].msg_hdr.msg_flags & MSG_TRUNC)
+			{
+				add_counter(counters_->truncatedPackets, 1);
+				continue;
+			}
+
+			if (len < eth::HeaderBytes || len % sizeof(uint32_t))
+			{
+				add_counter(counters_->shortPackets, 1);
+				continue;
+			}
+
+			checkSequence(packet);
+
+			if (out != packet)
+				std::memmove(out, packet, len);
+
+			out += len;
+			add_counter(counters_->packets, 1);
+			add_counter(counters_->bytes, len);
+		}
+
+		used = out - dest;
+
+		// The socket queue is drained.
+		if (static_cast<size_t>(received) < slots)
+			break;
+	}
+
+	return { {}, used };
+}
+
+void EthBatchReceiver::checkSequence(const uint8_t *packet)
+{
+	eth::PayloadHeaderInfo header = {};
+	std::memcpy(&header.header0, packet, sizeof(header.header0));
+	std::memcpy(&header.header1, packet + sizeof(header.header0), sizeof(header.header1));
+
+	auto &last = lastPacketNumbers_[header.packetChannel() & eth::header0::PacketChannelMask];
+	const int number = header.packetNumber();
+
+	if (last >= 0)
+		add_counter(counters_->lostPackets, (number - last - 1) & eth::header0::PacketNumberMask);
+
+	last = number;
+}
+
+void EthBatchCounters::snapshot(mvlcc_eth_batch_stats_t &dest) const
+{
+	dest.syscalls = syscalls.load(std::memory_order_relaxed);
+	dest.packets = packets.load(std::memory_order_relaxed);
+	dest.bytes = bytes.load(std::memory_order_relaxed);
+	dest.lost_packets = lostPackets.load(std::memory_order_relaxed);
+	dest.truncated_packets = truncatedPackets.load(std::memory_order_relaxed);
+	dest.short_packets = shortPackets.load(std::memory_order_relaxed);
+	dest.socket_drops = socketDrops.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+// Batched receive of MVLC_ETH data pipe packets with recvmmsg(), replacing
+// the one datagram per syscall path of mesytec::mvlc::readout().
+//
+// Packets are received directly into the destination buffer, one jumbo frame
+// sized slot per packet, and then moved together. The output is the same as
+// readout() produces for ETH connections: the packets including their header
+// words, back to back.
+//
+// Counters have a single writer, the readout thread, and may be read from
+// other threads (see add_counter()). They may be shared by the receivers
+// created one after another for the same connection, so that they add up to
+// the connection's data pipe totals.
+
+#include <mvlcc_wrap.h>
+#include <mesytec-mvlc/mesytec-mvlc.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include <sys/socket.h>
+
+#include "mvlcc_counters.h"
+
+struct EthBatchCounters
+{
+	std::atomic<uint64_t> syscalls = 0;
+	std::atomic<uint64_t> packets = 0;
+	std::atomic<uint64_t> bytes = 0;
+	std::atomic<uint64_t> lostPackets = 0;
+	std::atomic<uint64_t> truncatedPackets = 0;
+	std::atomic<uint64_t> shortPackets = 0;
+	std::atomic<uint64_t> socketDrops = 0;
+
+	void snapshot(mvlcc_eth_batch_stats_t &dest) const;
+};
+
+class EthBatchReceiver
+{
+	public:
+		// Applies the socket options. Throws std::system_error if one of them
+		// cannot be set. Creates its own counters if none are passed.
+		EthBatchReceiver(int fd, const mvlcc_eth_batch_options_t &options,
+			std::shared_ptr<EthBatchCounters> counters = {});
+
+		// Fills dest with whole packets until it cannot hold another jumbo
+		// frame or no more packets are queued. Waits up to timeout for the
+		// first packet and returns MVLCErrorCode::SocketReadTimeout if none
+		// arrives, like readout().
+		std::pair<std::error_code, size_t> receive(uint8_t *dest, size_t bytesFree,
+			std::chrono::milliseconds timeout);
+
+		void stats(mvlcc_eth_batch_stats_t &dest) const { counters_->snapshot(dest); }
+
+		uint64_t packets() const { return counters_->packets.load(std::memory_order_relaxed); }
+		uint64_t lostPackets() const { return counters_->lostPackets.load(std::memory_order_relaxed); }
+
+		static constexpr size_t SlotBytes = mesytec::mvlc::eth::JumboFrameMaxSize;
+
+	private:
+		void checkSequence(const uint8_t *packet);
+
+		int fd_;
+		std::vector<mmsghdr> msgs_;
+		std::vector<iovec> iovecs_;
+		std::vector<uint8_t> controls_;		// SO_RXQ_OVFL control message per packet
+		// Last packet number per packet channel, -1 before the first packet.
+		std::array<int, 4> lastPacketNumbers_ = { -1, -1, -1, -1 };
+		std::shared_ptr<EthBatchCounters> counters_;
+};
@@ -0,0 +1,420 @@
+#include "mvlcc_eth_emulator.h"
+
+#include <arpa/inet.h>
+#include <cstring>
+#include <optional>
+#include <poll.h>
+#include <stdexcept>
+#include <sys/socket.h>
+#include <unistd.h>
+
+using namespace mesytec::mvlc;
+
+using SCT = super_commands::SuperCommandType;
+
+namespace
+{
+
+// Type bytes of the StackStart and StackEnd words in stack memory.
+static const uint32_t StackStartType = 0xF3;
+static const uint32_t StackEndType = 0xF4;
+
+// Max number of event words passed to a single sendFrames() call.
+static const size_t DataChunkWords = 1u << 16;
+
+CrateConfig make_emulator_config(const EthEmulatorOptions &options)
+{
+	CrateConfig config;
+	config.connectionType = ConnectionType::ETH;
+	config.ethHost = options.bindAddress;
+	config.ethJumboEnable = options.jumboFrames;
+	return config;
+}
+
+int make_udp_socket(const std::string &address, uint16_t port)
+{
+	sockaddr_in addr = {};
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+
+	if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1)
+		throw std::runtime_error(fmt::format("eth emulator: invalid bind address '{}'", address));
+
+	int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+	if (sock < 0)
+		throw std::runtime_error(fmt::format("eth emulator: socket(): {}", strerror(errno)));
+
+	if (bind(sock, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) != 0)
+	{
+		auto err = errno;
+		close(sock);
+		throw std::runtime_error(fmt::format("eth emulator: bind({}:{}): {}", address, port, strerror(err)));
+	}
+
+	return sock;
+}
+
+bool wait_readable(int sock, int timeout_ms)
+{
+	pollfd pfd = { sock, POLLIN, 0 };
+	return poll(&pfd, 1, timeout_ms) > 0 && (pfd.revents & POLLIN);
+}
+
+bool chance(std::minstd_rand &rng, double probability)
+{
+	return probability > 0.0 && std::uniform_real_distribution<double>(0.0, 1.0)(rng) < probability;
+}
+
+}
+
+EthEmulator::EthEmulator(const EthEmulatorOptions &options)
+	: options_(options)
+	, sim_(make_emulator_config(options), options.sim)
+{
+	commandSink_.loss = options.commandLoss;
+	commandSink_.rng.seed(options.sim.seed);
+	dataSink_.loss = options.dataLoss;
+	dataSink_.rng.seed(options.sim.seed + 1);
+}
+
+EthEmulator::~EthEmulator()
+{
+	stop();
+}
+
+void EthEmulator::start()
+{
+	commandSink_.sock = make_udp_socket(options_.bindAddress, options_.commandPort);
+
+	try
+	{
+		dataSink_.sock = make_udp_socket(options_.bindAddress, options_.commandPort + 1);
+	}
+	catch (const std::runtime_error &)
+	{
+		close(commandSink_.sock);
+		commandSink_.sock = -1;
+		throw;
+	}
+
+	sim_.connect();
+	quit_ = false;
+	commandThread_ = std::thread(&EthEmulator::commandLoop, this);
+	dataThread_ = std::thread(&EthEmulator::dataLoop, this);
+}
+
+void EthEmulator::stop()
+{
+	quit_ = true;
+
+	if (commandThread_.joinable())
+		commandThread_.join();
+
+	if (dataThread_.joinable())
+		dataThread_.join();
+
+	for (auto sink: { &commandSink_, &dataSink_ })
+	{
+		if (sink->sock >= 0)
+			close(sink->sock);
+		sink->sock = -1;
+	}
+
+	haveDataClient_ = false;
+}
+
+void EthEmulator::commandLoop()
+{
+	std::vector<uint32_t> buffer(eth::JumboFrameMaxSize / sizeof(uint32_t));
+
+	while (!quit_)
+	{
+		if (!wait_readable(commandSink_.sock, 100))
+			continue;
+
+		sockaddr_in from = {};
+		socklen_t fromLen = sizeof(from);
+		auto bytes = recvfrom(commandSink_.sock, buffer.data(), buffer.size() * sizeof(uint32_t), 0,
+			reinterpret_cast<sockaddr *>(&from), &fromLen);
+
+		if (bytes < static_cast<ssize_t>(sizeof(uint32_t)))
+			continue;
+
+		// Responses go to wherever the last request came from.
+		commandSink_.dest = from;
+		++stats_.commandRequests;
+
+		try
+		{
+			handleSuperRequest(buffer.data(), bytes / sizeof(uint32_t));
+		}
+		catch (const std::exception &e)
+		{
+			spdlog::warn("eth emulator: error handling command request: {}", e.what());
+		}
+	}
+}
+
+// Mirrors the request like the MVLC does: a super frame containing the
+// request words, with the values of register reads inserted.
+void EthEmulator::handleSuperRequest(const uint32_t *request, size_t words)
+{
+	if (words == 0 || (request[0] >> super_commands::SuperCmdShift) != static_cast<uint16_t>(SCT::CmdBufferStart))
+		return;
+
+	std::vector<uint32_t> response = { 0 };
+	bool execImmediate = false;
+	bool done = false;
+
+	for (size_t i = 1; i < words && !done; ++i)
+	{
+		const uint32_t word = request[i];
+		const uint16_t arg = word & super_commands::SuperCmdArgMask;
+
+		switch (static_cast<SCT>(word >> super_commands::SuperCmdShift))
+		{
+			case SCT::CmdBufferEnd:
+				done = true;
+				break;
+
+			case SCT::ReferenceWord:
+				response.push_back(word);
+				break;
+
+			case SCT::WriteReset:
+				response.push_back(word);
+				sim_.setDaqMode(false);
+				break;
+
+			case SCT::ReadLocal:
+				{
+					uint32_t value = 0;
+					sim_.readRegister(arg, value);
+					response.push_back(word);
+					response.push_back(value);
+				}
+				break;
+
+			// Approximation: the count is echoed followed by the register values.
+			case SCT::ReadLocalBlock:
+				if (i + 1 < words)
+				{
+					const uint32_t count = std::min(request[++i], static_cast<uint32_t>(stacks::StackMemoryWords));
+					response.push_back(word);
+					response.push_back(count);
+					for (uint32_t wi = 0; wi < count; ++wi)
+					{
+						uint32_t value = 0;
+						sim_.readRegister(arg + wi * sizeof(uint32_t), value);
+						response.push_back(value);
+					}
+				}
+				break;
+
+			case SCT::WriteLocal:
+				if (i + 1 < words)
+				{
+					const uint32_t value = request[++i];
+					response.push_back(word);
+					response.push_back(value);
+
+					if (arg == registers::daq_mode && value)
+						applyReadoutStacks();
+
+					sim_.writeRegister(arg, value);
+
+					if (arg == stacks::get_trigger_register(0) && ((value >> stacks::ImmediateShift) & 1u))
+						execImmediate = true;
+				}
+				break;
+
+			case SCT::EthDelay:
+			case SCT::CmdBufferStart:
+				break;
+		}
+	}
+
+	response[0] = FrameWriter::make_header(frame_headers::SuperFrame, 0, 0, response.size() - 1);
+	sendFrames(commandSink_, static_cast<uint8_t>(eth::PacketChannel::Command), response, { 0 });
+
+	if (execImmediate)
+		executeImmediateStack();
+}
+
+void EthEmulator::executeImmediateStack()
+{
+	std::vector<uint32_t> out;
+	std::vector<size_t> frameStarts;
+
+	sim_.executeStack(readStack(0), 0, out, frameStarts);
+	++stats_.stackExecs;
+	sendFrames(commandSink_, static_cast<uint8_t>(eth::PacketChannel::Stack), out, frameStarts);
+}
+
+// Decodes the stack starting at the offset set for stackId. The end is found by
+// looking for the StackEnd word, so argument words with the same type byte
+// would cut the stack short. Good enough for the VME addresses used in tests.
+std::vector<StackCommand> EthEmulator::readStack(uint8_t stackId)
+{
+	uint32_t offset = 0;
+	sim_.readRegister(stacks::get_offset_register(stackId), offset);
+
+	uint32_t address = stacks::StackMemoryBegin + (offset & stacks::StackOffsetBitMaskBytes);
+	const uint32_t end = stacks::StackMemoryBegin + stacks::StackMemoryWords * sizeof(uint32_t);
+	uint32_t word = 0;
+
+	sim_.readRegister(address, word);
+
+	if ((word >> 24) != StackStartType)
+		return {};
+
+	std::vector<uint32_t> buffer;
+
+	for (address += sizeof(uint32_t); address < end; address += sizeof(uint32_t))
+	{
+		sim_.readRegister(address, word);
+
+		if ((word >> 24) == StackEndType)
+			break;
+
+		buffer.push_back(word);
+	}
+
+	return stack_commands_from_buffer(buffer);
+}
+
+void EthEmulator::applyReadoutStacks()
+{
+	std::vector<StackCommandBuilder> readoutStacks;
+	std::vector<uint32_t> triggers;
+
+	for (uint8_t stackId = stacks::FirstReadoutStackID; stackId < stacks::StackCount; ++stackId)
+	{
+		uint32_t trigger = 0;
+		sim_.readRegister(stacks::get_trigger_register(stackId), trigger);
+		triggers.push_back(trigger);
+		readoutStacks.emplace_back(trigger ? StackCommandBuilder(readStack(stackId)) : StackCommandBuilder());
+	}
+
+	sim_.setReadoutStacks(readoutStacks, triggers);
+}
+
+void EthEmulator::dataLoop()
+{
+	std::vector<uint32_t> stream;
+	std::vector<size_t> frameStarts;
+	uint32_t request[64];
+
+	while (!quit_)
+	{
+		// The client sends an empty request to the data port so that the
+		// controller learns where to send readout data.
+		if (wait_readable(dataSink_.sock, haveDataClient_ ? 0 : 100))
+		{
+			sockaddr_in from = {};
+			socklen_t fromLen = sizeof(from);
+
+			if (recvfrom(dataSink_.sock, request, sizeof(request), 0, reinterpret_cast<sockaddr *>(&from), &fromLen) > 0)
+			{
+				dataSink_.dest = from;
+				haveDataClient_ = true;
+			}
+		}
+
+		if (!haveDataClient_)
+			continue;
+
+		stream.clear();
+		frameStarts.clear();
+
+		if (sim_.readoutFrames(stream, frameStarts, DataChunkWords, std::chrono::milliseconds(100)))
+			continue;
+
+		if (!stream.empty())
+			sendFrames(dataSink_, static_cast<uint8_t>(eth::PacketChannel::Data), stream, frameStarts);
+	}
+}
+
+void EthEmulator::sendFrames(PacketSink &sink, uint8_t channel, const std::vector<uint32_t> &stream,
+	const std::vector<size_t> &frameStarts)
+{
+	std::vector<uint32_t> packets;
+	std::vector<size_t> packetStarts;
+
+	eth_packetize(stream, frameStarts, channel, sink.packetNumbers.at(channel),
+		sim_eth_payload_words(options_.jumboFrames), packets, &packetStarts);
+
+	const bool isData = &sink == &dataSink_;
+
+	auto send_packet = [&] (size_t pi)
+	{
+		const size_t begin = packetStarts[pi];
+		const size_t end = pi + 1 < packetStarts.size() ? packetStarts[pi + 1] : packets.size();
+		const size_t bytes = (end - begin) * sizeof(uint32_t);
+
+		if (isData && options_.dataRateBytesPerS > 0.0)
+		{
+			std::this_thread::sleep_until(nextDataSend_);
+			nextDataSend_ = std::max(nextDataSend_, std::chrono::steady_clock::now())
+				+ std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+					std::chrono::duration<double>(bytes / options_.dataRateBytesPerS));
+		}
+
+		sendto(sink.sock, packets.data() + begin, bytes, 0,
+			reinterpret_cast<const sockaddr *>(&sink.dest), sizeof(sink.dest));
+
+		++stats_.packetsSent;
+		if (isData)
+			stats_.dataBytesSent += bytes;
+	};
+
+	// Alternately a packet without a complete header and one exceeding a
+	// jumbo frame, both starting with the header of packet pi. Neither takes
+	// a packet number, the client has to drop them without seeing a loss.
+	auto send_malformed = [&] (size_t pi)
+	{
+		std::vector<uint8_t> packet(stats_.packetsMalformed % 2
+			? eth::JumboFrameMaxSize + sizeof(uint32_t) : eth::HeaderBytes - sizeof(uint16_t));
+		std::memcpy(packet.data(), packets.data() + packetStarts[pi], std::min(packet.size(), size_t(eth::HeaderBytes)));
+
+		sendto(sink.sock, packet.data(), packet.size(), 0,
+			reinterpret_cast<const sockaddr *>(&sink.dest), sizeof(sink.dest));
+
+		++stats_.packetsMalformed;
+	};
+
+	std::optional<size_t> held;
+
+	for (size_t pi = 0; pi < packetStarts.size(); ++pi)
+	{
+		// Dropped packets still consume a packet number, which is what the
+		// client uses to detect the loss.
+		if (chance(sink.rng, sink.loss))
+		{
+			++stats_.packetsDropped;
+			continue;
+		}
+
+		if (!held && chance(sink.rng, options_.reorder))
+		{
+			held = pi;
+			++stats_.packetsReordered;
+			continue;
+		}
+
+		send_packet(pi);
+
+		if (isData && chance(sink.rng, options_.malformed))
+			send_malformed(pi);
+
+		if (held)
+		{
+			send_packet(*held);
+			held.reset();
+		}
+	}
+
+	if (held)
+		send_packet(*held);
+}
@@ -0,0 +1,91 @@
+#pragma once
+
+// Emulates an MVLC_ETH on local UDP ports for testing the network path
+// without hardware.
+//
+// The command pipe answers super transactions (register reads/writes, stack
+// uploads) and executes immediate stacks. Readout stacks uploaded by the
+// client are installed into a SimCrate when DAQ mode is enabled, its events
+// are streamed as data pipe packets to the address the empty request on the
+// data port came from. Packet loss, reordering, malformed packets and the data
+// rate can be configured to exercise the loss accounting of the client.
+
+#include <array>
+#include <atomic>
+#include <netinet/in.h>
+#include <thread>
+
+#include "mvlcc_sim.h"
+
+struct EthEmulatorOptions
+{
+	std::string bindAddress = "127.0.0.1";
+	uint16_t commandPort = mesytec::mvlc::eth::CommandPort; // the data pipe uses commandPort + 1
+	double dataLoss = 0.0;			// probability of dropping a data pipe packet
+	double commandLoss = 0.0;		// probability of dropping a command pipe response packet
+	double reorder = 0.0;			// probability of swapping a packet with its successor
+	double malformed = 0.0;			// probability of following a data pipe packet with a short or oversized one
+	double dataRateBytesPerS = 0.0;	// 0: unlimited
+	bool jumboFrames = false;
+	SimParams sim;
+};
+
+struct EthEmulatorStats
+{
+	std::atomic<size_t> commandRequests = 0;
+	std::atomic<size_t> stackExecs = 0;
+	std::atomic<size_t> packetsSent = 0;
+	std::atomic<size_t> packetsDropped = 0;
+	std::atomic<size_t> packetsReordered = 0;
+	std::atomic<size_t> packetsMalformed = 0;
+	std::atomic<size_t> dataBytesSent = 0;
+};
+
+class EthEmulator
+{
+	public:
+		explicit EthEmulator(const EthEmulatorOptions &options);
+		~EthEmulator();
+
+		EthEmulator(const EthEmulator &) = delete;
+		EthEmulator &operator=(const EthEmulator &) = delete;
+
+		// Binds the sockets and starts the command and data threads. Throws
+		// std::runtime_error on socket errors.
+		void start();
+		void stop();
+
+		const EthEmulatorStats &stats() const { return stats_; }
+
+	private:
+		struct PacketSink
+		{
+			int sock = -1;
+			sockaddr_in dest = {};
+			double loss = 0.0;
+			// The MVLC numbers the packets of each channel separately.
+			std::array<uint16_t, static_cast<size_t>(mesytec::mvlc::eth::PacketChannel::NumPacketChannels)> packetNumbers = {};
+			std::minstd_rand rng;
+		};
+
+		void commandLoop();
+		void dataLoop();
+		void handleSuperRequest(const uint32_t *request, size_t words);
+		void executeImmediateStack();
+		std::vector<mesytec::mvlc::StackCommand> readStack(uint8_t stackId);
+		void applyReadoutStacks();
+		void sendFrames(PacketSink &sink, uint8_t channel, const std::vector<uint32_t> &stream,
+			const std::vector<size_t> &frameStarts);
+
+		EthEmulatorOptions options_;
+		SimCrate sim_;
+		std::atomic<bool> quit_ = false;
+		std::thread commandThread_;
+		std::thread dataThread_;
+		// The sinks are only used by their respective thread after start().
+		PacketSink commandSink_;
+		PacketSink dataSink_;
+		std::atomic<bool> haveDataClient_ = false;
+		std::chrono::steady_clock::time_point nextDataSend_;
+		EthEmulatorStats stats_;
+};
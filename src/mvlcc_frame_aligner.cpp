@@ -0,0 +1,188 @@
+#include "mvlcc_frame_aligner.h"
+
+using namespace mesytec::mvlc;
+
+namespace
+{
+
+bool is_event_start(uint8_t frameType)
+{
+	return frameType == frame_headers::StackFrame
+		|| frameType == frame_headers::SystemEvent
+		|| frameType == frame_headers::SystemEvent2
+		|| frameType == frame_headers::StackError;
+}
+
+}
+
+void FrameAligner::appendFrames(const uint32_t *data, size_t words)
+{
+	pending_.insert(std::end(pending_), data, data + words);
+}
+
+void FrameAligner::appendEthPackets(const uint32_t *data, size_t words)
+{
+	size_t i = 0;
+
+	while (i + eth::HeaderWords <= words)
+	{
+		const eth::PayloadHeaderInfo header = { data[i], data[i + 1] };
+		const uint32_t *payload = data + i + eth::HeaderWords;
+		const size_t payloadWords = std::min<size_t>(header.dataWordCount(), words - i - eth::HeaderWords);
+
+		i += eth::HeaderWords + payloadWords;
+
+		if (header.packetChannel() != static_cast<uint16_t>(eth::PacketChannel::Data))
+			continue;
+
+		const uint16_t packetNumber = header.packetNumber();
+		++packets_;
+
+		if (haveLastPacketNumber_ && ((lastPacketNumber_ + 1) & eth::header0::PacketNumberMask) != packetNumber)
+		{
+			lostPackets_ += (packetNumber - lastPacketNumber_ - 1) & eth::header0::PacketNumberMask;
+			dropIncompleteEvent();
+			resync_ = true;
+		}
+
+		haveLastPacketNumber_ = true;
+		lastPacketNumber_ = packetNumber;
+
+		size_t offset = 0;
+
+		if (resync_)
+		{
+			if (!header.isNextHeaderPointerValid() || header.nextHeaderPointer() > payloadWords)
+			{
+				droppedWords_ += payloadWords;
+				continue;
+			}
+
+			offset = header.nextHeaderPointer();
+			droppedWords_ += offset;
+			resync_ = false;
+		}
+
+		pending_.insert(std::end(pending_), payload + offset, payload + payloadWords);
+	}
+}
+
+FrameAligner::TakeResult FrameAligner::take(uint32_t *dest, size_t maxWords)
+{
+	TakeResult result;
+	result.continuesPrevious = inEvent_;
+
+	size_t i = begin_;
+	size_t eventStart = begin_;
+	size_t lastEventEnd = begin_;
+	size_t lastFrameEnd = begin_;
+	bool inEvent = inEvent_;
+	bool full = false;
+
+	while (i < pending_.size())
+	{
+		const auto info = extract_frame_info(pending_[i]);
+		const bool valid = inEvent
+			? info.type == frame_headers::StackContinuation
+			: is_event_start(info.type);
+
+		if (!valid)
+		{
+			// Stray word or an event broken by a missing continuation:
+			// drop it and continue with the following data.
+			const size_t dropBegin = inEvent ? eventStart : i;
+			const size_t dropEnd = inEvent ? i : i + 1;
+			pending_.erase(std::begin(pending_) + dropBegin, std::begin(pending_) + dropEnd);
+			droppedWords_ += dropEnd - dropBegin;
+			i = dropBegin;
+			inEvent = false;
+			lastFrameEnd = std::min(lastFrameEnd, dropBegin);
+			if (dropBegin == begin_)
+				result.continuesPrevious = false;
+			continue;
+		}
+
+		const size_t frameEnd = i + 1 + info.len;
+
+		if (frameEnd > pending_.size())
+			break;
+
+		if (frameEnd - begin_ > maxWords)
+		{
+			full = true;
+			break;
+		}
+
+		if (!inEvent)
+			eventStart = i;
+
+		inEvent = info.flags & frame_flags::Continue;
+		lastFrameEnd = frameEnd;
+
+		if (!inEvent)
+			lastEventEnd = frameEnd;
+
+		i = frameEnd;
+	}
+
+	size_t end = lastEventEnd;
+
+	if (end == begin_ && full)
+	{
+		// Not even one event fits.
+		end = lastFrameEnd;
+		result.continued = end > begin_;
+	}
+
+	if (end == begin_)
+	{
+		result.continuesPrevious = false;
+		return result;
+	}
+
+	std::copy(std::begin(pending_) + begin_, std::begin(pending_) + end, dest);
+	result.words = end - begin_;
+	inEvent_ = result.continued;
+	begin_ = end;
+	compact();
+
+	return result;
+}
+
+void FrameAligner::dropIncompleteEvent()
+{
+	size_t i = begin_;
+	size_t lastEventEnd = begin_;
+	bool inEvent = inEvent_;
+
+	while (i < pending_.size())
+	{
+		const auto info = extract_frame_info(pending_[i]);
+		const size_t frameEnd = i + 1 + info.len;
+
+		if (frameEnd > pending_.size())
+			break;
+
+		inEvent = info.flags & frame_flags::Continue;
+
+		if (!inEvent)
+			lastEventEnd = frameEnd;
+
+		i = frameEnd;
+	}
+
+	droppedWords_ += pending_.size() - lastEventEnd;
+	pending_.resize(lastEventEnd);
+
+	if (lastEventEnd == begin_)
+		inEvent_ = false;
+}
+
+void FrameAligner::compact()
+{
+	if (begin_ > pending_.size() / 2)
+	{
+		pending_.erase(std::begin(pending_), std::begin(pending_) + begin_);
+		begin_ = 0;
+	}
+}
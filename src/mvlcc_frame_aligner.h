@@ -0,0 +1,59 @@
+#pragma once
+
+// Turns the readout data stream into buffers that start and end on event
+// boundaries, so that each buffer can be parsed on its own.
+//
+// Input is the data returned by mesytec::mvlc::readout() in the format of the
+// connection. ETH packets are unpacked: the output is always a plain frame
+// stream, the format of USB readout data. An event is a StackFrame followed by
+// its StackContinuation frames up to the first frame without the continue
+// flag; system event and stack error frames are events on their own.
+//
+// Lost ETH packets break the frame stream. The incomplete event is dropped and
+// unpacking resumes at the next frame header announced by a packet header.
+
+#include <mesytec-mvlc/mesytec-mvlc.h>
+
+class FrameAligner
+{
+	public:
+		struct TakeResult
+		{
+			size_t words = 0;
+			// The buffer starts with frames of an event started in the
+			// previous buffer. Only happens after an event did not fit into
+			// a whole buffer.
+			bool continuesPrevious = false;
+			// The last event is continued in the next buffer.
+			bool continued = false;
+		};
+
+		void appendFrames(const uint32_t *data, size_t words);
+		void appendEthPackets(const uint32_t *data, size_t words);
+
+		// Moves the longest prefix of complete events that fits into
+		// maxWords to dest. If not even one event fits, the longest prefix of
+		// complete frames is moved instead and TakeResult::continued is set.
+		TakeResult take(uint32_t *dest, size_t maxWords);
+
+		size_t pendingWords() const { return pending_.size() - begin_; }
+
+		uint64_t packets() const { return packets_; }
+		uint64_t lostPackets() const { return lostPackets_; }
+		uint64_t droppedWords() const { return droppedWords_; }
+
+	private:
+		// Drops the trailing incomplete event after a packet loss.
+		void dropIncompleteEvent();
+		void compact();
+
+		std::vector<uint32_t> pending_;
+		size_t begin_ = 0;
+		bool haveLastPacketNumber_ = false;
+		uint16_t lastPacketNumber_ = 0;
+		bool resync_ = true;		// skip to the next announced frame header
+		bool inEvent_ = false;	// the next pending frame continues an event already taken
+		uint64_t packets_ = 0;
+		uint64_t lostPackets_ = 0;
+		uint64_t droppedWords_ = 0;
+};
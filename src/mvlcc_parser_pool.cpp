@@ -0,0 +1,402 @@
+#include "mvlcc_parser_pool.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "mvlcc_threads.h"
+#include "mvlcc_trace.h"
+
+using namespace mesytec::mvlc;
+
+namespace
+{
+
+ConnectionType buffer_type(const mvlcc_readout_info_t &info)
+{
+	return info.data_format == MVLCC_DATA_FORMAT_ETH_PACKETS ? ConnectionType::ETH : ConnectionType::USB;
+}
+
+}
+
+ParserPool::ParserPool(const readout_parser::ReadoutParserState &parserTemplate, const ParserPoolOptions &options)
+	: options_(options)
+	, freeBuffers_(options.bufferCount ? options.bufferCount : 4 * std::max(1u, options.threads))
+	// Room for one delivery token.
+	, filledBuffers_((options.bufferCount ? options.bufferCount : 4 * std::max(1u, options.threads)) + 1)
+{
+	options_.threads = std::max(1u, options_.threads);
+	options_.bufferCount = options.bufferCount ? options.bufferCount : 4 * options_.threads;
+	scratch_.data.reserve(options_.bufferBytes);
+
+	for (size_t i = 0; i < options_.bufferCount; ++i)
+	{
+		auto buffer = std::make_unique<Buffer>();
+		buffer->data.reserve(options_.bufferBytes);
+		freeBuffers_.push(buffer.get());
+		buffers_.emplace_back(std::move(buffer));
+	}
+
+	for (unsigned i = 0; i < options_.threads; ++i)
+	{
+		auto worker = std::make_unique<Worker>();
+		worker->pool = this;
+		worker->index = i;
+		worker->state = parserTemplate;
+		worker->state.userContext = worker.get();
+
+		if (options_.ordered)
+		{
+			worker->callbacks.eventData = [] (void *ctx, int crateIndex, int eventIndex,
+				const readout_parser::ModuleData *moduleDataList, unsigned moduleCount)
+			{
+				auto result = reinterpret_cast<Worker *>(ctx)->result;
+				result->events.push_back({ crateIndex, eventIndex, result->modules.size(), moduleCount, 0, 0 });
+
+				for (unsigned mi = 0; mi < moduleCount; ++mi)
+				{
+					const auto &md = moduleDataList[mi];
+					result->moduleOffsets.push_back(result->words.size());
+					result->modules.push_back({ { nullptr, md.data.size }, md.prefixSize, md.dynamicSize,
+						md.suffixSize, md.hasDynamic });
+					result->words.insert(std::end(result->words), md.data.data, md.data.data + md.data.size);
+				}
+			};
+
+			worker->callbacks.systemEvent = [] (void *ctx, int crateIndex, const u32 *header, u32 size)
+			{
+				auto result = reinterpret_cast<Worker *>(ctx)->result;
+				result->events.push_back({ crateIndex, -1, 0, 0, result->words.size(), size });
+				result->words.insert(std::end(result->words), header, header + size);
+			};
+		}
+		else
+		{
+			worker->callbacks.eventData = [] (void *ctx, int crateIndex, int eventIndex,
+				const readout_parser::ModuleData *moduleDataList, unsigned moduleCount)
+			{
+				auto self = reinterpret_cast<Worker *>(ctx);
+				auto &opts = self->pool->options_;
+				++self->pool->counters_.events;
+
+				if (!opts.eventData)
+					return;
+
+				self->moduleData.resize(moduleCount);
+
+				for (unsigned mi = 0; mi < moduleCount; ++mi)
+				{
+					const auto &md = moduleDataList[mi];
+					self->moduleData[mi] = { { md.data.data, md.data.size }, md.prefixSize, md.dynamicSize,
+						md.suffixSize, md.hasDynamic };
+				}
+
+				MVLCC_TRACE_ENTRY(event_callback, eventIndex);
+				opts.eventData(opts.userContext, crateIndex, eventIndex, self->moduleData.data(), moduleCount);
+				MVLCC_TRACE_EXIT(event_callback, eventIndex);
+			};
+
+			worker->callbacks.systemEvent = [] (void *ctx, int crateIndex, const u32 *header, u32 size)
+			{
+				auto self = reinterpret_cast<Worker *>(ctx);
+				auto &opts = self->pool->options_;
+				++self->pool->counters_.systemEvents;
+
+				if (opts.systemEvent)
+					opts.systemEvent(opts.userContext, crateIndex, { header, size });
+			};
+		}
+
+		workers_.emplace_back(std::move(worker));
+	}
+
+	for (auto &worker: workers_)
+		worker->thread = std::thread(&ParserPool::workerLoop, this, std::ref(*worker));
+}
+
+ParserPool::~ParserPool()
+{
+	flush();
+	filledBuffers_.close();
+	freeBuffers_.close();
+
+	for (auto &worker: workers_)
+	{
+		if (worker->thread.joinable())
+			worker->thread.join();
+	}
+}
+
+uint8_t *ParserPool::acquire(std::chrono::milliseconds timeout)
+{
+	if (auto buffer = freeBuffers_.pop(std::chrono::milliseconds(0)))
+		return (*buffer)->data.data();
+
+	switch (backpressure_.mode())
+	{
+		case MVLCC_BACKPRESSURE_BLOCK:
+			{
+				const auto start = std::chrono::steady_clock::now();
+				auto buffer = freeBuffers_.pop(timeout);
+				backpressure_.addBlocked(start);
+				return buffer ? (*buffer)->data.data() : nullptr;
+			}
+
+		case MVLCC_BACKPRESSURE_DROP_OLDEST:
+			if (auto buffer = evictOldest())
+				return buffer->data.data();
+			break;
+
+		case MVLCC_BACKPRESSURE_DROP_NEWEST:
+		case MVLCC_BACKPRESSURE_SAMPLE:
+			break;
+	}
+
+	return scratch_.data.data();
+}
+
+void ParserPool::submit(uint8_t *data, const mvlcc_readout_info_t &info)
+{
+	auto &bp = backpressure_.counters();
+	Buffer *buffer = nullptr;	// stays nullptr for the scratch buffer
+
+	if (data != scratch_.data.data())
+	{
+		auto it = std::find_if(std::begin(buffers_), std::end(buffers_),
+			[data] (const auto &b) { return b->data.data() == data; });
+
+		if (it == std::end(buffers_))
+			throw std::invalid_argument("parser pool: buffer does not belong to this pool");
+
+		buffer = it->get();
+	}
+
+	if (!info.bytes_used)
+	{
+		if (buffer)
+			freeBuffers_.push(buffer);
+		return;
+	}
+
+	// Any worker may parse any buffer, so each one has to start and end with
+	// a complete event.
+	const char *invalid = !(info.flags & MVLCC_READOUT_FLAG_ALIGNED)
+		? "parser pool: buffer is not from an aligned readout"
+		: (info.flags & (MVLCC_READOUT_FLAG_CONTINUES_PREVIOUS | MVLCC_READOUT_FLAG_CONTINUED))
+			? "parser pool: buffer contains an event split across buffers"
+			: nullptr;
+
+	if (invalid)
+	{
+		if (buffer)
+			freeBuffers_.push(buffer);
+		throw std::invalid_argument(invalid);
+	}
+
+	add_counter(bp.offered, 1);
+
+	if (!buffer)
+	{
+		add_counter(bp.droppedNewest, 1);
+		return;
+	}
+
+	if (!backpressure_.sampleNext())
+	{
+		add_counter(bp.sampledOut, 1);
+		freeBuffers_.push(buffer);
+		return;
+	}
+
+	add_counter(bp.accepted, 1);
+	buffer->info = info;
+	buffer->sequence = nextSubmit_++;
+
+	{
+		std::lock_guard<std::mutex> guard(flushMutex_);
+		++inFlight_;
+	}
+
+	filledBuffers_.push(buffer);
+}
+
+void ParserPool::flush()
+{
+	std::unique_lock<std::mutex> lock(flushMutex_);
+	flushCondition_.wait(lock, [this] { return inFlight_ == 0; });
+}
+
+void ParserPool::workerLoop(Worker &worker)
+{
+	if (int ec = apply_thread_role(MVLCC_THREAD_PARSER, worker.index))
+		spdlog::warn("parser pool: could not apply the parser thread config: {}", std::strerror(ec));
+
+	while (auto next = filledBuffers_.pop())
+	{
+		auto buffer = *next;
+
+		if (!buffer)
+		{
+			deliveryToken_.store(false);
+			deliverPending();
+			continue;
+		}
+
+		buffer->result.clear();
+		worker.result = &buffer->result;
+
+		MVLCC_TRACE_ENTRY(parse_buffer, buffer->info.bytes_used / sizeof(uint32_t));
+
+		auto pr = readout_parser::parse_readout_buffer(buffer_type(buffer->info), worker.state,
+			worker.callbacks, worker.parserCounters, buffer->info.buffer_number,
+			reinterpret_cast<const uint32_t *>(buffer->data.data()), buffer->info.bytes_used / sizeof(uint32_t));
+
+		MVLCC_TRACE_EXIT(parse_buffer, static_cast<uint64_t>(pr));
+
+		worker.result = nullptr;
+		++counters_.buffers;
+
+		if (pr != readout_parser::ParseResult::Ok)
+			++counters_.parseErrors;
+
+		if (options_.ordered)
+			deliver(buffer->sequence, buffer);
+		else
+			finished(buffer);
+	}
+}
+
+ParserPool::Buffer *ParserPool::evictOldest()
+{
+	Buffer *buffer = nullptr;
+
+	// At most one delivery token is queued. Found at the head, it is put back
+	// at the tail and the buffer behind it is taken instead.
+	for (size_t tries = filledBuffers_.size(); tries && !buffer; --tries)
+	{
+		auto next = filledBuffers_.pop(std::chrono::milliseconds(0));
+
+		if (!next)
+			return nullptr;
+
+		buffer = *next;
+
+		if (!buffer)
+			filledBuffers_.tryPush(nullptr);
+	}
+
+	if (!buffer)
+		return nullptr;
+
+	add_counter(backpressure_.counters().droppedOldest, 1);
+
+	if (!options_.ordered)
+	{
+		finished(nullptr);
+		return buffer;
+	}
+
+	// An empty entry in its place. Following buffers may be waiting for it,
+	// the readout thread must not deliver them itself: a worker is woken up
+	// by a token to do so. One queued token is enough.
+	{
+		std::lock_guard<std::mutex> guard(resultsMutex_);
+		results_.emplace(buffer->sequence, nullptr);
+	}
+
+	if (!deliveryToken_.exchange(true))
+		filledBuffers_.tryPush(nullptr);
+
+	return buffer;
+}
+
+// Whichever worker completes the next buffer in sequence delivers it and any
+// following buffers that are already done. The others keep parsing.
+void ParserPool::deliver(uint64_t sequence, Buffer *buffer)
+{
+	{
+		std::lock_guard<std::mutex> guard(resultsMutex_);
+		results_.emplace(sequence, buffer);
+	}
+
+	deliverPending();
+}
+
+void ParserPool::deliverPending()
+{
+	{
+		std::lock_guard<std::mutex> guard(resultsMutex_);
+
+		if (delivering_)
+			return;
+
+		delivering_ = true;
+	}
+
+	while (true)
+	{
+		Buffer *next = nullptr;
+
+		{
+			std::lock_guard<std::mutex> guard(resultsMutex_);
+			auto it = results_.find(nextDelivery_);
+
+			if (it == std::end(results_))
+			{
+				delivering_ = false;
+				return;
+			}
+
+			next = it->second;
+			results_.erase(it);
+			++nextDelivery_;
+		}
+
+		if (next)
+			deliverResult(next->result);
+
+		finished(next);
+	}
+}
+
+void ParserPool::deliverResult(Result &result)
+{
+	for (size_t mi = 0; mi < result.modules.size(); ++mi)
+		result.modules[mi].data_span.data = result.words.data() + result.moduleOffsets[mi];
+
+	for (const auto &event: result.events)
+	{
+		if (event.eventIndex < 0)
+		{
+			++counters_.systemEvents;
+
+			if (options_.systemEvent)
+				options_.systemEvent(options_.userContext, event.crateIndex,
+					{ result.words.data() + event.systemOffset, event.systemSize });
+		}
+		else
+		{
+			++counters_.events;
+
+			if (options_.eventData)
+			{
+				MVLCC_TRACE_ENTRY(event_callback, event.eventIndex);
+				options_.eventData(options_.userContext, event.crateIndex, event.eventIndex,
+					result.modules.data() + event.firstModule, event.moduleCount);
+				MVLCC_TRACE_EXIT(event_callback, event.eventIndex);
+			}
+		}
+	}
+}
+
+// buffer is nullptr for evicted buffers.
+void ParserPool::finished(Buffer *buffer)
+{
+	if (buffer)
+		freeBuffers_.push(buffer);
+
+	std::lock_guard<std::mutex> guard(flushMutex_);
+
+	if (--inFlight_ == 0)
+		flushCondition_.notify_all();
+}
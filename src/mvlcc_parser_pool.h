@@ -0,0 +1,158 @@
+#pragma once
+
+// Parses independent readout buffers (see FrameAligner) on several threads.
+//
+// Each worker owns a copy of the parser state. Workers take buffers from one
+// shared queue, so an expensive buffer does not hold up the following ones.
+// Unordered mode calls the event callbacks directly from the workers, they
+// have to be thread-safe. Ordered mode copies the events of each buffer and
+// delivers them in submission order, one buffer at a time; the buffer is
+// recycled only after its events have been delivered.
+//
+// The backpressure policy decides what acquire() does when all buffers are in
+// use. Except in BLOCK mode it returns a scratch buffer, whose contents are
+// discarded on submit, rather than waiting for the workers.
+
+#include <mvlcc_wrap.h>
+#include <mesytec-mvlc/mesytec-mvlc.h>
+
+#include <atomic>
+#include <map>
+#include <thread>
+
+#include "mvlcc_alloc.h"
+#include "mvlcc_backpressure.h"
+#include "mvlcc_queue.h"
+
+struct ParserPoolOptions
+{
+	unsigned threads = 2;
+	bool ordered = true;
+	size_t bufferCount = 0;		// 0: 4 * threads
+	size_t bufferBytes = 1u << 20;
+	void *userContext = nullptr;
+	event_data_callback_t *eventData = nullptr;
+	system_event_callback_t *systemEvent = nullptr;
+};
+
+struct ParserPoolCounters
+{
+	std::atomic<uint64_t> buffers = 0;
+	std::atomic<uint64_t> events = 0;
+	std::atomic<uint64_t> systemEvents = 0;
+	std::atomic<uint64_t> parseErrors = 0;
+};
+
+class ParserPool
+{
+	public:
+		ParserPool(const mesytec::mvlc::readout_parser::ReadoutParserState &parserTemplate,
+			const ParserPoolOptions &options);
+		~ParserPool();
+
+		ParserPool(const ParserPool &) = delete;
+		ParserPool &operator=(const ParserPool &) = delete;
+
+		size_t bufferBytes() const { return options_.bufferBytes; }
+
+		// Returns a free buffer of bufferBytes() or nullptr on timeout.
+		uint8_t *acquire(std::chrono::milliseconds timeout);
+		// Queues the buffer for parsing. Buffers without data are recycled.
+		// acquire() and submit() are meant to be called from one thread, the
+		// submission order is the delivery order. Throws std::invalid_argument
+		// for foreign buffers and for buffers not from an aligned readout or
+		// containing split events, the latter are recycled.
+		void submit(uint8_t *buffer, const mvlcc_readout_info_t &info);
+		// Waits until all submitted buffers are parsed and delivered.
+		void flush();
+
+		const ParserPoolCounters &counters() const { return counters_; }
+
+		// Thread-safe.
+		void setBackpressure(const mvlcc_backpressure_t &policy) { backpressure_.setPolicy(policy); }
+		mvlcc_backpressure_stats_t backpressureStats() const { return backpressure_.stats(); }
+
+	private:
+		// Copy of one event or system event in ordered mode. Module data
+		// offsets refer to Result::words.
+		struct EventRecord
+		{
+			int crateIndex;
+			int eventIndex;			// -1 for system events
+			size_t firstModule;
+			unsigned moduleCount;
+			size_t systemOffset;
+			size_t systemSize;
+		};
+
+		// Events of a buffer in ordered mode. Kept with the buffer and cleared
+		// for reuse, so the vectors keep their capacity.
+		struct Result
+		{
+			std::vector<EventRecord> events;
+			std::vector<mvlcc_module_data_t> modules;	// data pointers are set on delivery
+			std::vector<size_t> moduleOffsets;			// into words
+			std::vector<uint32_t> words;
+
+			void clear()
+			{
+				events.clear();
+				modules.clear();
+				moduleOffsets.clear();
+				words.clear();
+			}
+		};
+
+		struct Buffer
+		{
+			BufferMemory data;
+			mvlcc_readout_info_t info = {};
+			uint64_t sequence = 0;
+			Result result;
+		};
+
+		struct Worker
+		{
+			ParserPool *pool = nullptr;
+			unsigned index = 0;
+			mesytec::mvlc::readout_parser::ReadoutParserState state;
+			mesytec::mvlc::readout_parser::ReadoutParserCallbacks callbacks;
+			mesytec::mvlc::readout_parser::ReadoutParserCounters parserCounters = {};
+			std::vector<mvlcc_module_data_t> moduleData;
+			Result *result = nullptr;	// ordered mode: collects the events of the current buffer
+			std::thread thread;
+		};
+
+		void workerLoop(Worker &worker);
+		// Takes the oldest buffer still waiting for a worker back from the
+		// queue, nullptr if there is none.
+		Buffer *evictOldest();
+		// buffer is nullptr in place of an evicted one.
+		void deliver(uint64_t sequence, Buffer *buffer);
+		void deliverPending();
+		void deliverResult(Result &result);
+		void finished(Buffer *buffer);
+
+		ParserPoolOptions options_;
+		std::vector<std::unique_ptr<Buffer>> buffers_;
+		Buffer scratch_;
+		BoundedQueue<Buffer *> freeBuffers_;
+		// nullptr entries make a worker deliver pending results, see evictOldest().
+		BoundedQueue<Buffer *> filledBuffers_;
+		std::vector<std::unique_ptr<Worker>> workers_;
+		ParserPoolCounters counters_;
+		Backpressure backpressure_{MVLCC_BACKPRESSURE_BLOCK};
+
+		uint64_t nextSubmit_ = 0;
+
+		std::mutex resultsMutex_;
+		// Parsed buffers waiting for delivery by sequence, nullptr for evicted ones.
+		std::map<uint64_t, Buffer *> results_;
+		uint64_t nextDelivery_ = 0;
+		bool delivering_ = false;
+		std::atomic<bool> deliveryToken_ = false;
+
+		std::mutex flushMutex_;
+		std::condition_variable flushCondition_;
+		size_t inFlight_ = 0;
+};
@@ -0,0 +1,137 @@
+#pragma once
+
+// Bounded blocking multi-producer/multi-consumer queue.
+
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+
+template<typename T>
+class BoundedQueue
+{
+	public:
+		explicit BoundedQueue(size_t capacity)
+			: capacity_(capacity)
+		{}
+
+		// Blocks while the queue is full. Returns false if the queue was closed.
+		bool push(T value)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			notFull_.wait(lock, [this] { return closed_ || items_.size() < capacity_; });
+
+			if (closed_)
+				return false;
+
+			items_.emplace_back(std::move(value));
+			notEmpty_.notify_one();
+			return true;
+		}
+
+		// Like push(), but also returns false if the queue is still full after
+		// timeout.
+		bool push(T value, std::chrono::milliseconds timeout)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+
+			if (!notFull_.wait_for(lock, timeout, [this] { return closed_ || items_.size() < capacity_; }) || closed_)
+				return false;
+
+			items_.emplace_back(std::move(value));
+			notEmpty_.notify_one();
+			return true;
+		}
+
+		// Returns false without waiting if the queue is full or closed.
+		bool tryPush(T value)
+		{
+			std::lock_guard<std::mutex> guard(mutex_);
+
+			if (closed_ || items_.size() >= capacity_)
+				return false;
+
+			items_.emplace_back(std::move(value));
+			notEmpty_.notify_one();
+			return true;
+		}
+
+		// Never waits: if the queue is full, its oldest item is removed to make
+		// room and returned in evicted. Returns false if the queue was closed.
+		bool pushEvictOldest(T value, std::optional<T> &evicted)
+		{
+			std::lock_guard<std::mutex> guard(mutex_);
+			evicted.reset();
+
+			if (closed_)
+				return false;
+
+			if (items_.size() >= capacity_)
+			{
+				evicted.emplace(std::move(items_.front()));
+				items_.pop_front();
+			}
+
+			items_.emplace_back(std::move(value));
+			notEmpty_.notify_one();
+			return true;
+		}
+
+		// Blocks until an item is available or the queue is closed and empty.
+		std::optional<T> pop()
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			notEmpty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+			return takeFront();
+		}
+
+		std::optional<T> pop(std::chrono::milliseconds timeout)
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			notEmpty_.wait_for(lock, timeout, [this] { return closed_ || !items_.empty(); });
+			return takeFront();
+		}
+
+		// Wakes up all waiters. Remaining items can still be popped.
+		void close()
+		{
+			std::lock_guard<std::mutex> guard(mutex_);
+			closed_ = true;
+			notEmpty_.notify_all();
+			notFull_.notify_all();
+		}
+
+		size_t size() const
+		{
+			std::lock_guard<std::mutex> guard(mutex_);
+			return items_.size();
+		}
+
+		// True once the queue is closed and all items have been popped.
+		bool drained() const
+		{
+			std::lock_guard<std::mutex> guard(mutex_);
+			return closed_ && items_.empty();
+		}
+
+	private:
+		// Expects mutex_ to be held.
+		std::optional<T> takeFront()
+		{
+			if (items_.empty())
+				return {};
+
+			std::optional<T> result(std::move(items_.front()));
+			items_.pop_front();
+			notFull_.notify_one();
+			return result;
+		}
+
+		const size_t capacity_;
+		mutable std::mutex mutex_;
+		std::condition_variable notEmpty_;
+		std::condition_variable notFull_;
+		std::deque<T> items_;
+		bool closed_ = false;
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+// Per readout context statistics updated by mvlcc_readout().
+//
+// There is a single writer, the thread calling mvlcc_readout(), counters are
+// updated with add_counter().
+
+#include <mvlcc_wrap.h>
+
+#include <atomic>
+#include <chrono>
+
+#include "mvlcc_counters.h"
+
+struct ReadoutStats
+{
+	using Clock = std::chrono::steady_clock;
+
+	std::atomic<uint64_t> reads = 0;
+	std::atomic<uint64_t> buffers = 0;
+	std::atomic<uint64_t> bytes = 0;
+	std::atomic<uint64_t> emptyReads = 0;
+	std::atomic<uint64_t> timeouts = 0;
+	std::atomic<uint64_t> errors = 0;
+	std::atomic<uint64_t> readoutNs = 0;
+	std::atomic<uint64_t> consumerNs = 0;
+	std::atomic<uint64_t> carries = 0;
+	std::atomic<uint64_t> carriedBytes = 0;
+	std::atomic<uint64_t> fillHistogram[MVLCC_READOUT_FILL_BUCKETS] = {};
+
+	// Only accessed by the writer.
+	Clock::time_point lastReturn = {};
+
+	static uint64_t ns(Clock::duration d)
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+	}
+
+	// Called on entry with the number of bytes carried over from the previous call.
+	Clock::time_point begin(size_t carried)
+	{
+		const auto now = Clock::now();
+
+		if (lastReturn != Clock::time_point{})
+			add_counter(consumerNs, ns(now - lastReturn));
+
+		if (carried)
+		{
+			add_counter(carries, 1);
+			add_counter(carriedBytes, carried);
+		}
+
+		return now;
+	}
+
+	void end(Clock::time_point t0, size_t bytesFree, size_t bytesUsed, bool timeout, bool error)
+	{
+		lastReturn = Clock::now();
+		add_counter(readoutNs, ns(lastReturn - t0));
+		add_counter(reads, 1);
+
+		if (bytesUsed)
+		{
+			add_counter(buffers, 1);
+			add_counter(bytes, bytesUsed);
+		}
+		else
+			add_counter(emptyReads, 1);
+
+		if (timeout)
+			add_counter(timeouts, 1);
+		else if (error)
+			add_counter(errors, 1);
+
+		size_t bucket = bytesFree ? bytesUsed * MVLCC_READOUT_FILL_BUCKETS / bytesFree : 0;
+		add_counter(fillHistogram[std::min<size_t>(bucket, MVLCC_READOUT_FILL_BUCKETS - 1)], 1);
+	}
+
+	void snapshot(mvlcc_readout_stats_t &dest) const
+	{
+		auto get = [] (const std::atomic<uint64_t> &counter) { return counter.load(std::memory_order_relaxed); };
+
+		dest.reads = get(reads);
+		dest.buffers = get(buffers);
+		dest.bytes = get(bytes);
+		dest.empty_reads = get(emptyReads);
+		dest.timeouts = get(timeouts);
+		dest.errors = get(errors);
+		dest.readout_ns = get(readoutNs);
+		dest.consumer_ns = get(consumerNs);
+		dest.carries = get(carries);
+		dest.carried_bytes = get(carriedBytes);
+
+		for (size_t i = 0; i < MVLCC_READOUT_FILL_BUCKETS; ++i)
+			dest.fill_histogram[i] = get(fillHistogram[i]);
+	}
+};
@@ -0,0 +1,249 @@
+#include "mvlcc_shm_ring.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <new>
+#include <stdexcept>
+#include <system_error>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+namespace
+{
+
+constexpr size_t CacheLine = 64;
+
+size_t align_up(size_t n, size_t alignment)
+{
+	return (n + alignment - 1) / alignment * alignment;
+}
+
+std::system_error system_error(const std::string &what)
+{
+	return std::system_error(errno, std::system_category(), what);
+}
+
+// Shared (not FUTEX_PRIVATE) operations, the word is in a shared mapping.
+// Waiting works on read-only mappings.
+void futex_wake_all(std::atomic<uint32_t> *word)
+{
+	syscall(SYS_futex, reinterpret_cast<uint32_t *>(word), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+void futex_wait(const std::atomic<uint32_t> *word, uint32_t expected, std::chrono::nanoseconds timeout)
+{
+	struct timespec ts;
+	ts.tv_sec = timeout.count() / 1000000000;
+	ts.tv_nsec = timeout.count() % 1000000000;
+	syscall(SYS_futex, reinterpret_cast<const uint32_t *>(word), FUTEX_WAIT, expected, &ts, nullptr, 0);
+}
+
+}
+
+ShmPublisher::ShmPublisher(const std::string &name, size_t slotCount, size_t slotBytes)
+	: name_(name)
+{
+	if (!slotCount || !slotBytes)
+		throw std::invalid_argument("shm publisher: slot count and size must not be 0");
+
+	const size_t headerBytes = align_up(sizeof(ShmRingHeader), CacheLine);
+	const size_t stride = align_up(sizeof(ShmSlotHeader), CacheLine) + align_up(slotBytes, CacheLine);
+	mappingBytes_ = headerBytes + slotCount * stride;
+
+	// Readers attaching to a previous segment of the same name keep it, new
+	// ones get this one.
+	shm_unlink(name_.c_str());
+	int fd = shm_open(name_.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+
+	if (fd < 0)
+		throw system_error("shm_open " + name_);
+
+	if (ftruncate(fd, mappingBytes_))
+	{
+		auto error = system_error("ftruncate " + name_);
+		close(fd);
+		shm_unlink(name_.c_str());
+		throw error;
+	}
+
+	mapping_ = mmap(nullptr, mappingBytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (mapping_ == MAP_FAILED)
+	{
+		auto error = system_error("mmap " + name_);
+		mapping_ = nullptr;
+		shm_unlink(name_.c_str());
+		throw error;
+	}
+
+	// The new file is zero filled: all slot sequences are 0, i.e. empty.
+	header_ = new (mapping_) ShmRingHeader;
+	header_->slotCount = slotCount;
+	header_->slotBytes = slotBytes;
+	header_->slotStride = stride;
+	header_->published.store(0, std::memory_order_relaxed);
+	header_->futexWord.store(0, std::memory_order_relaxed);
+	header_->closed.store(0, std::memory_order_relaxed);
+	header_->version = ShmRingHeader::Version;
+	// Readers check the magic last.
+	std::atomic_thread_fence(std::memory_order_release);
+	header_->magic = ShmRingHeader::Magic;
+}
+
+ShmPublisher::~ShmPublisher()
+{
+	if (!mapping_)
+		return;
+
+	header_->closed.store(1, std::memory_order_release);
+	header_->futexWord.fetch_add(1, std::memory_order_release);
+	futex_wake_all(&header_->futexWord);
+	munmap(mapping_, mappingBytes_);
+	shm_unlink(name_.c_str());
+}
+
+void ShmPublisher::publish(const uint8_t *data, const mvlcc_readout_info_t &info)
+{
+	if (info.bytes_used > header_->slotBytes)
+		throw std::length_error("shm publisher: buffer larger than the slot size");
+
+	const uint64_t n = header_->published.load(std::memory_order_relaxed);
+	auto base = static_cast<uint8_t *>(mapping_) + align_up(sizeof(ShmRingHeader), CacheLine)
+		+ (n % header_->slotCount) * header_->slotStride;
+	auto slot = reinterpret_cast<ShmSlotHeader *>(base);
+	auto slotData = base + align_up(sizeof(ShmSlotHeader), CacheLine);
+
+	slot->sequence.store(2 * n + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	slot->info = info;
+	std::memcpy(slotData, data, info.bytes_used);
+	slot->sequence.store(2 * n + 2, std::memory_order_release);
+
+	header_->published.store(n + 1, std::memory_order_release);
+	header_->futexWord.fetch_add(1, std::memory_order_release);
+	futex_wake_all(&header_->futexWord);
+}
+
+ShmReader::ShmReader(const std::string &name, Mode mode)
+	: mode_(mode)
+{
+	int fd = shm_open(name.c_str(), O_RDONLY, 0);
+
+	if (fd < 0)
+		throw system_error("shm_open " + name);
+
+	struct stat st;
+
+	if (fstat(fd, &st) || static_cast<size_t>(st.st_size) < sizeof(ShmRingHeader))
+	{
+		close(fd);
+		throw std::runtime_error("shm reader: " + name + " is not a readout ring");
+	}
+
+	mappingBytes_ = st.st_size;
+	mapping_ = mmap(nullptr, mappingBytes_, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+
+	if (mapping_ == MAP_FAILED)
+	{
+		mapping_ = nullptr;
+		throw system_error("mmap " + name);
+	}
+
+	header_ = static_cast<const ShmRingHeader *>(mapping_);
+	const bool valid = header_->magic == ShmRingHeader::Magic;
+	std::atomic_thread_fence(std::memory_order_acquire);
+
+	if (!valid || header_->version != ShmRingHeader::Version
+		|| align_up(sizeof(ShmRingHeader), CacheLine) + header_->slotCount * header_->slotStride > mappingBytes_)
+	{
+		munmap(const_cast<void *>(mapping_), mappingBytes_);
+		mapping_ = nullptr;
+		throw std::runtime_error("shm reader: " + name + " is not a readout ring of this version");
+	}
+
+	// Start with the buffers published from now on.
+	next_ = header_->published.load(std::memory_order_acquire);
+}
+
+ShmReader::~ShmReader()
+{
+	if (mapping_)
+		munmap(const_cast<void *>(mapping_), mappingBytes_);
+}
+
+const ShmSlotHeader *ShmReader::slot(uint64_t n) const
+{
+	auto base = static_cast<const uint8_t *>(mapping_) + align_up(sizeof(ShmRingHeader), CacheLine)
+		+ (n % header_->slotCount) * header_->slotStride;
+	return reinterpret_cast<const ShmSlotHeader *>(base);
+}
+
+ShmReader::Result ShmReader::read(uint8_t *dest, size_t bytesFree, mvlcc_readout_info_t &info,
+	std::chrono::milliseconds timeout)
+{
+	if (bytesFree < header_->slotBytes)
+		return Result::TooSmall;
+
+	const auto deadline = std::chrono::steady_clock::now() + timeout;
+
+	while (true)
+	{
+		const uint32_t futexValue = header_->futexWord.load(std::memory_order_acquire);
+		const uint64_t published = header_->published.load(std::memory_order_acquire);
+
+		if (next_ < published)
+		{
+			// Skip what has been overwritten already, or everything but the
+			// newest buffer in Latest mode.
+			const uint64_t oldest = published > header_->slotCount ? published - header_->slotCount : 0;
+			const uint64_t first = mode_ == Mode::Latest ? published - 1 : std::max(next_, oldest);
+			lost_ += first - next_;
+			next_ = first;
+
+			auto s = slot(next_);
+			const uint64_t expected = 2 * next_ + 2;
+			const uint64_t before = s->sequence.load(std::memory_order_acquire);
+
+			if (before == expected)
+			{
+				mvlcc_readout_info_t slotInfo = s->info;
+				const size_t bytes = std::min<size_t>(slotInfo.bytes_used, header_->slotBytes);
+				std::memcpy(dest, reinterpret_cast<const uint8_t *>(s) + align_up(sizeof(ShmSlotHeader), CacheLine), bytes);
+				std::atomic_thread_fence(std::memory_order_acquire);
+
+				if (s->sequence.load(std::memory_order_relaxed) == expected)
+				{
+					++next_;
+					++buffers_;
+					info = slotInfo;
+					info.bytes_used = bytes;
+					return Result::Ok;
+				}
+			}
+
+			// Overwritten before or while copying.
+			++lost_;
+			++next_;
+			continue;
+		}
+
+		if (header_->closed.load(std::memory_order_acquire))
+			return Result::Closed;
+
+		const auto now = std::chrono::steady_clock::now();
+
+		if (now >= deadline)
+			return Result::Timeout;
+
+		futex_wait(&header_->futexWord, futexValue, deadline - now);
+	}
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+// Single writer, multi reader ring of readout buffers in POSIX shared memory.
+//
+// Readers map the segment read-only and cannot hold back the writer: each
+// slot is a seqlock, readers copy the buffer out and detect if it was
+// overwritten meanwhile. A reader that falls more than a ring behind loses
+// buffers and is told how many. Waiting readers sleep on a futex in the
+// segment header which the writer wakes after each buffer.
+//
+// Layout: ShmRingHeader, then slotCount slots of ShmSlotHeader + slotBytes
+// data, each aligned to a cache line.
+
+#include <mvlcc_wrap.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+struct ShmRingHeader
+{
+	static const uint32_t Magic = 0x6d76726e;	// "mvrn"
+	static const uint32_t Version = 1;
+
+	uint32_t magic;
+	uint32_t version;
+	uint64_t slotCount;
+	uint64_t slotBytes;
+	uint64_t slotStride;
+	// Number of buffers published. Buffer n lives in slot n % slotCount.
+	std::atomic<uint64_t> published;
+	// Incremented with each buffer and on close, readers wait on it.
+	std::atomic<uint32_t> futexWord;
+	std::atomic<uint32_t> closed;
+};
+
+struct ShmSlotHeader
+{
+	// 2n + 1 while buffer n is written, 2n + 2 once complete.
+	std::atomic<uint64_t> sequence;
+	mvlcc_readout_info_t info;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared memory atomics must be lock free");
+
+class ShmPublisher
+{
+	public:
+		// Creates the segment, replacing an existing one of the same name.
+		// Throws std::system_error.
+		ShmPublisher(const std::string &name, size_t slotCount, size_t slotBytes);
+		// Marks the ring closed, wakes the readers and unlinks the name.
+		// Attached readers keep their mapping.
+		~ShmPublisher();
+
+		ShmPublisher(const ShmPublisher &) = delete;
+		ShmPublisher &operator=(const ShmPublisher &) = delete;
+
+		// Throws std::length_error if the buffer does not fit into a slot.
+		void publish(const uint8_t *data, const mvlcc_readout_info_t &info);
+
+		size_t slotBytes() const { return header_->slotBytes; }
+
+	private:
+		std::string name_;
+		void *mapping_ = nullptr;
+		size_t mappingBytes_ = 0;
+		ShmRingHeader *header_ = nullptr;
+};
+
+class ShmReader
+{
+	public:
+		enum class Mode { Next, Latest };
+
+		// Attaches to an existing segment. Throws std::system_error or
+		// std::runtime_error.
+		ShmReader(const std::string &name, Mode mode);
+		~ShmReader();
+
+		ShmReader(const ShmReader &) = delete;
+		ShmReader &operator=(const ShmReader &) = delete;
+
+		enum class Result { Ok, Timeout, Closed, TooSmall };
+
+		// Copies the next buffer (Mode::Next) or the most recent one not read
+		// yet (Mode::Latest) to dest. Returns TooSmall without changing the
+		// reader state if bytesFree is smaller than slotBytes().
+		Result read(uint8_t *dest, size_t bytesFree, mvlcc_readout_info_t &info,
+			std::chrono::milliseconds timeout);
+
+		uint64_t buffers() const { return buffers_; }
+		uint64_t lostBuffers() const { return lost_; }
+		size_t slotBytes() const { return header_->slotBytes; }
+
+	private:
+		const ShmSlotHeader *slot(uint64_t n) const;
+
+		Mode mode_;
+		const void *mapping_ = nullptr;
+		size_t mappingBytes_ = 0;
+		const ShmRingHeader *header_ = nullptr;
+		uint64_t next_ = 0;
+		uint64_t buffers_ = 0;
+		uint64_t lost_ = 0;
+};
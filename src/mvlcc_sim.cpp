@@ -0,0 +1,540 @@
+#include "mvlcc_sim.h"
+
+#include <algorithm>
+#include <cassert>
+#include <cstring>
+#include <limits>
+#include <thread>
+
+#include "mvlcc_timing.h"
+
+using namespace mesytec::mvlc;
+
+using CT = StackCommand::CommandType;
+
+namespace
+{
+
+// Value of the hardware_id register reported by real controllers.
+static const uint32_t HardwareIdMVLC = 0x5008;
+
+
+bool is_read(const StackCommand &cmd)
+{
+	return cmd.type == CT::VMERead || cmd.type == CT::VMEReadSwapped
+		|| cmd.type == CT::VMEReadMem || cmd.type == CT::VMEReadMemSwapped;
+}
+
+std::error_code not_connected()
+{
+	return std::make_error_code(std::errc::not_connected);
+}
+
+}
+
+//
+// FrameWriter
+//
+
+FrameWriter::FrameWriter(std::vector<uint32_t> &out, std::vector<size_t> &frameStarts, uint8_t stackNum)
+	: out_(out)
+	, frameStarts_(frameStarts)
+	, stackNum_(stackNum)
+{
+	beginStackFrame(frame_headers::StackFrame);
+}
+
+uint32_t FrameWriter::make_header(uint8_t type, uint8_t flags, uint8_t stackNum, uint16_t len)
+{
+	return (static_cast<uint32_t>(type) << frame_headers::TypeShift)
+		| (static_cast<uint32_t>(flags & frame_headers::FrameFlagsMask) << frame_headers::FrameFlagsShift)
+		| (static_cast<uint32_t>(stackNum & frame_headers::StackNumMask) << frame_headers::StackNumShift)
+		| (len & frame_headers::LengthMask);
+}
+
+void FrameWriter::beginStackFrame(uint8_t type)
+{
+	frameStarts_.push_back(out_.size());
+	stackHeaderPos_ = out_.size();
+	out_.push_back(make_header(type, 0, stackNum_, 0));
+}
+
+// Closes the current (block and) stack frame with the continue flag set and
+// opens a stack continuation frame (and block frame).
+void FrameWriter::continueStackFrame()
+{
+	const uint32_t continueFlag = static_cast<uint32_t>(frame_flags::Continue) << frame_headers::FrameFlagsShift;
+
+	if (inBlock_)
+		out_[blockHeaderPos_] |= continueFlag | (out_.size() - blockHeaderPos_ - 1);
+
+	out_[stackHeaderPos_] |= continueFlag | (out_.size() - stackHeaderPos_ - 1);
+	beginStackFrame(frame_headers::StackContinuation);
+
+	if (inBlock_)
+	{
+		blockHeaderPos_ = out_.size();
+		out_.push_back(make_header(frame_headers::BlockRead, 0, 0, 0));
+	}
+}
+
+void FrameWriter::put(uint32_t word)
+{
+	if (inBlock_ && out_.size() - blockHeaderPos_ - 1 == frame_headers::LengthMask)
+	{
+		out_[blockHeaderPos_] |= (static_cast<uint32_t>(frame_flags::Continue) << frame_headers::FrameFlagsShift)
+			| frame_headers::LengthMask;
+		inBlock_ = false;
+		beginBlock();
+	}
+
+	if (out_.size() - stackHeaderPos_ - 1 == frame_headers::LengthMask)
+		continueStackFrame();
+
+	out_.push_back(word);
+}
+
+void FrameWriter::beginBlock()
+{
+	// Room for the block header and at least one data word.
+	if (out_.size() - stackHeaderPos_ - 1 + 2 > frame_headers::LengthMask)
+		continueStackFrame();
+
+	blockHeaderPos_ = out_.size();
+	out_.push_back(make_header(frame_headers::BlockRead, 0, 0, 0));
+	inBlock_ = true;
+}
+
+void FrameWriter::endBlock()
+{
+	out_[blockHeaderPos_] |= out_.size() - blockHeaderPos_ - 1;
+	inBlock_ = false;
+}
+
+void FrameWriter::finish()
+{
+	if (inBlock_)
+		endBlock();
+
+	out_[stackHeaderPos_] |= out_.size() - stackHeaderPos_ - 1;
+}
+
+//
+// SimCrate
+//
+
+SimCrate::SimCrate(const CrateConfig &config, const SimParams &params)
+	: params_(params)
+	, connectionType_(config.connectionType)
+	, ethJumbo_(config.ethJumboEnable)
+	, rng_(params.seed)
+{
+	registers_[registers::hardware_id] = HardwareIdMVLC;
+	stacks_ = config.stacks;
+}
+
+std::error_code SimCrate::connect()
+{
+	std::lock_guard<std::mutex> guard(mutex_);
+	connected_ = true;
+	daqMode_ = false; // same as setDisableTriggersOnConnect(true)
+	return {};
+}
+
+std::error_code SimCrate::disconnect()
+{
+	std::lock_guard<std::mutex> guard(mutex_);
+	connected_ = false;
+	daqMode_ = false;
+	return {};
+}
+
+bool SimCrate::isConnected() const
+{
+	std::lock_guard<std::mutex> guard(mutex_);
+	return connected_;
+}
+
+std::error_code SimCrate::readRegister(uint16_t address, uint32_t &value)
+{
+	std::lock_guard<std::mutex> guard(mutex_);
+	if (!connected_)
+		return not_connected();
+	auto it = registers_.find(address);
+	value = it != std::end(registers_) ? it->second : 0u;
+	return {};
+}
+
+std::error_code SimCrate::writeRegister(uint16_t address, uint32_t value)
+{
+	{
+		std::lock_guard<std::mutex> guard(mutex_);
+		if (!connected_)
+			return not_connected();
+		registers_[address] = value;
+	}
+
+	if (address == registers::daq_mode)
+		return setDaqMode(value);
+
+	return {};
+}
+
+// Returns the stored value or, for addresses never written, a deterministic
+// value derived from the address.
+uint32_t SimCrate::readWord(uint32_t address)
+{
+	if (auto it = vmeMemory_.find(address); it != std::end(vmeMemory_))
+		return it->second;
+
+	return address * 2654435761u;
+}
+
+std::error_code SimCrate::vmeRead(uint32_t address, uint32_t &value, uint8_t, VMEDataWidth dataWidth)
+{
+	std::lock_guard<std::mutex> guard(mutex_);
+	if (!connected_)
+		return not_connected();
+	value = readWord(address);
+	if (dataWidth == VMEDataWidth::D16)
+		value &= 0xffffu;
+	return {};
+}
+
+std::error_code SimCrate::vmeWrite(uint32_t address, uint32_t value, uint8_t, VMEDataWidth dataWidth)
+{
+	std::lock_guard<std::mutex> guard(mutex_);
+	if (!connected_)
+		return not_connected();
+	vmeMemory_[address] = dataWidth == VMEDataWidth::D16 ? value & 0xffffu : value;
+	return {};
+}
+
+std::error_code SimCrate::vmeBlockRead(uint32_t address, uint8_t amod, uint16_t maxTransfers, std::vector<uint32_t> &dest)
+{
+	std::lock_guard<std::mutex> guard(mutex_);
+	if (!connected_)
+		return not_connected();
+
+	StackCommand cmd;
+	cmd.amod = amod;
+	cmd.transfers = maxTransfers;
+	auto words = std::min(block_read_max_words(cmd), params_.blockReadWords);
+
+	for (uint32_t i = 0; i < words; ++i)
+		dest.push_back(readWord(address + i * 4));
+
+	return {};
+}
+
+CommandExecResult SimCrate::runCommand(const StackCommand &cmd)
+{
+	CommandExecResult result;
+
+	if (cmd.type == CT::SoftwareDelay)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(cmd.value));
+		return result;
+	}
+
+	if (is_read(cmd))
+	{
+		if (classify_amod(cmd.amod) == AmodClass::Single)
+		{
+			uint32_t value = 0;
+			result.ec = vmeRead(cmd.address, value, cmd.amod, cmd.dataWidth);
+			result.response.push_back(value);
+		}
+		else
+		{
+			result.ec = vmeBlockRead(cmd.address, cmd.amod, cmd.transfers, result.response);
+		}
+	}
+	else if (cmd.type == CT::VMEWrite)
+	{
+		result.ec = vmeWrite(cmd.address, cmd.value, cmd.amod, cmd.dataWidth);
+	}
+	else if (cmd.type == CT::WriteMarker)
+	{
+		result.response.push_back(cmd.value);
+	}
+
+	return result;
+}
+
+std::error_code SimCrate::initReadout(const CrateConfig &config)
+{
+	for (const auto *cmdList: { &config.initRegisters, &config.initTriggerIO, &config.initCommands })
+	{
+		for (const auto &cmd: cmdList->getCommands())
+		{
+			if (auto result = runCommand(cmd); result.ec)
+				return result.ec;
+		}
+	}
+
+	setReadoutStacks(config.stacks, config.triggers);
+
+	std::lock_guard<std::mutex> guard(mutex_);
+	connectionType_ = config.connectionType;
+	ethJumbo_ = config.ethJumboEnable;
+
+	return {};
+}
+
+void SimCrate::setReadoutStacks(const std::vector<StackCommandBuilder> &stacks, const std::vector<uint32_t> &triggers)
+{
+	std::lock_guard<std::mutex> guard(mutex_);
+	stacks_ = stacks;
+	triggeredStacks_.clear();
+
+	// Stacks without a trigger entry are triggered too, so that configs built
+	// in code only need to set the stacks.
+	for (size_t si = 0; si < stacks_.size(); ++si)
+	{
+		if (!stacks_[si].empty() && (si >= triggers.size() || triggers[si] != 0))
+			triggeredStacks_.push_back(si);
+	}
+}
+
+void SimCrate::disableTriggers()
+{
+	std::lock_guard<std::mutex> guard(mutex_);
+	triggeredStacks_.clear();
+}
+
+std::error_code SimCrate::setDaqMode(bool enable)
+{
+	std::lock_guard<std::mutex> guard(mutex_);
+	if (!connected_)
+		return not_connected();
+	daqMode_ = enable;
+	registers_[registers::daq_mode] = enable;
+
+	if (enable)
+	{
+		daqStart_ = clock::now();
+		eventsGenerated_ = 0;
+		pendingEvent_.clear();
+		pendingFrameStarts_.clear();
+	}
+
+	return {};
+}
+
+void SimCrate::putCommand(FrameWriter &fw, const StackCommand &cmd)
+{
+	if (is_read(cmd))
+	{
+		if (classify_amod(cmd.amod) == AmodClass::Single)
+		{
+			auto value = readWord(cmd.address);
+			fw.put(cmd.dataWidth == VMEDataWidth::D16 ? value & 0xffffu : value);
+		}
+		else
+		{
+			auto words = std::min(block_read_max_words(cmd), params_.blockReadWords);
+			fw.beginBlock();
+			for (uint32_t i = 0; i < words; ++i)
+				fw.put(rng_());
+			fw.endBlock();
+		}
+	}
+	else if (cmd.type == CT::VMEWrite)
+	{
+		vmeMemory_[cmd.address] = cmd.value;
+	}
+	else if (cmd.type == CT::WriteMarker)
+	{
+		fw.put(cmd.value);
+	}
+	else if (cmd.type == CT::WriteSpecial)
+	{
+		// 0: timestamp, otherwise the accumulator. Use an event counter for the latter.
+		auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(clock::now() - daqStart_);
+		fw.put(cmd.value == 0 ? static_cast<uint32_t>(elapsed.count()) : eventCounter_);
+	}
+}
+
+void SimCrate::executeStack(const std::vector<StackCommand> &commands, uint8_t stackNum,
+	std::vector<uint32_t> &out, std::vector<size_t> &frameStarts)
+{
+	std::lock_guard<std::mutex> guard(mutex_);
+	FrameWriter fw(out, frameStarts, stackNum);
+
+	for (const auto &cmd: commands)
+		putCommand(fw, cmd);
+
+	fw.finish();
+}
+
+void SimCrate::generateEvent(size_t stackIndex, std::vector<uint32_t> &out, std::vector<size_t> &frameStarts)
+{
+	FrameWriter fw(out, frameStarts, stackIndex + stacks::FirstReadoutStackID);
+
+	for (const auto &group: stacks_[stackIndex].getGroups())
+	{
+		for (const auto &cmd: group.commands)
+			putCommand(fw, cmd);
+	}
+
+	fw.finish();
+	++eventCounter_;
+}
+
+std::error_code SimCrate::readoutFrames(std::vector<uint32_t> &stream, std::vector<size_t> &frameStarts,
+	size_t maxWords, std::chrono::milliseconds timeout)
+{
+	const auto deadline = clock::now() + timeout;
+	const size_t streamBegin = stream.size();
+	std::unique_lock<std::mutex> guard(mutex_);
+
+	if (!connected_)
+		return not_connected();
+
+	uint64_t eventsDue = std::numeric_limits<uint64_t>::max();
+
+	while (true)
+	{
+		if (!daqMode_ || triggeredStacks_.empty())
+		{
+			guard.unlock();
+			std::this_thread::sleep_until(deadline);
+			return {};
+		}
+
+		if (params_.triggerRateHz <= 0.0)
+			break;
+
+		const auto elapsed = std::chrono::duration<double>(clock::now() - daqStart_).count();
+		const auto expected = static_cast<uint64_t>(elapsed * params_.triggerRateHz);
+
+		// Limit the backlog to one second worth of events. Older ones are lost,
+		// like the controller would drop data if nobody reads it out.
+		const auto maxBacklog = static_cast<uint64_t>(params_.triggerRateHz) + 1;
+		if (expected > eventsGenerated_ + maxBacklog)
+			eventsGenerated_ = expected - maxBacklog;
+
+		if (expected > eventsGenerated_)
+		{
+			eventsDue = expected - eventsGenerated_;
+			break;
+		}
+
+		auto nextDue = daqStart_ + std::chrono::duration_cast<clock::duration>(
+			std::chrono::duration<double>((eventsGenerated_ + 1) / params_.triggerRateHz));
+
+		if (nextDue > deadline)
+		{
+			guard.unlock();
+			std::this_thread::sleep_until(deadline);
+			return {};
+		}
+
+		guard.unlock();
+		std::this_thread::sleep_until(nextDue);
+		guard.lock();
+	}
+
+	while (eventsDue > 0)
+	{
+		if (pendingEvent_.empty())
+		{
+			auto stackIndex = triggeredStacks_[eventsGenerated_ % triggeredStacks_.size()];
+			generateEvent(stackIndex, pendingEvent_, pendingFrameStarts_);
+		}
+
+		if (stream.size() - streamBegin + pendingEvent_.size() > maxWords)
+		{
+			if (stream.size() == streamBegin)
+			{
+				// Can never be delivered, drop it.
+				pendingEvent_.clear();
+				pendingFrameStarts_.clear();
+				++eventsGenerated_;
+				return std::make_error_code(std::errc::no_buffer_space);
+			}
+			break;
+		}
+
+		for (auto fs: pendingFrameStarts_)
+			frameStarts.push_back(stream.size() + fs);
+		stream.insert(std::end(stream), std::begin(pendingEvent_), std::end(pendingEvent_));
+		pendingEvent_.clear();
+		pendingFrameStarts_.clear();
+		++eventsGenerated_;
+		--eventsDue;
+	}
+
+	return {};
+}
+
+std::pair<std::error_code, size_t> SimCrate::readout(uint8_t *dest, size_t bytesFree,
+	std::chrono::milliseconds timeout)
+{
+	std::unique_lock<std::mutex> guard(mutex_);
+	const bool isEth = connectionType_ == ConnectionType::ETH;
+	const size_t maxPayload = sim_eth_payload_words(ethJumbo_);
+	guard.unlock();
+
+	size_t maxWords = bytesFree / sizeof(uint32_t);
+
+	// w words need ceil(w / maxPayload) packet headers.
+	if (isEth)
+		maxWords = maxWords > eth::HeaderWords ? (maxWords - eth::HeaderWords) * maxPayload / (maxPayload + eth::HeaderWords) : 0;
+
+	std::vector<uint32_t> stream;
+	std::vector<size_t> frameStarts;
+
+	if (auto ec = readoutFrames(stream, frameStarts, maxWords, timeout))
+		return { ec, 0 };
+
+	if (isEth && !stream.empty())
+	{
+		std::vector<uint32_t> packets;
+		guard.lock();
+		eth_packetize(stream, frameStarts, static_cast<uint8_t>(eth::PacketChannel::Data),
+			packetNumber_, maxPayload, packets);
+		stream.swap(packets);
+	}
+
+	assert(stream.size() * sizeof(uint32_t) <= bytesFree);
+	std::memcpy(dest, stream.data(), stream.size() * sizeof(uint32_t));
+	return { {}, stream.size() * sizeof(uint32_t) };
+}
+
+size_t sim_eth_payload_words(bool jumbo)
+{
+	// Standard and jumbo frame MTUs minus IP/UDP and MVLC packet headers.
+	return jumbo ? 2200 : 360;
+}
+
+void eth_packetize(const std::vector<uint32_t> &stream, const std::vector<size_t> &frameStarts,
+	uint8_t channel, uint16_t &packetNumber, size_t maxPayloadWords,
+	std::vector<uint32_t> &out, std::vector<size_t> *packetStarts)
+{
+	size_t pos = 0, fi = 0;
+
+	while (pos < stream.size())
+	{
+		const size_t n = std::min(maxPayloadWords, stream.size() - pos);
+
+		while (fi < frameStarts.size() && frameStarts[fi] < pos)
+			++fi;
+
+		uint32_t nextHeader = eth::header1::NoHeaderPointerPresent;
+
+		if (fi < frameStarts.size() && frameStarts[fi] < pos + n)
+			nextHeader = frameStarts[fi] - pos;
+
+		if (packetStarts)
+			packetStarts->push_back(out.size());
+
+		out.push_back((static_cast<uint32_t>(channel & eth::header0::PacketChannelMask) << eth::header0::PacketChannelShift)
+			| ((packetNumber++ & eth::header0::PacketNumberMask) << eth::header0::PacketNumberShift)
+			| (static_cast<uint32_t>(n) & eth::header0::NumDataWordsMask));
+		out.push_back((nextHeader & eth::header1::HeaderPointerMask) << eth::header1::HeaderPointerShift);
+		out.insert(std::end(out), std::begin(stream) + pos, std::begin(stream) + pos + n);
+		pos += n;
+	}
+}
@@ -0,0 +1,139 @@
+#pragma once
+
+// In-process MVLC simulator used as a hardware-free backend for struct mvlcc.
+//
+// Register and VME accesses are answered from an in-memory address space.
+// While DAQ mode is enabled readout() generates events for the readout stacks
+// of the crate config in the MVLC framing format: USB style frame streams or
+// ETH data pipe packets, depending on the connection type of the config, so
+// that the readout parser can be used unchanged.
+
+#include <mesytec-mvlc/mesytec-mvlc.h>
+
+#include <mutex>
+#include <random>
+#include <unordered_map>
+
+class FrameWriter;
+
+struct SimParams
+{
+	double triggerRateHz = 0.0;		// 0: generate as fast as possible
+	uint32_t blockReadWords = 100;	// words per block read, capped at the max transfers
+	uint32_t seed = 1;
+};
+
+class SimCrate
+{
+	public:
+		SimCrate(const mesytec::mvlc::CrateConfig &config, const SimParams &params);
+
+		std::error_code connect();
+		std::error_code disconnect();
+		bool isConnected() const;
+
+		std::error_code readRegister(uint16_t address, uint32_t &value);
+		std::error_code writeRegister(uint16_t address, uint32_t value);
+		std::error_code vmeRead(uint32_t address, uint32_t &value, uint8_t amod, mesytec::mvlc::VMEDataWidth dataWidth);
+		std::error_code vmeWrite(uint32_t address, uint32_t value, uint8_t amod, mesytec::mvlc::VMEDataWidth dataWidth);
+		// Block reads return the plain data words without any framing.
+		std::error_code vmeBlockRead(uint32_t address, uint8_t amod, uint16_t maxTransfers, std::vector<uint32_t> &dest);
+		mesytec::mvlc::CommandExecResult runCommand(const mesytec::mvlc::StackCommand &cmd);
+
+		// Runs the init lists of the config against the address space and
+		// installs its readout stacks and triggers.
+		std::error_code initReadout(const mesytec::mvlc::CrateConfig &config);
+		// Stacks with a non-zero trigger value or without a trigger entry are
+		// executed round-robin while DAQ mode is enabled.
+		void setReadoutStacks(const std::vector<mesytec::mvlc::StackCommandBuilder> &stacks,
+			const std::vector<uint32_t> &triggers);
+		std::error_code setDaqMode(bool enable);
+		// Like writing 0 to all trigger registers: no stack is executed until
+		// setReadoutStacks() is called again.
+		void disableTriggers();
+
+		// Executes the commands like the MVLC would execute stack stackNum and
+		// appends the resulting frames to out.
+		void executeStack(const std::vector<mesytec::mvlc::StackCommand> &commands, uint8_t stackNum,
+			std::vector<uint32_t> &out, std::vector<size_t> &frameStarts);
+
+		// Appends complete events of at most maxWords words in total to
+		// stream, using the USB framing format. The start offset of each
+		// outer frame is added to frameStarts.
+		std::error_code readoutFrames(std::vector<uint32_t> &stream, std::vector<size_t> &frameStarts,
+			size_t maxWords, std::chrono::milliseconds timeout);
+
+		// Fills dest with complete events (USB) or complete packets (ETH).
+		// Waits up to timeout for events to become due when a trigger rate is set.
+		std::pair<std::error_code, size_t> readout(uint8_t *dest, size_t bytesFree,
+			std::chrono::milliseconds timeout);
+
+		mesytec::mvlc::ConnectionType connectionType() const
+		{
+			std::lock_guard<std::mutex> guard(mutex_);
+			return connectionType_;
+		}
+
+	private:
+		using clock = std::chrono::steady_clock;
+
+		uint32_t readWord(uint32_t address);
+		void putCommand(FrameWriter &fw, const mesytec::mvlc::StackCommand &cmd);
+		void generateEvent(size_t stackIndex, std::vector<uint32_t> &out, std::vector<size_t> &frameStarts);
+
+		mutable std::mutex mutex_;
+		SimParams params_;
+		mesytec::mvlc::ConnectionType connectionType_;
+		bool ethJumbo_ = false;
+		bool connected_ = false;
+		bool daqMode_ = false;
+		std::unordered_map<uint32_t, uint32_t> vmeMemory_;
+		std::unordered_map<uint16_t, uint32_t> registers_;
+		std::vector<mesytec::mvlc::StackCommandBuilder> stacks_;
+		std::vector<size_t> triggeredStacks_;
+		std::minstd_rand rng_;
+
+		clock::time_point daqStart_;
+		uint64_t eventsGenerated_ = 0;
+		uint32_t eventCounter_ = 0;
+		uint16_t packetNumber_ = 0;
+		// Event generated in a previous call that did not fit the dest buffer.
+		std::vector<uint32_t> pendingEvent_;
+		std::vector<size_t> pendingFrameStarts_;
+};
+
+// Max data words per ETH packet, leaving room for the IP/UDP and MVLC headers.
+size_t sim_eth_payload_words(bool jumbo);
+
+// Splits a frame stream into ETH packets for the given packet channel and
+// appends them to out, setting the next header pointers from frameStarts.
+// packetStarts receives the offset of each packet in out if not null.
+void eth_packetize(const std::vector<uint32_t> &stream, const std::vector<size_t> &frameStarts,
+	uint8_t channel, uint16_t &packetNumber, size_t maxPayloadWords,
+	std::vector<uint32_t> &out, std::vector<size_t> *packetStarts = nullptr);
+
+// Appends MVLC frame headers and data to a word vector, splitting stack and
+// block frames with continuation frames when they reach the maximum length.
+class FrameWriter
+{
+	public:
+		FrameWriter(std::vector<uint32_t> &out, std::vector<size_t> &frameStarts, uint8_t stackNum);
+
+		void put(uint32_t word);
+		void beginBlock();
+		void endBlock();
+		void finish();
+
+		static uint32_t make_header(uint8_t type, uint8_t flags, uint8_t stackNum, uint16_t len);
+
+	private:
+		void beginStackFrame(uint8_t type);
+		void continueStackFrame();
+
+		std::vector<uint32_t> &out_;
+		std::vector<size_t> &frameStarts_;
+		uint8_t stackNum_;
+		size_t stackHeaderPos_ = 0;
+		size_t blockHeaderPos_ = 0;
+		bool inBlock_ = false;
+};
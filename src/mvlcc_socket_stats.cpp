@@ -0,0 +1,79 @@
+#include "mvlcc_socket_stats.h"
+
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+
+namespace
+{
+
+// Line format: sl local_address rem_address st tx_queue:rx_queue tr:tm->when
+// retrnsmt uid timeout inode ref pointer drops
+bool find_in_proc(const char *path, ino_t inode, UdpSocketInfo &info)
+{
+	std::ifstream in(path);
+	std::string line;
+	std::getline(in, line);	// header
+
+	while (std::getline(in, line))
+	{
+		std::istringstream fields(line);
+		std::string sl, local, remote, state, queues, timer, retransmits, uid, timeout;
+		unsigned long lineInode = 0;
+		fields >> sl >> local >> remote >> state >> queues >> timer >> retransmits >> uid >> timeout >> lineInode;
+
+		if (!fields || lineInode != inode)
+			continue;
+
+		std::string ref, pointer;
+		uint64_t drops = 0;
+		fields >> ref >> pointer >> drops;
+
+		auto colon = queues.find(':');
+		if (colon != std::string::npos)
+			info.rxQueueBytes = std::stoull(queues.substr(colon + 1), nullptr, 16);
+
+		info.drops = drops;
+		return true;
+	}
+
+	return false;
+}
+
+}
+
+UdpSocketInfo udp_socket_info(int fd)
+{
+	UdpSocketInfo info;
+	struct stat st;
+
+	if (fd < 0 || fstat(fd, &st))
+		return info;
+
+	socklen_t len = sizeof(info.rcvbufBytes);
+	getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &info.rcvbufBytes, &len);
+
+	info.valid = find_in_proc("/proc/net/udp", st.st_ino, info)
+		|| find_in_proc("/proc/net/udp6", st.st_ino, info);
+
+	return info;
+}
+
+int64_t rxq_ovfl_drops(const msghdr &msg)
+{
+	for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(const_cast<msghdr *>(&msg), cmsg))
+	{
+		if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SO_RXQ_OVFL)
+		{
+			uint32_t drops = 0;
+			std::memcpy(&drops, CMSG_DATA(cmsg), sizeof(drops));
+			return drops;
+		}
+	}
+
+	return -1;
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+// Kernel side state of UDP sockets: the receive buffer size, the bytes
+// currently queued and the datagrams dropped because the receive buffer was
+// full. Drops counted here never reached the application, as opposed to
+// packets lost on the wire or in the controller, which only show up as gaps
+// in the MVLC packet numbers.
+
+#include <cstddef>
+#include <cstdint>
+
+#include <sys/socket.h>
+
+struct UdpSocketInfo
+{
+	bool valid = false;			// false if the socket was not found
+	int rcvbufBytes = 0;		// SO_RCVBUF, twice the requested size on Linux
+	uint64_t rxQueueBytes = 0;
+	uint64_t drops = 0;
+};
+
+// Reads /proc/net/udp and /proc/net/udp6.
+UdpSocketInfo udp_socket_info(int fd);
+
+// Returns the number of datagrams dropped by the kernel since the socket was
+// created, found in the SO_RXQ_OVFL control message of a received message,
+// or -1 if the message has none. Enable the option with
+// setsockopt(SOL_SOCKET, SO_RXQ_OVFL).
+int64_t rxq_ovfl_drops(const msghdr &msg);
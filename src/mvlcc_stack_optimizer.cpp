@@ -0,0 +1,172 @@
+#include "mvlcc_stack_optimizer.h"
+
+#include <algorithm>
+
+using namespace mesytec::mvlc;
+
+using CT = StackCommand::CommandType;
+
+namespace
+{
+
+// Block transfer amod matching a single cycle data amod (A24/A32, user and
+// supervisory data). 0 if there is none.
+uint8_t blt_amod_for(uint8_t amod)
+{
+	switch (amod)
+	{
+		case 0x09: return 0x0b;
+		case 0x0d: return 0x0f;
+		case 0x39: return 0x3b;
+		case 0x3d: return 0x3f;
+	}
+	return 0;
+}
+
+bool is_block_read(const StackCommand &cmd)
+{
+	auto ac = classify_amod(cmd.amod);
+	return (cmd.type == CT::VMERead || cmd.type == CT::VMEReadSwapped
+		|| cmd.type == CT::VMEReadMem || cmd.type == CT::VMEReadMemSwapped)
+		&& (ac == AmodClass::BLT || ac == AmodClass::MBLT || ac == AmodClass::ESST);
+}
+
+bool is_mergeable_read(const StackCommand &cmd)
+{
+	return cmd.type == CT::VMERead
+		&& cmd.dataWidth == VMEDataWidth::D32
+		&& blt_amod_for(cmd.amod) != 0;
+}
+
+// The readout parser allows at most one block read (the 'dynamic' part) per
+// module group. Groups that already contain one are left alone, otherwise the
+// longest qualifying run of single reads is merged.
+size_t merge_reads(std::vector<StackCommand> &commands, unsigned minRun)
+{
+	if (std::any_of(std::begin(commands), std::end(commands), is_block_read))
+		return 0;
+
+	size_t bestBegin = 0, bestLen = 0;
+
+	for (size_t i = 0; i < commands.size();)
+	{
+		if (!is_mergeable_read(commands[i]))
+		{
+			++i;
+			continue;
+		}
+
+		size_t j = i + 1;
+
+		while (j < commands.size()
+			&& is_mergeable_read(commands[j])
+			&& commands[j].amod == commands[i].amod
+			&& commands[j].address == commands[j - 1].address + 4)
+		{
+			++j;
+		}
+
+		if (j - i > bestLen)
+		{
+			bestBegin = i;
+			bestLen = j - i;
+		}
+
+		i = j;
+	}
+
+	if (bestLen < std::max(minRun, 2u))
+		return 0;
+
+	StackCommand blockRead;
+	blockRead.type = CT::VMEReadMem;
+	blockRead.amod = blt_amod_for(commands[bestBegin].amod);
+	blockRead.address = commands[bestBegin].address;
+	blockRead.transfers = bestLen;
+
+	commands.erase(std::begin(commands) + bestBegin + 1, std::begin(commands) + bestBegin + bestLen);
+	commands[bestBegin] = blockRead;
+
+	return bestLen;
+}
+
+size_t drop_redundant(std::vector<StackCommand> &commands, bool readoutStack)
+{
+	std::vector<StackCommand> result;
+	result.reserve(commands.size());
+
+	for (const auto &cmd: commands)
+	{
+		if (readoutStack && cmd.type == CT::SoftwareDelay)
+			continue;
+
+		if (cmd.type == CT::Wait && cmd.value == 0)
+			continue;
+
+		if (!result.empty())
+		{
+			auto &prev = result.back();
+
+			// The wait argument is a 24 bit clock count.
+			if (cmd.type == CT::Wait && prev.type == CT::Wait
+				&& prev.value + cmd.value <= 0xffffffu)
+			{
+				prev.value += cmd.value;
+				continue;
+			}
+
+			// A SetAccu immediately overwritten by another one has no effect.
+			if (cmd.type == CT::SetAccu && prev.type == CT::SetAccu)
+			{
+				prev = cmd;
+				continue;
+			}
+		}
+
+		result.push_back(cmd);
+	}
+
+	size_t removed = commands.size() - result.size();
+	commands = std::move(result);
+	return removed;
+}
+
+}
+
+StackCommandBuilder optimize_stack(
+	const StackCommandBuilder &stack,
+	const StackOptimizeOptions &options,
+	StackOptimizeReport &report)
+{
+	report = {};
+	report.commandsBefore = stack.commandCount();
+	report.stackWordsBefore = make_stack_buffer(stack).size();
+	report.busTimeBeforeNs = estimate_stack_ns(options.timing, stack);
+
+	StackCommandBuilder result;
+	result.setName(stack.getName());
+
+	for (auto group: stack.getGroups())
+	{
+		if (options.dropRedundant)
+			report.removedCommands += drop_redundant(group.commands, options.readoutStack);
+
+		if (options.mergeReads)
+		{
+			if (auto merged = merge_reads(group.commands, options.minMergeRun))
+			{
+				report.mergedReads += merged;
+				report.removedCommands += merged - 1;
+			}
+		}
+
+		result.addGroup(group);
+	}
+
+	report.commandsAfter = result.commandCount();
+	report.stackWordsAfter = make_stack_buffer(result).size();
+	report.busTimeAfterNs = estimate_stack_ns(options.timing, result);
+	report.fitsStackMemory = report.stackWordsAfter <= options.stackMemoryWords;
+
+	return result;
+}
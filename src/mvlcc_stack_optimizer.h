@@ -0,0 +1,44 @@
+#pragma once
+
+// Optimization passes over readout stacks.
+
+#include <mesytec-mvlc/mesytec-mvlc.h>
+
+#include "mvlcc_timing.h"
+
+struct StackOptimizeOptions
+{
+	// Fold runs of single D32 reads to consecutive addresses into one
+	// address-incrementing block read.
+	bool mergeReads = true;
+	// Merge adjacent waits, drop zero waits, overwritten accu values and, in
+	// readout stacks, software delays.
+	bool dropRedundant = true;
+	// Software delays are never executed by the MVLC but by the library when
+	// running init and other command lists, keep them unless set.
+	bool readoutStack = false;
+	// Minimum number of single reads in a run before it is merged.
+	unsigned minMergeRun = 4;
+	// Stack memory available to the stack in 32-bit words.
+	size_t stackMemoryWords = mesytec::mvlc::stacks::StackMemoryWords
+		- mesytec::mvlc::stacks::ImmediateStackReservedWords;
+	BusTimingModel timing = default_bus_timing_model();
+};
+
+struct StackOptimizeReport
+{
+	size_t commandsBefore;
+	size_t commandsAfter;
+	size_t stackWordsBefore;
+	size_t stackWordsAfter;
+	size_t mergedReads;
+	size_t removedCommands;
+	double busTimeBeforeNs;
+	double busTimeAfterNs;
+	bool fitsStackMemory;
+};
+
+mesytec::mvlc::StackCommandBuilder optimize_stack(
+	const mesytec::mvlc::StackCommandBuilder &stack,
+	const StackOptimizeOptions &options,
+	StackOptimizeReport &report);
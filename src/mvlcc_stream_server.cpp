@@ -0,0 +1,551 @@
+#include "mvlcc_stream_server.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <system_error>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <mesytec-mvlc/mesytec-mvlc.h>
+
+#include "mvlcc_threads.h"
+
+namespace
+{
+
+static const uint8_t StreamMagic[4] = { 'M', 'V', 'L', 'S' };
+static const uint16_t StreamVersion = 1;
+// How often idle senders check for a closed connection.
+static const std::chrono::milliseconds IdleCheckInterval(100);
+// Longest wait of submit() for full client queues in BLOCK mode. It holds
+// clientsMutex_ meanwhile, which also holds up accepting new clients.
+static const std::chrono::milliseconds SubmitBlockTimeout(1000);
+
+void put(uint8_t *&p, uint64_t v, int bytes)
+{
+	for (int i = 0; i < bytes; ++i)
+		*p++ = (v >> (i * 8)) & 0xff;
+}
+
+uint64_t get(const uint8_t *&p, int bytes)
+{
+	uint64_t v = 0;
+
+	for (int i = 0; i < bytes; ++i)
+		v |= static_cast<uint64_t>(*p++) << (i * 8);
+
+	return v;
+}
+
+std::system_error system_error(const std::string &what)
+{
+	return std::system_error(errno, std::system_category(), what);
+}
+
+int listen_unix(const std::string &path)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+
+	if (path.empty() || path.size() >= sizeof(addr.sun_path))
+		throw std::invalid_argument("stream server: invalid unix socket path: " + path);
+
+	std::memcpy(addr.sun_path, path.c_str(), path.size());
+
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+	if (fd < 0)
+		throw system_error("socket");
+
+	// A stale socket file of a previous server.
+	unlink(path.c_str());
+
+	if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) || listen(fd, 16))
+	{
+		auto error = system_error("bind " + path);
+		close(fd);
+		throw error;
+	}
+
+	return fd;
+}
+
+int listen_tcp(const std::string &host, const std::string &port)
+{
+	addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	addrinfo *result = nullptr;
+
+	if (int ec = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(), &hints, &result))
+		throw std::invalid_argument("stream server: " + host + ":" + port + ": " + gai_strerror(ec));
+
+	int fd = -1;
+	int lastErrno = 0;
+
+	for (auto ai = result; ai && fd < 0; ai = ai->ai_next)
+	{
+		fd = socket(ai->ai_family, ai->ai_socktype | SOCK_CLOEXEC, ai->ai_protocol);
+
+		if (fd < 0)
+		{
+			lastErrno = errno;
+			continue;
+		}
+
+		int one = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) || listen(fd, 16))
+		{
+			lastErrno = errno;
+			close(fd);
+			fd = -1;
+		}
+	}
+
+	freeaddrinfo(result);
+
+	if (fd < 0)
+	{
+		errno = lastErrno;
+		throw system_error("bind " + host + ":" + port);
+	}
+
+	return fd;
+}
+
+int bound_port(int fd)
+{
+	sockaddr_storage addr = {};
+	socklen_t len = sizeof(addr);
+
+	if (getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &len))
+		return 0;
+
+	if (addr.ss_family == AF_INET)
+		return ntohs(reinterpret_cast<sockaddr_in *>(&addr)->sin_port);
+
+	if (addr.ss_family == AF_INET6)
+		return ntohs(reinterpret_cast<sockaddr_in6 *>(&addr)->sin6_port);
+
+	return 0;
+}
+
+// Sends all of iov, continuing after partial writes. False if the connection
+// is gone.
+bool send_all(int fd, iovec *iov, size_t iovcnt)
+{
+	while (iovcnt)
+	{
+		msghdr msg = {};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		ssize_t sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+		if (sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+
+		while (iovcnt && static_cast<size_t>(sent) >= iov->iov_len)
+		{
+			sent -= iov->iov_len;
+			++iov;
+			--iovcnt;
+		}
+
+		if (iovcnt)
+		{
+			iov->iov_base = static_cast<uint8_t *>(iov->iov_base) + sent;
+			iov->iov_len -= sent;
+		}
+	}
+
+	return true;
+}
+
+// Clients only receive, so the connection is over once the peer shut down
+// its side or reset it.
+bool peer_closed(int fd)
+{
+	pollfd pfd = { fd, POLLRDHUP, 0 };
+	return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+}
+
+}
+
+void encode_stream_header(const mvlcc_readout_info_t &info, uint64_t droppedBuffers, uint8_t *dest)
+{
+	uint8_t *p = dest;
+	std::memcpy(p, StreamMagic, sizeof(StreamMagic));
+	p += sizeof(StreamMagic);
+	put(p, StreamVersion, 2);
+	put(p, StreamHeaderBytes, 2);
+	put(p, info.buffer_number, 8);
+	put(p, info.bytes_used, 8);
+	put(p, static_cast<uint32_t>(info.data_format), 4);
+	put(p, info.flags, 4);
+	put(p, static_cast<uint32_t>(info.crate_index), 4);
+	put(p, static_cast<uint32_t>(info.connection_type), 4);
+	put(p, info.monotonic_ns, 8);
+	put(p, info.tai_ns, 8);
+	put(p, info.packets, 8);
+	put(p, info.lost_packets, 8);
+	put(p, info.dropped_bytes, 8);
+	put(p, droppedBuffers, 8);
+}
+
+bool decode_stream_header(const uint8_t *src, mvlcc_readout_info_t &info, uint64_t &droppedBuffers)
+{
+	if (std::memcmp(src, StreamMagic, sizeof(StreamMagic)))
+		return false;
+
+	const uint8_t *p = src + sizeof(StreamMagic);
+
+	if (get(p, 2) != StreamVersion || get(p, 2) != StreamHeaderBytes)
+		return false;
+
+	info = {};
+	info.buffer_number = get(p, 8);
+	info.bytes_used = get(p, 8);
+	info.data_format = static_cast<int32_t>(get(p, 4));
+	info.flags = get(p, 4);
+	info.crate_index = static_cast<int32_t>(get(p, 4));
+	info.connection_type = static_cast<int32_t>(get(p, 4));
+	info.monotonic_ns = get(p, 8);
+	info.tai_ns = get(p, 8);
+	info.packets = get(p, 8);
+	info.lost_packets = get(p, 8);
+	info.dropped_bytes = get(p, 8);
+	droppedBuffers = get(p, 8);
+	return true;
+}
+
+StreamServer::StreamServer(const std::string &address, const StreamServerOptions &options)
+	: options_(options)
+	, freeBuffers_(std::max<size_t>(1, options.bufferCount))
+{
+	options_.bufferCount = std::max<size_t>(1, options_.bufferCount);
+	options_.clientQueue = std::max<size_t>(1, options_.clientQueue);
+
+	scratch_.data.reserve(options_.bufferBytes);
+
+	for (size_t i = 0; i < options_.bufferCount; ++i)
+	{
+		auto buffer = std::make_unique<Buffer>();
+		buffer->data.reserve(options_.bufferBytes);
+		freeBuffers_.push(buffer.get());
+		buffers_.emplace_back(std::move(buffer));
+	}
+
+	if (address.compare(0, 5, "unix:") == 0)
+	{
+		unixPath_ = address.substr(5);
+		listenFd_ = listen_unix(unixPath_);
+	}
+	else if (address.compare(0, 6, "tcp://") == 0)
+	{
+		auto hostPort = address.substr(6);
+		auto colon = hostPort.rfind(':');
+
+		if (colon == std::string::npos)
+			throw std::invalid_argument("stream server: missing port in " + address);
+
+		auto host = hostPort.substr(0, colon);
+
+		// [::1]:port
+		if (host.size() >= 2 && host.front() == '[' && host.back() == ']')
+			host = host.substr(1, host.size() - 2);
+
+		listenFd_ = listen_tcp(host, hostPort.substr(colon + 1));
+		port_ = bound_port(listenFd_);
+	}
+	else
+		throw std::invalid_argument("stream server: expected tcp:// or unix: address: " + address);
+
+	acceptThread_ = std::thread(&StreamServer::acceptLoop, this);
+}
+
+StreamServer::~StreamServer()
+{
+	quit_ = true;
+	// Makes the blocked accept() fail.
+	shutdown(listenFd_, SHUT_RDWR);
+	acceptThread_.join();
+	close(listenFd_);
+
+	if (!unixPath_.empty())
+		unlink(unixPath_.c_str());
+
+	std::lock_guard<std::mutex> guard(clientsMutex_);
+
+	for (auto &client: clients_)
+		disconnect(*client);
+
+	for (auto &client: clients_)
+	{
+		client->thread.join();
+		close(client->fd);
+	}
+
+	clients_.clear();
+	freeBuffers_.close();
+}
+
+uint8_t *StreamServer::acquire(std::chrono::milliseconds timeout)
+{
+	if (auto buffer = freeBuffers_.pop(std::chrono::milliseconds(0)))
+		return (*buffer)->data.data();
+
+	if (backpressure_.mode() != MVLCC_BACKPRESSURE_BLOCK)
+		return scratch_.data.data();
+
+	const auto start = std::chrono::steady_clock::now();
+	auto buffer = freeBuffers_.pop(timeout);
+	backpressure_.addBlocked(start);
+	return buffer ? (*buffer)->data.data() : nullptr;
+}
+
+void StreamServer::submit(uint8_t *data, const mvlcc_readout_info_t &info)
+{
+	auto &bp = backpressure_.counters();
+
+	if (data == scratch_.data.data())
+	{
+		if (info.bytes_used)
+		{
+			// Dropped for every connected client.
+			const uint64_t clients = stats().clients;
+			add_counter(submitted_, 1);
+			add_counter(bp.offered, clients);
+			add_counter(bp.droppedNewest, clients);
+			add_counter(droppedBuffers_, clients);
+		}
+
+		return;
+	}
+
+	auto it = std::find_if(std::begin(buffers_), std::end(buffers_),
+		[data] (const auto &buffer) { return buffer->data.data() == data; });
+
+	if (it == std::end(buffers_))
+		throw std::invalid_argument("stream server: buffer does not belong to this server");
+
+	auto buffer = it->get();
+
+	if (!info.bytes_used)
+	{
+		freeBuffers_.push(buffer);
+		return;
+	}
+
+	buffer->info = info;
+	// The submitter's reference, dropped below.
+	buffer->refs.store(1, std::memory_order_relaxed);
+	add_counter(submitted_, 1);
+	const bool sampled = backpressure_.sampleNext();
+	const auto blockDeadline = std::chrono::steady_clock::now() + SubmitBlockTimeout;
+
+	{
+		std::lock_guard<std::mutex> guard(clientsMutex_);
+		reapClients();
+
+		for (auto &client: clients_)
+		{
+			if (client->closing.load(std::memory_order_acquire))
+				continue;
+
+			if (!sampled)
+			{
+				add_counter(bp.offered, 1);
+				add_counter(bp.sampledOut, 1);
+				continue;
+			}
+
+			buffer->refs.fetch_add(1, std::memory_order_relaxed);
+
+			if (options_.slowClientPolicy == MVLCC_STREAM_DISCONNECT)
+			{
+				add_counter(bp.offered, 1);
+
+				if (client->queue.tryPush(buffer))
+				{
+					add_counter(bp.accepted, 1);
+					continue;
+				}
+
+				buffer->refs.fetch_sub(1, std::memory_order_relaxed);
+				add_counter(bp.droppedNewest, 1);
+
+				// Closed by its sender meanwhile.
+				if (client->closing.load(std::memory_order_acquire))
+					continue;
+
+				spdlog::warn("stream server: disconnecting slow client {}", client->id);
+				add_counter(slowDisconnects_, 1);
+				disconnect(*client);
+				continue;
+			}
+
+			const auto blockTimeout = std::max(std::chrono::milliseconds(0),
+				std::chrono::duration_cast<std::chrono::milliseconds>(blockDeadline - std::chrono::steady_clock::now()));
+			auto disposed = backpressure_.offer(client->queue, buffer, blockTimeout);
+
+			if (!disposed)
+				continue;
+
+			// The new buffer itself or, in DROP_OLDEST mode, the evicted one.
+			if (*disposed == buffer)
+				buffer->refs.fetch_sub(1, std::memory_order_relaxed);
+			else
+				release(*disposed);
+
+			client->droppedBuffers.fetch_add(1, std::memory_order_relaxed);
+			add_counter(droppedBuffers_, 1);
+		}
+	}
+
+	release(buffer);
+}
+
+mvlcc_stream_server_stats_t StreamServer::stats() const
+{
+	mvlcc_stream_server_stats_t result = {};
+
+	// Not under clientsMutex_, which submit() holds while waiting in BLOCK
+	// mode. Clients are counted as accepted before they can be closed.
+	const uint64_t closed = closed_.load(std::memory_order_acquire);
+	result.accepted = accepted_.load(std::memory_order_acquire);
+	result.clients = result.accepted - closed;
+	result.disconnected = disconnected_.load(std::memory_order_relaxed);
+	result.slow_disconnects = slowDisconnects_.load(std::memory_order_relaxed);
+	result.buffers = submitted_.load(std::memory_order_relaxed);
+	result.sent_buffers = sentBuffers_.load(std::memory_order_relaxed);
+	result.sent_bytes = sentBytes_.load(std::memory_order_relaxed);
+	result.dropped_buffers = droppedBuffers_.load(std::memory_order_relaxed);
+	return result;
+}
+
+void StreamServer::acceptLoop()
+{
+	while (!quit_)
+	{
+		int fd = accept4(listenFd_, nullptr, nullptr, SOCK_CLOEXEC);
+
+		if (fd < 0)
+		{
+			if (quit_)
+				break;
+
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+
+			// Out of descriptors or memory: keep serving the connected clients.
+			spdlog::warn("stream server: accept failed: {}", std::strerror(errno));
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+			continue;
+		}
+
+		auto client = std::make_unique<Client>(options_.clientQueue);
+		client->fd = fd;
+
+		std::lock_guard<std::mutex> guard(clientsMutex_);
+		reapClients();
+		client->id = nextClientId_++;
+		accepted_.fetch_add(1, std::memory_order_release);
+		client->thread = std::thread(&StreamServer::senderLoop, this, std::ref(*client));
+		clients_.emplace_back(std::move(client));
+	}
+}
+
+void StreamServer::senderLoop(Client &client)
+{
+	if (int ec = apply_thread_role(MVLCC_THREAD_WRITER, client.id))
+		spdlog::warn("stream server: could not apply the writer thread config: {}", std::strerror(ec));
+
+	uint8_t header[StreamHeaderBytes];
+
+	// After the connection failed the remaining buffers are just released.
+	while (!client.queue.drained())
+	{
+		// A failed send notices a close only once there is data to send, so
+		// idle connections are checked between waits.
+		auto next = client.queue.pop(IdleCheckInterval);
+
+		if (!next)
+		{
+			if (!client.closing.load(std::memory_order_acquire) && peer_closed(client.fd))
+				disconnect(client);
+			continue;
+		}
+
+		auto buffer = *next;
+
+		if (!client.closing.load(std::memory_order_acquire))
+		{
+			encode_stream_header(buffer->info, client.droppedBuffers.load(std::memory_order_relaxed), header);
+			iovec iov[2] = { { header, sizeof(header) }, { buffer->data.data(), buffer->info.bytes_used } };
+
+			if (send_all(client.fd, iov, 2))
+			{
+				add_shared_counter(sentBuffers_, 1);
+				add_shared_counter(sentBytes_, sizeof(header) + buffer->info.bytes_used);
+			}
+			else
+				disconnect(client);
+		}
+
+		release(buffer);
+	}
+
+	add_shared_counter(disconnected_, 1);
+	client.finished.store(true, std::memory_order_release);
+}
+
+void StreamServer::release(Buffer *buffer)
+{
+	if (buffer->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+		freeBuffers_.push(buffer);
+}
+
+void StreamServer::disconnect(Client &client)
+{
+	if (client.closing.exchange(true, std::memory_order_acq_rel))
+		return;
+
+	closed_.fetch_add(1, std::memory_order_release);
+	// Wakes up a sender blocked in sendmsg().
+	shutdown(client.fd, SHUT_RDWR);
+	client.queue.close();
+}
+
+void StreamServer::reapClients()
+{
+	auto it = std::begin(clients_);
+
+	while (it != std::end(clients_))
+	{
+		auto &client = *it;
+
+		if (client->finished.load(std::memory_order_acquire))
+		{
+			client->thread.join();
+			close(client->fd);
+			it = clients_.erase(it);
+		}
+		else
+			++it;
+	}
+}
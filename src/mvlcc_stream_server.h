@@ -0,0 +1,139 @@
+#pragma once
+
+// Serves readout buffers to any number of subscribers over TCP or a Unix
+// stream socket.
+//
+// The readout fills buffers from the server's pool in place (see ParserPool).
+// Each submitted buffer is queued to every connected client, and each client's
+// sender thread writes it with one sendmsg() per buffer, frame header and data
+// as separate iovecs, so the data is not copied again. A buffer returns to the
+// pool once all clients it was queued to have sent it. While its queue is
+// empty, a sender polls its connection for a close by the peer.
+//
+// Each client has a bounded queue. If it is full when a buffer is submitted,
+// the client is disconnected or the backpressure policy applies, by default
+// the buffer is dropped for that client.
+//
+// Wire format per buffer: a StreamHeaderBytes frame header (see
+// encode_stream_header()), followed by bytes_used bytes of readout data.
+
+#include <mvlcc_wrap.h>
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "mvlcc_alloc.h"
+#include "mvlcc_backpressure.h"
+#include "mvlcc_counters.h"
+#include "mvlcc_queue.h"
+
+static const size_t StreamHeaderBytes = MVLCC_STREAM_HEADER_BYTES;
+
+// Little-endian: u32 magic "MVLS", u16 version, u16 header bytes, u64
+// buffer_number, u64 bytes_used, i32 data_format, u32 flags, i32 crate_index,
+// i32 connection_type, u64 monotonic_ns, tai_ns, packets, lost_packets,
+// dropped_bytes and the number of buffers dropped for the receiving client.
+void encode_stream_header(const mvlcc_readout_info_t &info, uint64_t droppedBuffers, uint8_t *dest);
+// Returns false on a wrong magic or version.
+bool decode_stream_header(const uint8_t *src, mvlcc_readout_info_t &info, uint64_t &droppedBuffers);
+
+struct StreamServerOptions
+{
+	size_t bufferCount = 16;
+	size_t bufferBytes = 1u << 20;
+	size_t clientQueue = 8;
+	int slowClientPolicy = MVLCC_STREAM_DROP;
+};
+
+class StreamServer
+{
+	public:
+		// address: "tcp://host:port" (empty host: any address, port 0: any
+		// port) or "unix:path". Throws std::system_error or
+		// std::invalid_argument.
+		StreamServer(const std::string &address, const StreamServerOptions &options);
+		// Disconnects all clients, buffers still queued are not sent.
+		~StreamServer();
+
+		StreamServer(const StreamServer &) = delete;
+		StreamServer &operator=(const StreamServer &) = delete;
+
+		size_t bufferBytes() const { return options_.bufferBytes; }
+		// Bound TCP port, 0 for Unix sockets.
+		int port() const { return port_; }
+
+		// Returns a free buffer of bufferBytes() or nullptr on timeout.
+		uint8_t *acquire(std::chrono::milliseconds timeout);
+		// Queues the buffer to all connected clients. Buffers without data are
+		// recycled. Throws std::invalid_argument for foreign buffers.
+		void submit(uint8_t *buffer, const mvlcc_readout_info_t &info);
+
+		mvlcc_stream_server_stats_t stats() const;
+
+		// Thread-safe.
+		void setBackpressure(const mvlcc_backpressure_t &policy) { backpressure_.setPolicy(policy); }
+		mvlcc_backpressure_stats_t backpressureStats() const { return backpressure_.stats(); }
+
+	private:
+		struct Buffer
+		{
+			BufferMemory data;
+			mvlcc_readout_info_t info = {};
+			std::atomic<unsigned> refs = 0;
+		};
+
+		struct Client
+		{
+			explicit Client(size_t queueCapacity)
+				: queue(queueCapacity)
+			{}
+
+			unsigned id = 0;
+			int fd = -1;
+			BoundedQueue<Buffer *> queue;
+			std::thread thread;
+			// Set on disconnect, the sender then only releases its buffers.
+			std::atomic<bool> closing = false;
+			std::atomic<bool> finished = false;
+			// Written by the submitting thread, sent in the frame headers.
+			std::atomic<uint64_t> droppedBuffers = 0;
+		};
+
+		void acceptLoop();
+		void senderLoop(Client &client);
+		void release(Buffer *buffer);
+		// Shuts the connection down and closes the queue, once. Thread-safe.
+		void disconnect(Client &client);
+		// Joins finished clients. Expects clientsMutex_ to be held.
+		void reapClients();
+
+		StreamServerOptions options_;
+		std::string unixPath_;
+		int listenFd_ = -1;
+		int port_ = 0;
+		std::vector<std::unique_ptr<Buffer>> buffers_;
+		Buffer scratch_;
+		BoundedQueue<Buffer *> freeBuffers_;
+		Backpressure backpressure_{MVLCC_BACKPRESSURE_DROP_NEWEST};
+		std::thread acceptThread_;
+		std::atomic<bool> quit_ = false;
+
+		mutable std::mutex clientsMutex_;
+		std::vector<std::unique_ptr<Client>> clients_;
+		unsigned nextClientId_ = 0;
+
+		// Updated from the submitting thread (add_counter()) and from the
+		// sender threads (add_shared_counter()).
+		std::atomic<uint64_t> accepted_ = 0;
+		std::atomic<uint64_t> closed_ = 0;
+		std::atomic<uint64_t> disconnected_ = 0;
+		std::atomic<uint64_t> slowDisconnects_ = 0;
+		std::atomic<uint64_t> submitted_ = 0;
+		std::atomic<uint64_t> sentBuffers_ = 0;
+		std::atomic<uint64_t> sentBytes_ = 0;
+		std::atomic<uint64_t> droppedBuffers_ = 0;
+};
@@ -0,0 +1,286 @@
+#include "mvlcc_threads.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <tuple>
+
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace
+{
+
+struct RoleConfig
+{
+	bool setAffinity = false;
+	cpu_set_t cpus;
+	int fifoPriority = 0;
+	std::string name;
+};
+
+const char *default_thread_name(mvlcc_thread_role_t role)
+{
+	switch (role)
+	{
+		case MVLCC_THREAD_READOUT: return "mvlcc-readout";
+		case MVLCC_THREAD_PARSER: return "mvlcc-parser";
+		case MVLCC_THREAD_WRITER: return "mvlcc-writer";
+		case MVLCC_THREAD_ROLE_COUNT: break;
+	}
+
+	return "mvlcc";
+}
+
+struct ThreadEntry
+{
+	mvlcc_thread_role_t role;
+	pid_t tid;
+	pthread_t handle;
+	std::string name;
+};
+
+struct ThreadRegistry
+{
+	std::mutex mutex;
+	std::array<RoleConfig, MVLCC_THREAD_ROLE_COUNT> roles;
+	std::vector<ThreadEntry> threads;
+};
+
+ThreadRegistry &registry()
+{
+	static ThreadRegistry instance;
+	return instance;
+}
+
+pid_t current_tid()
+{
+	return static_cast<pid_t>(syscall(SYS_gettid));
+}
+
+// Removes the thread from the registry when it exits.
+struct Registration
+{
+	bool registered = false;
+
+	~Registration()
+	{
+		if (!registered)
+			return;
+
+		auto &reg = registry();
+		std::lock_guard<std::mutex> guard(reg.mutex);
+		const pid_t tid = current_tid();
+		reg.threads.erase(std::remove_if(std::begin(reg.threads), std::end(reg.threads),
+			[tid] (const ThreadEntry &e) { return e.tid == tid; }), std::end(reg.threads));
+	}
+};
+
+thread_local Registration t_registration;
+
+// Voluntary and involuntary context switches from /proc.
+std::pair<uint64_t, uint64_t> context_switches(pid_t tid)
+{
+	std::ifstream in("/proc/self/task/" + std::to_string(tid) + "/status");
+	std::string line;
+	uint64_t voluntary = 0, involuntary = 0;
+
+	while (std::getline(in, line))
+	{
+		std::istringstream ls(line);
+		std::string key;
+		ls >> key;
+
+		if (key == "voluntary_ctxt_switches:")
+			ls >> voluntary;
+		else if (key == "nonvoluntary_ctxt_switches:")
+			ls >> involuntary;
+	}
+
+	return { voluntary, involuntary };
+}
+
+int last_cpu(pid_t tid)
+{
+	std::ifstream in("/proc/self/task/" + std::to_string(tid) + "/stat");
+	std::string stat;
+	std::getline(in, stat);
+
+	// The command name in field 2 may contain spaces, count from its end.
+	auto pos = stat.rfind(')');
+
+	if (pos == std::string::npos)
+		return -1;
+
+	std::istringstream fields(stat.substr(pos + 1));
+	std::string field;
+
+	// Fields 3 (state) to 39 (processor).
+	for (int fi = 3; fi <= 39; ++fi)
+	{
+		if (!(fields >> field))
+			return -1;
+	}
+
+	return std::atoi(field.c_str());
+}
+
+}
+
+bool parse_cpu_list(const std::string &str, cpu_set_t &cpus)
+{
+	CPU_ZERO(&cpus);
+	std::istringstream in(str);
+	std::string range;
+	bool any = false;
+
+	while (std::getline(in, range, ','))
+	{
+		char *end = nullptr;
+		const long first = std::strtol(range.c_str(), &end, 10);
+		long last = first;
+
+		if (end == range.c_str())
+			return false;
+
+		if (*end == '-')
+		{
+			const char *lastStr = end + 1;
+			last = std::strtol(lastStr, &end, 10);
+
+			if (end == lastStr)
+				return false;
+		}
+
+		if (*end != '\0' || first < 0 || last < first || last >= CPU_SETSIZE)
+			return false;
+
+		for (long cpu = first; cpu <= last; ++cpu)
+			CPU_SET(cpu, &cpus);
+
+		any = true;
+	}
+
+	return any;
+}
+
+void set_thread_role_config(mvlcc_thread_role_t role, const mvlcc_thread_config_t &config)
+{
+	if (role < 0 || role >= MVLCC_THREAD_ROLE_COUNT)
+		throw std::invalid_argument("invalid thread role");
+
+	RoleConfig rc;
+
+	if (config.cpus && *config.cpus)
+	{
+		if (!parse_cpu_list(config.cpus, rc.cpus))
+			throw std::invalid_argument(std::string("invalid CPU list: ") + config.cpus);
+		rc.setAffinity = true;
+	}
+
+	if (config.fifo_priority < 0 || config.fifo_priority > 99)
+		throw std::invalid_argument("SCHED_FIFO priority must be in 0-99");
+
+	rc.fifoPriority = config.fifo_priority;
+
+	if (config.name)
+	{
+		// The kernel limit, excluding the terminating zero.
+		if (std::strlen(config.name) > 15)
+			throw std::invalid_argument("thread name longer than 15 characters");
+		rc.name = config.name;
+	}
+
+	auto &reg = registry();
+	std::lock_guard<std::mutex> guard(reg.mutex);
+	reg.roles[role] = rc;
+}
+
+int apply_thread_role(mvlcc_thread_role_t role, int index)
+{
+	auto &reg = registry();
+	RoleConfig rc;
+
+	{
+		std::lock_guard<std::mutex> guard(reg.mutex);
+		rc = reg.roles[role];
+	}
+
+	int result = 0;
+	const auto self = pthread_self();
+
+	if (rc.setAffinity)
+	{
+		if (int ec = pthread_setaffinity_np(self, sizeof(rc.cpus), &rc.cpus))
+			result = result ? result : ec;
+	}
+
+	if (rc.fifoPriority > 0)
+	{
+		struct sched_param param = {};
+		param.sched_priority = rc.fifoPriority;
+
+		if (int ec = pthread_setschedparam(self, SCHED_FIFO, &param))
+			result = result ? result : ec;
+	}
+
+	std::string name = rc.name.empty() ? default_thread_name(role) : rc.name;
+
+	if (index >= 0)
+		name += "-" + std::to_string(index);
+
+	name.resize(std::min<size_t>(name.size(), 15));
+	pthread_setname_np(self, name.c_str());
+
+	{
+		std::lock_guard<std::mutex> guard(reg.mutex);
+		const pid_t tid = current_tid();
+		auto it = std::find_if(std::begin(reg.threads), std::end(reg.threads),
+			[tid] (const ThreadEntry &e) { return e.tid == tid; });
+
+		if (it == std::end(reg.threads))
+			reg.threads.push_back({ role, tid, self, name });
+		else
+			*it = { role, tid, self, name };
+
+		t_registration.registered = true;
+	}
+
+	return result;
+}
+
+std::vector<mvlcc_thread_stats_t> thread_stats()
+{
+	auto &reg = registry();
+	std::lock_guard<std::mutex> guard(reg.mutex);
+	std::vector<mvlcc_thread_stats_t> result;
+
+	// Entries are removed under the lock before their threads exit, so the
+	// handles are valid here.
+	for (const auto &entry: reg.threads)
+	{
+		mvlcc_thread_stats_t stats = {};
+		stats.role = entry.role;
+		stats.tid = entry.tid;
+		std::strncpy(stats.name, entry.name.c_str(), sizeof(stats.name) - 1);
+		stats.cpu = last_cpu(entry.tid);
+
+		clockid_t clock;
+		struct timespec ts;
+
+		if (pthread_getcpuclockid(entry.handle, &clock) == 0 && clock_gettime(clock, &ts) == 0)
+			stats.cpu_ns = static_cast<uint64_t>(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+
+		std::tie(stats.voluntary_switches, stats.involuntary_switches) = context_switches(entry.tid);
+		result.push_back(stats);
+	}
+
+	return result;
+}
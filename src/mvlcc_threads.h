@@ -0,0 +1,30 @@
+#pragma once
+
+// Per role CPU affinity, real-time priority and names of the threads doing
+// readout work, and CPU time and context switch counts of these threads.
+//
+// Library threads apply their role configuration when they start. The
+// readout runs on threads owned by the caller, they opt in with
+// mvlcc_thread_apply_config(). Threads that applied a role are listed by
+// thread_stats() until they exit.
+
+#include <mvlcc_wrap.h>
+
+#include <sched.h>
+#include <string>
+#include <vector>
+
+// Parses a CPU list like "0-3,8". Returns false for invalid lists and CPU
+// numbers beyond CPU_SETSIZE.
+bool parse_cpu_list(const std::string &str, cpu_set_t &cpus);
+
+// Throws std::invalid_argument for invalid settings. Affects threads applying
+// the role afterwards. Thread-safe.
+void set_thread_role_config(mvlcc_thread_role_t role, const mvlcc_thread_config_t &config);
+
+// Applies the configuration of role to the calling thread and registers it.
+// index >= 0 is appended to the thread name. Returns 0 or the errno value of
+// the first failing step, the remaining steps are still done.
+int apply_thread_role(mvlcc_thread_role_t role, int index = -1);
+
+std::vector<mvlcc_thread_stats_t> thread_stats();
@@ -0,0 +1,75 @@
+#pragma once
+
+// FIFO lock for serializing command pipe access of threads sharing one
+// mvlcc_t. Threads are served in arrival order, so a slow-control thread
+// polling status cannot starve or be starved by another command issuer.
+// Waiters spin briefly, then sleep on a futex on the serving counter: holders
+// do network or USB round trips taking up to milliseconds, so the sleeping
+// path is the common one under contention. unlock() wakes all sleepers, only
+// the one holding the next ticket proceeds. Fine for the handful of threads
+// sharing a controller.
+//
+// Satisfies BasicLockable, use with std::lock_guard.
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+class TicketLock
+{
+	public:
+		void lock()
+		{
+			const uint32_t ticket = next_.fetch_add(1, std::memory_order_relaxed);
+
+			for (unsigned spins = 0; spins < SpinLimit; ++spins)
+			{
+				if (serving_.load(std::memory_order_acquire) == ticket)
+					return;
+				cpu_relax();
+			}
+
+			// seq_cst pairs with unlock(): either it sees the waiter or the
+			// waiter sees the new serving value, the futex wait then returns
+			// immediately.
+			waiters_.fetch_add(1, std::memory_order_seq_cst);
+
+			for (uint32_t serving; (serving = serving_.load(std::memory_order_seq_cst)) != ticket;)
+				futex(FUTEX_WAIT_PRIVATE, serving);
+
+			waiters_.fetch_sub(1, std::memory_order_relaxed);
+		}
+
+		void unlock()
+		{
+			serving_.store(serving_.load(std::memory_order_relaxed) + 1, std::memory_order_seq_cst);
+
+			if (waiters_.load(std::memory_order_seq_cst))
+				futex(FUTEX_WAKE_PRIVATE, INT_MAX);
+		}
+
+	private:
+		static const unsigned SpinLimit = 64;
+
+		static void cpu_relax()
+		{
+#if defined(__x86_64__) || defined(__i386__)
+			__builtin_ia32_pause();
+#elif defined(__aarch64__)
+			asm volatile("yield");
+#endif
+		}
+
+		void futex(int op, uint32_t value)
+		{
+			syscall(SYS_futex, reinterpret_cast<uint32_t *>(&serving_), op, value, nullptr, nullptr, 0);
+		}
+
+		std::atomic<uint32_t> next_ = 0;
+		std::atomic<uint32_t> serving_ = 0;
+		std::atomic<uint32_t> waiters_ = 0;
+};
@@ -0,0 +1,205 @@
+#include "mvlcc_timing.h"
+
+#include <algorithm>
+
+using namespace mesytec::mvlc;
+
+// Defaults are rough values measured with mesytec modules on an MVLC. Use
+// them for relative comparisons and capacity planning, not as exact numbers.
+BusTimingModel default_bus_timing_model()
+{
+	BusTimingModel model = {};
+	model.single_cycle_ns[MVLCC_TIMING_A16][MVLCC_TIMING_D16] = 350.0;
+	model.single_cycle_ns[MVLCC_TIMING_A16][MVLCC_TIMING_D32] = 400.0;
+	model.single_cycle_ns[MVLCC_TIMING_A24][MVLCC_TIMING_D16] = 375.0;
+	model.single_cycle_ns[MVLCC_TIMING_A24][MVLCC_TIMING_D32] = 425.0;
+	model.single_cycle_ns[MVLCC_TIMING_A32][MVLCC_TIMING_D16] = 400.0;
+	model.single_cycle_ns[MVLCC_TIMING_A32][MVLCC_TIMING_D32] = 450.0;
+	model.block_setup_ns = 400.0;
+	model.blt_word_ns = 80.0;
+	model.mblt_word_ns = 100.0;
+	model.esst_word_ns = 40.0;
+	model.wait_clock_ns = 25.0;
+	model.command_overhead_ns = 25.0;
+	model.stack_overhead_ns = 1000.0;
+	model.link_bytes_per_s = 90.0e6; // USB3 and GbE readout are in this range
+	model.assumed_block_words = 0;
+	return model;
+}
+
+AmodClass classify_amod(uint8_t amod)
+{
+	switch (amod)
+	{
+		case 0x09: case 0x0d: case 0x39: case 0x3d: case 0x29: case 0x2d:
+			return AmodClass::Single;
+		case 0x0b: case 0x0f: case 0x3b: case 0x3f:
+			return AmodClass::BLT;
+		case 0x08: case 0x0c: case 0x38: case 0x3c:
+			return AmodClass::MBLT;
+		case 0x20: case 0x21:
+			return AmodClass::ESST;
+	}
+
+	return AmodClass::Unknown;
+}
+
+static int address_class(uint8_t amod)
+{
+	switch (amod)
+	{
+		case 0x29: case 0x2d:
+			return MVLCC_TIMING_A16;
+		case 0x39: case 0x3d:
+			return MVLCC_TIMING_A24;
+	}
+
+	return MVLCC_TIMING_A32;
+}
+
+static bool is_read(const StackCommand &cmd)
+{
+	using CT = StackCommand::CommandType;
+	return cmd.type == CT::VMERead || cmd.type == CT::VMEReadSwapped
+		|| cmd.type == CT::VMEReadMem || cmd.type == CT::VMEReadMemSwapped;
+}
+
+uint32_t block_read_max_words(const StackCommand &cmd)
+{
+	switch (classify_amod(cmd.amod))
+	{
+		case AmodClass::BLT:
+			return cmd.transfers;
+		case AmodClass::MBLT:
+		case AmodClass::ESST:
+			return cmd.transfers * 2u;
+		default:
+			break;
+	}
+
+	return 0;
+}
+
+// Number of data words a block read is assumed to transfer per event.
+static uint32_t block_read_words(const BusTimingModel &model, const StackCommand &cmd)
+{
+	auto maxWords = block_read_max_words(cmd);
+
+	if (model.assumed_block_words)
+		return std::min(maxWords, model.assumed_block_words);
+
+	return maxWords;
+}
+
+double estimate_command_ns(const BusTimingModel &model, const StackCommand &cmd)
+{
+	using CT = StackCommand::CommandType;
+
+	if (is_read(cmd) || cmd.type == CT::VMEWrite)
+	{
+		auto words = block_read_words(model, cmd);
+
+		switch (classify_amod(cmd.amod))
+		{
+			case AmodClass::BLT:
+				return model.block_setup_ns + words * model.blt_word_ns;
+			case AmodClass::MBLT:
+				return model.block_setup_ns + (words + 1) / 2 * model.mblt_word_ns;
+			case AmodClass::ESST:
+				return model.block_setup_ns + (words + 1) / 2 * model.esst_word_ns;
+			default:
+				break;
+		}
+
+		auto dw = cmd.dataWidth == VMEDataWidth::D16 ? MVLCC_TIMING_D16 : MVLCC_TIMING_D32;
+		return model.single_cycle_ns[address_class(cmd.amod)][dw];
+	}
+
+	switch (cmd.type)
+	{
+		case CT::Wait:
+			return cmd.value * model.wait_clock_ns;
+		case CT::SoftwareDelay: // not executed by the MVLC
+		case CT::StackStart:
+		case CT::StackEnd:
+		case CT::Invalid:
+			return 0.0;
+		default:
+			break;
+	}
+
+	return model.command_overhead_ns;
+}
+
+size_t estimate_command_output_words(const BusTimingModel &model, const StackCommand &cmd)
+{
+	using CT = StackCommand::CommandType;
+
+	if (is_read(cmd))
+	{
+		if (classify_amod(cmd.amod) == AmodClass::Single)
+			return 1;
+
+		// Block frame headers, one per maximum frame length.
+		auto words = block_read_words(model, cmd);
+		return words + 1 + words / frame_headers::LengthMask;
+	}
+
+	if (cmd.type == CT::WriteMarker || cmd.type == CT::WriteSpecial)
+		return 1;
+
+	return 0;
+}
+
+double estimate_stack_ns(const BusTimingModel &model, const StackCommandBuilder &stack)
+{
+	double result = 0.0;
+
+	for (const auto &group: stack.getGroups())
+		for (const auto &cmd: group.commands)
+			result += estimate_command_ns(model, cmd);
+
+	return result;
+}
+
+StackEstimate estimate_stack(const BusTimingModel &model, const StackCommandBuilder &stack)
+{
+	StackEstimate result = {};
+	size_t outputWords = 1; // stack frame header
+	size_t cmdIndex = 0;
+
+	for (const auto &group: stack.getGroups())
+	{
+		for (const auto &cmd: group.commands)
+		{
+			auto ns = estimate_command_ns(model, cmd);
+			result.busTimeNs += ns;
+			outputWords += estimate_command_output_words(model, cmd);
+
+			if (ns > result.bottleneckNs)
+			{
+				result.bottleneckNs = ns;
+				result.bottleneckIndex = cmdIndex;
+				result.bottleneck = cmd;
+			}
+
+			++cmdIndex;
+		}
+	}
+
+	// Stack frames are limited in length, larger events get continuation frames.
+	outputWords += outputWords / frame_headers::LengthMask;
+
+	result.bytesPerEvent = outputWords * sizeof(u32);
+	result.stackMemoryWords = make_stack_buffer(stack).size();
+
+	const double busRate = 1e9 / (model.stack_overhead_ns + result.busTimeNs);
+	const double linkRate = model.link_bytes_per_s > 0.0
+		? model.link_bytes_per_s / result.bytesPerEvent
+		: busRate;
+
+	result.linkLimited = linkRate < busRate;
+	result.maxTriggerRateHz = std::min(busRate, linkRate);
+
+	return result;
+}
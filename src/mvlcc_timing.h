@@ -0,0 +1,50 @@
+#pragma once
+
+// Simple VME bus timing model used to estimate stack execution times, event
+// sizes and achievable trigger rates. The model parameters are the public
+// mvlcc_timing_model_t struct.
+
+#include <mvlcc_wrap.h>
+#include <mesytec-mvlc/mesytec-mvlc.h>
+
+using BusTimingModel = mvlcc_timing_model_t;
+
+BusTimingModel default_bus_timing_model();
+
+enum class AmodClass
+{
+	Unknown,
+	Single,
+	BLT,
+	MBLT,
+	ESST,
+};
+
+AmodClass classify_amod(uint8_t amod);
+
+// Number of 32-bit data words transferred by a block read command when it
+// reads its maximum number of transfers.
+uint32_t block_read_max_words(const mesytec::mvlc::StackCommand &cmd);
+
+// Estimated execution time of a single stack command.
+double estimate_command_ns(const BusTimingModel &model, const mesytec::mvlc::StackCommand &cmd);
+
+// Number of 32-bit words the command adds to the stack output, including
+// block read frame headers.
+size_t estimate_command_output_words(const BusTimingModel &model, const mesytec::mvlc::StackCommand &cmd);
+
+double estimate_stack_ns(const BusTimingModel &model, const mesytec::mvlc::StackCommandBuilder &stack);
+
+struct StackEstimate
+{
+	double busTimeNs;			// excluding the per execution overhead
+	size_t bytesPerEvent;
+	size_t stackMemoryWords;
+	double maxTriggerRateHz;
+	bool linkLimited;
+	size_t bottleneckIndex;		// flat command index as in getCommands()
+	double bottleneckNs;
+	mesytec::mvlc::StackCommand bottleneck;
+};
+
+StackEstimate estimate_stack(const BusTimingModel &model, const mesytec::mvlc::StackCommandBuilder &stack);
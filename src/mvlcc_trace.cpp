@@ -0,0 +1,156 @@
+#include "mvlcc_trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <vector>
+
+std::atomic<bool> trace_ring_enabled = false;
+
+namespace
+{
+
+// Fields are atomics so that dumping from another thread is not a data race.
+struct TraceRecord
+{
+	std::atomic<uint64_t> timestampNs;
+	std::atomic<uint64_t> arg;
+	std::atomic<uint16_t> eventAndPhase;
+};
+
+struct TraceRing
+{
+	explicit TraceRing(size_t capacity, uint64_t generation_)
+		: records(capacity)
+		, generation(generation_)
+		, tid(syscall(SYS_gettid))
+	{}
+
+	std::vector<TraceRecord> records;
+	std::atomic<uint64_t> head = 0; // total number of records written
+	const uint64_t generation;
+	const long tid;
+};
+
+struct TraceRegistry
+{
+	std::mutex mutex;
+	std::vector<std::shared_ptr<TraceRing>> rings;
+	size_t recordsPerThread = 0;
+	std::atomic<uint64_t> generation = 0;
+};
+
+TraceRegistry &get_registry()
+{
+	static TraceRegistry registry;
+	return registry;
+}
+
+thread_local std::shared_ptr<TraceRing> localRing;
+
+TraceRing *get_local_ring()
+{
+	auto &registry = get_registry();
+
+	if (localRing && localRing->generation == registry.generation.load(std::memory_order_relaxed))
+		return localRing.get();
+
+	std::lock_guard<std::mutex> guard(registry.mutex);
+
+	if (!registry.recordsPerThread)
+		return nullptr;
+
+	localRing = std::make_shared<TraceRing>(registry.recordsPerThread, registry.generation.load());
+	registry.rings.push_back(localRing);
+	return localRing.get();
+}
+
+uint64_t now_ns()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+}
+
+const char *trace_event_name(TraceEvent event)
+{
+	switch (event)
+	{
+		case TraceEvent::readout: return "readout";
+		case TraceEvent::parse_buffer: return "parse_buffer";
+		case TraceEvent::run_command: return "run_command";
+		case TraceEvent::vme_block_read: return "vme_block_read";
+		case TraceEvent::event_callback: return "event_callback";
+		case TraceEvent::Count: break;
+	}
+
+	return "unknown";
+}
+
+void trace_ring_record(TraceEvent event, TracePhase phase, uint64_t arg)
+{
+	auto ring = get_local_ring();
+
+	if (!ring)
+		return;
+
+	const uint64_t head = ring->head.load(std::memory_order_relaxed);
+	auto &record = ring->records[head % ring->records.size()];
+	record.timestampNs.store(now_ns(), std::memory_order_relaxed);
+	record.arg.store(arg, std::memory_order_relaxed);
+	record.eventAndPhase.store((static_cast<uint16_t>(event) << 8) | static_cast<uint16_t>(phase),
+		std::memory_order_relaxed);
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+void trace_ring_enable(size_t recordsPerThread)
+{
+	auto &registry = get_registry();
+	std::lock_guard<std::mutex> guard(registry.mutex);
+
+	// Disabling keeps the rings for dumping. Enabling discards them, threads
+	// switch to a new ring on their next event.
+	if (recordsPerThread)
+		registry.rings.clear();
+
+	registry.recordsPerThread = recordsPerThread;
+	++registry.generation;
+	trace_ring_enabled = recordsPerThread > 0;
+}
+
+void trace_ring_dump(FILE *out)
+{
+	auto &registry = get_registry();
+	std::vector<std::shared_ptr<TraceRing>> rings;
+
+	{
+		std::lock_guard<std::mutex> guard(registry.mutex);
+		rings = registry.rings;
+	}
+
+	for (const auto &ring: rings)
+	{
+		const uint64_t head = ring->head.load(std::memory_order_acquire);
+		const uint64_t count = std::min<uint64_t>(head, ring->records.size());
+
+		fprintf(out, "thread %ld: %lu records (%lu total)\n", ring->tid,
+			static_cast<unsigned long>(count), static_cast<unsigned long>(head));
+
+		for (uint64_t i = head - count; i < head; ++i)
+		{
+			const auto &record = ring->records[i % ring->records.size()];
+			const uint16_t eventAndPhase = record.eventAndPhase.load(std::memory_order_relaxed);
+			const auto phase = static_cast<TracePhase>(eventAndPhase & 0xff);
+
+			fprintf(out, "  %lu %s_%s %lu\n",
+				static_cast<unsigned long>(record.timestampNs.load(std::memory_order_relaxed)),
+				trace_event_name(static_cast<TraceEvent>(eventAndPhase >> 8)),
+				phase == TracePhase::Entry ? "entry" : "exit",
+				static_cast<unsigned long>(record.arg.load(std::memory_order_relaxed)));
+		}
+	}
+}
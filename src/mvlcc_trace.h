@@ -0,0 +1,76 @@
+#pragma once
+
+// Hot path tracing.
+//
+// Static tracepoints: building with 'make USDT=1' defines MVLCC_USDT and
+// places USDT probes (provider "mvlcc", needs <sys/sdt.h> from the systemtap
+// sdt headers) at the entry and exit of the traced calls. An unattached probe
+// is a single nop. Probe names are <event>_entry and <event>_exit, e.g.
+//
+//   bpftrace -e 'usdt:./mvlcc_mini_daq:mvlcc:readout_exit { @bytes = hist(arg0); }'
+//   perf probe -x ./mvlcc_mini_daq sdt_mvlcc:run_command_exit
+//
+// Trace ring: independent of the probes, mvlcc_trace_enable() makes every
+// thread record the same entry/exit events into its own fixed size ring of
+// binary records. Recording is a relaxed atomic load when disabled.
+// mvlcc_trace_dump() writes the rings of all threads.
+
+#include <mvlcc_wrap.h>
+
+#include <atomic>
+
+#ifdef MVLCC_USDT
+#include <sys/sdt.h>
+#define MVLCC_PROBE(name, arg) DTRACE_PROBE1(mvlcc, name, arg)
+#else
+#define MVLCC_PROBE(name, arg) do {} while (0)
+#endif
+
+// Enumerator names match the probe names.
+enum class TraceEvent: uint8_t
+{
+	readout,
+	parse_buffer,
+	run_command,
+	vme_block_read,
+	event_callback,
+	Count
+};
+
+enum class TracePhase: uint8_t
+{
+	Entry,
+	Exit,
+};
+
+const char *trace_event_name(TraceEvent event);
+
+extern std::atomic<bool> trace_ring_enabled;
+
+void trace_ring_record(TraceEvent event, TracePhase phase, uint64_t arg);
+
+inline void trace_record(TraceEvent event, TracePhase phase, uint64_t arg)
+{
+	if (trace_ring_enabled.load(std::memory_order_relaxed))
+		trace_ring_record(event, phase, arg);
+}
+
+// 0 disables recording. Rings are (re)allocated lazily by each thread on its
+// next recorded event.
+void trace_ring_enable(size_t recordsPerThread);
+
+// Best effort while other threads are recording: records overwritten during
+// the dump may show up with mixed fields.
+void trace_ring_dump(FILE *out);
+
+#define MVLCC_TRACE_ENTRY(name, arg) \
+	do { \
+		MVLCC_PROBE(name##_entry, arg); \
+		trace_record(TraceEvent::name, TracePhase::Entry, arg); \
+	} while (0)
+
+#define MVLCC_TRACE_EXIT(name, arg) \
+	do { \
+		MVLCC_PROBE(name##_exit, arg); \
+		trace_record(TraceEvent::name, TracePhase::Exit, arg); \
+	} while (0)
@@ -1,7 +1,29 @@
 #include <mvlcc_wrap.h>
 
 #include <mesytec-mvlc/mesytec-mvlc.h>
+#include <array>
+#include <unordered_map>
 #include <string.h>
+#include <time.h>
+
+#include "mvlcc_alloc.h"
+#include "mvlcc_binary.h"
+#include "mvlcc_cache.h"
+#include "mvlcc_command_log.h"
+#include "mvlcc_eth_batch.h"
+#include "mvlcc_eth_emulator.h"
+#include "mvlcc_frame_aligner.h"
+#include "mvlcc_parser_pool.h"
+#include "mvlcc_readout_stats.h"
+#include "mvlcc_shm_ring.h"
+#include "mvlcc_sim.h"
+#include "mvlcc_socket_stats.h"
+#include "mvlcc_stack_optimizer.h"
+#include "mvlcc_stream_server.h"
+#include "mvlcc_threads.h"
+#include "mvlcc_ticket_lock.h"
+#include "mvlcc_timing.h"
+#include "mvlcc_trace.h"
 
 using namespace mesytec::mvlc;
 
@@ -15,7 +37,20 @@ struct mvlcc
 	mesytec::mvlc::MVLC mvlc;
 	mesytec::mvlc::eth::MVLC_ETH_Interface *ethernet;
 	mesytec::mvlc::usb::MVLC_USB_Interface *usb;
-	std::vector<u32> bltWorkBuffer;
+	// Serializes the command pipe calls and the connection and applied config
+	// state below. The readout (data pipe) does not take this lock.
+	TicketLock cmdLock;
+	// Config last applied by mvlcc_init_readout2() or mvlcc_init_readout_diff().
+	// Reset on (re)connect as the controller state is unknown afterwards.
+	std::unique_ptr<mesytec::mvlc::CrateConfig> appliedConfig;
+	// Set for simulated controllers. The MVLC object is left invalid in this
+	// case and all operations are forwarded to the simulator instead.
+	std::shared_ptr<SimCrate> sim;
+	// Recent mvlcc_run_command() and mvlcc_vme_block_read() calls.
+	CommandLog commandLog;
+	// Data pipe counts of batched receive, shared by the readout contexts.
+	// mesytec-mvlc's pipe stats do not see these packets.
+	std::shared_ptr<EthBatchCounters> ethBatchCounters = std::make_shared<EthBatchCounters>();
 };
 
 int readout_eth(eth::MVLC_ETH_Interface *a_eth, uint8_t *a_buffer,
@@ -55,9 +90,25 @@ mvlcc_make_mvlc_from_crate_config(const char *configname)
 	return m;
 }
 
+static const char *SimUrlScheme = "sim://";
+static mvlcc_t make_mvlcc_sim_from_url(const std::string &spec);
+
+static mvlcc_t make_mvlcc_sim(const CrateConfig &crateConfig, const SimParams &params)
+{
+	auto ret = std::make_unique<mvlcc>();
+	ret->ethernet = nullptr;
+	ret->usb = nullptr;
+	ret->config = crateConfig;
+	ret->sim = std::make_shared<SimCrate>(crateConfig, params);
+	return ret.release();
+}
+
 mvlcc_t
 mvlcc_make_mvlc(const char *urlstr)
 {
+	if (strncmp(urlstr, SimUrlScheme, strlen(SimUrlScheme)) == 0)
+		return make_mvlcc_sim_from_url(urlstr + strlen(SimUrlScheme));
+
 	return make_mvlcc(make_mvlc(urlstr));
 }
 
@@ -100,22 +151,39 @@ mvlcc_connect(mvlcc_t a_mvlc)
 {
 	int rc;
 	auto m = static_cast<struct mvlcc *>(a_mvlc);
+	std::lock_guard<TicketLock> guard(m->cmdLock);
 
 	/* cancel ongoing readout when connecting */
 	m->mvlc.setDisableTriggersOnConnect(true);
+	m->appliedConfig.reset();
+
+	if (m->sim)
+		return m->sim->connect().value();
 
 	auto ec = m->mvlc.connect();
 	rc = ec.value();
 	return rc;
 }
 
+// Expects cmdLock to be held.
+static std::error_code disable_daq_and_triggers(struct mvlcc *m)
+{
+	if (!m->sim)
+		return disable_daq_mode_and_triggers(m->mvlc);
+
+	auto ec = m->sim->setDaqMode(false);
+	m->sim->disableTriggers();
+	return ec;
+}
+
 int
 mvlcc_stop(mvlcc_t a_mvlc)
 {
 	auto m = static_cast<struct mvlcc *>(a_mvlc);
+	std::lock_guard<TicketLock> guard(m->cmdLock);
 
 	/* perhaps try this a couple of times */
-	auto ec = disable_daq_mode_and_triggers(m->mvlc);
+	auto ec = disable_daq_and_triggers(m);
 	if (ec) {
 		printf("'%s'\n", ec.message().c_str());
 		return 1;
@@ -128,7 +196,12 @@ void
 mvlcc_disconnect(mvlcc_t a_mvlc)
 {
 	auto m = static_cast<struct mvlcc *>(a_mvlc);
-	m->mvlc.disconnect();
+	std::lock_guard<TicketLock> guard(m->cmdLock);
+	if (m->sim)
+		m->sim->disconnect();
+	else
+		m->mvlc.disconnect();
+	m->appliedConfig.reset();
 }
 
 int
@@ -136,6 +209,10 @@ mvlcc_init_readout(mvlcc_t a_mvlc, int)
 {
 	int rc;
 	auto m = static_cast<struct mvlcc *>(a_mvlc);
+	std::lock_guard<TicketLock> guard(m->cmdLock);
+
+	if (m->sim)
+		return m->sim->initReadout(m->config).value();
 
 	assert(m->ethernet);
 
@@ -309,7 +386,9 @@ mvlcc_single_vme_read(mvlcc_t a_mvlc, uint32_t address, uint32_t * value, uint8_
   uint8_t dWidth = mvlcc_data_width_from_arg(dataWidth);
   mesytec::mvlc::VMEDataWidth m_width = static_cast<mesytec::mvlc::VMEDataWidth>(dWidth);
 
-  auto ec = m->mvlc.vmeRead(address, *value, mode, m_width);
+  std::lock_guard<TicketLock> guard(m->cmdLock);
+  auto ec = m->sim ? m->sim->vmeRead(address, *value, mode, m_width)
+    : m->mvlc.vmeRead(address, *value, mode, m_width);
   // auto ec = m->mvlc.vmeRead(address, *m_value, amod, VMEDataWidth::D16);
   rc = ec.value();
   if (rc != 0) {
@@ -333,7 +412,9 @@ mvlcc_single_vme_write(mvlcc_t a_mvlc, uint32_t address, uint32_t value, uint8_t
   uint8_t dWidth = mvlcc_data_width_from_arg(dataWidth);
   mesytec::mvlc::VMEDataWidth m_width = static_cast<mesytec::mvlc::VMEDataWidth>(dWidth);
 
-  auto ec = m->mvlc.vmeWrite(address, value, mode, m_width);
+  std::lock_guard<TicketLock> guard(m->cmdLock);
+  auto ec = m->sim ? m->sim->vmeWrite(address, value, mode, m_width)
+    : m->mvlc.vmeWrite(address, value, mode, m_width);
   rc = ec.value();
   if (rc != 0) {
     printf("Failure in vmeWrite %d\n", rc);
@@ -346,58 +427,124 @@ mvlcc_single_vme_write(mvlcc_t a_mvlc, uint32_t address, uint32_t value, uint8_t
 int mvlcc_register_read(mvlcc_t a_mvlc, uint16_t address, uint32_t *value)
 {
 	auto m = static_cast<struct mvlcc *>(a_mvlc);
-	auto ec = m->mvlc.readRegister(address, *value);
+	std::lock_guard<TicketLock> guard(m->cmdLock);
+	auto ec = m->sim ? m->sim->readRegister(address, *value) : m->mvlc.readRegister(address, *value);
 	return ec.value();
 }
 
 int mvlcc_register_write(mvlcc_t a_mvlc, uint16_t address, uint32_t value)
 {
 	auto m = static_cast<struct mvlcc *>(a_mvlc);
-	auto ec = m->mvlc.writeRegister(address, value);
+	std::lock_guard<TicketLock> guard(m->cmdLock);
+	auto ec = m->sim ? m->sim->writeRegister(address, value) : m->mvlc.writeRegister(address, value);
 	return ec.value();
 }
 
-static char error_messages[static_cast<size_t>(mesytec::mvlc::MVLCErrorCode::ErrorCodeMax)][256];
+namespace
+{
 
-const char *mvlcc_strerror(int errnum)
+// Messages of all MVLC error codes and of the system errno values, built when
+// the library is loaded. Lookups are lock-free and do not allocate.
+class ErrorMessageTable
 {
-	if (errnum < static_cast<int>(mesytec::mvlc::MVLCErrorCode::ErrorCodeMax))
-	{
-		if (!error_messages[errnum][0])
+	public:
+		static const int SystemErrorMax = 256;
+
+		ErrorMessageTable()
 		{
-			auto ec = mesytec::mvlc::make_error_code(static_cast<mesytec::mvlc::MVLCErrorCode>(errnum));
-			strncpy(error_messages[errnum], ec.message().c_str(), 255);
+			for (int i = 0; i < MvlcErrorMax; ++i)
+				mvlc_[i] = make_error_code(static_cast<MVLCErrorCode>(i)).message();
+
+			for (int i = 0; i < SystemErrorMax; ++i)
+				system_[i] = std::generic_category().message(i);
 		}
 
-		return error_messages[errnum];
-	}
+		const char *lookup(mvlcc_error_category_t category, int errnum) const
+		{
+			switch (category)
+			{
+				case MVLCC_ERROR_MVLC:
+					if (errnum >= 0 && errnum < MvlcErrorMax)
+						return mvlc_[errnum].c_str();
+					break;
+
+				case MVLCC_ERROR_SYSTEM:
+					if (errnum < 0)
+						errnum = -errnum;
+					if (errnum < SystemErrorMax)
+						return system_[errnum].c_str();
+					break;
+			}
+
+			return "<unknown error>";
+		}
+
+	private:
+		static const int MvlcErrorMax = static_cast<int>(MVLCErrorCode::ErrorCodeMax);
+
+		std::array<std::string, MvlcErrorMax> mvlc_;
+		std::array<std::string, SystemErrorMax> system_;
+};
+
+const ErrorMessageTable ErrorMessages;
+
+}
+
+const char *mvlcc_strerror(int errnum)
+{
+	// -1 is the generic failure code of this library, not -EPERM.
+	if (errnum == -1)
+		return "generic failure";
 
-	return "<unknown error>";
+	// Codes outside the MVLC range come from the system category, e.g. socket
+	// errors or the simulator. Other negative values are taken as -errno.
+	if (errnum >= 0 && errnum < static_cast<int>(MVLCErrorCode::ErrorCodeMax))
+		return ErrorMessages.lookup(MVLCC_ERROR_MVLC, errnum);
+
+	return ErrorMessages.lookup(MVLCC_ERROR_SYSTEM, errnum);
+}
+
+const char *mvlcc_strerror_category(mvlcc_error_category_t category, int errnum)
+{
+	return ErrorMessages.lookup(category, errnum);
 }
 
 int mvlcc_is_mvlc_valid(mvlcc_t a_mvlc)
 {
 	auto m = static_cast<struct mvlcc *>(a_mvlc);
-	return m->mvlc.isValid();
+	return m->sim || m->mvlc.isValid();
 }
 
 int mvlcc_is_ethernet(mvlcc_t a_mvlc)
 {
 	auto m = static_cast<struct mvlcc *>(a_mvlc);
+	if (m->sim)
+		return m->sim->connectionType() == ConnectionType::ETH;
 	return m->ethernet != nullptr;
 }
 
 int mvlcc_is_usb(mvlcc_t a_mvlc)
 {
 	auto m = static_cast<struct mvlcc *>(a_mvlc);
+	if (m->sim)
+		return m->sim->connectionType() == ConnectionType::USB;
 	return m->usb != nullptr;
 }
 
+int mvlcc_is_sim(mvlcc_t a_mvlc)
+{
+	auto m = static_cast<struct mvlcc *>(a_mvlc);
+	return m->sim != nullptr;
+}
+
 int mvlcc_set_daq_mode(mvlcc_t a_mvlc, bool enable)
 {
 	auto m = static_cast<struct mvlcc *>(a_mvlc);
+	std::lock_guard<TicketLock> guard(m->cmdLock);
 	std::error_code ec;
-	if (enable)
+	if (m->sim)
+		ec = m->sim->setDaqMode(enable);
+	else if (enable)
 		ec = mesytec::mvlc::enable_daq_mode(m->mvlc);
 	else
 		ec = mesytec::mvlc::disable_daq_mode(m->mvlc);
@@ -545,25 +692,60 @@ int mvlcc_vme_block_read(mvlcc_t a_mvlc, uint32_t address, uint32_t *buffer, siz
 	assert(buffer);
 	assert(sizeOut);
 
+	MVLCC_TRACE_ENTRY(vme_block_read, address);
 	auto m = static_cast<struct mvlcc *>(a_mvlc);
 	auto &mvlc = m->mvlc;
+	// Per thread: block reads from several threads must not share it.
+	thread_local std::vector<u32> bltWorkBuffer;
 
 	const u16 maxTransfers = sizeIn / (vme_amods::is_mblt_mode(params.amod) ? 2 : 1);
+	const auto start = std::chrono::steady_clock::now();
 	std::error_code ec;
 
-	m->bltWorkBuffer.clear();
+	// Logged as the stack command doing the same transfer.
+	const bool swapped = vme_amods::is_mblt_mode(params.amod) && params.swap;
+	StackCommand logCmd;
+	if (params.fifo)
+		logCmd.type = swapped ? StackCommand::CommandType::VMEReadSwapped : StackCommand::CommandType::VMERead;
+	else
+		logCmd.type = swapped ? StackCommand::CommandType::VMEReadMemSwapped : StackCommand::CommandType::VMEReadMem;
+	logCmd.address = address;
+	logCmd.amod = params.amod;
+	logCmd.dataWidth = VMEDataWidth::D32;
+	logCmd.transfers = maxTransfers;
+
+	bltWorkBuffer.clear();
+	std::unique_lock<TicketLock> guard(m->cmdLock);
+
+	if (m->sim)
+	{
+		ec = m->sim->vmeBlockRead(address, params.amod, maxTransfers, bltWorkBuffer);
+		*sizeOut = std::min(sizeIn, bltWorkBuffer.size());
+		std::copy(std::begin(bltWorkBuffer), std::begin(bltWorkBuffer) + *sizeOut, buffer);
+		m->commandLog.record(logCmd, start, ec, buffer, *sizeOut);
+		MVLCC_TRACE_EXIT(vme_block_read, *sizeOut);
+		return ec.value();
+	}
 
-	if (vme_amods::is_mblt_mode(params.amod) && params.swap)
+	if (swapped)
 	{
-		ec = mvlc.vmeBlockReadSwapped(address, params.amod, maxTransfers, m->bltWorkBuffer, params.fifo);
+		ec = mvlc.vmeBlockReadSwapped(address, params.amod, maxTransfers, bltWorkBuffer, params.fifo);
 	}
 	else
 	{
-		ec = mvlc.vmeBlockRead(address, params.amod, maxTransfers, m->bltWorkBuffer, params.fifo);
+		ec = mvlc.vmeBlockRead(address, params.amod, maxTransfers, bltWorkBuffer, params.fifo);
 	}
 
-	log_buffer(default_logger(), spdlog::level::debug, m->bltWorkBuffer,
-		fmt::format("vmeBlockRead() (result={}, {}) raw data", ec.value(), ec.message()), 10);
+	guard.unlock();
+
+	// The header strings are only built if the buffers are actually logged.
+	const bool logData = default_logger()->should_log(spdlog::level::debug);
+
+	if (logData)
+	{
+		log_buffer(default_logger(), spdlog::level::debug, bltWorkBuffer,
+			fmt::format("vmeBlockRead() (result={}, {}) raw data", ec.value(), ec.message()), 10);
+	}
 
 	*sizeOut = 0;
 
@@ -571,15 +753,20 @@ int mvlcc_vme_block_read(mvlcc_t a_mvlc, uint32_t address, uint32_t *buffer, siz
 	{
 		util::span<uint32_t> dest(buffer, sizeIn);
 
-		if (post_process_blt_data(m->bltWorkBuffer, dest, *sizeOut) != 0)
+		if (post_process_blt_data(bltWorkBuffer, dest, *sizeOut) != 0)
 		{
 			spdlog::warn("post_process_blt_data() failed, wordsCopied={}", *sizeOut);
 		}
 	}
 
-	log_buffer(default_logger(), spdlog::level::debug, std::basic_string_view<u32>(buffer, *sizeOut),
-		fmt::format("vmeBlockRead() (result={}, {}) post processed data", ec.value(), ec.message()), 10);
+	if (logData)
+	{
+		log_buffer(default_logger(), spdlog::level::debug, std::basic_string_view<u32>(buffer, *sizeOut),
+			fmt::format("vmeBlockRead() (result={}, {}) post processed data", ec.value(), ec.message()), 10);
+	}
 
+	m->commandLog.record(logCmd, start, ec, buffer, *sizeOut);
+	MVLCC_TRACE_EXIT(vme_block_read, *sizeOut);
 	return ec.value();
 }
 
@@ -588,24 +775,152 @@ void mvlcc_set_global_log_level(const char *levelName)
 	set_global_log_level(spdlog::level::from_str(levelName));
 }
 
+int mvlcc_get_cmd_counters(mvlcc_t a_mvlc, mvlcc_cmd_counters_t *counters)
+{
+	assert(a_mvlc);
+	assert(counters);
+
+	auto m = static_cast<struct mvlcc *>(a_mvlc);
+	*counters = {};
+
+	if (m->sim)
+		return 0;
+
+	if (!m->mvlc.isValid())
+		return -1;
+
+	const auto c = m->mvlc.getCmdPipeCounters();
+
+	counters->super_transactions = c.superTransactionCount;
+	counters->super_transaction_retries = c.superTransactionRetries;
+	counters->stack_transactions = c.stackTransactionCount;
+	counters->stack_transaction_retries = c.stackTransactionRetries;
+	counters->stack_exec_requests_lost = c.stackExecRequestsLost;
+	counters->stack_exec_responses_lost = c.stackExecResponsesLost;
+	counters->cmd_reads = c.reads;
+	counters->cmd_bytes_read = c.bytesRead;
+	counters->cmd_timeouts = c.timeouts;
+	counters->cmd_invalid_headers = c.invalidHeaders;
+	counters->cmd_words_skipped = c.wordsSkipped;
+	counters->cmd_error_buffers = c.errorBuffers;
+	counters->cmd_super_buffers = c.superBuffers;
+	counters->cmd_stack_buffers = c.stackBuffers;
+	counters->cmd_dso_buffers = c.dsoBuffers;
+	counters->cmd_short_super_frames = c.shortSuperFrames;
+	counters->cmd_super_format_errors = c.superFormatErrors;
+	counters->cmd_super_ref_mismatches = c.superRefMismatches;
+	counters->cmd_stack_ref_mismatches = c.stackRefMismatches;
+
+	if (m->ethernet)
+	{
+		counters->is_ethernet = 1;
+		const auto pipeStats = m->ethernet->getPipeStats();
+
+		for (size_t pi = 0; pi < MVLCC_PIPE_COUNT; ++pi)
+		{
+			const auto &ps = pipeStats[pi];
+			auto &dest = counters->eth_pipes[pi];
+			dest.receive_attempts = ps.receiveAttempts;
+			dest.received_packets = ps.receivedPackets;
+			dest.received_bytes = ps.receivedBytes;
+			dest.short_packets = ps.shortPackets;
+			dest.packets_with_residue = ps.packetsWithResidue;
+			dest.no_header = ps.noHeader;
+			dest.header_out_of_range = ps.headerOutOfRange;
+			dest.lost_packets = ps.lostPackets;
+
+			// mesytec-mvlc does not see the packets of batched receive.
+			if (pi == MVLCC_PIPE_DATA)
+			{
+				mvlcc_eth_batch_stats_t batch = {};
+				m->ethBatchCounters->snapshot(batch);
+				dest.received_packets += batch.packets;
+				dest.received_bytes += batch.bytes;
+				dest.short_packets += batch.short_packets + batch.truncated_packets;
+				dest.lost_packets += batch.lost_packets;
+			}
+
+			if (auto impl = dynamic_cast<eth::Impl *>(m->ethernet))
+			{
+				const auto si = udp_socket_info(impl->getSocket(static_cast<Pipe>(pi)));
+				dest.socket_drops = si.drops;
+				dest.rcvbuf_bytes = si.rcvbufBytes;
+				dest.rx_queue_bytes = si.rxQueueBytes;
+			}
+		}
+	}
+
+	return 0;
+}
+
+void mvlcc_cmd_counters_delta(const mvlcc_cmd_counters_t *now, const mvlcc_cmd_counters_t *prev,
+  mvlcc_cmd_counters_t *delta)
+{
+	using C = mvlcc_cmd_counters_t;
+	using P = mvlcc_eth_pipe_stats_t;
+
+	static uint64_t C::* const counterFields[] =
+	{
+		&C::super_transactions, &C::super_transaction_retries, &C::stack_transactions,
+		&C::stack_transaction_retries, &C::stack_exec_requests_lost, &C::stack_exec_responses_lost,
+		&C::cmd_reads, &C::cmd_bytes_read, &C::cmd_timeouts, &C::cmd_invalid_headers,
+		&C::cmd_words_skipped, &C::cmd_error_buffers, &C::cmd_super_buffers, &C::cmd_stack_buffers,
+		&C::cmd_dso_buffers, &C::cmd_short_super_frames, &C::cmd_super_format_errors,
+		&C::cmd_super_ref_mismatches, &C::cmd_stack_ref_mismatches,
+	};
+
+	static uint64_t P::* const pipeFields[] =
+	{
+		&P::receive_attempts, &P::received_packets, &P::received_bytes, &P::short_packets,
+		&P::packets_with_residue, &P::no_header, &P::header_out_of_range, &P::lost_packets,
+		&P::socket_drops,
+	};
+
+	C result = {};
+	result.is_ethernet = now->is_ethernet;
+
+	for (auto field: counterFields)
+		result.*field = now->*field - prev->*field;
+
+	for (size_t pi = 0; pi < MVLCC_PIPE_COUNT; ++pi)
+	{
+		for (auto field: pipeFields)
+			result.eth_pipes[pi].*field = now->eth_pipes[pi].*field - prev->eth_pipes[pi].*field;
+
+		result.eth_pipes[pi].rcvbuf_bytes = now->eth_pipes[pi].rcvbuf_bytes;
+		result.eth_pipes[pi].rx_queue_bytes = now->eth_pipes[pi].rx_queue_bytes;
+	}
+
+	*delta = result;
+}
+
 void mvlcc_print_mvlc_cmd_counters(FILE *out, mvlcc_t a_mvlc)
 {
 	assert(out);
 	assert(a_mvlc);
 
-	auto m = static_cast<struct mvlcc *>(a_mvlc);
-	auto &mvlc = m->mvlc;
-	const auto counters = mvlc.getCmdPipeCounters();
+	if (mvlcc_is_sim(a_mvlc))
+	{
+		fprintf(out, "sim: no command pipe counters");
+		return;
+	}
+
+	mvlcc_cmd_counters_t counters;
+
+	if (mvlcc_get_cmd_counters(a_mvlc, &counters) != 0)
+		return;
 
 	fprintf(out, fmt::format("super txs: totalTxs={}, retries={}, cmd txs: totalTxs={}, retries={}, execRequestsLost={}, execResponsesLost={}",
-		counters.superTransactionCount, counters.superTransactionRetries,
-		counters.stackTransactionCount, counters.stackTransactionRetries,
-		counters.stackExecRequestsLost, counters.stackExecResponsesLost).c_str());
+		counters.super_transactions, counters.super_transaction_retries,
+		counters.stack_transactions, counters.stack_transaction_retries,
+		counters.stack_exec_requests_lost, counters.stack_exec_responses_lost).c_str());
 
-	if (m->ethernet)
+	if (counters.is_ethernet)
 	{
-		const auto cmdStats = m->ethernet->getPipeStats()[0];
-		fprintf(out, fmt::format(", eth: lostPackets={}", cmdStats.lostPackets).c_str());
+		const auto &data = counters.eth_pipes[MVLCC_PIPE_DATA];
+		fprintf(out, fmt::format(", eth: lostPackets={}, data pipe: lostPackets={}, socketDrops={}, rcvbuf={}, rxQueue={}",
+			counters.eth_pipes[MVLCC_PIPE_COMMAND].lost_packets, data.lost_packets, data.socket_drops,
+			data.rcvbuf_bytes, data.rx_queue_bytes).c_str());
 	}
 }
 
@@ -700,18 +1015,34 @@ int mvlcc_run_command(mvlcc_t a_mvlc, mvlcc_command_t cmd, uint32_t *buffer, siz
 {
 	auto m = static_cast<struct mvlcc *>(a_mvlc);
 	auto d_cmd = get_d<mvlcc_command>(cmd);
-	auto result = mesytec::mvlc::run_command(m->mvlc, d_cmd->cmd);
+	MVLCC_TRACE_ENTRY(run_command, d_cmd->cmd.address);
+	std::unique_lock<TicketLock> guard(m->cmdLock);
+	const auto start = std::chrono::steady_clock::now();
+	auto result = m->sim ? m->sim->runCommand(d_cmd->cmd) : mesytec::mvlc::run_command(m->mvlc, d_cmd->cmd);
+	m->commandLog.record(d_cmd->cmd, start, result.ec, result.response.data(), result.response.size());
+	guard.unlock();
 	if (result.ec)
+	{
 		spdlog::warn("run_command() failed: cmd={}, ec={}", mesytec::mvlc::to_string(d_cmd->cmd), result.ec.message());
-	else
-		spdlog::info("run_command() ok: cmd={}, response={:#010x}", mesytec::mvlc::to_string(d_cmd->cmd), fmt::join(result.response, ", "));
+		m->commandLog.log(spdlog::level::debug);
+	}
+	else if (spdlog::should_log(spdlog::level::debug))
+		spdlog::debug("run_command() ok: cmd={}, response={:#010x}", mesytec::mvlc::to_string(d_cmd->cmd), fmt::join(result.response, ", "));
 	const auto end = std::begin(result.response) + std::min(size_in, result.response.size());
 	std::copy(std::begin(result.response), end, buffer);
 	if (size_out)
 		*size_out = std::distance(std::begin(result.response), end);
+	MVLCC_TRACE_EXIT(run_command, result.ec.value());
 	return result.ec.value();
 }
 
+void mvlcc_dump_command_log(FILE *out, mvlcc_t a_mvlc)
+{
+	assert(out);
+	assert(a_mvlc);
+	static_cast<struct mvlcc *>(a_mvlc)->commandLog.dump(out);
+}
+
 struct mvlcc_command_list: public mvlcc_error_buffer
 {
 	mesytec::mvlc::StackCommandBuilder cmdList;
@@ -863,6 +1194,40 @@ int mvlcc_command_list_from_text(mvlcc_command_list_t *cmd_listp, const char *st
 	}
 }
 
+// Copies the binary encoded data into a malloc()'ed buffer for the C side.
+static uint8_t *binary_to_c(const std::vector<uint8_t> &data, size_t *sizep)
+{
+	auto result = static_cast<uint8_t *>(malloc(data.size()));
+	if (result)
+		memcpy(result, data.data(), data.size());
+	if (sizep)
+		*sizep = result ? data.size() : 0;
+	return result;
+}
+
+uint8_t *mvlcc_command_list_to_binary(mvlcc_command_list_t cmd_list, size_t *sizep)
+{
+	auto d = get_d<mvlcc_command_list>(cmd_list);
+	return binary_to_c(command_list_to_binary(d->cmdList), sizep);
+}
+
+int mvlcc_command_list_from_binary(mvlcc_command_list_t *cmd_listp, const uint8_t *data, size_t size)
+{
+	*cmd_listp = mvlcc_command_list_create();
+	auto d = get_d<mvlcc_command_list>(*cmd_listp);
+
+	try
+	{
+		d->cmdList = command_list_from_binary(data, size);
+		return 0;
+	}
+	catch(const std::exception& e)
+	{
+		d->errorString = e.what();
+		return -1;
+	}
+}
+
 int mvlcc_command_list_eq(mvlcc_command_list_t a, mvlcc_command_list_t b)
 {
 	auto da = get_d<mvlcc_command_list>(a);
@@ -870,6 +1235,54 @@ int mvlcc_command_list_eq(mvlcc_command_list_t a, mvlcc_command_list_t b)
 	return da->cmdList == db->cmdList;
 }
 
+int mvlcc_command_list_optimize(mvlcc_command_list_t cmd_list,
+  const mvlcc_stack_optimize_options_t *options,
+  mvlcc_stack_optimize_report_t *report)
+{
+	auto d = get_d<mvlcc_command_list>(cmd_list);
+
+	StackOptimizeOptions opts;
+
+	if (options)
+	{
+		opts.mergeReads = options->flags & MVLCC_OPTIMIZE_MERGE_READS;
+		opts.dropRedundant = options->flags & MVLCC_OPTIMIZE_DROP_REDUNDANT;
+		if (options->min_merge_run)
+			opts.minMergeRun = options->min_merge_run;
+		if (options->stack_memory_words)
+			opts.stackMemoryWords = options->stack_memory_words;
+		if (options->timing_model)
+			opts.timing = *options->timing_model;
+		opts.readoutStack = options->readout_stack;
+	}
+
+	StackOptimizeReport rep;
+	auto optimized = optimize_stack(d->cmdList, opts, rep);
+
+	if (report)
+	{
+		report->commands_before = rep.commandsBefore;
+		report->commands_after = rep.commandsAfter;
+		report->stack_words_before = rep.stackWordsBefore;
+		report->stack_words_after = rep.stackWordsAfter;
+		report->merged_reads = rep.mergedReads;
+		report->removed_commands = rep.removedCommands;
+		report->bus_time_before_ns = rep.busTimeBeforeNs;
+		report->bus_time_after_ns = rep.busTimeAfterNs;
+		report->fits_stack_memory = rep.fitsStackMemory;
+	}
+
+	if (!rep.fitsStackMemory)
+	{
+		d->errorString = fmt::format("optimized stack needs {} words, only {} available",
+			rep.stackWordsAfter, opts.stackMemoryWords);
+		return -1;
+	}
+
+	d->cmdList = std::move(optimized);
+	return 0;
+}
+
 const char *mvlcc_command_list_strerror(mvlcc_command_list_t cmd_list)
 {
 	auto d = get_d<mvlcc_command_list>(cmd_list);
@@ -922,7 +1335,7 @@ int mvlcc_crateconfig_from_yaml(mvlcc_crateconfig_t *crateconfigp, const char *s
 
 	try
 	{
-		d->config = mesytec::mvlc::crate_config_from_yaml(str);
+		d->config = *cached_crate_config_from_text(str, false);
 		return 0;
 	}
 	catch(const std::exception& e)
@@ -938,7 +1351,29 @@ int mvlcc_crateconfig_from_json(mvlcc_crateconfig_t *crateconfigp, const char *s
 
 	try
 	{
-		d->config = mesytec::mvlc::crate_config_from_json(str);
+		d->config = *cached_crate_config_from_text(str, true);
+		return 0;
+	}
+	catch(const std::exception& e)
+	{
+		d->errorString = e.what();
+		return -1;
+	}
+}
+
+uint8_t *mvlcc_crateconfig_to_binary(mvlcc_crateconfig_t crateconfig, size_t *sizep)
+{
+	auto d = get_d<mvlcc_crateconfig>(crateconfig);
+	return binary_to_c(crate_config_to_binary(d->config), sizep);
+}
+
+int mvlcc_crateconfig_from_binary(mvlcc_crateconfig_t *crateconfigp, const uint8_t *data, size_t size)
+{
+	auto d = set_d(*crateconfigp, new mvlcc_crateconfig);
+
+	try
+	{
+		d->config = crate_config_from_binary(data, size);
 		return 0;
 	}
 	catch(const std::exception& e)
@@ -956,17 +1391,23 @@ inline bool ends_with(std::string const & value, std::string const & ending)
 
 int mvlcc_crateconfig_from_file(mvlcc_crateconfig_t *crateconfigp, const char *filename)
 {
-	std::ifstream f(filename);
+	std::ifstream f(filename, std::ios::binary);
 	std::stringstream buffer;
 	buffer << f.rdbuf();
+	const auto contents = buffer.str();
 
-	if (ends_with(filename, ".json"))
+	if (is_binary_encoded(reinterpret_cast<const uint8_t *>(contents.data()), contents.size()))
+	{
+		return mvlcc_crateconfig_from_binary(crateconfigp,
+			reinterpret_cast<const uint8_t *>(contents.data()), contents.size());
+	}
+	else if (ends_with(filename, ".json"))
 	{
-		return mvlcc_crateconfig_from_json(crateconfigp, buffer.str().c_str());
+		return mvlcc_crateconfig_from_json(crateconfigp, contents.c_str());
 	}
 	else
 	{
-		return mvlcc_crateconfig_from_yaml(crateconfigp, buffer.str().c_str());
+		return mvlcc_crateconfig_from_yaml(crateconfigp, contents.c_str());
 	}
 }
 
@@ -982,6 +1423,90 @@ mvlcc_t mvlcc_make_mvlc_from_crateconfig_t(mvlcc_crateconfig_t crateconfig)
 	return make_mvlcc(mesytec::mvlc::make_mvlc(d->config), d->config);
 }
 
+static SimParams sim_params_from_c(const mvlcc_sim_params_t &params)
+{
+	SimParams result;
+	result.triggerRateHz = params.trigger_rate_hz;
+	if (params.block_read_words)
+		result.blockReadWords = params.block_read_words;
+	result.seed = params.seed;
+	return result;
+}
+
+mvlcc_t mvlcc_make_mvlc_sim(mvlcc_crateconfig_t crateconfig, const mvlcc_sim_params_t *params)
+{
+	auto d = get_d<mvlcc_crateconfig>(crateconfig);
+	return make_mvlcc_sim(d->config, params ? sim_params_from_c(*params) : SimParams{});
+}
+
+// spec is the part after "sim://": [config file][?rate=<hz>&block_words=<n>&seed=<n>].
+// Errors yield an mvlcc without a simulator or MVLC, like a config file that
+// cannot be read in mvlcc_make_mvlc_from_crate_config().
+static mvlcc_t make_mvlcc_sim_from_url(const std::string &spec)
+{
+	const auto query = spec.find('?');
+	const auto path = spec.substr(0, query);
+	mvlcc_sim_params_t params = { 0.0, 0, 1 };
+
+	if (query != std::string::npos)
+	{
+		std::istringstream fields(spec.substr(query + 1));
+		std::string field;
+
+		while (std::getline(fields, field, '&'))
+		{
+			const auto eq = field.find('=');
+			const auto key = field.substr(0, eq);
+			const auto value = eq == std::string::npos ? std::string() : field.substr(eq + 1);
+			size_t used = 0;
+
+			try
+			{
+				if (key == "rate")
+					params.trigger_rate_hz = std::stod(value, &used);
+				else if (key == "block_words")
+					params.block_read_words = std::stoul(value, &used);
+				else if (key == "seed")
+					params.seed = std::stoul(value, &used);
+			}
+			catch (const std::exception &)
+			{
+				used = 0;
+			}
+
+			if (!used || used != value.size())
+			{
+				printf("Invalid sim:// parameter '%s'\n", field.c_str());
+				return new mvlcc();
+			}
+		}
+	}
+
+	mvlcc_crateconfig_t crateConfig = mvlcc_createconfig_create();
+
+	if (!path.empty())
+	{
+		mvlcc_crateconfig_destroy(&crateConfig);
+
+		if (!std::ifstream(path).is_open())
+		{
+			printf("Could not open file '%s'\n", path.c_str());
+			return new mvlcc();
+		}
+
+		if (mvlcc_crateconfig_from_file(&crateConfig, path.c_str()))
+		{
+			printf("Error reading crate config: %s\n", mvlcc_crateconfig_strerror(crateConfig));
+			mvlcc_crateconfig_destroy(&crateConfig);
+			return new mvlcc();
+		}
+	}
+
+	auto m = mvlcc_make_mvlc_sim(crateConfig, &params);
+	mvlcc_crateconfig_destroy(&crateConfig);
+	return m;
+}
+
 mvlcc_command_list_t mvlcc_crateconfig_get_readout_stack(
   mvlcc_crateconfig_t crateconfig, unsigned stackId)
 {
@@ -1012,6 +1537,24 @@ int mvlcc_crateconfig_set_readout_stack(
 	return 0;
 }
 
+int mvlcc_crateconfig_set_connection_type(mvlcc_crateconfig_t crateconfig, int connection_type)
+{
+	auto d_crateconfig = get_d<mvlcc_crateconfig>(crateconfig);
+
+	switch (connection_type)
+	{
+		case MVLCC_CONNECTION_USB:
+			d_crateconfig->config.connectionType = ConnectionType::USB;
+			return 0;
+
+		case MVLCC_CONNECTION_ETH:
+			d_crateconfig->config.connectionType = ConnectionType::ETH;
+			return 0;
+	}
+
+	return -1;
+}
+
 mvlcc_command_list_t mvlcc_crateconfig_get_mcst_daq_start(mvlcc_crateconfig_t crateconfig)
 {
 	auto d_crateconfig = get_d<mvlcc_crateconfig>(crateconfig);
@@ -1028,45 +1571,336 @@ mvlcc_command_list_t mvlcc_crateconfig_get_mcst_daq_stop(mvlcc_crateconfig_t cra
 	return result;
 }
 
-int
-mvlcc_init_readout2(mvlcc_t a_mvlc, mvlcc_crateconfig_t crateconfig)
+void mvlcc_timing_model_init(mvlcc_timing_model_t *model)
 {
-	int rc;
-	auto m = static_cast<struct mvlcc *>(a_mvlc);
-	auto d_crateconfig = get_d<mvlcc_crateconfig>(crateconfig);
-
-	assert(m->ethernet || m->usb);
+	*model = default_bus_timing_model();
+}
 
-	auto result = init_readout(m->mvlc, d_crateconfig->config, {});
+int mvlcc_crateconfig_estimate_readout(mvlcc_crateconfig_t crateconfig,
+  const mvlcc_timing_model_t *model, mvlcc_readout_estimate_t *estimate)
+{
+	auto d = get_d<mvlcc_crateconfig>(crateconfig);
+	const auto &config = d->config;
+	const auto timing = model ? *model : default_bus_timing_model();
 
-	printf("mvlcc_init_readout\n");
-	// std::cout << "init_readout result = " << result.init << std::endl;
+	*estimate = {};
 
-	rc = result.ec.value();
-	if (rc != 0) {
-		printf("init_readout: '%s'\n", result.ec.message().c_str());
-		return rc;
+	if (config.stacks.size() > MVLCC_MAX_READOUT_STACKS)
+	{
+		d->errorString = fmt::format("too many readout stacks: {}", config.stacks.size());
+		return -1;
 	}
 
-	if (m->ethernet)
-	 {
-		m->ethernet->resetPipeAndChannelStats();
-		send_empty_request(&m->mvlc);
-	}
+	try
+	{
+		double combinedNs = 0.0;
+		size_t combinedBytes = 0;
 
-	return rc;
-}
+		for (size_t si = 0; si < config.stacks.size(); ++si)
+		{
+			const auto &stack = config.stacks[si];
 
-struct mvlcc_readout_context
-{
-	mesytec::mvlc::MVLC mvlc;
-	mesytec::mvlc::ReadoutBuffer tmpBuffer;
-};
+			if (stack.empty())
+				continue;
 
-mvlcc_readout_context_t mvlcc_readout_context_create(void)
-{
-	mvlcc_readout_context_t result = {};
-	set_d(result, new mvlcc_readout_context);
+			auto se = estimate_stack(timing, stack);
+			auto &out = estimate->stacks[estimate->stack_count++];
+			out.stack_index = si;
+			out.trigger = si < config.triggers.size() ? config.triggers[si] : 0u;
+			out.bus_time_ns = se.busTimeNs;
+			out.bytes_per_event = se.bytesPerEvent;
+			out.stack_memory_words = se.stackMemoryWords;
+			out.max_trigger_rate_hz = se.maxTriggerRateHz;
+			out.link_limited = se.linkLimited;
+			out.bottleneck_command_index = se.bottleneckIndex;
+			out.bottleneck_command_ns = se.bottleneckNs;
+			snprintf(out.bottleneck_command, sizeof(out.bottleneck_command), "%s",
+				se.bottleneck ? to_string(se.bottleneck).c_str() : "");
+
+			estimate->total_stack_memory_words += se.stackMemoryWords;
+			combinedNs += timing.stack_overhead_ns + se.busTimeNs;
+			combinedBytes += se.bytesPerEvent;
+		}
+
+		estimate->fits_stack_memory = estimate->total_stack_memory_words
+			<= static_cast<size_t>(stacks::StackMemoryWords - stacks::ImmediateStackReservedWords);
+
+		if (combinedNs > 0.0)
+		{
+			double rate = 1e9 / combinedNs;
+			if (timing.link_bytes_per_s > 0.0)
+				rate = std::min(rate, timing.link_bytes_per_s / combinedBytes);
+			estimate->combined_max_trigger_rate_hz = rate;
+		}
+
+		return 0;
+	}
+	catch (const std::exception &e)
+	{
+		d->errorString = e.what();
+		return -1;
+	}
+}
+
+// Expects cmdLock to be held.
+static int init_readout_full(struct mvlcc *m, const CrateConfig &config)
+{
+	int rc;
+
+	m->appliedConfig.reset();
+
+	if (m->sim)
+	{
+		if (auto ec = m->sim->initReadout(config))
+			return ec.value();
+		m->appliedConfig = std::make_unique<CrateConfig>(config);
+		return 0;
+	}
+
+	assert(m->ethernet || m->usb);
+
+	auto result = init_readout(m->mvlc, config, {});
+
+	printf("mvlcc_init_readout\n");
+	// std::cout << "init_readout result = " << result.init << std::endl;
+
+	rc = result.ec.value();
+	if (rc != 0) {
+		printf("init_readout: '%s'\n", result.ec.message().c_str());
+		return rc;
+	}
+
+	if (m->ethernet)
+	 {
+		m->ethernet->resetPipeAndChannelStats();
+		send_empty_request(&m->mvlc);
+	}
+
+	m->appliedConfig = std::make_unique<CrateConfig>(config);
+
+	return rc;
+}
+
+int
+mvlcc_init_readout2(mvlcc_t a_mvlc, mvlcc_crateconfig_t crateconfig)
+{
+	auto m = static_cast<struct mvlcc *>(a_mvlc);
+	std::lock_guard<TicketLock> guard(m->cmdLock);
+	return init_readout_full(m, get_d<mvlcc_crateconfig>(crateconfig)->config);
+}
+
+static bool same_groups(const StackCommandBuilder &a, const StackCommandBuilder &b)
+{
+	const auto &ga = a.getGroups();
+	const auto &gb = b.getGroups();
+
+	return ga.size() == gb.size() && std::equal(std::begin(ga), std::end(ga), std::begin(gb),
+		[] (const auto &x, const auto &y) { return x.name == y.name; });
+}
+
+// Expects cmdLock to be held.
+static std::error_code run_command_list(struct mvlcc *m, const std::vector<StackCommand> &commands)
+{
+	for (const auto &cmd: commands)
+	{
+		auto result = m->sim ? m->sim->runCommand(cmd) : mesytec::mvlc::run_command(m->mvlc, cmd);
+
+		if (result.ec)
+		{
+			spdlog::warn("run_command() failed: cmd={}, ec={}", to_string(cmd), result.ec.message());
+			return result.ec;
+		}
+	}
+
+	return {};
+}
+
+int mvlcc_init_readout_diff(mvlcc_t a_mvlc, mvlcc_crateconfig_t crateconfig, mvlcc_init_diff_t *diff)
+{
+	auto m = static_cast<struct mvlcc *>(a_mvlc);
+	std::lock_guard<TicketLock> guard(m->cmdLock);
+	const auto &config = get_d<mvlcc_crateconfig>(crateconfig)->config;
+	mvlcc_init_diff_t result = {};
+
+	auto finish = [&] (int rc)
+	{
+		if (diff)
+			*diff = result;
+		return rc;
+	};
+
+	std::error_code ec;
+
+	// Nothing is run while the readout is live: DAQ mode and triggers are
+	// disabled first, and DAQ mode is restored once the triggers are set up
+	// again at the end.
+	uint32_t daqMode = 0;
+	ec = m->sim
+		? m->sim->readRegister(registers::daq_mode, daqMode)
+		: m->mvlc.readRegister(registers::daq_mode, daqMode);
+
+	if (ec)
+	{
+		printf("read daq_mode: '%s'\n", ec.message().c_str());
+		return finish(ec.value());
+	}
+
+	if ((ec = disable_daq_and_triggers(m)))
+	{
+		printf("disable_daq_mode_and_triggers: '%s'\n", ec.message().c_str());
+		return finish(ec.value());
+	}
+
+	auto restore_daq_mode = [&] () -> std::error_code
+	{
+		if (!daqMode)
+			return {};
+
+		auto err = m->sim ? m->sim->setDaqMode(true) : enable_daq_mode(m->mvlc);
+
+		if (err)
+			printf("enable_daq_mode: '%s'\n", err.message().c_str());
+
+		return err;
+	};
+
+	// Anything that changes the structure of the module init sequence or the
+	// connection itself requires the full init procedure.
+	if (!m->appliedConfig
+		|| m->appliedConfig->connectionType != config.connectionType
+		|| m->appliedConfig->crateId != config.crateId
+		|| !same_groups(m->appliedConfig->initCommands, config.initCommands))
+	{
+		result.full_init = 1;
+
+		if (int rc = init_readout_full(m, config))
+			return finish(rc);
+
+		// init_readout() leaves the triggers disabled, the simulator has
+		// armed them with the stacks.
+		if (!m->sim && (ec = setup_readout_triggers(m->mvlc, config.triggers)))
+			printf("setup_readout_triggers: '%s'\n", ec.message().c_str());
+		else
+			ec = restore_daq_mode();
+
+		if (ec)
+		{
+			m->appliedConfig.reset();
+			return finish(ec.value());
+		}
+
+		result.triggers_applied = 1;
+		return finish(0);
+	}
+
+	const auto &applied = *m->appliedConfig;
+	const bool stacksChanged = applied.stacks != config.stacks;
+	const bool triggersChanged = stacksChanged || applied.triggers != config.triggers;
+
+	// Invalidated until everything has been applied successfully.
+	auto previous = std::move(m->appliedConfig);
+
+	if (applied.initRegisters != config.initRegisters)
+	{
+		if ((ec = run_command_list(m, config.initRegisters.getCommands())))
+			return finish(ec.value());
+		result.init_registers_run = 1;
+	}
+
+	if (applied.initTriggerIO != config.initTriggerIO)
+	{
+		if ((ec = run_command_list(m, config.initTriggerIO.getCommands())))
+			return finish(ec.value());
+		result.trigger_io_run = 1;
+	}
+
+	const auto &appliedGroups = applied.initCommands.getGroups();
+	const auto &groups = config.initCommands.getGroups();
+
+	for (size_t gi = 0; gi < groups.size(); ++gi)
+	{
+		if (groups[gi].commands == appliedGroups[gi].commands)
+			continue;
+
+		if ((ec = run_command_list(m, groups[gi].commands)))
+			return finish(ec.value());
+
+		++result.init_groups_run;
+	}
+
+	if (m->sim)
+	{
+		// Installs the stacks and arms their triggers.
+		m->sim->setReadoutStacks(config.stacks, config.triggers);
+		result.stacks_uploaded = stacksChanged;
+	}
+	else
+	{
+		if (stacksChanged)
+		{
+			if ((ec = setup_readout_stacks(m->mvlc, config.stacks)))
+			{
+				printf("setup_readout_stacks: '%s'\n", ec.message().c_str());
+				return finish(ec.value());
+			}
+			result.stacks_uploaded = 1;
+		}
+
+		if ((ec = setup_readout_triggers(m->mvlc, config.triggers)))
+		{
+			printf("setup_readout_triggers: '%s'\n", ec.message().c_str());
+			return finish(ec.value());
+		}
+
+		if (triggersChanged && m->ethernet)
+		{
+			m->ethernet->resetPipeAndChannelStats();
+			send_empty_request(&m->mvlc);
+		}
+	}
+
+	result.triggers_applied = 1;
+
+	if ((ec = restore_daq_mode()))
+		return finish(ec.value());
+
+	previous.reset();
+	m->appliedConfig = std::make_unique<CrateConfig>(config);
+
+	return finish(0);
+}
+
+void mvlcc_forget_applied_config(mvlcc_t a_mvlc)
+{
+	auto m = static_cast<struct mvlcc *>(a_mvlc);
+	std::lock_guard<TicketLock> guard(m->cmdLock);
+	m->appliedConfig.reset();
+}
+
+struct mvlcc_readout_context: public mvlcc_error_buffer
+{
+	mesytec::mvlc::MVLC mvlc;
+	mesytec::mvlc::ReadoutBuffer tmpBuffer;
+	std::shared_ptr<SimCrate> sim;
+	ReadoutStats stats;
+	size_t bufferNumber = 0;
+	int crateIndex = 0;
+	// Packet and loss counts at the previous buffer, see readout_packet_counts().
+	uint64_t lastPackets = 0;
+	uint64_t lastLostPackets = 0;
+	uint64_t lastDroppedWords = 0;
+	// Set in aligned mode, see mvlcc_readout_context_set_aligned().
+	std::unique_ptr<FrameAligner> aligner;
+	BufferMemory alignerInput;
+	// Set for ETH connections with batched receive enabled.
+	std::unique_ptr<EthBatchReceiver> ethBatch;
+	std::shared_ptr<EthBatchCounters> ethBatchCounters;
+};
+
+mvlcc_readout_context_t mvlcc_readout_context_create(void)
+{
+	mvlcc_readout_context_t result = {};
+	set_d(result, new mvlcc_readout_context);
 	return result;
 }
 
@@ -1076,6 +1910,9 @@ mvlcc_readout_context_t mvlcc_readout_context_create2(mvlcc_t a_mvlc)
 	auto d = set_d(result, new mvlcc_readout_context);
 	auto m = static_cast<struct mvlcc *>(a_mvlc);
 	d->mvlc = m->mvlc;
+	d->sim = m->sim;
+	d->crateIndex = m->config.crateId;
+	d->ethBatchCounters = m->ethBatchCounters;
 	return result;
 }
 
@@ -1090,137 +1927,1018 @@ void mvlcc_readout_context_set_mvlc(mvlcc_readout_context_t ctx, mvlcc_t a_mvlc)
 	auto d_ctx = get_d<mvlcc_readout_context>(ctx);
 	auto m = static_cast<struct mvlcc *>(a_mvlc);
 	d_ctx->mvlc = m->mvlc;
+	d_ctx->sim = m->sim;
+	d_ctx->crateIndex = m->config.crateId;
+	d_ctx->ethBatch.reset();
+	d_ctx->ethBatchCounters = m->ethBatchCounters;
 }
 
-int mvlcc_readout(mvlcc_readout_context_t ctx, uint8_t *dest, size_t bytes_free, size_t *bytes_used, int timeout_ms)
+static std::pair<std::error_code, size_t> readout_raw(mvlcc_readout_context *d_ctx,
+	uint8_t *dest, size_t bytes_free, int timeout_ms)
 {
-	auto d_ctx = get_d<mvlcc_readout_context>(ctx);
+	if (d_ctx->sim)
+		return d_ctx->sim->readout(dest, bytes_free, std::chrono::milliseconds(timeout_ms));
 
-	auto [ec, bytesRead] = mesytec::mvlc::readout(d_ctx->mvlc, d_ctx->tmpBuffer,
+	if (d_ctx->ethBatch)
+		return d_ctx->ethBatch->receive(dest, bytes_free, std::chrono::milliseconds(timeout_ms));
+
+	return mesytec::mvlc::readout(d_ctx->mvlc, d_ctx->tmpBuffer,
 		{ dest, bytes_free }, std::chrono::milliseconds(timeout_ms));
-	if (bytes_used)
-		*bytes_used = bytesRead;
-	return ec.value();
 }
 
-mvlcc_const_span_t mvlcc_module_data_get_prefix(mvlcc_module_data_t md)
+static bool readout_is_eth(mvlcc_readout_context *d_ctx)
 {
-  mvlcc_const_span_t result = {md.data_span.data, md.prefix_size};
-  return result;
+	const auto type = d_ctx->sim ? d_ctx->sim->connectionType() : d_ctx->mvlc.connectionType();
+	return type == ConnectionType::ETH;
 }
 
-mvlcc_const_span_t mvlcc_module_data_get_dynamic(mvlcc_module_data_t md)
+static uint64_t clock_ns(clockid_t clock)
 {
-  mvlcc_const_span_t result = {md.data_span.data + md.prefix_size, md.dynamic_size};
-  return result;
+	struct timespec ts;
+	if (clock_gettime(clock, &ts))
+		return 0;
+	return static_cast<uint64_t>(ts.tv_sec) * 1000000000u + ts.tv_nsec;
 }
 
-mvlcc_const_span_t mvlcc_module_data_get_suffix(mvlcc_module_data_t md)
+// Total data packets received and lost. The data pipe statistics count all
+// packets of real ETH connections, the aligner only sees the packets of the
+// reads made in aligned mode.
+static std::pair<uint64_t, uint64_t> readout_packet_counts(mvlcc_readout_context *d_ctx)
 {
-  mvlcc_const_span_t result = {md.data_span.data + md.prefix_size + md.dynamic_size, md.suffix_size};
-  return result;
-}
+	if (d_ctx->ethBatch)
+		return { d_ctx->ethBatch->packets(), d_ctx->ethBatch->lostPackets() };
 
-int mvlcc_module_data_check_consistency(mvlcc_module_data_t md)
-{
-    uint64_t partSum = md.prefix_size + md.dynamic_size + md.suffix_size;
-    int sumOk = partSum == md.data_span.size;
-    // Note: cannot test the opposite: the current dynamicSize can be 0 but
-    // hasDynamic can be true at the same time, e.g. from empty block reads.
-    int dynOk = md.dynamic_size > 0 ? md.has_dynamic : 1;
-    return sumOk && dynOk;
+	if (!d_ctx->sim)
+	{
+		if (auto eth = dynamic_cast<eth::MVLC_ETH_Interface *>(d_ctx->mvlc.getImpl()))
+		{
+			const auto pipeStats = eth->getPipeStats();
+			const auto &ps = pipeStats[static_cast<size_t>(Pipe::Data)];
+			return { ps.receivedPackets, ps.lostPackets };
+		}
+	}
+
+	if (d_ctx->aligner)
+		return { d_ctx->aligner->packets(), d_ctx->aligner->lostPackets() };
+
+	return {};
 }
 
-struct mvlcc_readout_parser: public mvlcc_error_buffer
+// Fills in the descriptor fields common to both readout modes and remembers
+// the counts reported with this buffer.
+static void readout_describe(mvlcc_readout_context *d_ctx, mvlcc_readout_info_t &info)
 {
-  CrateConfig crateConfig;
-  void *cUserContext;
-  event_data_callback_t *cEventData;
-  system_event_callback_t *cSystemEvent;
-  readout_parser::ReadoutParserCallbacks parserCallbacks;
-  readout_parser::ReadoutParserState readoutParser;
-  readout_parser::ReadoutParserCounters parserCounters;
-  std::vector<mvlcc_module_data_t> cModuleData;
-};
+	info.buffer_number = ++d_ctx->bufferNumber;
+	info.crate_index = d_ctx->crateIndex;
+	info.connection_type = readout_is_eth(d_ctx) ? MVLCC_CONNECTION_ETH : MVLCC_CONNECTION_USB;
+	info.monotonic_ns = clock_ns(CLOCK_MONOTONIC);
+#ifdef CLOCK_TAI
+	info.tai_ns = clock_ns(CLOCK_TAI);
+#endif
 
-static void event_data_internal(void *userContext, int crateIndex, int eventIndex,
-	const readout_parser::ModuleData *moduleDataList, unsigned moduleCount)
-{
-	auto d = reinterpret_cast<mvlcc_readout_parser *>(userContext);
-	d->cModuleData.resize(moduleCount);
+	if (info.connection_type == MVLCC_CONNECTION_ETH)
+	{
+		auto [packets, lost] = readout_packet_counts(d_ctx);
+		// The counts restart when switching between aligned and plain mode.
+		if (packets < d_ctx->lastPackets || lost < d_ctx->lastLostPackets)
+			d_ctx->lastPackets = d_ctx->lastLostPackets = 0;
+		info.packets = packets - d_ctx->lastPackets;
+		info.lost_packets = lost - d_ctx->lastLostPackets;
+		d_ctx->lastPackets = packets;
+		d_ctx->lastLostPackets = lost;
+	}
 
-	for (size_t mi=0; mi<moduleCount; ++mi)
+	if (info.lost_packets)
+		info.flags |= MVLCC_READOUT_FLAG_PACKET_LOSS;
+
+	if (d_ctx->aligner)
 	{
-		d->cModuleData[mi].data_span = { moduleDataList[mi].data.data, moduleDataList[mi].data.size };
-		d->cModuleData[mi].prefix_size = moduleDataList[mi].prefixSize;
-		d->cModuleData[mi].dynamic_size = moduleDataList[mi].dynamicSize;
-		d->cModuleData[mi].suffix_size = moduleDataList[mi].suffixSize;
-		d->cModuleData[mi].has_dynamic = moduleDataList[mi].hasDynamic;
+		const uint64_t dropped = d_ctx->aligner->droppedWords();
+		if (dropped < d_ctx->lastDroppedWords)
+			d_ctx->lastDroppedWords = 0;
+		info.dropped_bytes = (dropped - d_ctx->lastDroppedWords) * sizeof(uint32_t);
+		d_ctx->lastDroppedWords = dropped;
 	}
 
-	d->cEventData(d->cUserContext, crateIndex, eventIndex, d->cModuleData.data(), moduleCount);
+	if (info.dropped_bytes)
+		info.flags |= MVLCC_READOUT_FLAG_DATA_DROPPED;
 }
 
-static void system_event_internal(void *userContext, int crateIndex,
-	const u32 *header, u32 size)
+// Pending complete events are returned without reading. Otherwise at most
+// one buffer worth of data is read and aligned.
+static std::error_code readout_aligned(mvlcc_readout_context *d_ctx, uint8_t *dest, size_t bytes_free,
+	int timeout_ms, mvlcc_readout_info_t &info)
 {
-	auto d = reinterpret_cast<mvlcc_readout_parser *>(userContext);
-	d->cSystemEvent(d->cUserContext, crateIndex, { header, size });
+	auto &aligner = *d_ctx->aligner;
+	auto dest32 = reinterpret_cast<uint32_t *>(dest);
+	const size_t maxWords = bytes_free / sizeof(uint32_t);
+	std::error_code ec;
+
+	auto taken = aligner.take(dest32, maxWords);
+
+	if (!taken.words)
+	{
+		auto &input = d_ctx->alignerInput;
+		input.reserve(bytes_free);
+		size_t bytesRead = 0;
+		std::tie(ec, bytesRead) = readout_raw(d_ctx, input.data(), bytes_free, timeout_ms);
+
+		auto input32 = reinterpret_cast<const uint32_t *>(input.data());
+		if (readout_is_eth(d_ctx))
+			aligner.appendEthPackets(input32, bytesRead / sizeof(uint32_t));
+		else
+			aligner.appendFrames(input32, bytesRead / sizeof(uint32_t));
+
+		taken = aligner.take(dest32, maxWords);
+	}
+
+	info.bytes_used = taken.words * sizeof(uint32_t);
+	info.data_format = MVLCC_DATA_FORMAT_FRAMES;
+	info.flags |= MVLCC_READOUT_FLAG_ALIGNED;
+	if (taken.continuesPrevious)
+		info.flags |= MVLCC_READOUT_FLAG_CONTINUES_PREVIOUS;
+	if (taken.continued)
+		info.flags |= MVLCC_READOUT_FLAG_CONTINUED;
+
+	return ec;
 }
 
-int mvlcc_readout_parser_create(
-  mvlcc_readout_parser_t *parserp,
-  mvlcc_crateconfig_t crateconfig,
-  void *userContext,
-  event_data_callback_t *event_data_callback,
-  system_event_callback_t *system_event_callback)
+int mvlcc_readout2(mvlcc_readout_context_t ctx, uint8_t *dest, size_t bytes_free,
+	mvlcc_readout_info_t *info, int timeout_ms)
 {
-	auto d = set_d(*parserp, new mvlcc_readout_parser);
+	assert(info);
+	MVLCC_TRACE_ENTRY(readout, bytes_free);
+	auto d_ctx = get_d<mvlcc_readout_context>(ctx);
+	*info = {};
 
-	try
+	if (d_ctx->aligner && bytes_free < MVLCC_READOUT_ALIGNED_MIN_BYTES)
 	{
-		d->crateConfig = get_d<mvlcc_crateconfig>(crateconfig)->config;
-		d->cUserContext = userContext;
-		d->cEventData = event_data_callback;
-		d->cSystemEvent = system_event_callback;
-		d->parserCallbacks.eventData = event_data_internal;
-		d->parserCallbacks.systemEvent = system_event_internal;
-		d->readoutParser = readout_parser::make_readout_parser(d->crateConfig.stacks, d);
-		return 0;
+		d_ctx->errorString = fmt::format("readout: aligned mode needs at least {} bytes, got {}",
+			MVLCC_READOUT_ALIGNED_MIN_BYTES, bytes_free);
+		return -1;
 	}
-	catch (const std::exception &e)
+
+	if (d_ctx->ethBatch && bytes_free < EthBatchReceiver::SlotBytes)
 	{
-		d->errorString = e.what();
+		d_ctx->errorString = fmt::format("readout: batched receive needs at least {} bytes, got {}",
+			EthBatchReceiver::SlotBytes, bytes_free);
 		return -1;
 	}
-}
 
-void mvlcc_readout_parser_destroy(mvlcc_readout_parser_t *parser)
-{
-	delete get_d<mvlcc_readout_parser>(*parser);
-	parser->d = 0;
-}
+	const size_t carried = d_ctx->aligner
+		? d_ctx->aligner->pendingWords() * sizeof(uint32_t)
+		: (d_ctx->sim ? 0 : d_ctx->tmpBuffer.used());
+	auto t0 = d_ctx->stats.begin(carried);
+	std::error_code ec;
 
-mvlcc_parse_result_t mvlcc_readout_parser_parse_buffer(
-  mvlcc_readout_parser_t parser,
-  size_t linear_buffer_number,
-  const uint32_t *buffer,
-  size_t size)
-{
-	auto d = get_d<mvlcc_readout_parser>(parser);
+	if (d_ctx->aligner)
+	{
+		ec = readout_aligned(d_ctx, dest, bytes_free, timeout_ms, *info);
+	}
+	else
+	{
+		std::tie(ec, info->bytes_used) = readout_raw(d_ctx, dest, bytes_free, timeout_ms);
+		info->data_format = readout_is_eth(d_ctx) ? MVLCC_DATA_FORMAT_ETH_PACKETS : MVLCC_DATA_FORMAT_FRAMES;
+	}
 
-	auto result = readout_parser::parse_readout_buffer(
-		d->crateConfig.connectionType,
-		d->readoutParser,
-		d->parserCallbacks,
-		d->parserCounters,
-		linear_buffer_number, buffer, size);
+	if (info->bytes_used)
+		readout_describe(d_ctx, *info);
 
-	return static_cast<int>(result);
+	d_ctx->stats.end(t0, bytes_free, info->bytes_used, ec == ErrorType::Timeout, static_cast<bool>(ec));
+	MVLCC_TRACE_EXIT(readout, info->bytes_used);
+
+	return ec.value();
 }
 
-const char *mvlcc_parse_result_to_string(mvlcc_parse_result_t result)
+int mvlcc_readout(mvlcc_readout_context_t ctx, uint8_t *dest, size_t bytes_free, size_t *bytes_used, int timeout_ms)
+{
+	mvlcc_readout_info_t info;
+	int ec = mvlcc_readout2(ctx, dest, bytes_free, &info, timeout_ms);
+	if (bytes_used)
+		*bytes_used = info.bytes_used;
+	return ec;
+}
+
+const char *mvlcc_readout_context_strerror(mvlcc_readout_context_t ctx)
+{
+	return get_d<mvlcc_readout_context>(ctx)->errorString.c_str();
+}
+
+int mvlcc_readout_context_set_aligned(mvlcc_readout_context_t ctx, int enable)
+{
+	auto d_ctx = get_d<mvlcc_readout_context>(ctx);
+
+	if (!enable)
+	{
+		// Pending data is lost when switching modes.
+		d_ctx->aligner.reset();
+		return 0;
+	}
+
+	if (d_ctx->tmpBuffer.used())
+		return -1;
+
+	if (!d_ctx->aligner)
+		d_ctx->aligner = std::make_unique<FrameAligner>();
+
+	return 0;
+}
+
+int mvlcc_readout_context_set_eth_batch(mvlcc_readout_context_t ctx, const mvlcc_eth_batch_options_t *options)
+{
+	auto d_ctx = get_d<mvlcc_readout_context>(ctx);
+
+	if (!options)
+	{
+		d_ctx->ethBatch.reset();
+		std::tie(d_ctx->lastPackets, d_ctx->lastLostPackets) = readout_packet_counts(d_ctx);
+		return 0;
+	}
+
+	auto eth = d_ctx->sim ? nullptr : dynamic_cast<eth::Impl *>(d_ctx->mvlc.getImpl());
+
+	// Packets already read by readout() would be out of order.
+	if (!eth || d_ctx->tmpBuffer.used())
+		return -1;
+
+	try
+	{
+		d_ctx->ethBatch = std::make_unique<EthBatchReceiver>(eth->getSocket(Pipe::Data), *options,
+			d_ctx->ethBatchCounters);
+		// The counts of the next buffer start from the connection's totals.
+		std::tie(d_ctx->lastPackets, d_ctx->lastLostPackets) = readout_packet_counts(d_ctx);
+		return 0;
+	}
+	catch (const std::exception &e)
+	{
+		spdlog::warn("mvlcc_readout_context_set_eth_batch: {}", e.what());
+		return -1;
+	}
+}
+
+int mvlcc_readout_context_get_eth_batch_stats(mvlcc_readout_context_t ctx, mvlcc_eth_batch_stats_t *stats)
+{
+	assert(stats);
+	auto d_ctx = get_d<mvlcc_readout_context>(ctx);
+
+	if (!d_ctx || !d_ctx->ethBatch)
+		return -1;
+
+	d_ctx->ethBatch->stats(*stats);
+	return 0;
+}
+
+int mvlcc_readout_context_get_stats(mvlcc_readout_context_t ctx, mvlcc_readout_stats_t *stats)
+{
+	assert(stats);
+	auto d_ctx = get_d<mvlcc_readout_context>(ctx);
+
+	if (!d_ctx)
+		return -1;
+
+	d_ctx->stats.snapshot(*stats);
+	return 0;
+}
+
+void mvlcc_set_allocator(const mvlcc_allocator_t *allocator)
+{
+	set_buffer_allocator(allocator);
+}
+
+void mvlcc_set_buffer_alloc_options(const mvlcc_buffer_alloc_options_t *options)
+{
+	set_buffer_alloc_options(options ? *options : mvlcc_buffer_alloc_options_t{ 0, MVLCC_NUMA_NODE_ANY });
+}
+
+int mvlcc_numa_node_of_interface(const char *ifname)
+{
+	assert(ifname);
+	return interface_numa_node(ifname);
+}
+
+namespace
+{
+
+// Buffers handed out by mvlcc_buffer_alloc(), freed with the allocator they
+// came from.
+struct CBufferRegistry
+{
+	std::mutex mutex;
+	std::unordered_map<void *, BufferMemory> buffers;
+};
+
+CBufferRegistry &c_buffers()
+{
+	static CBufferRegistry instance;
+	return instance;
+}
+
+}
+
+void *mvlcc_buffer_alloc(size_t bytes)
+{
+	try
+	{
+		BufferMemory memory(bytes);
+		void *ptr = memory.data();
+		auto &registry = c_buffers();
+		std::lock_guard<std::mutex> guard(registry.mutex);
+		registry.buffers.emplace(ptr, std::move(memory));
+		return ptr;
+	}
+	catch (const std::bad_alloc &)
+	{
+		return nullptr;
+	}
+}
+
+void mvlcc_buffer_free(void *ptr)
+{
+	if (!ptr)
+		return;
+
+	BufferMemory memory;
+
+	{
+		auto &registry = c_buffers();
+		std::lock_guard<std::mutex> guard(registry.mutex);
+		auto it = registry.buffers.find(ptr);
+		assert(it != std::end(registry.buffers));
+		if (it == std::end(registry.buffers))
+			return;
+		memory = std::move(it->second);
+		registry.buffers.erase(it);
+	}
+}
+
+int mvlcc_thread_set_config(mvlcc_thread_role_t role, const mvlcc_thread_config_t *config)
+{
+	try
+	{
+		set_thread_role_config(role, config ? *config : mvlcc_thread_config_t{});
+		return 0;
+	}
+	catch (const std::exception &e)
+	{
+		spdlog::warn("mvlcc_thread_set_config: {}", e.what());
+		return -1;
+	}
+}
+
+int mvlcc_thread_apply_config(mvlcc_thread_role_t role)
+{
+	const int ec = (role < 0 || role >= MVLCC_THREAD_ROLE_COUNT) ? EINVAL : apply_thread_role(role);
+
+	if (ec)
+	{
+		spdlog::warn("mvlcc_thread_apply_config: {}", strerror(ec));
+		errno = ec;
+		return -1;
+	}
+
+	return 0;
+}
+
+size_t mvlcc_thread_get_stats(mvlcc_thread_stats_t *stats, size_t max_count)
+{
+	const auto threads = thread_stats();
+	std::copy_n(std::begin(threads), std::min(max_count, threads.size()), stats);
+	return threads.size();
+}
+
+void mvlcc_trace_enable(size_t records_per_thread)
+{
+	trace_ring_enable(records_per_thread);
+}
+
+void mvlcc_trace_dump(FILE *out)
+{
+	assert(out);
+	trace_ring_dump(out);
+}
+
+mvlcc_const_span_t mvlcc_module_data_get_prefix(mvlcc_module_data_t md)
+{
+  mvlcc_const_span_t result = {md.data_span.data, md.prefix_size};
+  return result;
+}
+
+mvlcc_const_span_t mvlcc_module_data_get_dynamic(mvlcc_module_data_t md)
+{
+  mvlcc_const_span_t result = {md.data_span.data + md.prefix_size, md.dynamic_size};
+  return result;
+}
+
+mvlcc_const_span_t mvlcc_module_data_get_suffix(mvlcc_module_data_t md)
+{
+  mvlcc_const_span_t result = {md.data_span.data + md.prefix_size + md.dynamic_size, md.suffix_size};
+  return result;
+}
+
+int mvlcc_module_data_check_consistency(mvlcc_module_data_t md)
+{
+    uint64_t partSum = md.prefix_size + md.dynamic_size + md.suffix_size;
+    int sumOk = partSum == md.data_span.size;
+    // Note: cannot test the opposite: the current dynamicSize can be 0 but
+    // hasDynamic can be true at the same time, e.g. from empty block reads.
+    int dynOk = md.dynamic_size > 0 ? md.has_dynamic : 1;
+    return sumOk && dynOk;
+}
+
+struct mvlcc_readout_parser: public mvlcc_error_buffer
+{
+  // Shared with all other parsers created from the same config, see mvlcc_cache.h.
+  std::shared_ptr<const CrateConfig> crateConfig;
+  void *cUserContext;
+  event_data_callback_t *cEventData;
+  system_event_callback_t *cSystemEvent;
+  readout_parser::ReadoutParserCallbacks parserCallbacks;
+  readout_parser::ReadoutParserState readoutParser;
+  readout_parser::ReadoutParserCounters parserCounters;
+  std::vector<mvlcc_module_data_t> cModuleData;
+};
+
+static void event_data_internal(void *userContext, int crateIndex, int eventIndex,
+	const readout_parser::ModuleData *moduleDataList, unsigned moduleCount)
+{
+	auto d = reinterpret_cast<mvlcc_readout_parser *>(userContext);
+	d->cModuleData.resize(moduleCount);
+
+	for (size_t mi=0; mi<moduleCount; ++mi)
+	{
+		d->cModuleData[mi].data_span = { moduleDataList[mi].data.data, moduleDataList[mi].data.size };
+		d->cModuleData[mi].prefix_size = moduleDataList[mi].prefixSize;
+		d->cModuleData[mi].dynamic_size = moduleDataList[mi].dynamicSize;
+		d->cModuleData[mi].suffix_size = moduleDataList[mi].suffixSize;
+		d->cModuleData[mi].has_dynamic = moduleDataList[mi].hasDynamic;
+	}
+
+	MVLCC_TRACE_ENTRY(event_callback, eventIndex);
+	d->cEventData(d->cUserContext, crateIndex, eventIndex, d->cModuleData.data(), moduleCount);
+	MVLCC_TRACE_EXIT(event_callback, eventIndex);
+}
+
+static void system_event_internal(void *userContext, int crateIndex,
+	const u32 *header, u32 size)
+{
+	auto d = reinterpret_cast<mvlcc_readout_parser *>(userContext);
+	d->cSystemEvent(d->cUserContext, crateIndex, { header, size });
+}
+
+int mvlcc_readout_parser_create(
+  mvlcc_readout_parser_t *parserp,
+  mvlcc_crateconfig_t crateconfig,
+  void *userContext,
+  event_data_callback_t *event_data_callback,
+  system_event_callback_t *system_event_callback)
+{
+	auto d = set_d(*parserp, new mvlcc_readout_parser);
+
+	try
+	{
+		auto parserTemplate = cached_parser_template(get_d<mvlcc_crateconfig>(crateconfig)->config);
+		d->crateConfig = parserTemplate->config;
+		d->cUserContext = userContext;
+		d->cEventData = event_data_callback;
+		d->cSystemEvent = system_event_callback;
+		if (event_data_callback)
+			d->parserCallbacks.eventData = event_data_internal;
+		if (system_event_callback)
+			d->parserCallbacks.systemEvent = system_event_internal;
+		d->readoutParser = parserTemplate->state;
+		d->readoutParser.userContext = d;
+		return 0;
+	}
+	catch (const std::exception &e)
+	{
+		d->errorString = e.what();
+		return -1;
+	}
+}
+
+void mvlcc_readout_parser_destroy(mvlcc_readout_parser_t *parser)
+{
+	delete get_d<mvlcc_readout_parser>(*parser);
+	parser->d = 0;
+}
+
+mvlcc_parse_result_t mvlcc_readout_parser_parse_buffer(
+  mvlcc_readout_parser_t parser,
+  size_t linear_buffer_number,
+  const uint32_t *buffer,
+  size_t size)
+{
+	MVLCC_TRACE_ENTRY(parse_buffer, size);
+	auto d = get_d<mvlcc_readout_parser>(parser);
+
+	auto result = readout_parser::parse_readout_buffer(
+		d->crateConfig->connectionType,
+		d->readoutParser,
+		d->parserCallbacks,
+		d->parserCounters,
+		linear_buffer_number, buffer, size);
+
+	MVLCC_TRACE_EXIT(parse_buffer, static_cast<uint64_t>(result));
+	return static_cast<int>(result);
+}
+
+mvlcc_parse_result_t mvlcc_readout_parser_parse_buffer2(
+  mvlcc_readout_parser_t parser,
+  const mvlcc_readout_info_t *info,
+  const uint32_t *buffer)
+{
+	assert(info);
+	MVLCC_TRACE_ENTRY(parse_buffer, info->bytes_used / sizeof(uint32_t));
+	auto d = get_d<mvlcc_readout_parser>(parser);
+
+	auto result = readout_parser::parse_readout_buffer(
+		info->data_format == MVLCC_DATA_FORMAT_ETH_PACKETS ? ConnectionType::ETH : ConnectionType::USB,
+		d->readoutParser,
+		d->parserCallbacks,
+		d->parserCounters,
+		info->buffer_number, buffer, info->bytes_used / sizeof(uint32_t));
+
+	MVLCC_TRACE_EXIT(parse_buffer, static_cast<uint64_t>(result));
+	return static_cast<int>(result);
+}
+
+const char *mvlcc_parse_result_to_string(mvlcc_parse_result_t result)
 {
 	return readout_parser::get_parse_result_name(
 		static_cast<readout_parser::ParseResult>(result));
 }
+
+struct mvlcc_parser_pool: public mvlcc_error_buffer
+{
+	std::unique_ptr<ParserPool> pool;
+};
+
+int mvlcc_parser_pool_create(
+  mvlcc_parser_pool_t *poolp,
+  mvlcc_readout_parser_t template_parser,
+  unsigned threads,
+  int ordered,
+  size_t buffer_count,
+  size_t buffer_bytes)
+{
+	auto d = set_d(*poolp, new mvlcc_parser_pool);
+
+	try
+	{
+		auto parser = get_d<mvlcc_readout_parser>(template_parser);
+		ParserPoolOptions options;
+
+		if (threads)
+			options.threads = threads;
+		options.ordered = ordered;
+		options.bufferCount = buffer_count;
+		if (buffer_bytes)
+			options.bufferBytes = buffer_bytes;
+		options.userContext = parser->cUserContext;
+		options.eventData = parser->cEventData;
+		options.systemEvent = parser->cSystemEvent;
+
+		d->pool = std::make_unique<ParserPool>(parser->readoutParser, options);
+		return 0;
+	}
+	catch (const std::exception &e)
+	{
+		d->pool.reset();
+		d->errorString = e.what();
+		return -1;
+	}
+}
+
+void mvlcc_parser_pool_destroy(mvlcc_parser_pool_t *pool)
+{
+	delete get_d<mvlcc_parser_pool>(*pool);
+	pool->d = 0;
+}
+
+const char *mvlcc_parser_pool_strerror(mvlcc_parser_pool_t pool)
+{
+	auto d = get_d<mvlcc_parser_pool>(pool);
+	return d->errorString.c_str();
+}
+
+size_t mvlcc_parser_pool_buffer_bytes(mvlcc_parser_pool_t pool)
+{
+	return get_d<mvlcc_parser_pool>(pool)->pool->bufferBytes();
+}
+
+uint8_t *mvlcc_parser_pool_acquire_buffer(mvlcc_parser_pool_t pool, int timeout_ms)
+{
+	return get_d<mvlcc_parser_pool>(pool)->pool->acquire(std::chrono::milliseconds(timeout_ms));
+}
+
+int mvlcc_parser_pool_submit(mvlcc_parser_pool_t pool, uint8_t *buffer,
+  const mvlcc_readout_info_t *info)
+{
+	assert(info);
+	auto d = get_d<mvlcc_parser_pool>(pool);
+
+	try
+	{
+		d->pool->submit(buffer, *info);
+		return 0;
+	}
+	catch (const std::exception &e)
+	{
+		d->errorString = e.what();
+		return -1;
+	}
+}
+
+void mvlcc_parser_pool_flush(mvlcc_parser_pool_t pool)
+{
+	get_d<mvlcc_parser_pool>(pool)->pool->flush();
+}
+
+mvlcc_parser_pool_stats_t mvlcc_parser_pool_get_stats(mvlcc_parser_pool_t pool)
+{
+	const auto &counters = get_d<mvlcc_parser_pool>(pool)->pool->counters();
+	mvlcc_parser_pool_stats_t result = {};
+	result.buffers = counters.buffers;
+	result.events = counters.events;
+	result.system_events = counters.systemEvents;
+	result.parse_errors = counters.parseErrors;
+	return result;
+}
+
+int mvlcc_parser_pool_set_backpressure(mvlcc_parser_pool_t pool,
+  const mvlcc_backpressure_t *policy)
+{
+	assert(policy);
+	auto d = get_d<mvlcc_parser_pool>(pool);
+
+	try
+	{
+		d->pool->setBackpressure(*policy);
+		return 0;
+	}
+	catch (const std::exception &e)
+	{
+		d->errorString = e.what();
+		return -1;
+	}
+}
+
+mvlcc_backpressure_stats_t mvlcc_parser_pool_get_backpressure_stats(mvlcc_parser_pool_t pool)
+{
+	return get_d<mvlcc_parser_pool>(pool)->pool->backpressureStats();
+}
+
+struct mvlcc_shm_publisher: public mvlcc_error_buffer
+{
+	std::unique_ptr<ShmPublisher> publisher;
+};
+
+int mvlcc_shm_publisher_create(mvlcc_shm_publisher_t *pubp, const char *name,
+  size_t slot_count, size_t slot_bytes)
+{
+	auto d = set_d(*pubp, new mvlcc_shm_publisher);
+
+	try
+	{
+		d->publisher = std::make_unique<ShmPublisher>(name, slot_count, slot_bytes);
+		return 0;
+	}
+	catch (const std::exception &e)
+	{
+		d->errorString = e.what();
+		return -1;
+	}
+}
+
+void mvlcc_shm_publisher_destroy(mvlcc_shm_publisher_t *pub)
+{
+	delete get_d<mvlcc_shm_publisher>(*pub);
+	pub->d = 0;
+}
+
+const char *mvlcc_shm_publisher_strerror(mvlcc_shm_publisher_t pub)
+{
+	auto d = get_d<mvlcc_shm_publisher>(pub);
+	return d->errorString.c_str();
+}
+
+int mvlcc_shm_publisher_publish(mvlcc_shm_publisher_t pub, const uint8_t *data,
+  const mvlcc_readout_info_t *info)
+{
+	assert(info);
+	auto d = get_d<mvlcc_shm_publisher>(pub);
+
+	try
+	{
+		d->publisher->publish(data, *info);
+		return 0;
+	}
+	catch (const std::exception &e)
+	{
+		d->errorString = e.what();
+		return -1;
+	}
+}
+
+struct mvlcc_shm_reader: public mvlcc_error_buffer
+{
+	std::unique_ptr<ShmReader> reader;
+};
+
+int mvlcc_shm_reader_create(mvlcc_shm_reader_t *readerp, const char *name, int mode)
+{
+	auto d = set_d(*readerp, new mvlcc_shm_reader);
+
+	try
+	{
+		d->reader = std::make_unique<ShmReader>(name,
+			mode == MVLCC_SHM_READ_LATEST ? ShmReader::Mode::Latest : ShmReader::Mode::Next);
+		return 0;
+	}
+	catch (const std::exception &e)
+	{
+		d->errorString = e.what();
+		return -1;
+	}
+}
+
+void mvlcc_shm_reader_destroy(mvlcc_shm_reader_t *reader)
+{
+	delete get_d<mvlcc_shm_reader>(*reader);
+	reader->d = 0;
+}
+
+const char *mvlcc_shm_reader_strerror(mvlcc_shm_reader_t reader)
+{
+	auto d = get_d<mvlcc_shm_reader>(reader);
+	return d->errorString.c_str();
+}
+
+int mvlcc_shm_reader_read(mvlcc_shm_reader_t reader, uint8_t *dest, size_t bytes_free,
+  mvlcc_readout_info_t *info, int timeout_ms)
+{
+	assert(info);
+	auto d = get_d<mvlcc_shm_reader>(reader);
+	*info = {};
+
+	switch (d->reader->read(dest, bytes_free, *info, std::chrono::milliseconds(timeout_ms)))
+	{
+		case ShmReader::Result::Ok:
+		case ShmReader::Result::Timeout:
+			return 0;
+
+		case ShmReader::Result::Closed:
+			d->errorString = "shm reader: publisher closed the ring";
+			return -1;
+
+		case ShmReader::Result::TooSmall:
+			d->errorString = "shm reader: bytes_free is smaller than the slot size";
+			return -1;
+	}
+
+	return -1;
+}
+
+mvlcc_shm_reader_stats_t mvlcc_shm_reader_get_stats(mvlcc_shm_reader_t reader)
+{
+	auto d = get_d<mvlcc_shm_reader>(reader);
+	mvlcc_shm_reader_stats_t result = {};
+	result.buffers = d->reader->buffers();
+	result.lost_buffers = d->reader->lostBuffers();
+	result.slot_bytes = d->reader->slotBytes();
+	return result;
+}
+
+struct mvlcc_stream_server: public mvlcc_error_buffer
+{
+	std::unique_ptr<StreamServer> server;
+};
+
+int mvlcc_stream_server_create(mvlcc_stream_server_t *serverp, const char *address,
+  const mvlcc_stream_server_options_t *options)
+{
+	auto d = set_d(*serverp, new mvlcc_stream_server);
+
+	try
+	{
+		StreamServerOptions opts;
+
+		if (options)
+		{
+			if (options->buffer_count)
+				opts.bufferCount = options->buffer_count;
+			if (options->buffer_bytes)
+				opts.bufferBytes = options->buffer_bytes;
+			if (options->client_queue)
+				opts.clientQueue = options->client_queue;
+			opts.slowClientPolicy = options->slow_client_policy;
+		}
+
+		d->server = std::make_unique<StreamServer>(address, opts);
+		return 0;
+	}
+	catch (const std::exception &e)
+	{
+		d->errorString = e.what();
+		return -1;
+	}
+}
+
+void mvlcc_stream_server_destroy(mvlcc_stream_server_t *server)
+{
+	delete get_d<mvlcc_stream_server>(*server);
+	server->d = 0;
+}
+
+const char *mvlcc_stream_server_strerror(mvlcc_stream_server_t server)
+{
+	auto d = get_d<mvlcc_stream_server>(server);
+	return d->errorString.c_str();
+}
+
+int mvlcc_stream_server_port(mvlcc_stream_server_t server)
+{
+	return get_d<mvlcc_stream_server>(server)->server->port();
+}
+
+size_t mvlcc_stream_server_buffer_bytes(mvlcc_stream_server_t server)
+{
+	return get_d<mvlcc_stream_server>(server)->server->bufferBytes();
+}
+
+uint8_t *mvlcc_stream_server_acquire_buffer(mvlcc_stream_server_t server, int timeout_ms)
+{
+	return get_d<mvlcc_stream_server>(server)->server->acquire(std::chrono::milliseconds(timeout_ms));
+}
+
+int mvlcc_stream_server_submit(mvlcc_stream_server_t server, uint8_t *buffer,
+  const mvlcc_readout_info_t *info)
+{
+	assert(info);
+	auto d = get_d<mvlcc_stream_server>(server);
+
+	try
+	{
+		d->server->submit(buffer, *info);
+		return 0;
+	}
+	catch (const std::exception &e)
+	{
+		d->errorString = e.what();
+		return -1;
+	}
+}
+
+mvlcc_stream_server_stats_t mvlcc_stream_server_get_stats(mvlcc_stream_server_t server)
+{
+	return get_d<mvlcc_stream_server>(server)->server->stats();
+}
+
+int mvlcc_stream_server_set_backpressure(mvlcc_stream_server_t server,
+  const mvlcc_backpressure_t *policy)
+{
+	assert(policy);
+	auto d = get_d<mvlcc_stream_server>(server);
+
+	try
+	{
+		d->server->setBackpressure(*policy);
+		return 0;
+	}
+	catch (const std::exception &e)
+	{
+		d->errorString = e.what();
+		return -1;
+	}
+}
+
+mvlcc_backpressure_stats_t mvlcc_stream_server_get_backpressure_stats(mvlcc_stream_server_t server)
+{
+	return get_d<mvlcc_stream_server>(server)->server->backpressureStats();
+}
+
+int mvlcc_stream_decode_header(const uint8_t *header, mvlcc_readout_info_t *info,
+  uint64_t *dropped_buffers)
+{
+	assert(info);
+	uint64_t dropped = 0;
+
+	if (!decode_stream_header(header, *info, dropped))
+		return -1;
+
+	if (dropped_buffers)
+		*dropped_buffers = dropped;
+
+	return 0;
+}
+
+void mvlcc_config_cache_set_enabled(int enabled)
+{
+	config_cache_set_enabled(enabled);
+}
+
+void mvlcc_config_cache_set_capacity(size_t capacity)
+{
+	config_cache_set_capacity(capacity);
+}
+
+size_t mvlcc_config_cache_get_capacity(void)
+{
+	return config_cache_get_capacity();
+}
+
+void mvlcc_config_cache_clear(void)
+{
+	config_cache_clear();
+}
+
+mvlcc_config_cache_stats_t mvlcc_config_cache_get_stats(void)
+{
+	auto stats = config_cache_get_stats();
+	mvlcc_config_cache_stats_t result = {};
+	result.config_entries = stats.configEntries;
+	result.parser_entries = stats.parserEntries;
+	result.config_hits = stats.configHits;
+	result.config_misses = stats.configMisses;
+	result.parser_hits = stats.parserHits;
+	result.parser_misses = stats.parserMisses;
+	result.evictions = stats.evictions;
+	return result;
+}
+
+uint64_t mvlcc_crateconfig_hash(mvlcc_crateconfig_t crateconfig)
+{
+	return crate_config_hash(get_d<mvlcc_crateconfig>(crateconfig)->config);
+}
+
+struct mvlcc_eth_emulator: public mvlcc_error_buffer
+{
+	std::unique_ptr<EthEmulator> emulator;
+};
+
+int mvlcc_eth_emulator_create(mvlcc_eth_emulator_t *emup, const mvlcc_eth_emulator_params_t *params)
+{
+	auto d = set_d(*emup, new mvlcc_eth_emulator);
+
+	try
+	{
+		EthEmulatorOptions options;
+
+		if (params)
+		{
+			if (params->bind_address)
+				options.bindAddress = params->bind_address;
+			if (params->command_port)
+				options.commandPort = params->command_port;
+			options.dataLoss = params->data_loss;
+			options.commandLoss = params->command_loss;
+			options.reorder = params->reorder;
+			options.malformed = params->malformed;
+			options.dataRateBytesPerS = params->data_rate_bytes_per_s;
+			options.jumboFrames = params->jumbo_frames;
+			options.sim = sim_params_from_c(params->sim);
+		}
+
+		d->emulator = std::make_unique<EthEmulator>(options);
+		d->emulator->start();
+		return 0;
+	}
+	catch (const std::exception &e)
+	{
+		d->emulator.reset();
+		d->errorString = e.what();
+		return -1;
+	}
+}
+
+void mvlcc_eth_emulator_destroy(mvlcc_eth_emulator_t *emu)
+{
+	delete get_d<mvlcc_eth_emulator>(*emu);
+	emu->d = 0;
+}
+
+const char *mvlcc_eth_emulator_strerror(mvlcc_eth_emulator_t emu)
+{
+	auto d = get_d<mvlcc_eth_emulator>(emu);
+	return d->errorString.c_str();
+}
+
+mvlcc_eth_emulator_stats_t mvlcc_eth_emulator_get_stats(mvlcc_eth_emulator_t emu)
+{
+	auto d = get_d<mvlcc_eth_emulator>(emu);
+	mvlcc_eth_emulator_stats_t result = {};
+
+	if (d->emulator)
+	{
+		const auto &stats = d->emulator->stats();
+		result.command_requests = stats.commandRequests;
+		result.stack_execs = stats.stackExecs;
+		result.packets_sent = stats.packetsSent;
+		result.packets_dropped = stats.packetsDropped;
+		result.packets_reordered = stats.packetsReordered;
+		result.packets_malformed = stats.packetsMalformed;
+		result.data_bytes_sent = stats.dataBytesSent;
+	}
+
+	return result;
+}
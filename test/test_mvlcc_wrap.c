@@ -3,9 +3,14 @@
 #include "minunit.h"
 
 #include <assert.h>
+#include <errno.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 MU_TEST(test_mvlcc_command_t_good)
 {
@@ -171,6 +176,1547 @@ void test_mvlcc_crateconfig_t()
     mvlcc_crateconfig_destroy(&crateConfig);
 }
 
+void test_mvlcc_command_list_t_binary()
+{
+    mvlcc_command_list_t cmdList1;
+    int res = mvlcc_command_list_from_text(&cmdList1, "vme_read 0x09 d16 0x12345678\nvme_read 0x0a d32 0x87654321");
+    mu_assert_int_eq(0, res);
+
+    size_t size = 0;
+    uint8_t *data = mvlcc_command_list_to_binary(cmdList1, &size);
+    mu_check(data != NULL);
+    mu_check(size > 0);
+
+    mvlcc_command_list_t cmdList2;
+    res = mvlcc_command_list_from_binary(&cmdList2, data, size);
+    mu_assert_int_eq(0, res);
+    mu_check(mvlcc_command_list_eq(cmdList1, cmdList2));
+    mvlcc_command_list_destroy(&cmdList2);
+
+    // truncated input must be rejected
+    res = mvlcc_command_list_from_binary(&cmdList2, data, size - 1);
+    mu_check(res != 0);
+    mu_check(strlen(mvlcc_command_list_strerror(cmdList2)) > 0);
+    mvlcc_command_list_destroy(&cmdList2);
+
+    free(data);
+    mvlcc_command_list_destroy(&cmdList1);
+
+    // a single command ends the input: its group's command count must be
+    // accepted with exactly one encoded command left
+    res = mvlcc_command_list_from_text(&cmdList1, "vme_write 0x09 d16 0x1000 0x1");
+    mu_assert_int_eq(0, res);
+    data = mvlcc_command_list_to_binary(cmdList1, &size);
+    mu_check(data != NULL);
+    res = mvlcc_command_list_from_binary(&cmdList2, data, size);
+    mu_assert_int_eq(0, res);
+    mu_check(mvlcc_command_list_eq(cmdList1, cmdList2));
+    mvlcc_command_list_destroy(&cmdList2);
+    free(data);
+    mvlcc_command_list_destroy(&cmdList1);
+}
+
+void test_mvlcc_crateconfig_t_binary()
+{
+    mvlcc_crateconfig_t crateConfig1 = mvlcc_createconfig_create();
+
+    mvlcc_command_list_t cmdList;
+    int res = mvlcc_command_list_from_text(&cmdList, "vme_read 0x09 d16 0x12345678\nvme_read 0x0a d32 0x87654321");
+    mu_assert_int_eq(0, res);
+    res = mvlcc_crateconfig_set_readout_stack(crateConfig1, 1, cmdList);
+    mu_assert_int_eq(0, res);
+    mvlcc_command_list_destroy(&cmdList);
+
+    size_t size = 0;
+    uint8_t *data = mvlcc_crateconfig_to_binary(crateConfig1, &size);
+    mu_check(data != NULL);
+
+    mvlcc_crateconfig_t crateConfig2;
+    res = mvlcc_crateconfig_from_binary(&crateConfig2, data, size);
+    mu_assert_int_eq(0, res);
+
+    char *yaml1 = mvlcc_crateconfig_to_yaml(crateConfig1);
+    char *yaml2 = mvlcc_crateconfig_to_yaml(crateConfig2);
+    mu_assert_string_eq(yaml1, yaml2);
+    free(yaml1);
+    free(yaml2);
+    mvlcc_crateconfig_destroy(&crateConfig2);
+
+    // a command list is not a crate config
+    res = mvlcc_crateconfig_from_binary(&crateConfig2, (const uint8_t *)"MVCB\x01\x00\x01\x00", 8);
+    mu_check(res != 0);
+    mu_check(strlen(mvlcc_crateconfig_strerror(crateConfig2)) > 0);
+    mvlcc_crateconfig_destroy(&crateConfig2);
+
+    free(data);
+    mvlcc_crateconfig_destroy(&crateConfig1);
+}
+
+void test_mvlcc_config_cache()
+{
+    mvlcc_config_cache_set_enabled(1);
+    mvlcc_config_cache_clear();
+
+    mvlcc_crateconfig_t crateConfig = mvlcc_createconfig_create();
+    mvlcc_command_list_t cmdList;
+    int res = mvlcc_command_list_from_text(&cmdList, "vme_read 0x09 d16 0x12345678");
+    mu_assert_int_eq(0, res);
+    res = mvlcc_crateconfig_set_readout_stack(crateConfig, 0, cmdList);
+    mu_assert_int_eq(0, res);
+
+    mvlcc_readout_parser_t parser1, parser2;
+    res = mvlcc_readout_parser_create(&parser1, crateConfig, NULL, NULL, NULL);
+    mu_assert_int_eq(0, res);
+    res = mvlcc_readout_parser_create(&parser2, crateConfig, NULL, NULL, NULL);
+    mu_assert_int_eq(0, res);
+
+    mvlcc_config_cache_stats_t stats = mvlcc_config_cache_get_stats();
+    mu_assert_uint_eq(1, stats.parser_entries);
+    mu_assert_uint_eq(1, stats.parser_misses);
+    mu_assert_uint_eq(1, stats.parser_hits);
+
+    char *yaml = mvlcc_crateconfig_to_yaml(crateConfig);
+    mvlcc_crateconfig_t fromYaml1, fromYaml2;
+    mu_assert_int_eq(0, mvlcc_crateconfig_from_yaml(&fromYaml1, yaml));
+    mu_assert_int_eq(0, mvlcc_crateconfig_from_yaml(&fromYaml2, yaml));
+    stats = mvlcc_config_cache_get_stats();
+    mu_assert_uint_eq(1, stats.config_hits);
+    mu_check(mvlcc_crateconfig_hash(fromYaml1) == mvlcc_crateconfig_hash(fromYaml2));
+
+    // modifying the config changes the hash
+    uint64_t hash = mvlcc_crateconfig_hash(crateConfig);
+    mvlcc_crateconfig_set_readout_stack(crateConfig, 1, cmdList);
+    mu_check(hash != mvlcc_crateconfig_hash(crateConfig));
+
+    free(yaml);
+    mvlcc_crateconfig_destroy(&fromYaml1);
+    mvlcc_crateconfig_destroy(&fromYaml2);
+    mvlcc_readout_parser_destroy(&parser1);
+    mvlcc_readout_parser_destroy(&parser2);
+
+    // LRU eviction beyond the capacity: three distinct configs, A is used
+    // again before C is added, so B is dropped
+    mvlcc_config_cache_clear();
+    mvlcc_config_cache_set_capacity(2);
+    mu_assert_uint_eq(2, mvlcc_config_cache_get_capacity());
+    char *yamls[3];
+    for (int i = 0; i < 3; ++i)
+    {
+        mvlcc_crateconfig_set_readout_stack(crateConfig, 2 + i, cmdList);
+        yamls[i] = mvlcc_crateconfig_to_yaml(crateConfig);
+    }
+    mvlcc_crateconfig_t fromYaml[5];
+    mu_assert_int_eq(0, mvlcc_crateconfig_from_yaml(&fromYaml[0], yamls[0]));
+    mu_assert_int_eq(0, mvlcc_crateconfig_from_yaml(&fromYaml[1], yamls[1]));
+    mu_assert_int_eq(0, mvlcc_crateconfig_from_yaml(&fromYaml[2], yamls[0]));
+    mu_assert_int_eq(0, mvlcc_crateconfig_from_yaml(&fromYaml[3], yamls[2]));
+    stats = mvlcc_config_cache_get_stats();
+    mu_assert_uint_eq(2, stats.config_entries);
+    mu_assert_uint_eq(1, stats.evictions);
+    mu_assert_uint_eq(1, stats.config_hits);
+    mu_assert_int_eq(0, mvlcc_crateconfig_from_yaml(&fromYaml[4], yamls[1]));
+    stats = mvlcc_config_cache_get_stats();
+    mu_assert_uint_eq(1, stats.config_hits);
+    mu_assert_uint_eq(4, stats.config_misses);
+    mu_assert_uint_eq(2, stats.config_entries);
+
+    // shrinking evicts immediately
+    mvlcc_config_cache_set_capacity(0);
+    stats = mvlcc_config_cache_get_stats();
+    mu_assert_uint_eq(0, stats.config_entries);
+
+    for (int i = 0; i < 5; ++i)
+        mvlcc_crateconfig_destroy(&fromYaml[i]);
+    for (int i = 0; i < 3; ++i)
+        free(yamls[i]);
+    mvlcc_config_cache_set_capacity(32);
+    mvlcc_command_list_destroy(&cmdList);
+    mvlcc_crateconfig_destroy(&crateConfig);
+    mvlcc_config_cache_clear();
+}
+
+void test_mvlcc_command_list_optimize()
+{
+    mvlcc_command_list_t cmdList;
+    int res = mvlcc_command_list_from_text(&cmdList,
+        "vme_read 0x09 d32 0x00006000\n"
+        "vme_read 0x09 d32 0x00006004\n"
+        "vme_read 0x09 d32 0x00006008\n"
+        "vme_read 0x09 d32 0x0000600c\n"
+        "wait 10\n"
+        "wait 20\n"
+        "wait 0\n"
+        "vme_read 0x09 d16 0x00006010\n");
+    mu_assert_int_eq(0, res);
+    mu_assert_uint_eq(8, mvlcc_command_list_total_size(cmdList));
+
+    mvlcc_stack_optimize_report_t report;
+    res = mvlcc_command_list_optimize(cmdList, NULL, &report);
+    mu_assert_int_eq(0, res);
+    mu_assert_uint_eq(8, report.commands_before);
+    mu_assert_uint_eq(3, report.commands_after);
+    mu_assert_uint_eq(3, mvlcc_command_list_total_size(cmdList));
+    mu_assert_uint_eq(4, report.merged_reads);
+    mu_check(report.bus_time_after_ns < report.bus_time_before_ns);
+    mu_check(report.fits_stack_memory);
+
+    mvlcc_command_t cmd = mvlcc_command_list_get_command(cmdList, 0);
+    mu_assert_uint_eq(0x6000u, mvlcc_command_get_vme_address(cmd));
+    mvlcc_command_destroy(&cmd);
+
+    // a tiny stack memory limit makes the optimizer fail, the list is kept
+    mvlcc_stack_optimize_options_t options = { MVLCC_OPTIMIZE_ALL, 0, 1, NULL, 0 };
+    res = mvlcc_command_list_optimize(cmdList, &options, &report);
+    mu_check(res != 0);
+    mu_check(strlen(mvlcc_command_list_strerror(cmdList)) > 0);
+    mu_assert_uint_eq(3, mvlcc_command_list_total_size(cmdList));
+
+    mvlcc_command_list_destroy(&cmdList);
+
+    // software delays are only dropped from readout stacks
+    res = mvlcc_command_list_from_text(&cmdList,
+        "vme_write 0x09 d16 0x00006000 0x1\n"
+        "software_delay 10\n"
+        "vme_write 0x09 d16 0x00006002 0x1\n");
+    mu_assert_int_eq(0, res);
+    res = mvlcc_command_list_optimize(cmdList, NULL, &report);
+    mu_assert_int_eq(0, res);
+    mu_assert_uint_eq(3, mvlcc_command_list_total_size(cmdList));
+    mvlcc_stack_optimize_options_t readoutOptions = { MVLCC_OPTIMIZE_ALL, 0, 0, NULL, 1 };
+    res = mvlcc_command_list_optimize(cmdList, &readoutOptions, &report);
+    mu_assert_int_eq(0, res);
+    mu_assert_uint_eq(2, mvlcc_command_list_total_size(cmdList));
+    mu_assert_uint_eq(1, report.removed_commands);
+
+    mvlcc_command_list_destroy(&cmdList);
+}
+
+void test_mvlcc_crateconfig_estimate_readout()
+{
+    mvlcc_crateconfig_t crateConfig = mvlcc_createconfig_create();
+    mvlcc_command_list_t cmdList;
+    int res = mvlcc_command_list_from_text(&cmdList,
+        "vme_read 0x09 d32 0x00006000\n"
+        "vme_read 0x0b 0x00000000 1000\n");
+    mu_assert_int_eq(0, res);
+    res = mvlcc_crateconfig_set_readout_stack(crateConfig, 2, cmdList);
+    mu_assert_int_eq(0, res);
+
+    mvlcc_timing_model_t model;
+    mvlcc_timing_model_init(&model);
+    model.link_bytes_per_s = 0;
+
+    mvlcc_readout_estimate_t estimate;
+    res = mvlcc_crateconfig_estimate_readout(crateConfig, &model, &estimate);
+    mu_assert_int_eq(0, res);
+    mu_assert_uint_eq(1, estimate.stack_count);
+    mu_assert_uint_eq(2, estimate.stacks[0].stack_index);
+    mu_assert_uint_eq(1, estimate.stacks[0].bottleneck_command_index);
+    mu_check(estimate.stacks[0].bus_time_ns > model.block_setup_ns + 1000 * model.blt_word_ns);
+    // frame header + single read + block frame header + block data
+    mu_assert_uint_eq((3 + 1000) * 4, estimate.stacks[0].bytes_per_event);
+    mu_check(estimate.stacks[0].max_trigger_rate_hz > 0.0);
+    mu_check(!estimate.stacks[0].link_limited);
+    mu_check(estimate.fits_stack_memory);
+
+    // a slow link limits the rate
+    model.link_bytes_per_s = 1000.0;
+    res = mvlcc_crateconfig_estimate_readout(crateConfig, &model, &estimate);
+    mu_assert_int_eq(0, res);
+    mu_check(estimate.stacks[0].link_limited);
+    mvlcc_command_list_destroy(&cmdList);
+
+    // an odd word count of a 64-bit MBLT read still takes its last beat
+    res = mvlcc_command_list_from_text(&cmdList, "vme_read 0x08 0x00000000 100\n");
+    mu_assert_int_eq(0, res);
+    res = mvlcc_crateconfig_set_readout_stack(crateConfig, 2, cmdList);
+    mu_assert_int_eq(0, res);
+    model.link_bytes_per_s = 0;
+    model.assumed_block_words = 1;
+    res = mvlcc_crateconfig_estimate_readout(crateConfig, &model, &estimate);
+    mu_assert_int_eq(0, res);
+    double oneWordNs = estimate.stacks[0].bus_time_ns;
+    model.assumed_block_words = 2;
+    res = mvlcc_crateconfig_estimate_readout(crateConfig, &model, &estimate);
+    mu_assert_int_eq(0, res);
+    mu_check(oneWordNs == estimate.stacks[0].bus_time_ns);
+
+    mvlcc_command_list_destroy(&cmdList);
+    mvlcc_crateconfig_destroy(&crateConfig);
+}
+
+static MVLCC_DEFINE_EVENT_CALLBACK(count_sim_events)
+{
+    (void) crateIndex;
+    size_t *counts = (size_t *) userContext;
+    if (eventIndex == 0 && moduleCount == 1
+        && moduleDataList[0].prefix_size == 2
+        && moduleDataList[0].dynamic_size == 10
+        && moduleDataList[0].data_span.data[0] == 0x87654321u)
+        ++counts[0];
+    else
+        ++counts[1];
+}
+
+/* Simulated crate reading out a marker, a single and a block read with
+ * stack 0, connected, initialized and in DAQ mode. Returns 0 on success. */
+static int start_sim_readout(int connectionType, mvlcc_crateconfig_t *crateConfig, mvlcc_t *mvlc)
+{
+    *crateConfig = mvlcc_createconfig_create();
+    mvlcc_command_list_t cmdList;
+    int res = mvlcc_command_list_from_text(&cmdList,
+        "marker 0x87654321\n"
+        "vme_read 0x09 d32 0x00006000\n"
+        "vme_read 0x0b 0x00000000 1000\n");
+    if (res)
+        return res;
+    res = mvlcc_crateconfig_set_readout_stack(*crateConfig, 0, cmdList);
+    mvlcc_command_list_destroy(&cmdList);
+    if (res || (res = mvlcc_crateconfig_set_connection_type(*crateConfig, connectionType)))
+        return res;
+
+    mvlcc_sim_params_t params = { 0.0, 10, 1 };
+    *mvlc = mvlcc_make_mvlc_sim(*crateConfig, &params);
+    if ((res = mvlcc_connect(*mvlc)) || (res = mvlcc_init_readout2(*mvlc, *crateConfig)))
+        return res;
+    return mvlcc_set_daq_mode(*mvlc, 1);
+}
+
+static void stop_sim_readout(mvlcc_crateconfig_t *crateConfig, mvlcc_t mvlc)
+{
+    mvlcc_disconnect(mvlc);
+    mvlcc_free_mvlc(mvlc);
+    mvlcc_crateconfig_destroy(crateConfig);
+}
+
+void test_mvlcc_sim()
+{
+    mvlcc_crateconfig_t crateConfig;
+    mvlcc_t mvlc;
+    mu_assert_int_eq(0, start_sim_readout(MVLCC_CONNECTION_USB, &crateConfig, &mvlc));
+    mu_check(mvlcc_is_sim(mvlc));
+
+    uint32_t value = 0;
+    mu_assert_int_eq(0, mvlcc_single_vme_write(mvlc, 0x6000, 0x1234, 32, 32));
+    mu_assert_int_eq(0, mvlcc_single_vme_read(mvlc, 0x6000, &value, 32, 32));
+    mu_assert_int_eq(0x1234, value);
+
+    size_t counts[2] = { 0, 0 };
+    mvlcc_readout_parser_t parser;
+    int res = mvlcc_readout_parser_create(&parser, crateConfig, counts, count_sim_events, NULL);
+    mu_assert_int_eq(0, res);
+
+    mvlcc_readout_context_t ctx = mvlcc_readout_context_create2(mvlc);
+    static uint32_t buffer[1u << 14];
+
+    for (size_t bufferNumber = 1; bufferNumber <= 4; ++bufferNumber)
+    {
+        size_t bytes = 0;
+        res = mvlcc_readout(ctx, (uint8_t *) buffer, sizeof(buffer), &bytes, 100);
+        mu_assert_int_eq(0, res);
+        mu_check(bytes > 0);
+        mvlcc_readout_parser_parse_buffer(parser, bufferNumber, buffer, bytes / sizeof(uint32_t));
+    }
+
+    mu_check(counts[0] > 0);
+    mu_assert_uint_eq(0, counts[1]);
+
+    mvlcc_readout_stats_t stats;
+    mu_assert_int_eq(0, mvlcc_readout_context_get_stats(ctx, &stats));
+    mu_assert_uint_eq(4, stats.reads);
+    mu_assert_uint_eq(4, stats.buffers);
+    mu_assert_uint_eq(0, stats.empty_reads + stats.timeouts + stats.errors);
+    mu_check(stats.bytes > 0);
+    uint64_t filled = 0;
+    for (size_t i = 0; i < MVLCC_READOUT_FILL_BUCKETS; ++i)
+        filled += stats.fill_histogram[i];
+    mu_assert_uint_eq(4, filled);
+
+    mvlcc_readout_context_destroy(&ctx);
+    mvlcc_readout_parser_destroy(&parser);
+    stop_sim_readout(&crateConfig, mvlc);
+
+    /* Simulator URLs: params are parsed, invalid ones are not ignored. */
+    mvlc = mvlcc_make_mvlc("sim://?rate=1000&block_words=10&seed=2");
+    mu_check(mvlcc_is_sim(mvlc));
+    mu_assert_int_eq(0, mvlcc_connect(mvlc));
+    mvlcc_disconnect(mvlc);
+    mvlcc_free_mvlc(mvlc);
+
+    const char *invalidUrls[] = { "sim://?rate=fast", "sim://?rate=1000&bogus=1",
+        "sim:///nonexistent/crate.yaml" };
+    for (size_t i = 0; i < sizeof(invalidUrls) / sizeof(invalidUrls[0]); ++i)
+    {
+        mvlc = mvlcc_make_mvlc(invalidUrls[i]);
+        mu_assert_int_eq(0, mvlcc_is_mvlc_valid(mvlc));
+        mvlcc_free_mvlc(mvlc);
+    }
+}
+
+void test_mvlcc_init_readout_diff()
+{
+    mvlcc_crateconfig_t crateConfig = mvlcc_createconfig_create();
+    mvlcc_command_list_t cmdList;
+    int res = mvlcc_command_list_from_text(&cmdList,
+        "marker 0x87654321\n"
+        "vme_read 0x09 d32 0x00006000\n");
+    mu_assert_int_eq(0, res);
+    res = mvlcc_crateconfig_set_readout_stack(crateConfig, 0, cmdList);
+    mu_assert_int_eq(0, res);
+
+    mvlcc_sim_params_t params = { 0.0, 10, 1 };
+    mvlcc_t mvlc = mvlcc_make_mvlc_sim(crateConfig, &params);
+    mu_assert_int_eq(0, mvlcc_connect(mvlc));
+
+    mvlcc_init_diff_t diff;
+    mu_assert_int_eq(0, mvlcc_init_readout_diff(mvlc, crateConfig, &diff));
+    mu_assert_int_eq(1, diff.full_init);
+    mu_assert_int_eq(0, mvlcc_set_daq_mode(mvlc, 1));
+
+    mvlcc_readout_context_t ctx = mvlcc_readout_context_create2(mvlc);
+    static uint32_t buffer[1u << 12];
+    size_t bytes = 0;
+
+    // changing the stacks of a live readout: DAQ mode is enabled again
+    // afterwards and the new stack is read out
+    res = mvlcc_crateconfig_set_readout_stack(crateConfig, 1, cmdList);
+    mu_assert_int_eq(0, res);
+    mu_assert_int_eq(0, mvlcc_init_readout_diff(mvlc, crateConfig, &diff));
+    mu_assert_int_eq(0, diff.full_init);
+    mu_assert_int_eq(1, diff.stacks_uploaded);
+    mu_assert_int_eq(1, diff.triggers_applied);
+    uint32_t daqMode = 0;
+    mu_assert_int_eq(0, mvlcc_register_read(mvlc, 0x1300, &daqMode));
+    mu_assert_uint_eq(1, daqMode);
+    mu_assert_int_eq(0, mvlcc_readout(ctx, (uint8_t *) buffer, sizeof(buffer), &bytes, 100));
+    mu_check(bytes > 0);
+
+    // the full init fallback of a live readout restores DAQ mode too
+    mvlcc_forget_applied_config(mvlc);
+    mu_assert_int_eq(0, mvlcc_init_readout_diff(mvlc, crateConfig, &diff));
+    mu_assert_int_eq(1, diff.full_init);
+    mu_assert_int_eq(1, diff.triggers_applied);
+    mu_assert_int_eq(0, mvlcc_register_read(mvlc, 0x1300, &daqMode));
+    mu_assert_uint_eq(1, daqMode);
+    mu_assert_int_eq(0, mvlcc_readout(ctx, (uint8_t *) buffer, sizeof(buffer), &bytes, 100));
+    mu_check(bytes > 0);
+
+    // mvlcc_stop() disables the triggers, a diff of the unchanged config arms
+    // them again but leaves DAQ mode off
+    mu_assert_int_eq(0, mvlcc_stop(mvlc));
+    mu_assert_int_eq(0, mvlcc_set_daq_mode(mvlc, 1));
+    mu_assert_int_eq(0, mvlcc_readout(ctx, (uint8_t *) buffer, sizeof(buffer), &bytes, 10));
+    mu_assert_uint_eq(0, bytes);
+    mu_assert_int_eq(0, mvlcc_stop(mvlc));
+
+    mu_assert_int_eq(0, mvlcc_init_readout_diff(mvlc, crateConfig, &diff));
+    mu_assert_int_eq(0, diff.full_init);
+    mu_assert_int_eq(0, diff.stacks_uploaded);
+    mu_assert_int_eq(1, diff.triggers_applied);
+    mu_assert_int_eq(0, mvlcc_register_read(mvlc, 0x1300, &daqMode));
+    mu_assert_uint_eq(0, daqMode);
+    mu_assert_int_eq(0, mvlcc_set_daq_mode(mvlc, 1));
+    mu_assert_int_eq(0, mvlcc_readout(ctx, (uint8_t *) buffer, sizeof(buffer), &bytes, 100));
+    mu_check(bytes > 0);
+
+    mvlcc_readout_context_destroy(&ctx);
+    mvlcc_disconnect(mvlc);
+    mvlcc_free_mvlc(mvlc);
+    mvlcc_command_list_destroy(&cmdList);
+    mvlcc_crateconfig_destroy(&crateConfig);
+}
+
+void test_mvlcc_cmd_counters()
+{
+    mvlcc_crateconfig_t crateConfig = mvlcc_createconfig_create();
+    mvlcc_t mvlc = mvlcc_make_mvlc_sim(crateConfig, NULL);
+    mu_assert_int_eq(0, mvlcc_connect(mvlc));
+
+    mvlcc_cmd_counters_t prev, now, delta;
+    memset(&prev, 0xff, sizeof(prev));
+    mu_assert_int_eq(0, mvlcc_get_cmd_counters(mvlc, &prev));
+    mu_assert_uint_eq(0, prev.stack_transactions);
+    mu_assert_int_eq(0, prev.is_ethernet);
+    mu_assert_uint_eq(0, prev.eth_pipes[MVLCC_PIPE_DATA].lost_packets);
+
+    now = prev;
+    now.super_transactions = 10;
+    now.stack_transaction_retries = 3;
+    now.cmd_stack_ref_mismatches = 2;
+    now.eth_pipes[MVLCC_PIPE_DATA].lost_packets = 7;
+    now.eth_pipes[MVLCC_PIPE_DATA].socket_drops = 5;
+    now.eth_pipes[MVLCC_PIPE_DATA].rcvbuf_bytes = 1u << 20;
+    prev.super_transactions = 4;
+    prev.eth_pipes[MVLCC_PIPE_DATA].rcvbuf_bytes = 1u << 16;
+    mvlcc_cmd_counters_delta(&now, &prev, &delta);
+    mu_assert_uint_eq(6, delta.super_transactions);
+    mu_assert_uint_eq(3, delta.stack_transaction_retries);
+    mu_assert_uint_eq(2, delta.cmd_stack_ref_mismatches);
+    mu_assert_uint_eq(7, delta.eth_pipes[MVLCC_PIPE_DATA].lost_packets);
+    mu_assert_uint_eq(0, delta.eth_pipes[MVLCC_PIPE_COMMAND].lost_packets);
+    mu_assert_uint_eq(5, delta.eth_pipes[MVLCC_PIPE_DATA].socket_drops);
+    mu_assert_uint_eq(1u << 20, delta.eth_pipes[MVLCC_PIPE_DATA].rcvbuf_bytes);
+
+    mvlcc_disconnect(mvlc);
+    mvlcc_free_mvlc(mvlc);
+    mvlcc_crateconfig_destroy(&crateConfig);
+}
+
+void test_mvlcc_eth_emulator()
+{
+    mvlcc_eth_emulator_params_t params;
+    memset(&params, 0, sizeof(params));
+    mvlcc_eth_emulator_t emu;
+    mu_assert_int_eq(0, mvlcc_eth_emulator_create(&emu, &params));
+
+    mvlcc_t mvlc = mvlcc_make_mvlc_eth("127.0.0.1");
+    mu_assert_int_eq(0, mvlcc_connect(mvlc));
+
+    // each VME access is answered with a super response on the command
+    // channel and a stack response on the stack channel, both numbered
+    // separately: no gaps in either
+    uint32_t value = 0;
+    for (uint32_t i = 0; i < 10; ++i)
+    {
+        mu_assert_int_eq(0, mvlcc_single_vme_write(mvlc, 0x6000 + i * 4, i, 32, 32));
+        mu_assert_int_eq(0, mvlcc_single_vme_read(mvlc, 0x6000 + i * 4, &value, 32, 32));
+        mu_assert_uint_eq(i, value);
+    }
+
+    mvlcc_cmd_counters_t counters;
+    mu_assert_int_eq(0, mvlcc_get_cmd_counters(mvlc, &counters));
+    mu_assert_int_eq(1, counters.is_ethernet);
+    mu_check(counters.eth_pipes[MVLCC_PIPE_COMMAND].received_packets >= 40);
+    mu_assert_uint_eq(0, counters.eth_pipes[MVLCC_PIPE_COMMAND].lost_packets);
+
+    mvlcc_eth_emulator_stats_t stats = mvlcc_eth_emulator_get_stats(emu);
+    mu_check(stats.stack_execs >= 20);
+    mu_assert_uint_eq(0, stats.packets_dropped);
+
+    mvlcc_disconnect(mvlc);
+    mvlcc_free_mvlc(mvlc);
+    mvlcc_eth_emulator_destroy(&emu);
+}
+
+/* Emulated ETH crate reading out a marker and a block read with stack 0,
+ * connected and initialized. Returns 0 on success. */
+static int start_emulator_readout(const mvlcc_eth_emulator_params_t *params, mvlcc_eth_emulator_t *emu,
+    mvlcc_crateconfig_t *crateConfig, mvlcc_t *mvlc)
+{
+    int res = mvlcc_eth_emulator_create(emu, params);
+    if (res)
+        return res;
+
+    *crateConfig = mvlcc_createconfig_create();
+    mvlcc_command_list_t cmdList;
+    res = mvlcc_command_list_from_text(&cmdList,
+        "marker 0x87654321\n"
+        "vme_read 0x0b 0x00000000 1000\n");
+    if (res)
+        return res;
+    res = mvlcc_crateconfig_set_readout_stack(*crateConfig, 0, cmdList);
+    mvlcc_command_list_destroy(&cmdList);
+    if (res || (res = mvlcc_crateconfig_set_connection_type(*crateConfig, MVLCC_CONNECTION_ETH)))
+        return res;
+
+    *mvlc = mvlcc_make_mvlc_eth("127.0.0.1");
+    if ((res = mvlcc_connect(*mvlc)))
+        return res;
+    return mvlcc_init_readout2(*mvlc, *crateConfig);
+}
+
+/* Enables DAQ mode and reads until packet_count data packets have been
+ * received, then disables it and reads until the timeout, so that all packets
+ * sent by the emulator are accounted for. Checks that the packets are back to
+ * back and returns their number. */
+static uint64_t read_emulator_packets(mvlcc_t mvlc, mvlcc_readout_context_t ctx, uint64_t packet_count)
+{
+    static uint32_t buffer[1u << 14];
+    mvlcc_readout_info_t info;
+    int daq_mode = 1;
+    uint64_t packets = 0;
+
+    if (mvlcc_set_daq_mode(mvlc, 1))
+        return 0;
+
+    while (mvlcc_readout2(ctx, (uint8_t *) buffer, sizeof(buffer), &info, daq_mode ? 1000 : 300) == 0)
+    {
+        // dropped packets leave no holes: each packet directly follows the
+        // data words of the previous one
+        size_t pos = 0;
+        while (pos < info.bytes_used / sizeof(uint32_t))
+        {
+            if (((buffer[pos] >> 28) & 0x3) != 2) // data channel
+                return 0;
+            pos += 2 + (buffer[pos] & 0x1fff);
+            ++packets;
+        }
+        if (pos != info.bytes_used / sizeof(uint32_t))
+            return 0;
+
+        if (daq_mode && packets >= packet_count)
+        {
+            if (mvlcc_set_daq_mode(mvlc, 0))
+                return 0;
+            daq_mode = 0;
+        }
+    }
+
+    return daq_mode ? 0 : packets;
+}
+
+static void stop_emulator_readout(mvlcc_eth_emulator_t *emu, mvlcc_crateconfig_t *crateConfig, mvlcc_t mvlc)
+{
+    mvlcc_disconnect(mvlc);
+    mvlcc_free_mvlc(mvlc);
+    mvlcc_crateconfig_destroy(crateConfig);
+    mvlcc_eth_emulator_destroy(emu);
+}
+
+void test_mvlcc_eth_batch()
+{
+    mvlcc_eth_emulator_params_t params;
+    memset(&params, 0, sizeof(params));
+    params.data_loss = 0.05;
+    params.malformed = 0.1;
+    params.data_rate_bytes_per_s = 2e6;
+    params.sim.seed = 1;
+    mvlcc_eth_emulator_t emu;
+    mvlcc_crateconfig_t crateConfig;
+    mvlcc_t mvlc;
+    mu_assert_int_eq(0, start_emulator_readout(&params, &emu, &crateConfig, &mvlc));
+
+    mvlcc_readout_context_t ctx = mvlcc_readout_context_create2(mvlc);
+    mvlcc_eth_batch_options_t batch_options = { 16, 1 << 22, 0 };
+    mu_assert_int_eq(0, mvlcc_readout_context_set_eth_batch(ctx, &batch_options));
+
+    // no data before DAQ mode is enabled: a timeout, as without batching
+    static uint32_t buffer[1u << 14];
+    mvlcc_readout_info_t info;
+    mu_check(mvlcc_readout2(ctx, (uint8_t *) buffer, sizeof(buffer), &info, 10) != 0);
+    mu_assert_uint_eq(0, info.bytes_used);
+
+    uint64_t packets = read_emulator_packets(mvlc, ctx, 300);
+    mu_check(packets >= 300);
+
+    mvlcc_readout_stats_t stats;
+    mu_assert_int_eq(0, mvlcc_readout_context_get_stats(ctx, &stats));
+    mu_assert_uint_eq(2, stats.timeouts);
+    mu_assert_uint_eq(0, stats.errors);
+
+    mvlcc_eth_batch_stats_t batch_stats;
+    mu_assert_int_eq(0, mvlcc_readout_context_get_eth_batch_stats(ctx, &batch_stats));
+    mvlcc_eth_emulator_stats_t emu_stats = mvlcc_eth_emulator_get_stats(emu);
+    mu_assert_uint_eq(packets, batch_stats.packets);
+    // losses after the last received packet cannot be seen
+    mu_check(batch_stats.lost_packets > 0);
+    mu_check(batch_stats.lost_packets <= emu_stats.packets_dropped);
+    mu_check(batch_stats.truncated_packets > 0);
+    mu_check(batch_stats.short_packets > 0);
+    mu_assert_uint_eq(emu_stats.packets_malformed, batch_stats.truncated_packets + batch_stats.short_packets);
+
+    mvlcc_readout_context_destroy(&ctx);
+    stop_emulator_readout(&emu, &crateConfig, mvlc);
+}
+
+void test_mvlcc_eth_socket_stats()
+{
+    mvlcc_eth_emulator_params_t params;
+    memset(&params, 0, sizeof(params));
+    params.data_rate_bytes_per_s = 2e6;
+    params.sim.seed = 1;
+    mvlcc_eth_emulator_t emu;
+    mvlcc_crateconfig_t crateConfig;
+    mvlcc_t mvlc;
+    mu_assert_int_eq(0, start_emulator_readout(&params, &emu, &crateConfig, &mvlc));
+
+    // both sockets are found in /proc/net/udp
+    mvlcc_cmd_counters_t counters;
+    mu_assert_int_eq(0, mvlcc_get_cmd_counters(mvlc, &counters));
+    mu_assert_int_eq(1, counters.is_ethernet);
+    mu_check(counters.eth_pipes[MVLCC_PIPE_COMMAND].rcvbuf_bytes > 0);
+    mu_check(counters.eth_pipes[MVLCC_PIPE_DATA].rcvbuf_bytes > 0);
+    mu_assert_uint_eq(0, counters.eth_pipes[MVLCC_PIPE_DATA].rx_queue_bytes);
+    mu_assert_uint_eq(0, counters.eth_pipes[MVLCC_PIPE_DATA].socket_drops);
+
+    mvlcc_readout_context_t ctx = mvlcc_readout_context_create2(mvlc);
+    mvlcc_eth_batch_options_t batch_options = { 16, 1 << 20, 0 };
+    mu_assert_int_eq(0, mvlcc_readout_context_set_eth_batch(ctx, &batch_options));
+
+    // data is queued in the socket until it is read
+    mu_assert_int_eq(0, mvlcc_set_daq_mode(mvlc, 1));
+    usleep(100 * 1000);
+    mu_assert_int_eq(0, mvlcc_get_cmd_counters(mvlc, &counters));
+    mu_check(counters.eth_pipes[MVLCC_PIPE_DATA].rx_queue_bytes > 0);
+
+    uint64_t packets = read_emulator_packets(mvlc, ctx, 300);
+    mu_check(packets >= 300);
+
+    // the data pipe counts include batched receive, also after switching it
+    // off, and gaps from socket drops are counted as lost packets
+    mvlcc_eth_batch_stats_t batch_stats;
+    mu_assert_int_eq(0, mvlcc_readout_context_get_eth_batch_stats(ctx, &batch_stats));
+    mu_assert_uint_eq(packets, batch_stats.packets);
+    mu_assert_int_eq(0, mvlcc_readout_context_set_eth_batch(ctx, NULL));
+
+    mu_assert_int_eq(0, mvlcc_get_cmd_counters(mvlc, &counters));
+    const mvlcc_eth_pipe_stats_t *data = &counters.eth_pipes[MVLCC_PIPE_DATA];
+    mu_check(data->received_packets >= packets);
+    mu_check(data->lost_packets >= batch_stats.lost_packets);
+    mu_check(data->lost_packets >= data->socket_drops);
+    mu_assert_uint_eq(0, data->rx_queue_bytes);
+
+    mvlcc_readout_context_destroy(&ctx);
+    stop_emulator_readout(&emu, &crateConfig, mvlc);
+}
+
+void test_mvlcc_trace()
+{
+    mvlcc_crateconfig_t crateConfig = mvlcc_createconfig_create();
+    mvlcc_t mvlc = mvlcc_make_mvlc_sim(crateConfig, NULL);
+    mu_assert_int_eq(0, mvlcc_connect(mvlc));
+    mvlcc_readout_context_t ctx = mvlcc_readout_context_create2(mvlc);
+
+    mvlcc_trace_enable(4);
+    uint8_t buffer[1024];
+    for (int i = 0; i < 3; ++i)
+        mvlcc_readout(ctx, buffer, sizeof(buffer), NULL, 1);
+    mvlcc_trace_enable(0);
+
+    char *text = NULL;
+    size_t textSize = 0;
+    FILE *out = open_memstream(&text, &textSize);
+    mvlcc_trace_dump(out);
+    fclose(out);
+
+    /* 6 events recorded into a ring of 4 */
+    mu_check(strstr(text, "4 records (6 total)") != NULL);
+    mu_check(strstr(text, "readout_entry") != NULL);
+    mu_check(strstr(text, "readout_exit") != NULL);
+    free(text);
+
+    mvlcc_readout_context_destroy(&ctx);
+    mvlcc_free_mvlc(mvlc);
+    mvlcc_crateconfig_destroy(&crateConfig);
+}
+
+void test_mvlcc_command_log()
+{
+    mvlcc_crateconfig_t crateConfig = mvlcc_createconfig_create();
+    mvlcc_t mvlc = mvlcc_make_mvlc_sim(crateConfig, NULL);
+    mu_assert_int_eq(0, mvlcc_connect(mvlc));
+
+    mvlcc_command_t cmd;
+    mu_assert_int_eq(0, mvlcc_command_from_string(&cmd, "vme_write 0x09 d32 0x00006000 0x1234"));
+    for (int i = 0; i < 70; ++i)
+        mu_assert_int_eq(0, mvlcc_run_command(mvlc, cmd, NULL, 0, NULL));
+    mvlcc_command_destroy(&cmd);
+
+    /* Block reads are logged with their command type and transfer count. */
+    static uint32_t blockData[37];
+    size_t blockWords = 0;
+    struct MvlccBlockReadParams params = { 0x0b, 0, 0 };
+    mu_assert_int_eq(0, mvlcc_vme_block_read(mvlc, 0x10000, blockData, 37, &blockWords, params));
+
+    char *text = NULL;
+    size_t textSize = 0;
+    FILE *out = open_memstream(&text, &textSize);
+    mvlcc_dump_command_log(out, mvlc);
+    fclose(out);
+
+    /* Only the last 64 commands are kept. */
+    size_t lines = 0;
+    for (const char *c = text; *c; ++c)
+        lines += *c == '\n';
+    mu_assert_uint_eq(64, lines);
+    mu_check(strstr(text, "ec=0") != NULL);
+    const char *blockLine = strstr(text, "vme_read_mem ");
+    mu_check(blockLine != NULL);
+    mu_check(strstr(blockLine, " 37'") != NULL);
+    free(text);
+
+    mvlcc_free_mvlc(mvlc);
+    mvlcc_crateconfig_destroy(&crateConfig);
+}
+
+typedef struct
+{
+    mvlcc_t mvlc;
+    uint16_t address;
+    int errors;
+} register_poller_t;
+
+static void *poll_registers(void *arg)
+{
+    register_poller_t *poller = (register_poller_t *) arg;
+
+    for (uint32_t i = 0; i < 1000; ++i)
+    {
+        uint32_t value = 0;
+        if (mvlcc_register_write(poller->mvlc, poller->address, i)
+            || mvlcc_register_read(poller->mvlc, poller->address, &value)
+            || value != i)
+            ++poller->errors;
+    }
+
+    return NULL;
+}
+
+void test_mvlcc_concurrent_commands()
+{
+    mvlcc_crateconfig_t crateConfig = mvlcc_createconfig_create();
+    mvlcc_t mvlc = mvlcc_make_mvlc_sim(crateConfig, NULL);
+    mu_assert_int_eq(0, mvlcc_connect(mvlc));
+    mu_assert_int_eq(0, mvlcc_init_readout2(mvlc, crateConfig));
+    mu_assert_int_eq(0, mvlcc_set_daq_mode(mvlc, 1));
+
+    register_poller_t pollers[2] = { { mvlc, 0x2000, 0 }, { mvlc, 0x2004, 0 } };
+    pthread_t threads[2];
+    for (int i = 0; i < 2; ++i)
+        pthread_create(&threads[i], NULL, poll_registers, &pollers[i]);
+
+    /* Readout on the data pipe while the pollers use the command pipe. */
+    mvlcc_readout_context_t ctx = mvlcc_readout_context_create2(mvlc);
+    static uint8_t buffer[1u << 14];
+    for (int i = 0; i < 10; ++i)
+        mu_assert_int_eq(0, mvlcc_readout(ctx, buffer, sizeof(buffer), NULL, 1));
+
+    for (int i = 0; i < 2; ++i)
+    {
+        pthread_join(threads[i], NULL);
+        mu_assert_int_eq(0, pollers[i].errors);
+    }
+
+    mvlcc_readout_context_destroy(&ctx);
+    mvlcc_disconnect(mvlc);
+    mvlcc_free_mvlc(mvlc);
+    mvlcc_crateconfig_destroy(&crateConfig);
+}
+
+void test_mvlcc_strerror()
+{
+    mu_check(strcmp(mvlcc_strerror(ENOTCONN), strerror(ENOTCONN)) == 0);
+    mu_check(strcmp(mvlcc_strerror(-ENOTCONN), strerror(ENOTCONN)) == 0);
+    mu_check(strcmp(mvlcc_strerror(-1), "generic failure") == 0);
+    mu_check(strcmp(mvlcc_strerror_category(MVLCC_ERROR_SYSTEM, EIO), strerror(EIO)) == 0);
+    mu_check(strcmp(mvlcc_strerror_category(MVLCC_ERROR_MVLC, -1), "<unknown error>") == 0);
+    mu_check(strlen(mvlcc_strerror(1)) > 0);
+    /* Stable pointers, no per call buffers */
+    mu_check(mvlcc_strerror(1) == mvlcc_strerror(1));
+}
+
+void test_mvlcc_readout_aligned()
+{
+    /* ETH packets are unpacked into a frame stream in aligned mode. */
+    mvlcc_crateconfig_t crateConfig;
+    mvlcc_t mvlc;
+    mu_assert_int_eq(0, start_sim_readout(MVLCC_CONNECTION_ETH, &crateConfig, &mvlc));
+
+    mvlcc_readout_context_t ctx = mvlcc_readout_context_create2(mvlc);
+    mu_assert_int_eq(0, mvlcc_readout_context_set_aligned(ctx, 1));
+
+    static uint32_t buffer[MVLCC_READOUT_ALIGNED_MIN_BYTES / 4];
+    mvlcc_readout_info_t info;
+    mu_assert_int_eq(-1, mvlcc_readout2(ctx, (uint8_t *) buffer, 1024, &info, 100));
+    mu_check(strlen(mvlcc_readout_context_strerror(ctx)) > 0);
+    uint64_t last_monotonic_ns = 0;
+    uint64_t packets = 0;
+
+    for (size_t expected = 1; expected <= 4; ++expected)
+    {
+        mu_assert_int_eq(0, mvlcc_readout2(ctx, (uint8_t *) buffer, sizeof(buffer), &info, 100));
+        mu_assert_uint_eq(expected, info.buffer_number);
+        mu_assert_int_eq(MVLCC_DATA_FORMAT_FRAMES, info.data_format);
+        mu_assert_int_eq(MVLCC_READOUT_FLAG_ALIGNED, info.flags);
+        mu_assert_int_eq(0xf3, buffer[0] >> 24);
+        mu_assert_int_eq(0, info.crate_index);
+        mu_assert_int_eq(MVLCC_CONNECTION_ETH, info.connection_type);
+        mu_check(info.monotonic_ns > last_monotonic_ns);
+        last_monotonic_ns = info.monotonic_ns;
+        packets += info.packets;
+        mu_assert_uint_eq(0, info.lost_packets);
+        mu_assert_uint_eq(0, info.dropped_bytes);
+
+        /* Each buffer parses on its own with a fresh parser. */
+        size_t counts[2] = { 0, 0 };
+        mvlcc_readout_parser_t parser;
+        mu_assert_int_eq(0, mvlcc_readout_parser_create(&parser, crateConfig, counts, count_sim_events, NULL));
+        mu_assert_int_eq(0, mvlcc_readout_parser_parse_buffer2(parser, &info, buffer));
+        mu_check(counts[0] > 0);
+        mu_assert_uint_eq(0, counts[1]);
+        mvlcc_readout_parser_destroy(&parser);
+    }
+
+    mu_check(packets > 0);
+
+    /* Batched receive needs the socket of a real ETH connection. */
+    mvlcc_eth_batch_options_t batch_options = { 0, 0, 0 };
+    mvlcc_eth_batch_stats_t batch_stats;
+    mu_assert_int_eq(-1, mvlcc_readout_context_set_eth_batch(ctx, &batch_options));
+    mu_assert_int_eq(-1, mvlcc_readout_context_get_eth_batch_stats(ctx, &batch_stats));
+    mu_assert_int_eq(0, mvlcc_readout_context_set_eth_batch(ctx, NULL));
+
+    mvlcc_readout_context_destroy(&ctx);
+    stop_sim_readout(&crateConfig, mvlc);
+}
+
+/* Order sensitive hash of the event data. counts[0] is the hash, counts[1] the
+ * number of events. */
+static MVLCC_DEFINE_EVENT_CALLBACK(hash_sim_events)
+{
+    (void) crateIndex;
+    (void) eventIndex;
+    size_t *counts = (size_t *) userContext;
+    for (unsigned mi = 0; mi < moduleCount; ++mi)
+        for (size_t i = 0; i < moduleDataList[mi].data_span.size; ++i)
+            counts[0] = counts[0] * 31 + moduleDataList[mi].data_span.data[i];
+    ++counts[1];
+}
+
+void test_mvlcc_parser_pool()
+{
+    mvlcc_crateconfig_t crateConfig;
+    mvlcc_t mvlc;
+    mu_assert_int_eq(0, start_sim_readout(MVLCC_CONNECTION_USB, &crateConfig, &mvlc));
+
+    mvlcc_readout_context_t ctx = mvlcc_readout_context_create2(mvlc);
+    mu_assert_int_eq(0, mvlcc_readout_context_set_aligned(ctx, 1));
+
+    size_t poolCounts[2] = { 0, 0 };
+    mvlcc_readout_parser_t poolParser;
+    mu_assert_int_eq(0, mvlcc_readout_parser_create(&poolParser, crateConfig, poolCounts, hash_sim_events, NULL));
+    mvlcc_parser_pool_t pool;
+    int res = mvlcc_parser_pool_create(&pool, poolParser, 3, 1, 0, MVLCC_READOUT_ALIGNED_MIN_BYTES);
+    mu_assert_int_eq(0, res);
+    mu_assert_uint_eq(MVLCC_READOUT_ALIGNED_MIN_BYTES, mvlcc_parser_pool_buffer_bytes(pool));
+
+    /* Keep copies of the buffers to parse them sequentially for comparison. */
+    enum { BufferCount = 32 };
+    static uint32_t copies[BufferCount][MVLCC_READOUT_ALIGNED_MIN_BYTES / 4];
+    mvlcc_readout_info_t infos[BufferCount];
+
+    for (size_t i = 0; i < BufferCount; ++i)
+    {
+        uint8_t *buffer = mvlcc_parser_pool_acquire_buffer(pool, 1000);
+        mu_check(buffer != NULL);
+        mu_assert_int_eq(0, mvlcc_readout2(ctx, buffer, MVLCC_READOUT_ALIGNED_MIN_BYTES, &infos[i], 100));
+        memcpy(copies[i], buffer, infos[i].bytes_used);
+        mu_assert_int_eq(0, mvlcc_parser_pool_submit(pool, buffer, &infos[i]));
+    }
+
+    uint32_t foreign[4];
+    mu_check(mvlcc_parser_pool_submit(pool, (uint8_t *) foreign, &infos[0]) != 0);
+    mu_check(strlen(mvlcc_parser_pool_strerror(pool)) > 0);
+
+    /* Buffers of non-aligned readouts and split events are rejected and
+     * returned to the pool unparsed. */
+    mvlcc_readout_info_t invalid = infos[0];
+    const uint32_t invalidFlags[3] = { 0, MVLCC_READOUT_FLAG_ALIGNED | MVLCC_READOUT_FLAG_CONTINUED,
+        MVLCC_READOUT_FLAG_ALIGNED | MVLCC_READOUT_FLAG_CONTINUES_PREVIOUS };
+    for (size_t i = 0; i < 3; ++i)
+    {
+        uint8_t *buffer = mvlcc_parser_pool_acquire_buffer(pool, 1000);
+        mu_check(buffer != NULL);
+        invalid.flags = invalidFlags[i];
+        mu_assert_int_eq(-1, mvlcc_parser_pool_submit(pool, buffer, &invalid));
+        mu_check(strlen(mvlcc_parser_pool_strerror(pool)) > 0);
+    }
+
+    mvlcc_parser_pool_flush(pool);
+
+    size_t seqCounts[2] = { 0, 0 };
+    mvlcc_readout_parser_t seqParser;
+    mu_assert_int_eq(0, mvlcc_readout_parser_create(&seqParser, crateConfig, seqCounts, hash_sim_events, NULL));
+    for (size_t i = 0; i < BufferCount; ++i)
+        mu_assert_int_eq(0, mvlcc_readout_parser_parse_buffer2(seqParser, &infos[i], copies[i]));
+
+    mu_check(seqCounts[1] > BufferCount);
+    mu_assert_uint_eq(seqCounts[1], poolCounts[1]);
+    mu_check(seqCounts[0] == poolCounts[0]);
+
+    mvlcc_parser_pool_stats_t stats = mvlcc_parser_pool_get_stats(pool);
+    mu_assert_uint_eq(BufferCount, stats.buffers);
+    mu_assert_uint_eq(seqCounts[1], stats.events);
+    mu_assert_uint_eq(0, stats.parse_errors);
+
+    mvlcc_backpressure_stats_t bpStats = mvlcc_parser_pool_get_backpressure_stats(pool);
+    mu_assert_uint_eq(BufferCount, bpStats.offered);
+    mu_assert_uint_eq(BufferCount, bpStats.accepted);
+
+    mvlcc_backpressure_t policy = { (mvlcc_backpressure_mode_t) 42, 0 };
+    mu_assert_int_eq(-1, mvlcc_parser_pool_set_backpressure(pool, &policy));
+
+    /* Every 4th buffer of 8 is parsed. */
+    policy.mode = MVLCC_BACKPRESSURE_SAMPLE;
+    policy.sample_every = 4;
+    mu_assert_int_eq(0, mvlcc_parser_pool_set_backpressure(pool, &policy));
+    for (size_t i = 0; i < 8; ++i)
+    {
+        mvlcc_readout_info_t info;
+        uint8_t *buffer = mvlcc_parser_pool_acquire_buffer(pool, 1000);
+        mu_check(buffer != NULL);
+        mu_assert_int_eq(0, mvlcc_readout2(ctx, buffer, MVLCC_READOUT_ALIGNED_MIN_BYTES, &info, 100));
+        mu_assert_int_eq(0, mvlcc_parser_pool_submit(pool, buffer, &info));
+    }
+    mvlcc_parser_pool_flush(pool);
+    stats = mvlcc_parser_pool_get_stats(pool);
+    mu_assert_uint_eq(BufferCount + 2, stats.buffers);
+    mu_assert_uint_eq(0, stats.parse_errors);
+    bpStats = mvlcc_parser_pool_get_backpressure_stats(pool);
+    mu_assert_uint_eq(BufferCount + 8, bpStats.offered);
+    mu_assert_uint_eq(6, bpStats.sampled_out);
+
+    /* With all buffers taken acquire does not wait but hands out a scratch
+     * buffer, discarded on submit. */
+    policy.mode = MVLCC_BACKPRESSURE_DROP_NEWEST;
+    mu_assert_int_eq(0, mvlcc_parser_pool_set_backpressure(pool, &policy));
+    uint8_t *taken[12];
+    for (size_t i = 0; i < 12; ++i)
+        taken[i] = mvlcc_parser_pool_acquire_buffer(pool, 0);
+    uint8_t *scratch = mvlcc_parser_pool_acquire_buffer(pool, 1000);
+    mu_check(scratch != NULL);
+    for (size_t i = 0; i < 12; ++i)
+        mu_check(taken[i] != scratch);
+    mu_assert_int_eq(0, mvlcc_parser_pool_submit(pool, scratch, &infos[0]));
+    mvlcc_readout_info_t empty = {};
+    for (size_t i = 0; i < 12; ++i)
+        mu_assert_int_eq(0, mvlcc_parser_pool_submit(pool, taken[i], &empty));
+    bpStats = mvlcc_parser_pool_get_backpressure_stats(pool);
+    mu_assert_uint_eq(1, bpStats.dropped_newest);
+    mu_assert_uint_eq(bpStats.offered, bpStats.accepted + bpStats.dropped_newest + bpStats.sampled_out);
+
+    mvlcc_parser_pool_destroy(&pool);
+    mvlcc_readout_parser_destroy(&seqParser);
+    mvlcc_readout_parser_destroy(&poolParser);
+    mvlcc_readout_context_destroy(&ctx);
+    stop_sim_readout(&crateConfig, mvlc);
+}
+
+/* Hashes the events like hash_sim_events() but first waits until the gate is
+ * open, to stall the parser pool workers. */
+typedef struct
+{
+    size_t counts[2];
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int open;
+    int waiting; /* set once a worker waits at the gate */
+} event_gate_t;
+
+static MVLCC_DEFINE_EVENT_CALLBACK(gated_hash_events)
+{
+    event_gate_t *gate = (event_gate_t *) userContext;
+    pthread_mutex_lock(&gate->mutex);
+    gate->waiting = 1;
+    pthread_cond_broadcast(&gate->cond);
+    while (!gate->open)
+        pthread_cond_wait(&gate->cond, &gate->mutex);
+    pthread_mutex_unlock(&gate->mutex);
+    hash_sim_events(gate->counts, crateIndex, eventIndex, moduleDataList, moduleCount);
+}
+
+static void gate_close(event_gate_t *gate)
+{
+    pthread_mutex_lock(&gate->mutex);
+    gate->open = 0;
+    gate->waiting = 0;
+    pthread_mutex_unlock(&gate->mutex);
+}
+
+static void gate_open(event_gate_t *gate)
+{
+    pthread_mutex_lock(&gate->mutex);
+    gate->open = 1;
+    pthread_cond_broadcast(&gate->cond);
+    pthread_mutex_unlock(&gate->mutex);
+}
+
+static void gate_wait_for_worker(event_gate_t *gate)
+{
+    pthread_mutex_lock(&gate->mutex);
+    while (!gate->waiting)
+        pthread_cond_wait(&gate->cond, &gate->mutex);
+    pthread_mutex_unlock(&gate->mutex);
+}
+
+/* Reads into an acquired pool buffer and submits it, keeping a copy. */
+static int submit_pool_readout(mvlcc_parser_pool_t pool, mvlcc_readout_context_t ctx,
+    uint32_t *copy, mvlcc_readout_info_t *info)
+{
+    uint8_t *buffer = mvlcc_parser_pool_acquire_buffer(pool, 1000);
+    if (!buffer)
+        return -1;
+    int res = mvlcc_readout2(ctx, buffer, MVLCC_READOUT_ALIGNED_MIN_BYTES, info, 100);
+    if (res)
+        return res;
+    memcpy(copy, buffer, info->bytes_used);
+    return mvlcc_parser_pool_submit(pool, buffer, info);
+}
+
+void test_mvlcc_parser_pool_backpressure()
+{
+    mvlcc_crateconfig_t crateConfig;
+    mvlcc_t mvlc;
+    mu_assert_int_eq(0, start_sim_readout(MVLCC_CONNECTION_USB, &crateConfig, &mvlc));
+
+    mvlcc_readout_context_t ctx = mvlcc_readout_context_create2(mvlc);
+    mu_assert_int_eq(0, mvlcc_readout_context_set_aligned(ctx, 1));
+
+    event_gate_t gate = { { 0, 0 }, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0 };
+    mvlcc_readout_parser_t poolParser;
+    mu_assert_int_eq(0, mvlcc_readout_parser_create(&poolParser, crateConfig, &gate, gated_hash_events, NULL));
+    /* One ordered worker and four buffers. */
+    mvlcc_parser_pool_t pool;
+    mu_assert_int_eq(0, mvlcc_parser_pool_create(&pool, poolParser, 1, 1, 4, MVLCC_READOUT_ALIGNED_MIN_BYTES));
+
+    static uint32_t copies[8][MVLCC_READOUT_ALIGNED_MIN_BYTES / 4];
+    mvlcc_readout_info_t infos[8];
+
+    /* BLOCK: with the worker stalled on the first buffer and the other three
+     * queued, acquire waits for a free buffer until its timeout. */
+    mu_assert_int_eq(0, submit_pool_readout(pool, ctx, copies[0], &infos[0]));
+    gate_wait_for_worker(&gate);
+    for (size_t i = 1; i < 4; ++i)
+        mu_assert_int_eq(0, submit_pool_readout(pool, ctx, copies[i], &infos[i]));
+    mvlcc_backpressure_stats_t bpStats = mvlcc_parser_pool_get_backpressure_stats(pool);
+    mu_assert_uint_eq(0, bpStats.blocked);
+    mu_check(mvlcc_parser_pool_acquire_buffer(pool, 50) == NULL);
+    bpStats = mvlcc_parser_pool_get_backpressure_stats(pool);
+    mu_assert_uint_eq(1, bpStats.blocked);
+    mu_check(bpStats.blocked_ns >= 50 * 1000000ull);
+    gate_open(&gate);
+    mvlcc_parser_pool_flush(pool);
+
+    /* DROP_OLDEST: buffers 1 to 4 are still queued when 4 to 7 need their
+     * place. Evicting 1 queues a delivery token, which is at the head when 4
+     * is evicted. 0, 5, 6 and 7 are delivered in this order. */
+    mvlcc_backpressure_t policy = { MVLCC_BACKPRESSURE_DROP_OLDEST, 0 };
+    mu_assert_int_eq(0, mvlcc_parser_pool_set_backpressure(pool, &policy));
+    gate_close(&gate);
+    gate.counts[0] = gate.counts[1] = 0;
+    mu_assert_int_eq(0, submit_pool_readout(pool, ctx, copies[0], &infos[0]));
+    gate_wait_for_worker(&gate);
+    for (size_t i = 1; i < 8; ++i)
+        mu_assert_int_eq(0, submit_pool_readout(pool, ctx, copies[i], &infos[i]));
+    bpStats = mvlcc_parser_pool_get_backpressure_stats(pool);
+    mu_assert_uint_eq(4, bpStats.dropped_oldest);
+    gate_open(&gate);
+    mvlcc_parser_pool_flush(pool);
+
+    size_t seqCounts[2] = { 0, 0 };
+    mvlcc_readout_parser_t seqParser;
+    mu_assert_int_eq(0, mvlcc_readout_parser_create(&seqParser, crateConfig, seqCounts, hash_sim_events, NULL));
+    const size_t delivered[4] = { 0, 5, 6, 7 };
+    for (size_t i = 0; i < 4; ++i)
+        mu_assert_int_eq(0, mvlcc_readout_parser_parse_buffer2(seqParser, &infos[delivered[i]], copies[delivered[i]]));
+    mu_assert_uint_eq(seqCounts[1], gate.counts[1]);
+    mu_check(seqCounts[0] == gate.counts[0]);
+
+    mvlcc_parser_pool_stats_t stats = mvlcc_parser_pool_get_stats(pool);
+    mu_assert_uint_eq(8, stats.buffers);
+    mu_assert_uint_eq(0, stats.parse_errors);
+    bpStats = mvlcc_parser_pool_get_backpressure_stats(pool);
+    mu_assert_uint_eq(12, bpStats.offered);
+    mu_assert_uint_eq(12, bpStats.accepted);
+    mu_assert_uint_eq(0, bpStats.dropped_newest);
+    mu_assert_uint_eq(bpStats.offered, bpStats.accepted + bpStats.dropped_newest + bpStats.sampled_out);
+
+    mvlcc_parser_pool_destroy(&pool);
+    mvlcc_readout_parser_destroy(&seqParser);
+    mvlcc_readout_parser_destroy(&poolParser);
+    mvlcc_readout_context_destroy(&ctx);
+    stop_sim_readout(&crateConfig, mvlc);
+}
+
+static size_t hook_allocs = 0;
+static size_t hook_frees = 0;
+
+static void *counting_alloc(void *user, size_t bytes)
+{
+    (void) user;
+    ++hook_allocs;
+    return malloc(bytes);
+}
+
+static void counting_free(void *user, void *ptr, size_t bytes)
+{
+    (void) user;
+    (void) bytes;
+    ++hook_frees;
+    free(ptr);
+}
+
+void test_mvlcc_buffer_alloc()
+{
+    mvlcc_allocator_t allocator = { counting_alloc, counting_free, NULL };
+    mvlcc_set_allocator(&allocator);
+    uint8_t *buffer = mvlcc_buffer_alloc(4096);
+    mu_check(buffer != NULL);
+    memset(buffer, 0xff, 4096);
+    mvlcc_buffer_free(buffer);
+    mu_assert_uint_eq(1, hook_allocs);
+    mu_assert_uint_eq(1, hook_frees);
+    mvlcc_set_allocator(NULL);
+
+    /* Falls back to transparent hugepages and first touch placement when
+     * there are no reserved hugepages or no NUMA support. */
+    mvlcc_buffer_alloc_options_t options = { 1, MVLCC_NUMA_NODE_LOCAL };
+    mvlcc_set_buffer_alloc_options(&options);
+    buffer = mvlcc_buffer_alloc(3u << 20);
+    mu_check(buffer != NULL);
+    mu_assert_uint_eq(0, (uintptr_t) buffer & ((2u << 20) - 1));
+    mu_assert_int_eq(0, buffer[(3u << 20) - 1]);
+    mvlcc_buffer_free(buffer);
+    mvlcc_set_buffer_alloc_options(NULL);
+
+    mu_assert_uint_eq(1, hook_allocs);
+    mu_assert_int_eq(-1, mvlcc_numa_node_of_interface("lo"));
+}
+
+/* Results of thread_config_main(), checked on the main thread. */
+typedef struct
+{
+    int applied;
+    size_t found;
+} thread_config_result_t;
+
+static void *thread_config_main(void *arg)
+{
+    thread_config_result_t *result = (thread_config_result_t *) arg;
+    result->applied = mvlcc_thread_apply_config(MVLCC_THREAD_WRITER);
+
+    /* Burn some CPU time. */
+    volatile uint64_t sum = 0;
+    for (uint64_t i = 0; i < 1000000; ++i)
+        sum += i;
+
+    mvlcc_thread_stats_t stats[16];
+    size_t count = mvlcc_thread_get_stats(stats, 16);
+    for (size_t i = 0; i < count && i < 16; ++i)
+    {
+        if (stats[i].role == MVLCC_THREAD_WRITER && strcmp(stats[i].name, "mvlcc-test") == 0
+            && stats[i].cpu_ns > 0)
+            ++result->found;
+    }
+    return NULL;
+}
+
+void test_mvlcc_thread_config()
+{
+    mvlcc_thread_config_t config = { "x", 0, NULL };
+    mu_assert_int_eq(-1, mvlcc_thread_set_config(MVLCC_THREAD_WRITER, &config));
+    config.cpus = "3-1";
+    mu_assert_int_eq(-1, mvlcc_thread_set_config(MVLCC_THREAD_WRITER, &config));
+    config.cpus = "0";
+    config.fifo_priority = 100;
+    mu_assert_int_eq(-1, mvlcc_thread_set_config(MVLCC_THREAD_WRITER, &config));
+    config.fifo_priority = 0;
+    config.name = "a-name-that-is-too-long";
+    mu_assert_int_eq(-1, mvlcc_thread_set_config(MVLCC_THREAD_WRITER, &config));
+    /* Not pinned, CPU 0 may be outside the allowed set. */
+    config.name = "mvlcc-test";
+    config.cpus = NULL;
+    mu_assert_int_eq(0, mvlcc_thread_set_config(MVLCC_THREAD_WRITER, &config));
+
+    thread_config_result_t result = { -1, 0 };
+    pthread_t thread;
+    mu_assert_int_eq(0, pthread_create(&thread, NULL, thread_config_main, &result));
+    pthread_join(thread, NULL);
+    mu_assert_int_eq(0, result.applied);
+    mu_assert_uint_eq(1, result.found);
+
+    /* Exited threads are removed. */
+    mvlcc_thread_stats_t stats[16];
+    size_t count = mvlcc_thread_get_stats(stats, 16);
+    for (size_t i = 0; i < count && i < 16; ++i)
+        mu_check(stats[i].role != MVLCC_THREAD_WRITER);
+
+    mu_assert_int_eq(0, mvlcc_thread_set_config(MVLCC_THREAD_WRITER, NULL));
+
+    errno = 0;
+    mu_assert_int_eq(-1, mvlcc_thread_apply_config(MVLCC_THREAD_ROLE_COUNT));
+    mu_assert_int_eq(EINVAL, errno);
+}
+
+void test_mvlcc_shm_ring()
+{
+    const char *name = "/mvlcc-test-ring";
+    mvlcc_shm_publisher_t pub;
+    mu_assert_int_eq(0, mvlcc_shm_publisher_create(&pub, name, 4, 64));
+
+    mvlcc_shm_reader_t next, latest;
+    mu_assert_int_eq(0, mvlcc_shm_reader_create(&next, name, MVLCC_SHM_READ_NEXT));
+    mu_assert_int_eq(0, mvlcc_shm_reader_create(&latest, name, MVLCC_SHM_READ_LATEST));
+
+    uint8_t data[64];
+    uint8_t dest[64];
+    mvlcc_readout_info_t info = {};
+
+    info.bytes_used = 65;
+    mu_assert_int_eq(-1, mvlcc_shm_publisher_publish(pub, data, &info));
+
+    /* Nothing published yet: a timeout, not an error. */
+    mu_assert_int_eq(0, mvlcc_shm_reader_read(next, dest, sizeof(dest), &info, 0));
+    mu_assert_uint_eq(0, info.bytes_used);
+    mu_assert_int_eq(-1, mvlcc_shm_reader_read(next, dest, 16, &info, 0));
+
+    /* Overrun the ring: buffers 0-5 are published, 0 and 1 are overwritten. */
+    for (uint32_t i = 0; i < 6; ++i)
+    {
+        memset(data, i, sizeof(data));
+        info.bytes_used = 8 + i;
+        info.buffer_number = i;
+        mu_assert_int_eq(0, mvlcc_shm_publisher_publish(pub, data, &info));
+    }
+
+    /* A too small buffer leaves the reader unchanged. */
+    mu_assert_int_eq(-1, mvlcc_shm_reader_read(next, dest, 16, &info, 0));
+    mvlcc_shm_reader_stats_t stats = mvlcc_shm_reader_get_stats(next);
+    mu_assert_uint_eq(0, stats.buffers);
+    mu_assert_uint_eq(0, stats.lost_buffers);
+
+    for (uint32_t i = 2; i < 6; ++i)
+    {
+        mu_assert_int_eq(0, mvlcc_shm_reader_read(next, dest, sizeof(dest), &info, 0));
+        mu_assert_uint_eq(i, info.buffer_number);
+        mu_assert_uint_eq(8 + i, info.bytes_used);
+        mu_assert_uint_eq(i, dest[7 + i]);
+    }
+
+    stats = mvlcc_shm_reader_get_stats(next);
+    mu_assert_uint_eq(4, stats.buffers);
+    mu_assert_uint_eq(2, stats.lost_buffers);
+    mu_assert_uint_eq(64, stats.slot_bytes);
+
+    mu_assert_int_eq(0, mvlcc_shm_reader_read(latest, dest, sizeof(dest), &info, 0));
+    mu_assert_uint_eq(5, info.buffer_number);
+    stats = mvlcc_shm_reader_get_stats(latest);
+    mu_assert_uint_eq(1, stats.buffers);
+    mu_assert_uint_eq(5, stats.lost_buffers);
+
+    mvlcc_shm_publisher_destroy(&pub);
+    mu_assert_int_eq(-1, mvlcc_shm_reader_read(next, dest, sizeof(dest), &info, 1000));
+    mvlcc_shm_reader_destroy(&next);
+    mvlcc_shm_reader_destroy(&latest);
+
+    mu_assert_int_eq(-1, mvlcc_shm_reader_create(&next, name, MVLCC_SHM_READ_NEXT));
+    mu_check(strlen(mvlcc_shm_reader_strerror(next)) > 0);
+    mvlcc_shm_reader_destroy(&next);
+}
+
+static int read_all(int fd, void *dest, size_t bytes)
+{
+    uint8_t *p = dest;
+    while (bytes)
+    {
+        ssize_t n = read(fd, p, bytes);
+        if (n <= 0)
+            return -1;
+        p += n;
+        bytes -= n;
+    }
+    return 0;
+}
+
+void test_mvlcc_stream_server()
+{
+    mvlcc_stream_server_t server;
+    mu_assert_int_eq(-1, mvlcc_stream_server_create(&server, "udp://localhost:1", NULL));
+    mu_check(strlen(mvlcc_stream_server_strerror(server)) > 0);
+    mvlcc_stream_server_destroy(&server);
+
+    /* The client queue holds all three buffers submitted below, nothing is
+     * dropped however late the sender gets to them. */
+    mvlcc_stream_server_options_t options = { 4, 4096, 4, MVLCC_STREAM_DROP };
+    const char *path = "/tmp/mvlcc-test-stream.sock";
+    mu_assert_int_eq(0, mvlcc_stream_server_create(&server, "unix:/tmp/mvlcc-test-stream.sock", &options));
+    mu_assert_int_eq(0, mvlcc_stream_server_port(server));
+    mu_assert_uint_eq(4096, mvlcc_stream_server_buffer_bytes(server));
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    mu_assert_int_eq(0, connect(fd, (struct sockaddr *)&addr, sizeof(addr)));
+
+    /* The client is registered by the server's accept thread. */
+    for (int i = 0; i < 100 && mvlcc_stream_server_get_stats(server).clients == 0; ++i)
+        usleep(10 * 1000);
+    mu_assert_uint_eq(1, mvlcc_stream_server_get_stats(server).clients);
+
+    mvlcc_readout_info_t info = {};
+    for (uint32_t i = 1; i <= 3; ++i)
+    {
+        uint8_t *buffer = mvlcc_stream_server_acquire_buffer(server, 1000);
+        mu_check(buffer != NULL);
+        memset(buffer, i, 100);
+        info.bytes_used = 100;
+        info.buffer_number = i;
+        mu_assert_int_eq(0, mvlcc_stream_server_submit(server, buffer, &info));
+    }
+
+    uint8_t foreign[16];
+    mu_assert_int_eq(-1, mvlcc_stream_server_submit(server, foreign, &info));
+
+    for (uint32_t i = 1; i <= 3; ++i)
+    {
+        uint8_t header[MVLCC_STREAM_HEADER_BYTES];
+        uint8_t data[100];
+        uint64_t dropped = 1;
+        mu_assert_int_eq(0, read_all(fd, header, sizeof(header)));
+        mu_assert_int_eq(0, mvlcc_stream_decode_header(header, &info, &dropped));
+        mu_assert_uint_eq(i, info.buffer_number);
+        mu_assert_uint_eq(100, info.bytes_used);
+        mu_assert_uint_eq(0, dropped);
+        mu_assert_int_eq(0, read_all(fd, data, sizeof(data)));
+        mu_assert_uint_eq(i, data[99]);
+    }
+
+    mvlcc_stream_server_stats_t stats = mvlcc_stream_server_get_stats(server);
+    mu_assert_uint_eq(1, stats.accepted);
+    mu_assert_uint_eq(3, stats.buffers);
+    mu_assert_uint_eq(3, stats.sent_buffers);
+    mu_assert_uint_eq(3 * (MVLCC_STREAM_HEADER_BYTES + 100), stats.sent_bytes);
+    mu_assert_uint_eq(0, stats.dropped_buffers);
+
+    mvlcc_backpressure_stats_t bpStats = mvlcc_stream_server_get_backpressure_stats(server);
+    mu_assert_uint_eq(3, bpStats.offered);
+    mu_assert_uint_eq(3, bpStats.accepted);
+
+    /* A client closing an idle connection is noticed without a send. */
+    close(fd);
+    for (int i = 0; i < 100 && mvlcc_stream_server_get_stats(server).disconnected == 0; ++i)
+        usleep(10 * 1000);
+    stats = mvlcc_stream_server_get_stats(server);
+    mu_assert_uint_eq(0, stats.clients);
+    mu_assert_uint_eq(1, stats.disconnected);
+
+    mvlcc_stream_server_destroy(&server);
+}
+
+enum { StreamBufferBytes = 1 << 20 };
+
+/* Reads one frame, returns its buffer number or -1. */
+static int64_t read_stream_buffer(int fd, uint8_t *data, uint64_t *dropped)
+{
+    uint8_t header[MVLCC_STREAM_HEADER_BYTES];
+    mvlcc_readout_info_t info;
+    if (read_all(fd, header, sizeof(header)) || mvlcc_stream_decode_header(header, &info, dropped)
+        || info.bytes_used > StreamBufferBytes || read_all(fd, data, info.bytes_used))
+        return -1;
+    return info.buffer_number;
+}
+
+typedef struct
+{
+    int fd;
+    int64_t numbers[4];
+} stream_reader_t;
+
+/* Starts reading late, the submitting thread blocks meanwhile. */
+static void *read_stream_buffers_late(void *arg)
+{
+    static uint8_t data[StreamBufferBytes];
+    stream_reader_t *reader = (stream_reader_t *) arg;
+    uint64_t dropped;
+    usleep(100 * 1000);
+    for (size_t i = 0; i < 4; ++i)
+        reader->numbers[i] = read_stream_buffer(reader->fd, data, &dropped);
+    return NULL;
+}
+
+static int submit_stream_buffer(mvlcc_stream_server_t server, uint64_t number)
+{
+    uint8_t *buffer = mvlcc_stream_server_acquire_buffer(server, 1000);
+    if (!buffer)
+        return -1;
+    memset(buffer, (int) number, StreamBufferBytes);
+    mvlcc_readout_info_t info = {};
+    info.bytes_used = StreamBufferBytes;
+    info.buffer_number = number;
+    return mvlcc_stream_server_submit(server, buffer, &info);
+}
+
+void test_mvlcc_stream_server_backpressure()
+{
+    /* Buffers larger than the socket buffer: a sender stays in sendmsg() until
+     * the client reads. */
+    mvlcc_stream_server_options_t options = { 8, StreamBufferBytes, 2, MVLCC_STREAM_DROP };
+    const char *path = "/tmp/mvlcc-test-stream-bp.sock";
+    mvlcc_stream_server_t server;
+    mu_assert_int_eq(0, mvlcc_stream_server_create(&server, "unix:/tmp/mvlcc-test-stream-bp.sock", &options));
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    mu_assert_int_eq(0, connect(fd, (struct sockaddr *)&addr, sizeof(addr)));
+    for (int i = 0; i < 100 && mvlcc_stream_server_get_stats(server).clients == 0; ++i)
+        usleep(10 * 1000);
+    mu_assert_uint_eq(1, mvlcc_stream_server_get_stats(server).clients);
+
+    /* DROP_OLDEST: once the sender is stuck in buffer 1, buffers 2 to 4 are
+     * evicted from the full queue by 4 to 6. */
+    mvlcc_backpressure_t policy = { MVLCC_BACKPRESSURE_DROP_OLDEST, 0 };
+    mu_assert_int_eq(0, mvlcc_stream_server_set_backpressure(server, &policy));
+    static uint8_t data[StreamBufferBytes];
+    uint8_t header[MVLCC_STREAM_HEADER_BYTES];
+    mvlcc_readout_info_t info;
+    uint64_t dropped = 1;
+    mu_assert_int_eq(0, submit_stream_buffer(server, 1));
+    mu_assert_int_eq(0, read_all(fd, header, sizeof(header)));
+    mu_assert_int_eq(0, mvlcc_stream_decode_header(header, &info, &dropped));
+    mu_assert_uint_eq(1, info.buffer_number);
+    mu_assert_uint_eq(0, dropped);
+
+    for (uint64_t i = 2; i <= 6; ++i)
+        mu_assert_int_eq(0, submit_stream_buffer(server, i));
+    mvlcc_backpressure_stats_t bpStats = mvlcc_stream_server_get_backpressure_stats(server);
+    mu_assert_uint_eq(3, bpStats.dropped_oldest);
+
+    mu_assert_int_eq(0, read_all(fd, data, StreamBufferBytes));
+    mu_assert_uint_eq(1, data[StreamBufferBytes - 1]);
+    mu_assert_int_eq(5, read_stream_buffer(fd, data, &dropped));
+    mu_assert_uint_eq(3, dropped);
+    mu_assert_uint_eq(5, data[StreamBufferBytes - 1]);
+    mu_assert_int_eq(6, read_stream_buffer(fd, data, &dropped));
+    mu_assert_uint_eq(6, data[0]);
+
+    for (int i = 0; i < 100 && mvlcc_stream_server_get_stats(server).sent_buffers < 3; ++i)
+        usleep(10 * 1000);
+    mvlcc_stream_server_stats_t stats = mvlcc_stream_server_get_stats(server);
+    mu_assert_uint_eq(6, stats.buffers);
+    mu_assert_uint_eq(3, stats.sent_buffers);
+    mu_assert_uint_eq(3, stats.dropped_buffers);
+    bpStats = mvlcc_stream_server_get_backpressure_stats(server);
+    mu_assert_uint_eq(6, bpStats.offered);
+    mu_assert_uint_eq(6, bpStats.accepted);
+    mu_assert_uint_eq(0, bpStats.dropped_newest);
+    mu_assert_uint_eq(bpStats.offered, bpStats.accepted + bpStats.dropped_newest + bpStats.sampled_out);
+
+    /* BLOCK: submit waits for the late reader instead of dropping. */
+    policy.mode = MVLCC_BACKPRESSURE_BLOCK;
+    mu_assert_int_eq(0, mvlcc_stream_server_set_backpressure(server, &policy));
+    stream_reader_t reader = { fd, { 0, 0, 0, 0 } };
+    pthread_t readerThread;
+    mu_assert_int_eq(0, pthread_create(&readerThread, NULL, read_stream_buffers_late, &reader));
+    for (uint64_t i = 7; i <= 10; ++i)
+        mu_assert_int_eq(0, submit_stream_buffer(server, i));
+    pthread_join(readerThread, NULL);
+    for (size_t i = 0; i < 4; ++i)
+        mu_assert_int_eq(7 + i, reader.numbers[i]);
+
+    bpStats = mvlcc_stream_server_get_backpressure_stats(server);
+    mu_check(bpStats.blocked >= 1);
+    mu_check(bpStats.blocked_ns >= 50 * 1000000ull);
+    mu_assert_uint_eq(10, bpStats.offered);
+    mu_assert_uint_eq(10, bpStats.accepted);
+    mu_assert_uint_eq(0, bpStats.dropped_newest);
+    mu_assert_uint_eq(3, bpStats.dropped_oldest);
+    mu_assert_uint_eq(3, mvlcc_stream_server_get_stats(server).dropped_buffers);
+
+    close(fd);
+    mvlcc_stream_server_destroy(&server);
+}
+
 void test_mvlcc_module_data_t()
 {
     mvlcc_module_data_t md;
@@ -195,6 +1741,29 @@ MU_TEST_SUITE(test_mvlcc_wrap)
     MU_RUN_TEST(test_mvlcc_command_list_t_yaml);
     MU_RUN_TEST(test_mvlcc_command_list_t_json);
     MU_RUN_TEST(test_mvlcc_crateconfig_t);
+    MU_RUN_TEST(test_mvlcc_command_list_t_binary);
+    MU_RUN_TEST(test_mvlcc_crateconfig_t_binary);
+    MU_RUN_TEST(test_mvlcc_config_cache);
+    MU_RUN_TEST(test_mvlcc_command_list_optimize);
+    MU_RUN_TEST(test_mvlcc_crateconfig_estimate_readout);
+    MU_RUN_TEST(test_mvlcc_sim);
+    MU_RUN_TEST(test_mvlcc_init_readout_diff);
+    MU_RUN_TEST(test_mvlcc_cmd_counters);
+    MU_RUN_TEST(test_mvlcc_eth_emulator);
+    MU_RUN_TEST(test_mvlcc_eth_batch);
+    MU_RUN_TEST(test_mvlcc_eth_socket_stats);
+    MU_RUN_TEST(test_mvlcc_trace);
+    MU_RUN_TEST(test_mvlcc_command_log);
+    MU_RUN_TEST(test_mvlcc_concurrent_commands);
+    MU_RUN_TEST(test_mvlcc_strerror);
+    MU_RUN_TEST(test_mvlcc_readout_aligned);
+    MU_RUN_TEST(test_mvlcc_parser_pool);
+    MU_RUN_TEST(test_mvlcc_parser_pool_backpressure);
+    MU_RUN_TEST(test_mvlcc_buffer_alloc);
+    MU_RUN_TEST(test_mvlcc_thread_config);
+    MU_RUN_TEST(test_mvlcc_shm_ring);
+    MU_RUN_TEST(test_mvlcc_stream_server);
+    MU_RUN_TEST(test_mvlcc_stream_server_backpressure);
     MU_RUN_TEST(test_mvlcc_module_data_t);
 }
 
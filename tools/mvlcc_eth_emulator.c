@@ -0,0 +1,100 @@
+/* Standalone MVLC_ETH emulator on local UDP ports, see mvlcc_eth_emulator_create().
+ *
+ * Usage: mvlcc_eth_emulator [options]
+ *   -b <address>   bind address (default 127.0.0.1)
+ *   -p <port>      command port, the data port is port + 1 (default 32768)
+ *   -l <prob>      data pipe packet loss probability (default 0)
+ *   -c <prob>      command pipe packet loss probability (default 0)
+ *   -o <prob>      packet reorder probability (default 0)
+ *   -m <prob>      malformed data pipe packet probability (default 0)
+ *   -B <bytes/s>   data rate limit (default unlimited)
+ *   -r <hz>        trigger rate (default as fast as possible)
+ *   -w <words>     words per block read (default 100)
+ *   -s <seed>      random seed (default 1)
+ *   -j             use jumbo frames
+ *
+ * Point mvlcc_make_mvlc_eth() or a crate config at the bind address to use it.
+ */
+
+#include <mvlcc_wrap.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+volatile bool signal_received_ = false;
+
+void signal_handler(int signum)
+{
+    (void) signum;
+    signal_received_ = true;
+}
+
+void setup_signal_handlers()
+{
+    struct sigaction new_action;
+    new_action.sa_handler = signal_handler;
+    sigemptyset (&new_action.sa_mask);
+    new_action.sa_flags = 0;
+
+    sigaction(SIGINT, &new_action, NULL);
+    sigaction(SIGHUP, &new_action, NULL);
+    sigaction(SIGTERM, &new_action, NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    mvlcc_eth_emulator_params_t params = {};
+    params.sim.seed = 1;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "b:p:l:c:o:m:B:r:w:s:j")) != -1)
+    {
+        switch (opt)
+        {
+            case 'b': params.bind_address = optarg; break;
+            case 'p': params.command_port = atoi(optarg); break;
+            case 'l': params.data_loss = atof(optarg); break;
+            case 'c': params.command_loss = atof(optarg); break;
+            case 'o': params.reorder = atof(optarg); break;
+            case 'm': params.malformed = atof(optarg); break;
+            case 'B': params.data_rate_bytes_per_s = atof(optarg); break;
+            case 'r': params.sim.trigger_rate_hz = atof(optarg); break;
+            case 'w': params.sim.block_read_words = atoi(optarg); break;
+            case 's': params.sim.seed = atoi(optarg); break;
+            case 'j': params.jumbo_frames = 1; break;
+            default:
+                fprintf(stderr, "Usage: %s [-b address] [-p port] [-l data_loss] [-c command_loss]"
+                    " [-o reorder] [-m malformed] [-B bytes_per_s] [-r trigger_rate_hz] [-w block_words] [-s seed] [-j]\n", argv[0]);
+                return 1;
+        }
+    }
+
+    setup_signal_handlers();
+
+    mvlcc_eth_emulator_t emu = {};
+
+    if (mvlcc_eth_emulator_create(&emu, &params))
+    {
+        fprintf(stderr, "Error starting emulator: %s\n", mvlcc_eth_emulator_strerror(emu));
+        mvlcc_eth_emulator_destroy(&emu);
+        return 1;
+    }
+
+    fprintf(stdout, "MVLC_ETH emulator running on %s, press Ctrl-C to quit\n",
+        params.bind_address ? params.bind_address : "127.0.0.1");
+
+    while (!signal_received_)
+    {
+        sleep(1);
+
+        mvlcc_eth_emulator_stats_t stats = mvlcc_eth_emulator_get_stats(emu);
+        fprintf(stdout, "requests=%zu, stack_execs=%zu, packets: sent=%zu, dropped=%zu, reordered=%zu, malformed=%zu, data=%.2lf MiB\n",
+            stats.command_requests, stats.stack_execs, stats.packets_sent, stats.packets_dropped,
+            stats.packets_reordered, stats.packets_malformed, stats.data_bytes_sent / (1024.0 * 1024.0));
+    }
+
+    mvlcc_eth_emulator_destroy(&emu);
+
+    return 0;
+}